@@ -59,53 +59,70 @@ namespace cuBQL {
     BuildMethod buildMethod = SPATIAL_MEDIAN;
   };
 
-  /*! the most basic type of BVH where each BVH::Node is either a leaf
-      (and contains Node::count primitives), or is a inner node (and
-      points to a pair of child nodes). Node 0 is the root node; node
-      1 is always unused (so all other node pairs start on n even
-      index) */
-  template<typename _scalar_t, int _numDims>
-  struct BinaryBVH {
-    using scalar_t = _scalar_t;
-    enum { numDims = _numDims };
-    using vec_t = cuBQL::vec_t<scalar_t,numDims>;
-    using box_t = cuBQL::box_t<scalar_t,numDims>;
-
-    struct CUBQL_ALIGN(16) Node {
-      enum { count_bits = 16, offset_bits = 64-count_bits };
+  /*! a node of a BinaryBVH: either a leaf (and contains Node::count
+      primitives), or a inner node (and points to a pair of child
+      nodes). This is the same type for all index types of BinaryBVH,
+      so a BinaryBVH and a BinaryBVH64 share the same node layout */
+  template<typename scalar_t, int numDims>
+  struct CUBQL_ALIGN(16) BinaryBVHNode {
+    enum { count_bits = 16, offset_bits = 64-count_bits };
       
-      box_t    bounds;
+    cuBQL::box_t<scalar_t,numDims> bounds;
 
-      struct Admin {
+    struct Admin {
       /*! For inner nodes, this points into the nodes[] array, with
         left child at nodes.offset+0, and right child at
         nodes.offset+1. For leaf nodes, this points into the
         primIDs[] array, which first prim beign primIDs[offset],
         next one primIDs[offset+1], etc. */
-        union {
-          struct {
-            uint64_t offset : offset_bits;
-            /* number of primitives in this leaf, if a leaf; 0 for inner
-               nodes. */
-            uint64_t count  : count_bits;
-          };
-          // the same as a single int64, so we can read/write with a
-          // single op
-          uint64_t offsetAndCountBits;
+      union {
+        struct {
+          uint64_t offset : offset_bits;
+          /* number of primitives in this leaf, if a leaf; 0 for inner
+             nodes. */
+          uint64_t count  : count_bits;
         };
+        // the same as a single int64, so we can read/write with a
+        // single op
+        uint64_t offsetAndCountBits;
       };
-      Admin admin;
     };
+    Admin admin;
+  };
+
+  /*! the most basic type of BVH where each BVH::Node is either a leaf
+      (and contains Node::count primitives), or is a inner node (and
+      points to a pair of child nodes). Node 0 is the root node; node
+      1 is always unused (so all other node pairs start on n even
+      index). 'index_t' is the type of the primIDs[], and of the
+      number of nodes and prims; with the default of uint32_t a BVH
+      can have at most 2^32-1 prims - see BinaryBVH64 for more than
+      that. */
+  template<typename _scalar_t, int _numDims, typename _index_t=uint32_t>
+  struct BinaryBVH {
+    using scalar_t = _scalar_t;
+    using index_t  = _index_t;
+    enum { numDims = _numDims };
+    using vec_t = cuBQL::vec_t<scalar_t,numDims>;
+    using box_t = cuBQL::box_t<scalar_t,numDims>;
+    using Node  = BinaryBVHNode<scalar_t,numDims>;
 
     enum { maxLeafSize=((1<<Node::count_bits)-1) };
     
     using node_t       = Node;
     node_t   *nodes    = 0;
-    uint32_t  numNodes = 0;
-    uint32_t *primIDs  = 0;
-    uint32_t  numPrims = 0;
+    index_t   numNodes = 0;
+    index_t  *primIDs  = 0;
+    index_t   numPrims = 0;
   };
 
+  /*! a BinaryBVH with 64-bit primIDs and node and prim counts, for
+      data sets of more than 2^32-1 primitives. Nodes are the same as
+      in a regular BinaryBVH (their offsets have 48 bits either
+      way). */
+  template<typename T, int D>
+  using BinaryBVH64 = BinaryBVH<T,D,uint64_t>;
+
   /*! a 'wide' BVH in which each node has a fixed number of
     `BVH_WIDTH` children (some of those children can be un-used) */
   template<typename _scalar_t, int _numDims, int BVH_WIDTH>
@@ -235,6 +252,30 @@ namespace cuBQL {
 
 
   
+  /*! Builds a BinaryBVH64 over more boxes than fit into 32-bit
+      primIDs, by sorting the boxes into spatially coherent chunks of
+      at most maxPrimsPerChunk boxes each (by the cell of a coarse,
+      Morton-ordered grid over the boxes' centers), building each
+      chunk with the regular gpuBuilder() above, and building a
+      top-level tree over the chunks' root nodes on the host.
+
+      Unlike for the other builders, boxes[] must be host-readable
+      (host or managed memory): at this size they typically won't
+      fit into device memory anyway, so they get staged to the
+      device one chunk at a time. The bvh arrays get allocated
+      through memResource. Inactive/invalid boxes get ignored, same
+      as with the other builders. */
+  template<typename T, int D>
+  void gpuBuilder(BinaryBVH64<T,D>  &bvh,
+                  /*! array of bounding boxes to build BVH over, must
+                      be host-readable */
+                  const box_t<T,D>  *boxes,
+                  uint64_t           numBoxes,
+                  BuildConfig        buildConfig,
+                  cudaStream_t       s=0,
+                  GpuMemoryResource &memResource=defaultGpuMemResource(),
+                  size_t             maxPrimsPerChunk=size_t(1)<<24);
+
   // ------------------------------------------------------------------
   /*! fast radix/morton builder for float3 data */
   // ------------------------------------------------------------------
@@ -247,6 +288,29 @@ namespace cuBQL {
                      GpuMemoryResource    &memResource=defaultGpuMemResource());
   
   // ------------------------------------------------------------------
+
+  /*! Re-computes the bounding boxes of all nodes of an existing
+      BinaryBVH (bottom-up, on the GPU) after the primitives' boxes
+      have changed, without changing the BVH's topology. boxes[] must
+      have the same number of entries as the array the BVH was
+      originally built over, and must be device-readable. Note this
+      does not sync; the app has to do that before using the BVH.
+  */
+  template<typename T, int D>
+  void refit(BinaryBVH<T,D>   &bvh,
+             const box_t<T,D> *boxes,
+             cudaStream_t      s=0,
+             GpuMemoryResource &memResource=defaultGpuMemResource());
+
+  /*! same as above, for a BinaryBVH64; boxes[] has to be
+      device-readable here, too (eg, managed memory) */
+  template<typename T, int D>
+  void refit(BinaryBVH64<T,D>  &bvh,
+             const box_t<T,D>  *boxes,
+             cudaStream_t       s=0,
+             GpuMemoryResource &memResource=defaultGpuMemResource());
+  
+  // ------------------------------------------------------------------
   
   /*! Frees the bvh.nodes[] and bvh.primIDs[] memory allocated when
       building the BVH.
@@ -256,6 +320,14 @@ namespace cuBQL {
             cudaStream_t      s=0,
             GpuMemoryResource& memResource=defaultGpuMemResource());
 
+  /*! Frees the bvh.nodes[] and bvh.primIDs[] memory allocated when
+      building the BVH.
+  */
+  template<typename T, int D>
+  void free(BinaryBVH64<T,D> &bvh,
+            cudaStream_t      s=0,
+            GpuMemoryResource& memResource=defaultGpuMemResource());
+
   /*! Frees the bvh.nodes[] and bvh.primIDs[] memory allocated when
       building the BVH.
   */
@@ -280,6 +352,7 @@ namespace cuBQL {
 #  include "cuBQL/impl/elh_builder.h"  
 #  include "cuBQL/impl/morton.h"  
 #  include "cuBQL/impl/wide_gpu_builder.h"  
+#  include "cuBQL/impl/chunked_builder.h"  
 # endif
 #endif
 
@@ -0,0 +1,543 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+
+/*! a helper for BVHs over animated prims that keeps a BinaryBVH
+    usable from frame to frame at the lowest cost it can: every
+    update() refits the BVH to the prims' new boxes, and then looks
+    at how much each subtree's SAH cost (with the metric of
+    computeSAH.h, but relative to the subtree's own root) has grown
+    since that subtree was last built. If the whole tree has degraded
+    too much, it gets re-built from scratch; else, only the subtrees
+    that crossed their own threshold do - each with the regular
+    gpuBuilder(), and spliced back into the tree on the host, like
+    the chunked builder does for its chunks. Each update() reports
+    what it did, and how long that took. */
+#pragma once
+
+#include "cuBQL/bvh.h"
+#include "cuBQL/impl/bottomUp.h"
+#include <vector>
+#include <stdexcept>
+#include <cstring>
+
+namespace cuBQL {
+
+  template<typename T, int D>
+  struct BVHMaintainer {
+    using box_t = cuBQL::box_t<T,D>;
+    using Node  = typename BinaryBVH<T,D>::Node;
+
+    struct Config {
+      /*! the whole tree gets re-built once its SAH cost has grown by
+          this factor since it was last built */
+      float       rebuildThreshold = 1.5f;
+      /*! a subtree gets re-built once its SAH cost (relative to its
+          own root's surface area) has grown by this factor since it
+          was last built */
+      float       subtreeRebuildThreshold = 1.25f;
+      /*! subtrees with fewer prims than this do not get re-built on
+          their own; they are too small for a gpuBuilder() call to
+          pay off */
+      uint32_t    minSubtreePrims = 4096;
+      /*! if the subtrees to re-build have more than this fraction of
+          all prims, the whole tree gets re-built instead */
+      float       maxSubtreeFraction = .5f;
+      BuildConfig buildConfig;
+    };
+
+    enum Decision { REFIT, REBUILD_SUBTREES, REBUILD };
+
+    /*! what one update() did */
+    struct FrameReport {
+      Decision decision;
+      /*! SAH cost of the refitted tree relative to when it was last
+          (fully) built; this is what 'rebuildThreshold' applies to */
+      float    sahRatio;
+      /*! SAH cost of the tree at the end of the frame, as
+          computeSAH() would give it */
+      float    sah;
+      uint32_t numSubtreesRebuilt;
+      uint32_t numPrimsRebuilt;
+      /*! seconds spent refitting, computing the per-subtree costs,
+          and re-building (including computing the new costs) */
+      double   refitTime;
+      double   costTime;
+      double   rebuildTime;
+    };
+
+#ifdef __CUDACC__
+    /*! all of bvh's memory, and all temporary memory, gets allocated
+        through memResource, and all work gets done in stream s */
+    BVHMaintainer(const Config      &config=Config(),
+                  cudaStream_t       s=0,
+                  GpuMemoryResource &memResource=defaultGpuMemResource());
+    ~BVHMaintainer();
+
+    /*! (re-)builds the BVH over the given boxes, which must be
+        device-readable */
+    void build(const box_t *boxes, uint32_t numBoxes);
+
+    /*! refits the BVH to the prims' new boxes - same number of boxes
+        as in build(), and device-readable, too - and re-builds
+        subtrees, or the whole tree, as needed: the whole tree if its
+        cost ratio crossed rebuildThreshold; else, each subtree (with
+        at least minSubtreePrims prims) whose cost ratio crossed
+        subtreeRebuildThreshold - unless that is only because of
+        subtrees further down, which then get checked on their
+        own. If that picks the root, or subtrees with too many prims,
+        the whole tree gets re-built, too. Prims that were in the BVH
+        must not have become empty. Syncs the stream. */
+    FrameReport update(const box_t *boxes);
+#endif
+
+    /*! the maintained BVH; valid for queries after build() and after
+        each update() */
+    BinaryBVH<T,D> bvh;
+    const Config   config;
+  private:
+    BVHMaintainer(const BVHMaintainer &) = delete;
+    BVHMaintainer &operator=(const BVHMaintainer &) = delete;
+
+#ifdef __CUDACC__
+    /*! computes the per-subtree costs, and the nodes' areas, of the
+        (current) bvh into 'costs' and 'areas' */
+    void computeCosts();
+    /*! reads bvh's nodes back into 'topology' */
+    void readTopology();
+    /*! counts each subtree's prims, from 'topology' */
+    void countSubtreePrims();
+    /*! picks the subtrees to re-build (see update()); returns how
+        many prims they have */
+    uint64_t selectSubtrees(std::vector<uint32_t> &roots) const;
+    void rebuildSubtrees(const box_t *boxes, const std::vector<uint32_t> &roots);
+    /*! how much the given subtree's cost has grown since it was
+        built */
+    inline float costRatio(uint32_t nodeID) const;
+    /*! the same, but as if its children's subtrees had all been
+        re-built (to their baseline costs) - ie, how much the node
+        itself has degraded */
+    inline float ownCostRatio(uint32_t nodeID) const;
+#endif
+    
+    cudaStream_t         stream;
+    GpuMemoryResource   *memResource;
+    uint32_t             numBoxes = 0;
+    /*! bvh's nodes as of its last (full or partial) re-build; their
+        topology is still valid, their bounds are not */
+    std::vector<Node>     topology;
+    std::vector<uint32_t> subtreePrims;
+    /*! per node, the SAH cost of its subtree, relative to its
+        surface area; both now, and when that subtree was built */
+    std::vector<float>    costs;
+    std::vector<float>    baselineCosts;
+    std::vector<float>    areas;
+    /*! the device-side costs, followed by the areas */
+    float                *d_costs = 0;
+  };
+
+  // ==================================================================
+  // IMPLEMENTATION
+  // ==================================================================
+
+  namespace bvhMaintainer_impl {
+    /*! the D-dimensional equivalent of a box's surface area, as in
+        computeSAH.h (for D == 3 it is exactly surfaceArea()) */
+    template<typename T, int D>
+    inline __cubql_both float area(const box_t<T,D> &box)
+    {
+      float sum = 0.f;
+      for (int d=0;d<D;d++) {
+        float product = 1.f;
+        for (int e=0;e<D;e++)
+          if (e != d) product *= float(box.upper[e]-box.lower[e]);
+        sum += product;
+      }
+      return sum;
+    }
+    
+    /*! how much a (subtree) cost has grown from its baseline; a
+        subtree that had zero area when it was built has degraded
+        infinitely once it does not any more */
+    inline float ratio(float cost, float baselineCost)
+    {
+      if (baselineCost > 0.f)
+        return cost/baselineCost;
+      return cost > 0.f ? INFINITY : 1.f;
+    }
+    
+#ifdef __CUDACC__
+    /*! bottomUp_impl op that computes each subtree's SAH cost -
+        every node's area times its number of prims for leaves, and
+        times 1 for inner nodes, summed up - divided by the subtree
+        root's area; and each node's area. Subtrees with zero area get
+        a cost of 0 (all their nodes have zero area, too). */
+    template<typename T, int D>
+    struct SubtreeCostOp {
+      inline __device__ void leaf(uint32_t nodeID) const
+      {
+        const BinaryBVHNode<T,D> &node = bvh.nodes[nodeID];
+        areas[nodeID] = area(node.bounds);
+        costs[nodeID] = areas[nodeID] > 0.f ? float(node.admin.count) : 0.f;
+      }
+      inline __device__ void inner(uint32_t nodeID) const
+      {
+        const BinaryBVHNode<T,D> &node = bvh.nodes[nodeID];
+        const float nodeArea = area(node.bounds);
+        float sum = nodeArea;
+        for (int c=0;c<2;c++) {
+          const uint32_t childID = node.admin.offset+c;
+          sum += costs[childID]*areas[childID];
+        }
+        areas[nodeID] = nodeArea;
+        costs[nodeID] = nodeArea > 0.f ? sum/nodeArea : 0.f;
+      }
+      
+      BinaryBVH<T,D> bvh;
+      float         *costs;
+      float         *areas;
+    };
+
+    template<typename T, int D>
+    __global__
+    void gatherBoxes(box_t<T,D>       *out,
+                     const box_t<T,D> *boxes,
+                     const uint32_t   *primIDs,
+                     uint32_t          numPrims)
+    {
+      const uint32_t tid = threadIdx.x+blockIdx.x*blockDim.x;
+      if (tid >= numPrims) return;
+      out[tid] = boxes[primIDs[tid]];
+    }
+#endif
+  } // ::cuBQL::bvhMaintainer_impl
+
+#ifdef __CUDACC__
+  template<typename T, int D>
+  BVHMaintainer<T,D>::BVHMaintainer(const Config      &config,
+                                    cudaStream_t       s,
+                                    GpuMemoryResource &memResource)
+    : config(config), stream(s), memResource(&memResource)
+  {}
+
+  template<typename T, int D>
+  BVHMaintainer<T,D>::~BVHMaintainer()
+  {
+    if (d_costs)
+      memResource->free(d_costs,stream);
+    if (bvh.nodes)
+      cuBQL::free(bvh,stream,*memResource);
+  }
+
+  template<typename T, int D>
+  void BVHMaintainer<T,D>::build(const box_t *boxes, uint32_t numBoxes)
+  {
+    if (bvh.nodes)
+      cuBQL::free(bvh,stream,*memResource);
+    this->numBoxes = numBoxes;
+    gpuBuilder(bvh,boxes,numBoxes,config.buildConfig,stream,*memResource);
+    readTopology();
+    computeCosts();
+    baselineCosts = costs;
+  }
+
+  template<typename T, int D>
+  void BVHMaintainer<T,D>::computeCosts()
+  {
+    const uint32_t numNodes = bvh.numNodes;
+    if (numNodes == 0) {
+      costs.clear();
+      areas.clear();
+      return;
+    }
+    if (!d_costs || costs.size() != numNodes) {
+      if (d_costs)
+        CUBQL_CUDA_CHECK(memResource->free(d_costs,stream));
+      CUBQL_CUDA_CHECK(memResource->malloc((void**)&d_costs,2*numNodes*sizeof(float),stream));
+      costs.resize(numNodes);
+      areas.resize(numNodes);
+    }
+    bottomUp_impl::bottomUp(bvh,bvhMaintainer_impl::SubtreeCostOp<T,D>
+                            { bvh,d_costs,d_costs+numNodes },
+                            stream,*memResource);
+    CUBQL_CUDA_CALL(MemcpyAsync(costs.data(),d_costs,numNodes*sizeof(float),
+                                cudaMemcpyDefault,stream));
+    CUBQL_CUDA_CALL(MemcpyAsync(areas.data(),d_costs+numNodes,numNodes*sizeof(float),
+                                cudaMemcpyDefault,stream));
+    CUBQL_CUDA_CALL(StreamSynchronize(stream));
+    // node 1 is unused
+    if (numNodes > 1) costs[1] = areas[1] = 0.f;
+  }
+
+  template<typename T, int D>
+  void BVHMaintainer<T,D>::readTopology()
+  {
+    topology.resize(bvh.numNodes);
+    CUBQL_CUDA_CALL(MemcpyAsync(topology.data(),bvh.nodes,bvh.numNodes*sizeof(Node),
+                                cudaMemcpyDefault,stream));
+    CUBQL_CUDA_CALL(StreamSynchronize(stream));
+    countSubtreePrims();
+  }
+
+  template<typename T, int D>
+  void BVHMaintainer<T,D>::countSubtreePrims()
+  {
+    subtreePrims.assign(topology.size(),0);
+    if (topology.empty()) return;
+
+    // count prims in reverse pre-order, so children come before
+    // their parents no matter how the nodes are laid out
+    std::vector<uint32_t> preOrder;
+    std::vector<uint32_t> stack = { 0 };
+    while (!stack.empty()) {
+      const uint32_t nodeID = stack.back();
+      stack.pop_back();
+      preOrder.push_back(nodeID);
+      const Node &node = topology[nodeID];
+      if (node.admin.count == 0) {
+        stack.push_back(node.admin.offset+0);
+        stack.push_back(node.admin.offset+1);
+      }
+    }
+    for (size_t i=preOrder.size();i-->0;) {
+      const Node &node = topology[preOrder[i]];
+      subtreePrims[preOrder[i]]
+        = node.admin.count
+        ? uint32_t(node.admin.count)
+        : subtreePrims[node.admin.offset+0]+subtreePrims[node.admin.offset+1];
+    }
+  }
+
+  template<typename T, int D>
+  inline float BVHMaintainer<T,D>::costRatio(uint32_t nodeID) const
+  {
+    return bvhMaintainer_impl::ratio(costs[nodeID],baselineCosts[nodeID]);
+  }
+
+  template<typename T, int D>
+  inline float BVHMaintainer<T,D>::ownCostRatio(uint32_t nodeID) const
+  {
+    const Node &node = topology[nodeID];
+    if (node.admin.count != 0 || areas[nodeID] == 0.f)
+      return costRatio(nodeID);
+    float sum = areas[nodeID];
+    for (int c=0;c<2;c++) {
+      const uint32_t childID = node.admin.offset+c;
+      sum += areas[childID]*std::min(costs[childID],baselineCosts[childID]);
+    }
+    return bvhMaintainer_impl::ratio(sum/areas[nodeID],baselineCosts[nodeID]);
+  }
+
+  template<typename T, int D>
+  uint64_t BVHMaintainer<T,D>::selectSubtrees(std::vector<uint32_t> &roots) const
+  {
+    uint64_t numPrims = 0;
+    std::vector<uint32_t> stack = { 0 };
+    while (!stack.empty()) {
+      const uint32_t nodeID = stack.back();
+      stack.pop_back();
+      const Node &node = topology[nodeID];
+      if (subtreePrims[nodeID] < config.minSubtreePrims)
+        continue;
+      // a subtree that degraded only below its children gets left to
+      // those children
+      if (costRatio(nodeID) > config.subtreeRebuildThreshold
+          && (node.admin.count != 0
+              || ownCostRatio(nodeID) > config.subtreeRebuildThreshold)) {
+        roots.push_back(nodeID);
+        numPrims += subtreePrims[nodeID];
+        continue;
+      }
+      if (node.admin.count == 0) {
+        stack.push_back(node.admin.offset+1);
+        stack.push_back(node.admin.offset+0);
+      }
+    }
+    return numPrims;
+  }
+
+  template<typename T, int D>
+  void BVHMaintainer<T,D>::rebuildSubtrees(const box_t                 *boxes,
+                                           const std::vector<uint32_t> &roots)
+  {
+    // the current (refitted) nodes, and the primIDs
+    std::vector<Node> nodes(bvh.numNodes);
+    std::vector<uint32_t> primIDs(bvh.numPrims);
+    CUBQL_CUDA_CALL(MemcpyAsync(nodes.data(),bvh.nodes,bvh.numNodes*sizeof(Node),
+                                cudaMemcpyDefault,stream));
+    CUBQL_CUDA_CALL(MemcpyAsync(primIDs.data(),bvh.primIDs,bvh.numPrims*sizeof(uint32_t),
+                                cudaMemcpyDefault,stream));
+    CUBQL_CUDA_CALL(StreamSynchronize(stream));
+
+    // build a new BVH over each subtree's prims
+    uint32_t maxSubtreePrims = 0;
+    for (auto root : roots)
+      maxSubtreePrims = std::max(maxSubtreePrims,subtreePrims[root]);
+    box_t    *d_boxes   = 0;
+    uint32_t *d_primIDs = 0;
+    CUBQL_CUDA_CHECK(memResource->malloc((void**)&d_boxes,maxSubtreePrims*sizeof(box_t),stream));
+    CUBQL_CUDA_CHECK(memResource->malloc((void**)&d_primIDs,maxSubtreePrims*sizeof(uint32_t),stream));
+    std::vector<int> subtreeOf(bvh.numNodes,-1);
+    std::vector<std::vector<Node>>     subtreeNodes(roots.size());
+    std::vector<std::vector<uint32_t>> subtreePrimIDs(roots.size());
+    for (size_t k=0;k<roots.size();k++) {
+      subtreeOf[roots[k]] = int(k);
+      std::vector<uint32_t> &subtreePrimIDs_k = subtreePrimIDs[k];
+      std::vector<uint32_t> oldPrimIDs;
+      std::vector<uint32_t> stack = { roots[k] };
+      while (!stack.empty()) {
+        const Node &node = nodes[stack.back()];
+        stack.pop_back();
+        if (node.admin.count == 0) {
+          stack.push_back(node.admin.offset+0);
+          stack.push_back(node.admin.offset+1);
+        } else
+          for (int i=0;i<node.admin.count;i++)
+            oldPrimIDs.push_back(primIDs[node.admin.offset+i]);
+      }
+      const uint32_t numPrims = uint32_t(oldPrimIDs.size());
+      CUBQL_CUDA_CALL(MemcpyAsync(d_primIDs,oldPrimIDs.data(),numPrims*sizeof(uint32_t),
+                                  cudaMemcpyDefault,stream));
+      bvhMaintainer_impl::gatherBoxes<<<divRoundUp(numPrims,1024u),1024,0,stream>>>
+        (d_boxes,boxes,d_primIDs,numPrims);
+      BinaryBVH<T,D> subtree;
+      gpuBuilder(subtree,d_boxes,numPrims,config.buildConfig,stream,*memResource);
+      subtreeNodes[k].resize(subtree.numNodes);
+      subtreePrimIDs_k.resize(subtree.numPrims);
+      CUBQL_CUDA_CALL(MemcpyAsync(subtreeNodes[k].data(),subtree.nodes,
+                                  subtree.numNodes*sizeof(Node),
+                                  cudaMemcpyDefault,stream));
+      CUBQL_CUDA_CALL(MemcpyAsync(subtreePrimIDs_k.data(),subtree.primIDs,
+                                  subtree.numPrims*sizeof(uint32_t),
+                                  cudaMemcpyDefault,stream));
+      CUBQL_CUDA_CALL(StreamSynchronize(stream));
+      cuBQL::free(subtree,stream,*memResource);
+      if (subtreePrimIDs_k.size() != numPrims)
+        throw std::runtime_error("cuBQL: unexpected number of prims in re-built subtree");
+      for (auto &primID : subtreePrimIDs_k)
+        primID = oldPrimIDs[primID];
+    }
+    CUBQL_CUDA_CHECK(memResource->free(d_primIDs,stream));
+    CUBQL_CUDA_CHECK(memResource->free(d_boxes,stream));
+
+    // splice the new subtrees in, writing the whole tree out in
+    // depth-first order; nodes outside the re-built subtrees keep
+    // their baseline costs
+    struct Item { int subtree; uint32_t srcID, dstID; };
+    std::vector<Node>     newNodes(2);
+    std::vector<uint32_t> newPrimIDs;
+    std::vector<float>    newBaselineCosts(2,0.f);
+    std::vector<bool>     rebuilt(2,false);
+    newPrimIDs.reserve(bvh.numPrims);
+    memset((void *)newNodes.data(),0,2*sizeof(Node));
+    std::vector<Item> stack = { { -1,0u,0u } };
+    while (!stack.empty()) {
+      Item item = stack.back();
+      stack.pop_back();
+      if (item.subtree < 0 && subtreeOf[item.srcID] >= 0)
+        item = { subtreeOf[item.srcID],0u,item.dstID };
+      const Node &node
+        = item.subtree < 0 ? nodes[item.srcID] : subtreeNodes[item.subtree][item.srcID];
+      rebuilt[item.dstID] = item.subtree >= 0;
+      newBaselineCosts[item.dstID] = item.subtree < 0 ? baselineCosts[item.srcID] : 0.f;
+      Node out;
+      out.bounds = node.bounds;
+      if (node.admin.count == 0) {
+        const uint32_t pair = uint32_t(newNodes.size());
+        newNodes.resize(pair+2);
+        newBaselineCosts.resize(pair+2);
+        rebuilt.resize(pair+2);
+        out.admin.offset = pair;
+        out.admin.count  = 0;
+        stack.push_back({ item.subtree,uint32_t(node.admin.offset+1),pair+1 });
+        stack.push_back({ item.subtree,uint32_t(node.admin.offset+0),pair+0 });
+      } else {
+        const uint32_t *leafPrimIDs
+          = (item.subtree < 0 ? primIDs.data() : subtreePrimIDs[item.subtree].data())
+          + node.admin.offset;
+        out.admin.offset = newPrimIDs.size();
+        out.admin.count  = node.admin.count;
+        newPrimIDs.insert(newPrimIDs.end(),leafPrimIDs,leafPrimIDs+node.admin.count);
+      }
+      newNodes[item.dstID] = out;
+    }
+    if (newPrimIDs.size() != bvh.numPrims)
+      throw std::runtime_error("cuBQL: lost prims while splicing re-built subtrees");
+
+    if (newNodes.size() != bvh.numNodes) {
+      CUBQL_CUDA_CHECK(memResource->free(bvh.nodes,stream));
+      bvh.numNodes = uint32_t(newNodes.size());
+      CUBQL_CUDA_CHECK(memResource->malloc((void**)&bvh.nodes,bvh.numNodes*sizeof(Node),stream));
+    }
+    CUBQL_CUDA_CALL(MemcpyAsync(bvh.nodes,newNodes.data(),bvh.numNodes*sizeof(Node),
+                                cudaMemcpyDefault,stream));
+    CUBQL_CUDA_CALL(MemcpyAsync(bvh.primIDs,newPrimIDs.data(),bvh.numPrims*sizeof(uint32_t),
+                                cudaMemcpyDefault,stream));
+    topology = newNodes;
+    countSubtreePrims();
+    computeCosts();
+    for (size_t nodeID=0;nodeID<newNodes.size();nodeID++)
+      if (rebuilt[nodeID])
+        newBaselineCosts[nodeID] = costs[nodeID];
+    baselineCosts = newBaselineCosts;
+  }
+
+  template<typename T, int D>
+  typename BVHMaintainer<T,D>::FrameReport
+  BVHMaintainer<T,D>::update(const box_t *boxes)
+  {
+    FrameReport report;
+    memset((void *)&report,0,sizeof(report));
+    report.decision = REFIT;
+    report.sahRatio = 1.f;
+    if (bvh.numNodes == 0)
+      return report;
+
+    double t0 = getCurrentTime();
+    refit(bvh,boxes,stream,*memResource);
+    CUBQL_CUDA_CALL(StreamSynchronize(stream));
+    double t1 = getCurrentTime();
+    report.refitTime = t1-t0;
+    
+    computeCosts();
+    report.sahRatio = costRatio(0);
+    std::vector<uint32_t> roots;
+    if (report.sahRatio > config.rebuildThreshold)
+      report.decision = REBUILD;
+    else if (selectSubtrees(roots) > config.maxSubtreeFraction*double(bvh.numPrims)
+             || (!roots.empty() && roots[0] == 0))
+      report.decision = REBUILD;
+    else if (!roots.empty())
+      report.decision = REBUILD_SUBTREES;
+    double t2 = getCurrentTime();
+    report.costTime = t2-t1;
+
+    if (report.decision == REBUILD) {
+      build(boxes,numBoxes);
+      report.numPrimsRebuilt = bvh.numPrims;
+    } else if (report.decision == REBUILD_SUBTREES) {
+      report.numSubtreesRebuilt = uint32_t(roots.size());
+      for (auto root : roots)
+        report.numPrimsRebuilt += subtreePrims[root];
+      rebuildSubtrees(boxes,roots);
+    }
+    report.rebuildTime = getCurrentTime()-t2;
+    report.sah = costs[0];
+    return report;
+  }
+#endif
+  
+} // ::cuBQL
@@ -0,0 +1,428 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+
+/*! a host-side BVH that supports inserting, removing, and updating
+    single prims - for scenes where only a few prims appear,
+    disappear, or move each frame, and a full gpuBuilder() call
+    every frame would be a waste. New prims get placed by a
+    branch-and-bound search for the sibling that increases the SAH
+    cost the least (Bittner et al., "Fast insertion-based
+    optimization of bounding volume hierarchies"), and every node on
+    the way back up to the root gets checked for a 'rotation' - a
+    swap of a child with a grandchild - that lowers the cost (Kopta
+    et al., "Fast, effective BVH updates for animated
+    scenes"). Removed prims' node slots and primIDs go to free lists
+    and get re-used by later inserts. For queries, exportBVH() writes
+    the tree out in the regular BinaryBVH layout, with one prim per
+    leaf. */
+#pragma once
+
+#include "cuBQL/bvh.h"
+#include <vector>
+#include <queue>
+#include <stdexcept>
+#include <cstring>
+
+namespace cuBQL {
+
+  template<typename T, int D>
+  struct DynamicBVH {
+    using box_t = cuBQL::box_t<T,D>;
+
+    /*! adds a prim with the given (non-empty) box; returns its
+        primID, which is either one that a previous remove() freed,
+        or primIDRange()-1 */
+    inline uint32_t insert(const box_t &box);
+    /*! removes the given prim; its primID may get re-used by later
+        inserts */
+    inline void remove(uint32_t primID);
+    /*! changes the given prim's box (by taking its leaf out of the
+        tree, and re-inserting it) */
+    inline void update(uint32_t primID, const box_t &box);
+
+    /*! number of prims currently in the tree */
+    inline uint32_t numPrims() const
+    { return uint32_t(leafOf.size()-freePrimIDs.size()); }
+    /*! one more than the largest primID handed out so far, ie, the
+        size that arrays indexed by primID must have */
+    inline uint32_t primIDRange() const
+    { return uint32_t(leafOf.size()); }
+    /*! whether the given primID is currently in use */
+    inline bool isValid(uint32_t primID) const
+    { return primID < leafOf.size() && leafOf[primID] >= 0; }
+    /*! the box of the given (valid) prim */
+    inline box_t getBox(uint32_t primID) const
+    { return nodes[leafOf.at(primID)].bounds; }
+    /*! bounds of all prims; empty if there are none */
+    inline box_t getBounds() const
+    { return root < 0 ? box_t() : nodes[root].bounds; }
+
+    /*! SAH cost of the tree, with the same metric as
+        computeSAH.h: each node's surface area relative to the
+        root's, times its number of prims for leaves */
+    inline float sahCost() const;
+
+#ifdef __CUDACC__
+    /*! writes the tree, in the regular BinaryBVH layout (and with
+        one prim per leaf), into arrays allocated with memResource;
+        free with cuBQL::free(bvh,s,memResource). The BVH's primIDs
+        are the ones insert() returned. Syncs the stream. */
+    inline void exportBVH(BinaryBVH<T,D>    &bvh,
+                          cudaStream_t       s=0,
+                          GpuMemoryResource &memResource=defaultGpuMemResource()) const;
+#endif
+
+    struct Node {
+      box_t   bounds;
+      int32_t parent;
+      /*! both -1 for leaves */
+      int32_t child[2];
+      /*! for leaves only */
+      int32_t primID;
+
+      inline bool isLeaf() const { return child[0] < 0; }
+    };
+    
+    /*! all node slots, including free ones */
+    std::vector<Node>     nodes;
+    int32_t               root = -1;
+  private:
+    inline int32_t allocNode();
+    inline void    freeNode(int32_t nodeID);
+    /*! takes the given leaf out of the tree, keeping its slot */
+    inline void    detachLeaf(int32_t leaf);
+    /*! inserts the given (detached) leaf next to the best sibling */
+    inline void    attachLeaf(int32_t leaf);
+    /*! re-computes the bounds of nodeID and all its ancestors,
+        rotating where that lowers the cost */
+    inline void    refitAndRotate(int32_t nodeID);
+    inline void    rotate(int32_t nodeID);
+    inline void    replaceChild(int32_t parent, int32_t oldChild, int32_t newChild);
+
+    /*! leaf node of each primID, or -1 for free primIDs */
+    std::vector<int32_t>  leafOf;
+    std::vector<int32_t>  freeNodes;
+    std::vector<uint32_t> freePrimIDs;
+  };
+
+  // ==================================================================
+  // IMPLEMENTATION
+  // ==================================================================
+
+  namespace dynamicBVH_impl {
+    /*! the D-dimensional equivalent of (half) a box's surface area:
+        the sum, over all dimensions, of the product of the box's
+        extents in all other dimensions */
+    template<typename T, int D>
+    inline double area(const box_t<T,D> &box)
+    {
+      double sum = 0.;
+      for (int d=0;d<D;d++) {
+        double product = 1.;
+        for (int e=0;e<D;e++)
+          if (e != d) product *= double(box.upper[e])-double(box.lower[e]);
+        sum += product;
+      }
+      return sum;
+    }
+
+    template<typename T, int D>
+    inline box_t<T,D> merge(box_t<T,D> a, const box_t<T,D> &b)
+    { return a.grow(b); }
+  } // ::cuBQL::dynamicBVH_impl
+
+  template<typename T, int D>
+  inline int32_t DynamicBVH<T,D>::allocNode()
+  {
+    if (freeNodes.empty()) {
+      nodes.push_back(Node());
+      return int32_t(nodes.size()-1);
+    }
+    const int32_t nodeID = freeNodes.back();
+    freeNodes.pop_back();
+    return nodeID;
+  }
+
+  template<typename T, int D>
+  inline void DynamicBVH<T,D>::freeNode(int32_t nodeID)
+  {
+    nodes[nodeID].parent = -1;
+    freeNodes.push_back(nodeID);
+  }
+
+  template<typename T, int D>
+  inline void DynamicBVH<T,D>::replaceChild(int32_t parent,
+                                            int32_t oldChild,
+                                            int32_t newChild)
+  {
+    if (parent < 0)
+      root = newChild;
+    else
+      nodes[parent].child[nodes[parent].child[0] == oldChild ? 0 : 1] = newChild;
+    nodes[newChild].parent = parent;
+  }
+
+  template<typename T, int D>
+  inline uint32_t DynamicBVH<T,D>::insert(const box_t &box)
+  {
+    if (box.empty())
+      throw std::runtime_error("cuBQL: cannot insert an empty box into a DynamicBVH");
+    uint32_t primID;
+    if (freePrimIDs.empty()) {
+      if (leafOf.size() >= size_t(uint32_t(-1)))
+        throw std::runtime_error("cuBQL: too many prims for a DynamicBVH");
+      primID = uint32_t(leafOf.size());
+      leafOf.push_back(-1);
+    } else {
+      primID = freePrimIDs.back();
+      freePrimIDs.pop_back();
+    }
+    const int32_t leaf = allocNode();
+    Node &node = nodes[leaf];
+    node.bounds   = box;
+    node.child[0] = node.child[1] = -1;
+    node.primID   = int32_t(primID);
+    leafOf[primID] = leaf;
+    attachLeaf(leaf);
+    return primID;
+  }
+
+  template<typename T, int D>
+  inline void DynamicBVH<T,D>::remove(uint32_t primID)
+  {
+    if (!isValid(primID))
+      throw std::runtime_error("cuBQL: DynamicBVH::remove() of invalid primID");
+    const int32_t leaf = leafOf[primID];
+    detachLeaf(leaf);
+    freeNode(leaf);
+    leafOf[primID] = -1;
+    freePrimIDs.push_back(primID);
+  }
+
+  template<typename T, int D>
+  inline void DynamicBVH<T,D>::update(uint32_t primID, const box_t &box)
+  {
+    if (!isValid(primID))
+      throw std::runtime_error("cuBQL: DynamicBVH::update() of invalid primID");
+    if (box.empty())
+      throw std::runtime_error("cuBQL: cannot update a DynamicBVH prim to an empty box");
+    const int32_t leaf = leafOf[primID];
+    detachLeaf(leaf);
+    nodes[leaf].bounds = box;
+    attachLeaf(leaf);
+  }
+
+  template<typename T, int D>
+  inline void DynamicBVH<T,D>::detachLeaf(int32_t leaf)
+  {
+    const int32_t parent = nodes[leaf].parent;
+    nodes[leaf].parent = -1;
+    if (parent < 0) {
+      root = -1;
+      return;
+    }
+    // the leaf's sibling takes its parent's place
+    const Node   &p           = nodes[parent];
+    const int32_t sibling     = p.child[p.child[0] == leaf ? 1 : 0];
+    const int32_t grandParent = p.parent;
+    replaceChild(grandParent,parent,sibling);
+    freeNode(parent);
+    if (grandParent >= 0)
+      refitAndRotate(grandParent);
+  }
+
+  template<typename T, int D>
+  inline void DynamicBVH<T,D>::attachLeaf(int32_t leaf)
+  {
+    using namespace dynamicBVH_impl;
+    if (root < 0) {
+      root = leaf;
+      nodes[leaf].parent = -1;
+      return;
+    }
+
+    // branch-and-bound search for the sibling: the cost of a
+    // candidate is the area of its union with the new leaf, plus how
+    // much the areas of all its ancestors grow; the 'inherited' part
+    // of that only grows further down, which bounds all of a node's
+    // descendants' costs from below
+    const box_t  box      = nodes[leaf].bounds;
+    const double leafArea = area(box);
+    struct Candidate {
+      double  lowerBound;
+      double  inherited;
+      int32_t nodeID;
+      bool operator<(const Candidate &other) const
+      { return lowerBound > other.lowerBound; }
+    };
+    std::priority_queue<Candidate> candidates;
+    candidates.push({ leafArea,0.,root });
+    int32_t sibling  = root;
+    double  bestCost = INFINITY;
+    while (!candidates.empty()) {
+      const Candidate candidate = candidates.top();
+      candidates.pop();
+      if (candidate.lowerBound >= bestCost) break;
+      const Node  &node   = nodes[candidate.nodeID];
+      const double direct = area(merge(node.bounds,box));
+      const double cost   = direct + candidate.inherited;
+      if (cost < bestCost) {
+        bestCost = cost;
+        sibling  = candidate.nodeID;
+      }
+      if (node.isLeaf()) continue;
+      const double inherited  = candidate.inherited + direct - area(node.bounds);
+      const double lowerBound = leafArea + inherited;
+      if (lowerBound < bestCost)
+        for (int c=0;c<2;c++)
+          candidates.push({ lowerBound,inherited,node.child[c] });
+    }
+
+    // new parent of the sibling and the leaf, where the sibling was
+    const int32_t parent    = allocNode();
+    const int32_t oldParent = nodes[sibling].parent;
+    replaceChild(oldParent,sibling,parent);
+    nodes[parent].child[0] = sibling;
+    nodes[parent].child[1] = leaf;
+    nodes[parent].primID   = -1;
+    nodes[sibling].parent  = parent;
+    nodes[leaf].parent     = parent;
+    refitAndRotate(parent);
+  }
+
+  template<typename T, int D>
+  inline void DynamicBVH<T,D>::refitAndRotate(int32_t nodeID)
+  {
+    using namespace dynamicBVH_impl;
+    for (;nodeID >= 0;nodeID = nodes[nodeID].parent) {
+      Node &node = nodes[nodeID];
+      node.bounds = merge(nodes[node.child[0]].bounds,nodes[node.child[1]].bounds);
+      rotate(nodeID);
+    }
+  }
+
+  /*! of the four possible swaps of one of the node's children with
+      one of the other child's children, applies the one that lowers
+      the cost the most, if any. Such a swap changes only the bounds
+      of that other child, so the change in cost is the change in its
+      area */
+  template<typename T, int D>
+  inline void DynamicBVH<T,D>::rotate(int32_t nodeID)
+  {
+    using namespace dynamicBVH_impl;
+    const Node &node = nodes[nodeID];
+    double  bestDelta = 0.;
+    int32_t bestChild = -1, bestGrandChild = -1;
+    for (int c=0;c<2;c++) {
+      const int32_t child = node.child[c];
+      const int32_t other = node.child[1-c];
+      if (nodes[other].isLeaf()) continue;
+      const double otherArea = area(nodes[other].bounds);
+      for (int g=0;g<2;g++) {
+        const int32_t grandChild = nodes[other].child[g];
+        const int32_t remaining  = nodes[other].child[1-g];
+        const double delta
+          = area(merge(nodes[child].bounds,nodes[remaining].bounds)) - otherArea;
+        if (delta < bestDelta) {
+          bestDelta      = delta;
+          bestChild      = child;
+          bestGrandChild = grandChild;
+        }
+      }
+    }
+    if (bestChild < 0) return;
+
+    const int32_t other = nodes[bestGrandChild].parent;
+    Node &o = nodes[other];
+    o.child[o.child[0] == bestGrandChild ? 0 : 1] = bestChild;
+    nodes[bestChild].parent = other;
+    Node &n = nodes[nodeID];
+    n.child[n.child[0] == bestChild ? 0 : 1] = bestGrandChild;
+    nodes[bestGrandChild].parent = nodeID;
+    o.bounds = merge(nodes[o.child[0]].bounds,nodes[o.child[1]].bounds);
+  }
+
+  template<typename T, int D>
+  inline float DynamicBVH<T,D>::sahCost() const
+  {
+    using namespace dynamicBVH_impl;
+    if (root < 0) return 0.f;
+    const double rootArea = area(nodes[root].bounds);
+    if (rootArea <= 0.) return 0.f;
+    double cost = 0.;
+    std::vector<int32_t> stack = { root };
+    while (!stack.empty()) {
+      const Node &node = nodes[stack.back()];
+      stack.pop_back();
+      cost += area(node.bounds)/rootArea;
+      if (!node.isLeaf()) {
+        stack.push_back(node.child[0]);
+        stack.push_back(node.child[1]);
+      }
+    }
+    return float(cost);
+  }
+
+#ifdef __CUDACC__
+  template<typename T, int D>
+  inline void DynamicBVH<T,D>::exportBVH(BinaryBVH<T,D>    &bvh,
+                                         cudaStream_t       s,
+                                         GpuMemoryResource &memResource) const
+  {
+    using OutNode = typename BinaryBVH<T,D>::Node;
+    bvh = BinaryBVH<T,D>();
+    if (root < 0) return;
+
+    // node 0 is the root, node 1 is unused, and each inner node's
+    // children get the next free pair
+    const uint32_t numLeaves = numPrims();
+    std::vector<OutNode>  outNodes(2*size_t(numLeaves));
+    std::vector<uint32_t> outPrimIDs;
+    memset((void *)outNodes.data(),0,outNodes.size()*sizeof(OutNode));
+    std::vector<std::pair<int32_t,uint32_t>> stack = { { root,0u } };
+    uint32_t nextPair = 2;
+    while (!stack.empty()) {
+      const Node &node = nodes[stack.back().first];
+      OutNode    &out  = outNodes[stack.back().second];
+      stack.pop_back();
+      out.bounds = node.bounds;
+      if (node.isLeaf()) {
+        out.admin.offset = outPrimIDs.size();
+        out.admin.count  = 1;
+        outPrimIDs.push_back(uint32_t(node.primID));
+      } else {
+        out.admin.offset = nextPair;
+        out.admin.count  = 0;
+        stack.push_back({ node.child[1],nextPair+1 });
+        stack.push_back({ node.child[0],nextPair+0 });
+        nextPair += 2;
+      }
+    }
+
+    bvh.numNodes = uint32_t(outNodes.size());
+    bvh.numPrims = uint32_t(outPrimIDs.size());
+    CUBQL_CUDA_CHECK(memResource.malloc((void**)&bvh.nodes,bvh.numNodes*sizeof(OutNode),s));
+    CUBQL_CUDA_CHECK(memResource.malloc((void**)&bvh.primIDs,bvh.numPrims*sizeof(uint32_t),s));
+    CUBQL_CUDA_CALL(MemcpyAsync(bvh.nodes,outNodes.data(),
+                                bvh.numNodes*sizeof(OutNode),cudaMemcpyDefault,s));
+    CUBQL_CUDA_CALL(MemcpyAsync(bvh.primIDs,outPrimIDs.data(),
+                                bvh.numPrims*sizeof(uint32_t),cudaMemcpyDefault,s));
+    CUBQL_CUDA_CALL(StreamSynchronize(s));
+  }
+#endif
+
+} // ::cuBQL
@@ -0,0 +1,118 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+/*! a generic bottom-up pass over a BinaryBVH on the GPU, as used by
+    refit() and by computeAggregates(): one thread per leaf computes
+    that leaf, then walks upwards; at every inner node the second of
+    the two children's threads to arrive computes that node and
+    continues, the first one exits. Which per-node data gets computed
+    is up to an 'op' object that provides
+
+      __device__ void leaf(index_t nodeID);
+      __device__ void inner(index_t nodeID);
+
+    where inner() may read whatever leaf() or inner() wrote for the
+    node's two children, and index_t is the BVH's index type. Node 1
+    is unused, and gets visited by neither. */
+#pragma once
+
+#include "cuBQL/bvh.h"
+
+namespace cuBQL {
+#ifdef __CUDACC__
+  namespace bottomUp_impl {
+
+    inline __device__ uint32_t atomicAddIndex(uint32_t *ptr, uint32_t value)
+    { return atomicAdd(ptr,value); }
+    
+    inline __device__ uint64_t atomicAddIndex(uint64_t *ptr, uint64_t value)
+    {
+      return atomicAdd((unsigned long long *)ptr,(unsigned long long)value);
+    }
+
+    /*! stores each node's parent (shifted left by one bit; the
+        lowest bit is used as 'one of my children is done' flag by
+        run()) */
+    template<typename T, int D, typename index_t>
+    __global__
+    void initParents(const BinaryBVHNode<T,D> *nodes,
+                     index_t                  *parentData,
+                     index_t                   numNodes)
+    {
+      const index_t nodeID = threadIdx.x+index_t(blockIdx.x)*blockDim.x;
+      if (nodeID == 1 || nodeID >= numNodes) return;
+      if (nodeID == 0)
+        parentData[0] = 0;
+      const auto &node = nodes[nodeID];
+      if (node.admin.count) return;
+
+      parentData[node.admin.offset+0] = nodeID << 1;
+      parentData[node.admin.offset+1] = nodeID << 1;
+    }
+
+    template<typename T, int D, typename index_t, typename Op>
+    __global__
+    void run(const BinaryBVH<T,D,index_t> bvh,
+             index_t                     *parentData,
+             Op                           op)
+    {
+      index_t nodeID = threadIdx.x+index_t(blockIdx.x)*blockDim.x;
+      if (nodeID == 1 || nodeID >= bvh.numNodes) return;
+      if (bvh.nodes[nodeID].admin.count == 0)
+        // this is a inner node - exit
+        return;
+
+      op.leaf(nodeID);
+      index_t parentID = (parentData[nodeID] >> 1);
+      while (true) {
+        __threadfence();
+        if (nodeID == 0)
+          break;
+
+        index_t parentBits = atomicAddIndex(&parentData[parentID],index_t(1));
+        if ((parentBits & 1) == 0)
+          // we're the first one - let other one do it
+          break;
+
+        nodeID   = parentID;
+        parentID = (parentBits >> 1);
+        op.inner(nodeID);
+      }
+    }
+
+    /*! runs the bottom-up pass with the given op; the temporary
+        parent data gets allocated through the given memory
+        resource. Does not sync. */
+    template<typename T, int D, typename index_t, typename Op>
+    void bottomUp(const BinaryBVH<T,D,index_t> bvh,
+                  const Op                    &op,
+                  cudaStream_t                 s,
+                  GpuMemoryResource           &memResource)
+    {
+      const index_t numNodes = bvh.numNodes;
+      if (numNodes == 0) return;
+      index_t *parentData = 0;
+      CUBQL_CUDA_CHECK(memResource.malloc((void**)&parentData,numNodes*sizeof(index_t),s));
+      initParents<T,D,index_t><<<divRoundUp(numNodes,index_t(1024)),1024,0,s>>>
+        (bvh.nodes,parentData,numNodes);
+      run<<<divRoundUp(numNodes,index_t(32)),32,0,s>>>
+        (bvh,parentData,op);
+      CUBQL_CUDA_CHECK(memResource.free(parentData,s));
+    }
+
+  } // ::cuBQL::bottomUp_impl
+#endif
+} // ::cuBQL
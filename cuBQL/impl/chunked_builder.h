@@ -0,0 +1,364 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+
+/*! the chunked builder behind gpuBuilder(BinaryBVH64&,...), and the
+    pieces of it that buildOutOfCore() (io/outOfCore.h) shares: boxes
+    get sorted - by the cell of a coarse, Morton-ordered grid over
+    the boxes' centers - into spatially coherent chunks of at most
+    maxPrimsPerChunk boxes each; each chunk gets built with the
+    regular (32-bit) gpuBuilder(), and its nodes rebased to where
+    they go in the final BVH; and a top-level tree over the chunks'
+    root nodes gets built on the host. Since only the top-level tree
+    and the rebased offsets are 64-bit, this gives BVHs over more
+    than 2^32 prims without touching the builders themselves. */
+#pragma once
+
+#include "cuBQL/bvh.h"
+#include "cuBQL/impl/parallel_for.h"
+#include <algorithm>
+#include <numeric>
+#include <stdexcept>
+#include <vector>
+#include <cstring>
+
+namespace cuBQL {
+  namespace chunkedBuilder_impl {
+    /*! log2 of the number of cells in the grid that boxes get sorted
+        into chunks by */
+    enum { numCellBits = 18 };
+    /*! number of boxes that get processed (by one thread) at a time */
+    enum { blockSize = 1<<20 };
+    
+    /*! a grid of 2^numCellBits cells over the bounds of the boxes'
+        centers, with cells numbered in Morton order */
+    template<typename T, int D>
+    struct Grid {
+      inline Grid(const box_t<double,D> &centerBounds)
+      {
+        for (int d=0;d<D;d++) {
+          const double extent = centerBounds.upper[d]-centerBounds.lower[d];
+          lower[d] = centerBounds.lower[d];
+          scale[d] = extent > 0. ? cellsPerDim/extent : 0.;
+        }
+      }
+
+      /*! the cell that the given box's center is in */
+      inline uint32_t cellOf(const box_t<T,D> &box) const
+      {
+        uint32_t q[D];
+        for (int d=0;d<D;d++) {
+          const double center = .5*(double(box.lower[d])+double(box.upper[d]));
+          q[d] = (uint32_t)std::min(double(cellsPerDim-1),
+                                    std::max(0.,(center-lower[d])*scale[d]));
+        }
+        uint32_t cell = 0;
+        for (int bit=bitsPerDim-1;bit>=0;bit--)
+          for (int d=0;d<D;d++)
+            cell = (cell << 1) | ((q[d] >> bit) & 1);
+        return cell;
+      }
+
+      enum { bitsPerDim  = (numCellBits/D > 0) ? numCellBits/D : 1,
+             cellsPerDim = 1<<bitsPerDim,
+             numCells    = 1<<(bitsPerDim*D) };
+      double lower[D], scale[D];
+    };
+
+    /*! bounds of the centers of all valid boxes; empty if there are
+        none */
+    template<typename T, int D>
+    box_t<double,D> computeCenterBounds(const box_t<T,D> *boxes,
+                                        uint64_t          numBoxes)
+    {
+      const uint64_t numBlocks = divRoundUp(numBoxes,uint64_t(blockSize));
+      std::vector<box_t<double,D>> blockBounds(numBlocks);
+      host::parallel_for(numBlocks,[&](size_t blockID) {
+        box_t<double,D> &bounds = blockBounds[blockID];
+        bounds.set_empty();
+        const uint64_t end = std::min(numBoxes,(blockID+1)*uint64_t(blockSize));
+        for (uint64_t i=blockID*uint64_t(blockSize);i<end;i++) {
+          if (boxes[i].empty()) continue;
+          vec_t<double,D> center;
+          for (int d=0;d<D;d++)
+            center[d] = .5*(double(boxes[i].lower[d])+double(boxes[i].upper[d]));
+          bounds.grow(center);
+        }
+      },1);
+      box_t<double,D> centerBounds;
+      centerBounds.set_empty();
+      for (auto &bounds : blockBounds)
+        if (!bounds.empty()) centerBounds.grow(bounds);
+      return centerBounds;
+    }
+
+    /*! the (Grid::numCells+1) positions, in cell order, where each
+        cell's valid boxes begin (with per-thread histograms) */
+    template<typename T, int D>
+    std::vector<uint64_t> computeCellBegin(const Grid<T,D>  &grid,
+                                           const box_t<T,D> *boxes,
+                                           uint64_t          numBoxes)
+    {
+      const size_t numCells = Grid<T,D>::numCells;
+      const uint64_t numBlocks = divRoundUp(numBoxes,uint64_t(blockSize));
+      std::vector<std::vector<uint64_t>> threadCounts(host::getNumThreads());
+      host::parallel_for_with_threadID(numBlocks,[&](int threadID, size_t blockID) {
+        std::vector<uint64_t> &counts = threadCounts[threadID];
+        if (counts.empty()) counts.resize(numCells);
+        const uint64_t end = std::min(numBoxes,(blockID+1)*uint64_t(blockSize));
+        for (uint64_t i=blockID*uint64_t(blockSize);i<end;i++)
+          if (!boxes[i].empty()) counts[grid.cellOf(boxes[i])]++;
+      },1);
+      std::vector<uint64_t> cellBegin(numCells+1,0);
+      for (auto &counts : threadCounts)
+        for (size_t cell=0;cell<counts.size();cell++)
+          cellBegin[cell+1] += counts[cell];
+      for (size_t cell=0;cell<numCells;cell++)
+        cellBegin[cell+1] += cellBegin[cell];
+      return cellBegin;
+    }
+    
+    /*! splits the prims, in the order of their cells, into chunks of
+        at most maxPrimsPerChunk prims; returns the (numChunks+1)
+        positions in that order where chunks begin. Chunks end at cell
+        boundaries, unless a single cell has more than
+        maxPrimsPerChunk prims, in which case that cell gets split */
+    inline std::vector<uint64_t> makeChunks(const std::vector<uint64_t> &cellBegin,
+                                            uint64_t maxPrimsPerChunk)
+    {
+      std::vector<uint64_t> chunkBegin = { 0 };
+      for (size_t cell=0;cell+1<cellBegin.size();cell++) {
+        const uint64_t begin = cellBegin[cell];
+        const uint64_t count = cellBegin[cell+1]-begin;
+        if (count == 0 || begin+count-chunkBegin.back() <= maxPrimsPerChunk)
+          continue;
+        if (begin > chunkBegin.back())
+          chunkBegin.push_back(begin);
+        const uint64_t numPieces = divRoundUp(count,maxPrimsPerChunk);
+        for (uint64_t i=1;i<numPieces;i++)
+          chunkBegin.push_back(begin+i*count/numPieces);
+      }
+      chunkBegin.push_back(cellBegin.back());
+      return chunkBegin;
+    }
+
+    /*! builds the top-level tree over the given chunk roots, into
+        nodes[nodeID] and (newly allocated) pairs of nodes after that;
+        each leaf of that tree is a copy of one chunk's root */
+    template<typename Node>
+    void buildTopLevel(std::vector<Node>       &nodes,
+                       size_t                   nodeID,
+                       const std::vector<Node> &chunkRoots,
+                       int                     *chunkIDs,
+                       int                      numChunks)
+    {
+      if (numChunks == 1) {
+        nodes[nodeID] = chunkRoots[chunkIDs[0]];
+        return;
+      }
+      auto bounds = chunkRoots[chunkIDs[0]].bounds;
+      auto centerBounds = bounds;
+      centerBounds.lower = centerBounds.upper = bounds.center();
+      for (int i=1;i<numChunks;i++) {
+        bounds.grow(chunkRoots[chunkIDs[i]].bounds);
+        centerBounds.grow(chunkRoots[chunkIDs[i]].bounds.center());
+      }
+      int dim = 0;
+      for (int d=1;d<decltype(bounds)::numDims;d++)
+        if (centerBounds.size()[d] > centerBounds.size()[dim]) dim = d;
+      const int mid = numChunks/2;
+      std::nth_element(chunkIDs,chunkIDs+mid,chunkIDs+numChunks,
+                       [&](int a, int b) {
+                         return chunkRoots[a].bounds.center()[dim]
+                           < chunkRoots[b].bounds.center()[dim];
+                       });
+      const size_t childID = nodes.size();
+      nodes.resize(childID+2);
+      nodes[nodeID].bounds = bounds;
+      nodes[nodeID].admin.offsetAndCountBits = 0;
+      nodes[nodeID].admin.offset = childID;
+      buildTopLevel(nodes,childID+0,chunkRoots,chunkIDs,mid);
+      buildTopLevel(nodes,childID+1,chunkRoots,chunkIDs+mid,numChunks-mid);
+    }
+
+    /*! the top-level tree over all chunks' roots: the first
+        2*numChunks nodes of the final BVH (root, unused node 1, and
+        one pair per inner node) */
+    template<typename Node>
+    std::vector<Node> buildTopLevel(const std::vector<Node> &chunkRoots)
+    {
+      const int numChunks = (int)chunkRoots.size();
+      std::vector<Node> topLevel(2);
+      memset((void *)topLevel.data(),0,2*sizeof(Node));
+      std::vector<int> chunkIDs(numChunks);
+      std::iota(chunkIDs.begin(),chunkIDs.end(),0);
+      buildTopLevel(topLevel,0,chunkRoots,chunkIDs.data(),numChunks);
+      return topLevel;
+    }
+    
+#ifdef __CUDACC__
+    /*! builds the BVH over one chunk - ie, over the boxes
+        boxes[chunkPrimIDs[i]] - with the regular gpuBuilder(),
+        staging those boxes through d_boxes (which must have room for
+        all of them). On return, 'nodes' has the chunk's nodes, with
+        offsets rebased such that its nodes 2 and up can go to
+        position nodeOffset and up of the final nodes[] array, and its
+        primIDs to position primOffset and up of the final primIDs[]
+        array; and 'primIDs' has the chunk BVH's primIDs, already
+        mapped back through chunkPrimIDs[]. */
+    template<typename T, int D, typename index_t>
+    void buildChunk(std::vector<BinaryBVHNode<T,D>> &nodes,
+                    std::vector<index_t>            &primIDs,
+                    const box_t<T,D>                *boxes,
+                    const std::vector<index_t>      &chunkPrimIDs,
+                    uint64_t                         nodeOffset,
+                    uint64_t                         primOffset,
+                    box_t<T,D>                      *d_boxes,
+                    BuildConfig                      buildConfig,
+                    cudaStream_t                     s,
+                    GpuMemoryResource               &memResource)
+    {
+      const uint32_t numPrims = (uint32_t)chunkPrimIDs.size();
+      std::vector<box_t<T,D>> chunkBoxes(numPrims);
+      host::parallel_for(numPrims,[&](size_t i) {
+        chunkBoxes[i] = boxes[chunkPrimIDs[i]];
+      },4096);
+      CUBQL_CUDA_CALL(MemcpyAsync(d_boxes,chunkBoxes.data(),
+                                  numPrims*sizeof(box_t<T,D>),
+                                  cudaMemcpyDefault,s));
+      BinaryBVH<T,D> chunkBVH;
+      gpuBuilder(chunkBVH,d_boxes,numPrims,buildConfig,s,memResource);
+      std::vector<uint32_t> chunkBVHPrimIDs(chunkBVH.numPrims);
+      nodes.resize(chunkBVH.numNodes);
+      CUBQL_CUDA_CALL(MemcpyAsync(nodes.data(),chunkBVH.nodes,
+                                  chunkBVH.numNodes*sizeof(BinaryBVHNode<T,D>),
+                                  cudaMemcpyDefault,s));
+      CUBQL_CUDA_CALL(MemcpyAsync(chunkBVHPrimIDs.data(),chunkBVH.primIDs,
+                                  chunkBVH.numPrims*sizeof(uint32_t),
+                                  cudaMemcpyDefault,s));
+      CUBQL_CUDA_CALL(StreamSynchronize(s));
+      cuBQL::free(chunkBVH,s,memResource);
+      if (chunkBVHPrimIDs.size() != numPrims)
+        throw std::runtime_error("cuBQL: unexpected number of prims in chunk BVH");
+
+      for (size_t nodeID=0;nodeID<nodes.size();nodeID++) {
+        BinaryBVHNode<T,D> &node = nodes[nodeID];
+        if (nodeID == 1)
+          // unused
+          continue;
+        if (node.admin.count == 0) {
+          if (node.admin.offset < 2)
+            throw std::runtime_error("cuBQL: unexpected chunk BVH layout");
+          node.admin.offset = nodeOffset + node.admin.offset - 2;
+        } else
+          node.admin.offset = primOffset + node.admin.offset;
+      }
+      primIDs.resize(numPrims);
+      for (uint32_t i=0;i<numPrims;i++)
+        primIDs[i] = chunkPrimIDs[chunkBVHPrimIDs[i]];
+    }
+#endif
+  } // ::cuBQL::chunkedBuilder_impl
+
+#ifdef __CUDACC__
+  template<typename T, int D>
+  void gpuBuilder(BinaryBVH64<T,D>  &bvh,
+                  const box_t<T,D>  *boxes,
+                  uint64_t           numBoxes,
+                  BuildConfig        buildConfig,
+                  cudaStream_t       s,
+                  GpuMemoryResource &memResource,
+                  size_t             maxPrimsPerChunk)
+  {
+    using namespace chunkedBuilder_impl;
+    using Node = BinaryBVHNode<T,D>;
+    bvh = BinaryBVH64<T,D>();
+    if (numBoxes == 0) return;
+    const box_t<double,D> centerBounds = computeCenterBounds(boxes,numBoxes);
+    if (centerBounds.empty()) return;
+    const Grid<T,D> grid(centerBounds);
+    std::vector<uint64_t> cellBegin = computeCellBegin(grid,boxes,numBoxes);
+    const uint64_t numPrims = cellBegin.back();
+    const std::vector<uint64_t> chunkBegin
+      = makeChunks(cellBegin,std::max(maxPrimsPerChunk,size_t(1)));
+    const int numChunks = int(chunkBegin.size()-1);
+
+    // sort the (valid) primIDs by cell
+    std::vector<uint64_t> sortedPrimIDs(numPrims);
+    {
+      std::vector<uint32_t> cells(std::min(numBoxes,uint64_t(blockSize)));
+      for (uint64_t blockBegin=0;blockBegin<numBoxes;blockBegin+=blockSize) {
+        const uint64_t blockEnd = std::min(numBoxes,blockBegin+blockSize);
+        host::parallel_for(blockEnd-blockBegin,[&](size_t i) {
+          const box_t<T,D> &box = boxes[blockBegin+i];
+          cells[i] = box.empty() ? uint32_t(-1) : grid.cellOf(box);
+        },4096);
+        for (uint64_t i=blockBegin;i<blockEnd;i++) {
+          const uint32_t cell = cells[i-blockBegin];
+          if (cell != uint32_t(-1))
+            sortedPrimIDs[cellBegin[cell]++] = i;
+        }
+      }
+    }
+
+    // build the chunks; the top-level tree takes the first
+    // 2*numChunks nodes, the chunks' nodes come after that
+    std::vector<Node> nodes(2*size_t(numChunks));
+    std::vector<Node> chunkRoots(numChunks);
+    size_t maxChunkSize = 0;
+    for (int chunkID=0;chunkID<numChunks;chunkID++)
+      maxChunkSize = std::max(maxChunkSize,
+                              size_t(chunkBegin[chunkID+1]-chunkBegin[chunkID]));
+    box_t<T,D> *d_boxes = 0;
+    try {
+      CUBQL_CUDA_CHECK(memResource.malloc((void**)&bvh.primIDs,numPrims*sizeof(uint64_t),s));
+      CUBQL_CUDA_CHECK(memResource.malloc((void**)&d_boxes,maxChunkSize*sizeof(box_t<T,D>),s));
+      std::vector<uint64_t> chunkPrimIDs, primIDs;
+      std::vector<Node>     chunkNodes;
+      for (int chunkID=0;chunkID<numChunks;chunkID++) {
+        const uint64_t primOffset = chunkBegin[chunkID];
+        chunkPrimIDs.assign(sortedPrimIDs.begin()+primOffset,
+                            sortedPrimIDs.begin()+chunkBegin[chunkID+1]);
+        buildChunk(chunkNodes,primIDs,boxes,chunkPrimIDs,nodes.size(),primOffset,
+                   d_boxes,buildConfig,s,memResource);
+        CUBQL_CUDA_CALL(MemcpyAsync(bvh.primIDs+primOffset,primIDs.data(),
+                                    primIDs.size()*sizeof(uint64_t),
+                                    cudaMemcpyDefault,s));
+        CUBQL_CUDA_CALL(StreamSynchronize(s));
+        chunkRoots[chunkID] = chunkNodes[0];
+        if (chunkNodes.size() > 2)
+          nodes.insert(nodes.end(),chunkNodes.begin()+2,chunkNodes.end());
+      }
+      CUBQL_CUDA_CHECK(memResource.free(d_boxes,s));
+      d_boxes = 0;
+      const std::vector<Node> topLevel = buildTopLevel(chunkRoots);
+      std::copy(topLevel.begin(),topLevel.end(),nodes.begin());
+
+      CUBQL_CUDA_CHECK(memResource.malloc((void**)&bvh.nodes,nodes.size()*sizeof(Node),s));
+      CUBQL_CUDA_CALL(MemcpyAsync(bvh.nodes,nodes.data(),nodes.size()*sizeof(Node),
+                                  cudaMemcpyDefault,s));
+      CUBQL_CUDA_CALL(StreamSynchronize(s));
+      bvh.numNodes = nodes.size();
+      bvh.numPrims = numPrims;
+    } catch (...) {
+      if (d_boxes) memResource.free(d_boxes,s);
+      if (bvh.primIDs) memResource.free(bvh.primIDs,s);
+      bvh = BinaryBVH64<T,D>();
+      throw;
+    }
+  }
+#endif
+} // ::cuBQL
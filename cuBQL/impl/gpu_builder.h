@@ -66,6 +66,16 @@ namespace cuBQL {
     gpuBuilder_impl::refit(bvh,boxes,s,memResource);
   }
 
+  template<typename T, int D>
+  void refit(BinaryBVH<T,D>    &bvh,
+             const box_t<T,D>  *boxes,
+             cudaStream_t       s,
+             GpuMemoryResource &memResource)
+  {
+    if (bvh.numNodes == 0) return;
+    gpuBuilder_impl::refit(bvh,boxes,s,memResource);
+  }
+
   template<typename T, int D>
   void free(BinaryBVH<T,D>    &bvh,
             cudaStream_t       s,
@@ -76,6 +86,27 @@ namespace cuBQL {
     CUBQL_CUDA_CALL(StreamSynchronize(s));
     bvh.primIDs = 0;
   }
+
+  template<typename T, int D>
+  void refit(BinaryBVH64<T,D>  &bvh,
+             const box_t<T,D>  *boxes,
+             cudaStream_t       s,
+             GpuMemoryResource &memResource)
+  {
+    if (bvh.numNodes == 0) return;
+    gpuBuilder_impl::refit(bvh,boxes,s,memResource);
+  }
+
+  template<typename T, int D>
+  void free(BinaryBVH64<T,D>  &bvh,
+            cudaStream_t       s,
+            GpuMemoryResource &memResource)
+  {
+    gpuBuilder_impl::_FREE(bvh.primIDs,s,memResource);
+    gpuBuilder_impl::_FREE(bvh.nodes,s,memResource);
+    CUBQL_CUDA_CALL(StreamSynchronize(s));
+    bvh.primIDs = 0;
+  }
 }
 
 
@@ -87,6 +118,10 @@ namespace cuBQL {
                              BuildConfig        buildConfig,           \
                              cudaStream_t       s,                     \
                              GpuMemoryResource &mem_resource);         \
+    template void refit(BinaryBVH<T,D>    &bvh,                        \
+                        const box_t<T,D>  *boxes,                      \
+                        cudaStream_t       s,                          \
+                        GpuMemoryResource &mem_resource);              \
     template void free(BinaryBVH<T,D>    &bvh,                         \
                        cudaStream_t       s,                           \
                        GpuMemoryResource &mem_resource);               \
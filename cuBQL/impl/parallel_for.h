@@ -0,0 +1,111 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+/* minimal host-side threading helpers, used by the host-side
+   variants of the (batched) query kernels. this is intentionally
+   kept simple (plain std::threads with an atomic work counter) so
+   we don't have to pull in tbb, openmp, or similar */
+#pragma once
+
+#include "cuBQL/math/common.h"
+#include <thread>
+#include <atomic>
+#include <vector>
+
+namespace cuBQL {
+  namespace host {
+
+    /*! returns the number of host threads that the host-side query
+        variants will use; can be overridden through the
+        CUBQL_NUM_THREADS environment variable */
+    inline int getNumThreads()
+    {
+      static int numThreads = 0;
+      if (numThreads == 0) {
+        const char *fromEnv = getenv("CUBQL_NUM_THREADS");
+        numThreads
+          = fromEnv
+          ? std::max(1,atoi(fromEnv))
+          : std::max(1,(int)std::thread::hardware_concurrency());
+      }
+      return numThreads;
+    }
+
+    /*! executes lambda(jobID) for all jobID in [0,numJobs), in
+        parallel, using getNumThreads() host threads. jobs are
+        handed out in small blocks, so the lambda should be
+        reasonably cheap to call */
+    template<typename Lambda>
+    inline void parallel_for(size_t numJobs, const Lambda &lambda,
+                             size_t blockSize=64)
+    {
+      if (numJobs == 0) return;
+      const int numThreads
+        = (int)std::min(size_t(getNumThreads()),divRoundUp(numJobs,blockSize));
+      if (numThreads <= 1) {
+        for (size_t jobID=0;jobID<numJobs;jobID++)
+          lambda(jobID);
+        return;
+      }
+      std::atomic<size_t> nextBlock(0);
+      auto worker = [&]() {
+        while (true) {
+          size_t begin = blockSize * nextBlock++;
+          if (begin >= numJobs) break;
+          size_t end = std::min(numJobs,begin+blockSize);
+          for (size_t jobID=begin;jobID<end;jobID++)
+            lambda(jobID);
+        }
+      };
+      std::vector<std::thread> threads;
+      for (int i=1;i<numThreads;i++)
+        threads.push_back(std::thread(worker));
+      worker();
+      for (auto &t : threads) t.join();
+    }
+
+    /*! executes lambda(threadID,jobID) for all jobID in [0,numJobs),
+        in parallel; same as parallel_for(), but also passes the ID
+        of the calling thread, so the lambda can write into
+        per-thread buffers. use getNumThreads() to find out how many
+        such buffers are required */
+    template<typename Lambda>
+    inline void parallel_for_with_threadID(size_t numJobs, const Lambda &lambda,
+                                           size_t blockSize=64)
+    {
+      if (numJobs == 0) return;
+      const int numThreads
+        = (int)std::min(size_t(getNumThreads()),divRoundUp(numJobs,blockSize));
+      std::atomic<size_t> nextBlock(0);
+      auto worker = [&](int threadID) {
+        while (true) {
+          size_t begin = blockSize * nextBlock++;
+          if (begin >= numJobs) break;
+          size_t end = std::min(numJobs,begin+blockSize);
+          for (size_t jobID=begin;jobID<end;jobID++)
+            lambda(threadID,jobID);
+        }
+      };
+      std::vector<std::thread> threads;
+      for (int i=1;i<numThreads;i++)
+        threads.push_back(std::thread(worker,i));
+      worker(0);
+      for (auto &t : threads) t.join();
+    }
+
+  } // ::cuBQL::host
+} // ::cuBQL
+
@@ -17,6 +17,7 @@
 #pragma once
 
 #include "cuBQL/impl/builder_common.h"
+#include "cuBQL/impl/bottomUp.h"
 
 namespace cuBQL {
   namespace gpuBuilder_impl {
@@ -613,82 +614,41 @@ namespace cuBQL {
       _FREE(buildState,s,memResource);
     }
 
-    template<typename T, int D>
-    __global__ void
-    refit_init(const typename BinaryBVH<T,D>::Node *nodes,
-               uint32_t              *refitData,
-               int numNodes)
-    {
-      const int nodeID = threadIdx.x+blockIdx.x*blockDim.x;
-      if (nodeID == 1 || nodeID >= numNodes) return;
-      if (nodeID < 2)
-        refitData[0] = 0;
-      const auto &node = nodes[nodeID];
-      if (node.admin.count) return;
-
-      refitData[node.admin.offset+0] = nodeID << 1;
-      refitData[node.admin.offset+1] = nodeID << 1;
-    }
-    
-    template<typename T, int D>
-    __global__
-    void refit_run(BinaryBVH<T,D> bvh,
-                   uint32_t *refitData,
-                   const box_t<T,D> *boxes)
-    {
-      int nodeID = threadIdx.x+blockIdx.x*blockDim.x;
-      if (nodeID == 1 || nodeID >= bvh.numNodes) return;
-      
-      typename BinaryBVH<T,D>::Node *node = &bvh.nodes[nodeID];
-      if (node->admin.count == 0)
-        // this is a inner node - exit
-        return;
-
-      box_t<T,D> bounds; bounds.set_empty();
-      for (int i=0;i<node->admin.count;i++) {
-        const box_t<T,D> primBox = boxes[bvh.primIDs[node->admin.offset+i]];
-        bounds.lower = min(bounds.lower,primBox.lower);
-        bounds.upper = max(bounds.upper,primBox.upper);
+    /*! bottomUp_impl op for refit(): leaves get the bounds of their
+        prims, inner nodes those of their two children */
+    template<typename T, int D, typename index_t>
+    struct RefitOp {
+      inline __device__ void leaf(index_t nodeID) const
+      {
+        BinaryBVHNode<T,D> &node = bvh.nodes[nodeID];
+        box_t<T,D> bounds; bounds.set_empty();
+        for (int i=0;i<node.admin.count;i++) {
+          const box_t<T,D> primBox = boxes[bvh.primIDs[node.admin.offset+i]];
+          bounds.lower = min(bounds.lower,primBox.lower);
+          bounds.upper = max(bounds.upper,primBox.upper);
+        }
+        node.bounds = bounds;
       }
-
-      int parentID = (refitData[nodeID] >> 1);
-      while (true) {
-        node->bounds = bounds;
-        __threadfence();
-        if (node == bvh.nodes)
-          break;
-
-        uint32_t refitBits = atomicAdd(&refitData[parentID],1u);
-        if ((refitBits & 1) == 0)
-          // we're the first one - let other one do it
-          break;
-
-        nodeID   = parentID;
-        node     = &bvh.nodes[parentID];
-        parentID = (refitBits >> 1);
-        
-        typename BinaryBVH<T,D>::Node l = bvh.nodes[node->admin.offset+0];
-        typename BinaryBVH<T,D>::Node r = bvh.nodes[node->admin.offset+1];
-        bounds.lower = min(l.bounds.lower,r.bounds.lower);
-        bounds.upper = max(l.bounds.upper,r.bounds.upper);
+      inline __device__ void inner(index_t nodeID) const
+      {
+        BinaryBVHNode<T,D> &node = bvh.nodes[nodeID];
+        BinaryBVHNode<T,D> l = bvh.nodes[node.admin.offset+0];
+        BinaryBVHNode<T,D> r = bvh.nodes[node.admin.offset+1];
+        node.bounds.lower = min(l.bounds.lower,r.bounds.lower);
+        node.bounds.upper = max(l.bounds.upper,r.bounds.upper);
       }
-    }
 
-    template<typename T, int D>
-    void refit(BinaryBVH<T,D>    &bvh,
-               const box_t<T,D>  *boxes,
-               cudaStream_t       s=0,
-               GpuMemoryResource &memResource=defaultGpuMemResource())
+      BinaryBVH<T,D,index_t> bvh;
+      const box_t<T,D>      *boxes;
+    };
+
+    template<typename T, int D, typename index_t>
+    void refit(BinaryBVH<T,D,index_t> &bvh,
+               const box_t<T,D>       *boxes,
+               cudaStream_t            s=0,
+               GpuMemoryResource      &memResource=defaultGpuMemResource())
     {
-      uint32_t *refitData = 0;
-      memResource.malloc((void**)&refitData,bvh.numNodes*sizeof(int),s);
-      
-      int numNodes = bvh.numNodes;
-      refit_init<T,D><<<divRoundUp(numNodes,1024),1024,0,s>>>
-        (bvh.nodes,refitData,bvh.numNodes);
-      refit_run<<<divRoundUp(numNodes,32),32,0,s>>>
-        (bvh,refitData,boxes);
-      memResource.free((void*)refitData,s);
+      bottomUp_impl::bottomUp(bvh,RefitOp<T,D,index_t>{ bvh, boxes },s,memResource);
       // we're not syncing here - let APP do that
     }
     
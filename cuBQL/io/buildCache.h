@@ -0,0 +1,301 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+
+/*! a content-addressed cache of built BVHs: the input boxes and the
+    BuildConfig get hashed (in parallel), and if a BVH file (see
+    bvhFile.h) for that hash already exists in the cache directory,
+    that file gets mapped instead of building the BVH again; else the
+    BVH gets built, and stored under that hash for the next time. This
+    is meant for pipelines that keep re-building BVHs over the same
+    static inputs. Note the GPU builder's results are not necessarily
+    bit-identical from one build to the next (nor from one cuBQL
+    version to the next), so cached BVHs are valid BVHs over the same
+    input, but not necessarily the same BVH that a fresh build would
+    produce. */
+#pragma once
+
+#include "cuBQL/io/bvhFile.h"
+#include "cuBQL/impl/parallel_for.h"
+#include <cstdio>
+#include <random>
+#ifdef _WIN32
+# include <direct.h>
+#else
+# include <sys/stat.h>
+#endif
+
+namespace cuBQL {
+
+  /*! 128-bit hash of a build's input boxes and config */
+  struct BuildCacheKey {
+    /*! 32 hex digits */
+    inline std::string toString() const;
+    inline bool operator==(const BuildCacheKey &other) const
+    { return lo == other.lo && hi == other.hi; }
+    inline bool operator!=(const BuildCacheKey &other) const
+    { return !(*this == other); }
+
+    uint64_t lo, hi;
+  };
+
+  /*! computes the key for a build over the given (device-readable)
+      boxes with the given config. Each GPU thread hashes one chunk of
+      the input, and the per-chunk hashes then get combined, in order,
+      on the host. This syncs the stream. */
+  template<typename T, int D>
+  BuildCacheKey computeBuildCacheKey(const box_t<T,D>  *boxes,
+                                     uint32_t           numBoxes,
+                                     BuildConfig        buildConfig,
+                                     cudaStream_t       s=0,
+                                     GpuMemoryResource &memResource=defaultGpuMemResource());
+
+  namespace host {
+    /*! host-side version of cuBQL::computeBuildCacheKey(), for
+        host-readable boxes; gives the same key */
+    template<typename T, int D>
+    BuildCacheKey computeBuildCacheKey(const box_t<T,D> *boxes,
+                                       uint32_t          numBoxes,
+                                       BuildConfig       buildConfig);
+  }
+
+  /*! a cache directory of built BVHs; see top of this file */
+  struct BuildCache {
+    /*! uses (and, if required, creates) the given directory */
+    inline explicit BuildCache(const std::string &directory);
+
+    /*! returns the (mapped) BVH over the given boxes, either from the
+        cache, or by building it with gpuBuilder() (boxes[] must be
+        device-readable) and then adding it to the cache. Adding goes
+        through a temporary file that then gets renamed, so several
+        processes can share the same cache directory. */
+    template<typename T, int D>
+    MappedBVH<BinaryBVH<T,D>> build(const box_t<T,D>  *boxes,
+                                    uint32_t           numBoxes,
+                                    BuildConfig        buildConfig,
+                                    cudaStream_t       s=0,
+                                    GpuMemoryResource &memResource=defaultGpuMemResource());
+
+    /*! the file that a BVH with the given key gets stored in */
+    inline std::string fileNameFor(const BuildCacheKey &key) const;
+
+    std::string directory;
+    /*! how many build() calls were served from the cache, and how
+        many had to build */
+    size_t numHits = 0, numMisses = 0;
+  };
+
+  // ==================================================================
+  // IMPLEMENTATION
+  // ==================================================================
+
+  namespace buildCache_impl {
+    /*! number of 32-bit words each thread hashes */
+    enum { wordsPerChunk = 1024 };
+
+    /*! murmur3's 64-bit finalizer */
+    inline __cubql_both uint64_t mix(uint64_t h)
+    {
+      h ^= h >> 33; h *= 0xff51afd7ed558ccdull;
+      h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ull;
+      h ^= h >> 33;
+      return h;
+    }
+
+    /*! hashes words [begin,end); two independent 64-bit lanes, for
+        128 bits in total */
+    inline __cubql_both
+    void hashChunk(uint64_t &h0, uint64_t &h1,
+                   const uint32_t *words, size_t begin, size_t end)
+    {
+      h0 = 0xcbf29ce484222325ull ^ begin;
+      h1 = 0x9e3779b97f4a7c15ull + begin;
+      for (size_t i=begin;i<end;i++) {
+        const uint64_t w = words[i];
+        h0 = (h0 ^ w) * 0x100000001b3ull;
+        h1 = (h1 + w) * 0x9e3779b97f4a7c15ull;
+        h1 ^= h1 >> 29;
+      }
+      h0 = mix(h0);
+      h1 = mix(h1);
+    }
+
+    template<typename T, int D>
+    size_t numWords(uint32_t numBoxes)
+    {
+      static_assert(sizeof(box_t<T,D>) % sizeof(uint32_t) == 0,
+                    "box type not a multiple of 32 bits");
+      return size_t(numBoxes)*sizeof(box_t<T,D>)/sizeof(uint32_t);
+    }
+
+    /*! combines the per-chunk hashes, in order, with everything else
+        that determines the BVH: the type of box, the number of boxes,
+        the build config, and the file format version */
+    template<typename T, int D>
+    BuildCacheKey combine(const std::vector<uint64_t> &chunkHashes,
+                          uint32_t numBoxes,
+                          const BuildConfig &buildConfig)
+    {
+      const uint64_t meta[] = {
+        bvhFile_impl::scalarTypeID<T>(), uint64_t(D), numBoxes,
+        uint64_t(buildConfig.buildMethod),
+        uint64_t(buildConfig.makeLeafThreshold),
+        uint64_t(buildConfig.maxAllowedLeafSize),
+        uint64_t(BVHFileHeader::currentVersion)
+      };
+      BuildCacheKey key = { 0x6375424c63616368ull, 0x3141592653589793ull };
+      auto add = [&key](uint64_t v0, uint64_t v1) {
+        key.lo = mix(key.lo ^ v0) + 0x9e3779b97f4a7c15ull;
+        key.hi = mix(key.hi ^ v1) + 0xbf58476d1ce4e5b9ull;
+      };
+      for (auto v : meta) add(v,~v);
+      for (size_t i=0;i<chunkHashes.size();i+=2)
+        add(chunkHashes[i],chunkHashes[i+1]);
+      return key;
+    }
+
+#ifdef __CUDACC__
+    template<typename T, int D>
+    __global__
+    void hashChunks(uint64_t *chunkHashes, const box_t<T,D> *boxes, size_t numWords)
+    {
+      const uint32_t *words = (const uint32_t *)boxes;
+      const size_t chunkID = threadIdx.x+size_t(blockIdx.x)*blockDim.x;
+      const size_t begin = chunkID*wordsPerChunk;
+      if (begin >= numWords) return;
+      const size_t end = min(numWords,begin+wordsPerChunk);
+      hashChunk(chunkHashes[2*chunkID+0],chunkHashes[2*chunkID+1],words,begin,end);
+    }
+#endif
+
+    inline void makeDirectory(const std::string &directory)
+    {
+#ifdef _WIN32
+      _mkdir(directory.c_str());
+#else
+      mkdir(directory.c_str(),0755);
+#endif
+    }
+
+    inline bool fileExists(const std::string &fileName)
+    {
+      return (bool)std::ifstream(fileName,std::ios::binary);
+    }
+  } // ::cuBQL::buildCache_impl
+
+  inline std::string BuildCacheKey::toString() const
+  {
+    char hex[33];
+    snprintf(hex,sizeof(hex),"%016llx%016llx",
+             (unsigned long long)hi,(unsigned long long)lo);
+    return hex;
+  }
+
+  namespace host {
+    template<typename T, int D>
+    BuildCacheKey computeBuildCacheKey(const box_t<T,D> *boxes,
+                                       uint32_t          numBoxes,
+                                       BuildConfig       buildConfig)
+    {
+      using namespace buildCache_impl;
+      const size_t numWords = buildCache_impl::numWords<T,D>(numBoxes);
+      const size_t numChunks = divRoundUp(numWords,size_t(wordsPerChunk));
+      std::vector<uint64_t> chunkHashes(2*numChunks);
+      parallel_for(numChunks,[&](size_t chunkID) {
+        const size_t begin = chunkID*wordsPerChunk;
+        const size_t end = std::min(numWords,begin+wordsPerChunk);
+        hashChunk(chunkHashes[2*chunkID+0],chunkHashes[2*chunkID+1],
+                  (const uint32_t *)boxes,begin,end);
+      },1);
+      return combine<T,D>(chunkHashes,numBoxes,buildConfig);
+    }
+  }
+
+  inline BuildCache::BuildCache(const std::string &directory)
+    : directory(directory)
+  {
+    buildCache_impl::makeDirectory(directory);
+  }
+
+  inline std::string BuildCache::fileNameFor(const BuildCacheKey &key) const
+  {
+    return directory+"/"+key.toString()+".bvh";
+  }
+
+#ifdef __CUDACC__
+  template<typename T, int D>
+  BuildCacheKey computeBuildCacheKey(const box_t<T,D>  *boxes,
+                                     uint32_t           numBoxes,
+                                     BuildConfig        buildConfig,
+                                     cudaStream_t       s,
+                                     GpuMemoryResource &memResource)
+  {
+    using namespace buildCache_impl;
+    const size_t numWords = buildCache_impl::numWords<T,D>(numBoxes);
+    const size_t numChunks = divRoundUp(numWords,size_t(wordsPerChunk));
+    std::vector<uint64_t> chunkHashes(2*numChunks);
+    if (numChunks > 0) {
+      uint64_t *d_chunkHashes = 0;
+      CUBQL_CUDA_CHECK(memResource.malloc((void**)&d_chunkHashes,
+                                          chunkHashes.size()*sizeof(uint64_t),s));
+      hashChunks<<<divRoundUp(numChunks,size_t(128)),128,0,s>>>
+        (d_chunkHashes,boxes,numWords);
+      CUBQL_CUDA_CALL(MemcpyAsync(chunkHashes.data(),d_chunkHashes,
+                                  chunkHashes.size()*sizeof(uint64_t),
+                                  cudaMemcpyDefault,s));
+      CUBQL_CUDA_CHECK(memResource.free(d_chunkHashes,s));
+      CUBQL_CUDA_CALL(StreamSynchronize(s));
+    }
+    return combine<T,D>(chunkHashes,numBoxes,buildConfig);
+  }
+
+  template<typename T, int D>
+  MappedBVH<BinaryBVH<T,D>> BuildCache::build(const box_t<T,D>  *boxes,
+                                              uint32_t           numBoxes,
+                                              BuildConfig        buildConfig,
+                                              cudaStream_t       s,
+                                              GpuMemoryResource &memResource)
+  {
+    const std::string fileName
+      = fileNameFor(computeBuildCacheKey(boxes,numBoxes,buildConfig,s,memResource));
+    if (buildCache_impl::fileExists(fileName)) {
+      try {
+        MappedBVH<BinaryBVH<T,D>> cached(fileName);
+        ++numHits;
+        return cached;
+      } catch (const std::runtime_error &) {
+        // not a valid file (eg, from an older version); re-build
+      }
+    }
+    ++numMisses;
+    BinaryBVH<T,D> bvh;
+    gpuBuilder(bvh,boxes,numBoxes,buildConfig,s,memResource);
+    CUBQL_CUDA_CALL(StreamSynchronize(s));
+    const std::string tmpFileName
+      = fileName+".tmp"+std::to_string(std::random_device()());
+    saveBVH(tmpFileName,bvh,buildConfig);
+    cuBQL::free(bvh,s,memResource);
+    if (std::rename(tmpFileName.c_str(),fileName.c_str()) != 0) {
+      // eg, another process added the same file in the meantime
+      std::remove(tmpFileName.c_str());
+      if (!buildCache_impl::fileExists(fileName))
+        throw std::runtime_error("cuBQL: could not add '"+fileName+"' to build cache");
+    }
+    return MappedBVH<BinaryBVH<T,D>>(fileName);
+  }
+#endif
+
+} // ::cuBQL
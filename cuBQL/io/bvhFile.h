@@ -0,0 +1,258 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+
+/*! saving BVHs to, and loading them from, a binary file. The file
+    stores the nodes[] and primIDs[] arrays exactly as they are laid
+    out in memory, each starting at a page-aligned file offset, so a
+    loaded BVH can point right into a (read-only, shared) memory
+    mapping of the file: loading does not read or copy anything
+    until a query actually touches the respective pages, and several
+    processes that map the same file share the same physical
+    pages. */
+#pragma once
+
+#include "cuBQL/bvh.h"
+#include "cuBQL/io/mappedFile.h"
+#include <string>
+#include <fstream>
+#include <stdexcept>
+#include <type_traits>
+#include <limits>
+#include <vector>
+#include <cstring>
+
+namespace cuBQL {
+
+  /*! the header at the start of each BVH file. nodes[] start at byte
+      nodesOffset, and primIDs[] at primIDsOffset; both are multiples
+      of 'alignment'. Everything a loader needs to check that the
+      file matches the BVH type it is loaded as (scalar type, number
+      of dims, branching factor, node size, and primID size) is
+      stored as well, as is the config the BVH was built with.
+      Version 1 files are the same as version 2 files, except that
+      they always have 32-bit primIDs (and have 0 in primIDSize). */
+  struct BVHFileHeader {
+    enum { currentVersion = 2, alignment = 4096 };
+    
+    /*! "cuBQLbvh" */
+    char     magic[8];
+    /*! 0x01020304 as written by the writer; anything else means the
+        file was written on a machine of different endianness */
+    uint32_t byteOrder;
+    uint32_t version;
+    /*! 'f' (floating point) or 'i' (integer) in bits 8 and up, and
+        sizeof(scalar_t) in the lowest byte */
+    uint32_t scalarType;
+    uint32_t numDims;
+    /*! 2 for a BinaryBVH, N for a WideBVH<T,D,N> */
+    uint32_t bvhWidth;
+    /*! sizeof(bvh_t::Node) */
+    uint32_t nodeSize;
+    uint64_t numNodes;
+    uint64_t numPrims;
+    uint64_t nodesOffset;
+    uint64_t primIDsOffset;
+    /*! the BuildConfig the BVH was built with */
+    int32_t  buildMethod;
+    int32_t  makeLeafThreshold;
+    int32_t  maxAllowedLeafSize;
+    /*! sizeof(bvh_t::index_t): 4, or 8 for a BinaryBVH64 */
+    uint32_t primIDSize;
+  };
+
+  /*! writes the given BVH (and the config it was built with) to a
+      file. The bvh's arrays can be in host, managed, or device
+      memory. Throws a std::runtime_error if the file could not be
+      written. */
+  template<typename T, int D, typename index_t>
+  void saveBVH(const std::string            &fileName,
+               const BinaryBVH<T,D,index_t> &bvh,
+               BuildConfig                   buildConfig = BuildConfig());
+
+  /*! same as above, for a WideBVH */
+  template<typename T, int D, int N>
+  void saveBVH(const std::string    &fileName,
+               const WideBVH<T,D,N> &bvh,
+               BuildConfig           buildConfig = BuildConfig());
+
+  /*! a BVH (BinaryBVH or WideBVH) loaded from a file written by
+      saveBVH(), with bvh.nodes and bvh.primIDs pointing into a
+      memory mapping of that file. The mapping - and thus the BVH -
+      stays valid for as long as this object lives; do not call
+      cuBQL::free() on this bvh. The mapping is host memory, so this
+      BVH can be used by host-side queries as is; for device-side
+      queries, copy its arrays to the device first. Throws a
+      std::runtime_error if the file cannot be opened, or does not
+      contain a BVH of type bvh_t. */
+  template<typename bvh_t>
+  struct MappedBVH {
+    explicit MappedBVH(const std::string &fileName);
+
+    bvh_t         bvh;
+    /*! the config the BVH was built with (as passed to saveBVH()) */
+    BuildConfig   buildConfig;
+    BVHFileHeader header;
+  private:
+    io_impl::MappedFile file;
+  };
+
+  // ==================================================================
+  // IMPLEMENTATION
+  // ==================================================================
+
+  namespace bvhFile_impl {
+    template<typename bvh_t> struct Traits;
+    template<typename T, int D, typename I> struct Traits<BinaryBVH<T,D,I>> {
+      using scalar_t = T;
+      using index_t  = I;
+      enum { numDims = D, width = 2 };
+    };
+    template<typename T, int D, int N> struct Traits<WideBVH<T,D,N>> {
+      using scalar_t = T;
+      using index_t  = uint32_t;
+      enum { numDims = D, width = N };
+    };
+
+    template<typename T>
+    inline uint32_t scalarTypeID()
+    { return ((std::is_floating_point<T>::value ? 'f' : 'i') << 8) | uint32_t(sizeof(T)); }
+
+    inline uint64_t alignUp(uint64_t offset)
+    {
+      return (offset + BVHFileHeader::alignment - 1)
+        / BVHFileHeader::alignment * BVHFileHeader::alignment;
+    }
+
+    template<typename bvh_t>
+    BVHFileHeader makeHeader(const bvh_t &bvh, const BuildConfig &buildConfig)
+    {
+      BVHFileHeader header;
+      memset(&header,0,sizeof(header));
+      memcpy(header.magic,"cuBQLbvh",8);
+      header.byteOrder     = 0x01020304;
+      header.version       = BVHFileHeader::currentVersion;
+      header.scalarType    = scalarTypeID<typename Traits<bvh_t>::scalar_t>();
+      header.numDims       = Traits<bvh_t>::numDims;
+      header.bvhWidth      = Traits<bvh_t>::width;
+      header.nodeSize      = sizeof(typename bvh_t::Node);
+      header.primIDSize    = sizeof(typename Traits<bvh_t>::index_t);
+      header.numNodes      = bvh.numNodes;
+      header.numPrims      = bvh.numPrims;
+      header.nodesOffset   = alignUp(sizeof(header));
+      header.primIDsOffset
+        = alignUp(header.nodesOffset + header.numNodes*header.nodeSize);
+      header.buildMethod        = buildConfig.buildMethod;
+      header.makeLeafThreshold  = buildConfig.makeLeafThreshold;
+      header.maxAllowedLeafSize = buildConfig.maxAllowedLeafSize;
+      return header;
+    }
+
+    /*! pads the file with zeroes up to the given offset */
+    inline void padTo(std::ofstream &out, uint64_t offset)
+    {
+      const uint64_t pos = (uint64_t)out.tellp();
+      std::vector<char> zeroes(offset-pos,0);
+      out.write(zeroes.data(),zeroes.size());
+    }
+
+    /*! writes count elements from a host, managed, or device array,
+        through a host-side staging buffer */
+    template<typename T>
+    void writeArray(std::ofstream &out, const T *array, uint64_t count)
+    {
+      const uint64_t chunkSize = (16<<20)/sizeof(T)+1;
+      std::vector<T> staging(std::min(count,chunkSize));
+      for (uint64_t begin=0;begin<count;begin+=chunkSize) {
+        const uint64_t num = std::min(count-begin,chunkSize);
+        CUBQL_CUDA_CALL(Memcpy(staging.data(),array+begin,num*sizeof(T),cudaMemcpyDefault));
+        out.write((const char *)staging.data(),num*sizeof(T));
+      }
+    }
+
+    template<typename bvh_t>
+    void save(const std::string &fileName, const bvh_t &bvh, const BuildConfig &buildConfig)
+    {
+      const BVHFileHeader header = makeHeader(bvh,buildConfig);
+      std::ofstream out(fileName,std::ios::binary);
+      if (!out)
+        throw std::runtime_error("cuBQL: could not open '"+fileName+"' for writing");
+      out.write((const char *)&header,sizeof(header));
+      padTo(out,header.nodesOffset);
+      writeArray(out,bvh.nodes,header.numNodes);
+      padTo(out,header.primIDsOffset);
+      writeArray(out,bvh.primIDs,header.numPrims);
+      if (!out)
+        throw std::runtime_error("cuBQL: error writing BVH to '"+fileName+"'");
+    }
+
+  } // ::cuBQL::bvhFile_impl
+
+  template<typename T, int D, typename index_t>
+  void saveBVH(const std::string            &fileName,
+               const BinaryBVH<T,D,index_t> &bvh,
+               BuildConfig                   buildConfig)
+  { bvhFile_impl::save(fileName,bvh,buildConfig); }
+
+  template<typename T, int D, int N>
+  void saveBVH(const std::string    &fileName,
+               const WideBVH<T,D,N> &bvh,
+               BuildConfig           buildConfig)
+  { bvhFile_impl::save(fileName,bvh,buildConfig); }
+
+  template<typename bvh_t>
+  MappedBVH<bvh_t>::MappedBVH(const std::string &fileName)
+    : file(fileName)
+  {
+    using namespace bvhFile_impl;
+    auto fail = [&](const std::string &why)
+    { throw std::runtime_error("cuBQL: cannot load '"+fileName+"' - "+why); };
+    if (file.size < sizeof(header))
+      fail("file too small");
+    memcpy(&header,file.data,sizeof(header));
+    if (memcmp(header.magic,"cuBQLbvh",8) != 0)
+      fail("not a cuBQL BVH file");
+    if (header.byteOrder != 0x01020304)
+      fail("written on a machine of different byte order");
+    if (header.version == 1)
+      header.primIDSize = sizeof(uint32_t);
+    else if (header.version != BVHFileHeader::currentVersion)
+      fail("unsupported file version "+std::to_string(header.version));
+    using index_t = typename Traits<bvh_t>::index_t;
+    if (header.scalarType != scalarTypeID<typename Traits<bvh_t>::scalar_t>()
+        || header.numDims    != (uint32_t)Traits<bvh_t>::numDims
+        || header.bvhWidth   != (uint32_t)Traits<bvh_t>::width
+        || header.nodeSize   != sizeof(typename bvh_t::Node)
+        || header.primIDSize != sizeof(index_t))
+      fail("file contains a different type of BVH");
+    if (header.numNodes > std::numeric_limits<index_t>::max()
+        || header.numPrims > std::numeric_limits<index_t>::max())
+      fail("BVH too large for this BVH type");
+    if (header.nodesOffset % BVHFileHeader::alignment != 0
+        || header.primIDsOffset % BVHFileHeader::alignment != 0
+        || header.nodesOffset + header.numNodes*header.nodeSize > file.size
+        || header.primIDsOffset + header.numPrims*sizeof(index_t) > file.size)
+      fail("file is truncated or corrupt");
+    bvh.nodes    = (typename bvh_t::Node *)(file.data + header.nodesOffset);
+    bvh.numNodes = (index_t)header.numNodes;
+    bvh.primIDs  = (index_t *)(file.data + header.primIDsOffset);
+    bvh.numPrims = (index_t)header.numPrims;
+    buildConfig.buildMethod        = (BuildConfig::BuildMethod)header.buildMethod;
+    buildConfig.makeLeafThreshold  = header.makeLeafThreshold;
+    buildConfig.maxAllowedLeafSize = header.maxAllowedLeafSize;
+  }
+
+} // ::cuBQL
@@ -0,0 +1,116 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+
+/*! a read-only memory mapping of an entire file, shared by the
+    file-based loaders in cuBQL/io/ */
+#pragma once
+
+#include <string>
+#include <fstream>
+#include <stdexcept>
+#include <algorithm>
+#include <cstdint>
+#ifdef _WIN32
+# include <malloc.h>
+#else
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <unistd.h>
+#endif
+
+namespace cuBQL {
+  namespace io_impl {
+
+    /*! a read-only mapping of an entire file; movable, but not
+        copyable, and unmaps the file when destroyed */
+    struct MappedFile {
+      /*! the mapping starts at a multiple of this (where mmap is not
+          available, we read the file into memory that is aligned the
+          same way) */
+      enum { alignment = 4096 };
+      
+      MappedFile() = default;
+      explicit MappedFile(const std::string &fileName);
+      MappedFile(MappedFile &&other) { swap(other); }
+      MappedFile &operator=(MappedFile &&other) { swap(other); return *this; }
+      MappedFile(const MappedFile &) = delete;
+      MappedFile &operator=(const MappedFile &) = delete;
+      ~MappedFile();
+
+      void swap(MappedFile &other)
+      { std::swap(data,other.data); std::swap(size,other.size); }
+
+      const uint8_t *data = 0;
+      size_t         size = 0;
+    };
+
+    // ==================================================================
+    // IMPLEMENTATION
+    // ==================================================================
+
+    inline MappedFile::MappedFile(const std::string &fileName)
+    {
+#ifdef _WIN32
+      std::ifstream in(fileName,std::ios::binary|std::ios::ate);
+      if (!in)
+        throw std::runtime_error("cuBQL: could not open '"+fileName+"'");
+      size = (size_t)in.tellg();
+      // no mmap here; read it into (page-aligned) memory instead
+      uint8_t *mem = (uint8_t *)_aligned_malloc(std::max(size,size_t(1)),
+                                                alignment);
+      if (!mem)
+        throw std::runtime_error("cuBQL: out of memory reading '"+fileName+"'");
+      in.seekg(0);
+      in.read((char *)mem,size);
+      // a throwing constructor does not run the destructor, so free
+      // this ourselves
+      if (!in) {
+        _aligned_free(mem);
+        throw std::runtime_error("cuBQL: could not read '"+fileName+"'");
+      }
+      data = mem;
+#else
+      const int fd = open(fileName.c_str(),O_RDONLY);
+      if (fd < 0)
+        throw std::runtime_error("cuBQL: could not open '"+fileName+"'");
+      struct stat info;
+      if (fstat(fd,&info) != 0 || info.st_size == 0) {
+        close(fd);
+        throw std::runtime_error("cuBQL: '"+fileName+"' is empty or cannot be read");
+      }
+      size = (size_t)info.st_size;
+      void *mapping = mmap(0,size,PROT_READ,MAP_SHARED,fd,0);
+      // the mapping keeps the file alive
+      close(fd);
+      if (mapping == MAP_FAILED)
+        throw std::runtime_error("cuBQL: could not mmap '"+fileName+"'");
+      data = (const uint8_t *)mapping;
+#endif
+    }
+
+    inline MappedFile::~MappedFile()
+    {
+      if (!data) return;
+#ifdef _WIN32
+      _aligned_free((void *)data);
+#else
+      munmap((void *)data,size);
+#endif
+    }
+  } // ::cuBQL::io_impl
+} // ::cuBQL
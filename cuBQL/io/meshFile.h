@@ -0,0 +1,644 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+
+/*! loading triangle meshes from OBJ and PLY files, directly into the
+    indexed (vec3i indices, vec3f vertices) form the triangle queries
+    and the builder work on - i.e., without going through a
+    general-purpose mesh loader, and without duplicating the vertices
+    of each triangle.
+
+    OBJ files get memory-mapped and split into line-aligned chunks
+    that get parsed in parallel: a first pass counts each chunk's
+    vertices and triangles, and a second pass then parses each chunk
+    right into its place in the output arrays. Only vertex positions
+    ('v') and faces ('f') are read; polygons get fan-triangulated, and
+    normals, texture coordinates, groups, materials, and line
+    continuations are ignored.
+
+    PLY files can be ascii or binary (of either endianness); of these,
+    only the "vertex" element's x, y, and z properties and the "face"
+    element's vertex_indices (or vertex_index) list get read - all
+    other elements and properties are skipped. Binary vertices with
+    fixed-size records get read in parallel.
+
+    All loaders throw a std::runtime_error if a file cannot be read,
+    is malformed, or refers to vertices that do not exist. */
+#pragma once
+
+#include "cuBQL/math/vec.h"
+#include "cuBQL/io/mappedFile.h"
+#include "cuBQL/impl/parallel_for.h"
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <cstring>
+#include <cmath>
+#include <climits>
+#include <cctype>
+
+namespace cuBQL {
+  namespace host {
+
+    /*! loads the triangles of the given OBJ file; see top of this
+        file */
+    inline void loadOBJ(std::vector<vec3i>  &indices,
+                        std::vector<vec3f>  &vertices,
+                        const std::string   &fileName);
+    
+    /*! loads the triangles of the given (ascii or binary) PLY file;
+        see top of this file */
+    inline void loadPLY(std::vector<vec3i>  &indices,
+                        std::vector<vec3f>  &vertices,
+                        const std::string   &fileName);
+
+    /*! loads the given file with either loadOBJ() or loadPLY(),
+        depending on its extension (.obj or .ply, in either case) */
+    inline void loadTriangleMesh(std::vector<vec3i>  &indices,
+                                 std::vector<vec3f>  &vertices,
+                                 const std::string   &fileName);
+    
+  } // ::cuBQL::host
+
+  // ==================================================================
+  // IMPLEMENTATION
+  // ==================================================================
+
+  namespace meshFile_impl {
+
+    inline bool isBlank(char c)
+    { return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f'; }
+    
+    inline bool isDigit(char c)
+    { return c >= '0' && c <= '9'; }
+
+    inline void skipBlanks(const char *&p, const char *end)
+    { while (p < end && isBlank(*p)) ++p; }
+
+    /*! skips to the start of the next line */
+    inline void skipLine(const char *&p, const char *end)
+    { while (p < end && *p++ != '\n'); }
+
+    /*! parses a (signed) integer at p, and advances p past it; returns
+        false (and leaves p alone) if there is none. Never reads at or
+        past 'end', so this works on the mapped file itself */
+    inline bool parseInt(const char *&p, const char *end, int64_t &value)
+    {
+      const char *s = p;
+      bool negative = false;
+      if (s < end && (*s == '-' || *s == '+'))
+        negative = (*s++ == '-');
+      if (s == end || !isDigit(*s))
+        return false;
+      int64_t result = 0;
+      for (;s < end && isDigit(*s); ++s)
+        // saturate rather than overflow; whoever uses the value has
+        // to range-check it, anyway
+        if (result < (int64_t(1) << 60))
+          result = 10*result + (*s-'0');
+      value = negative ? -result : result;
+      p = s;
+      return true;
+    }
+
+    /*! parses a decimal floating-point number ("1", "-.5", "1.5e-3",
+        etc) at p, and advances p past it; returns false (and leaves p
+        alone) if there is none. Same as parseInt(), this never reads
+        at or past 'end'. Up to 17 significant digits get used,
+        which gives the exact float for anything that was written out
+        with enough digits to round-trip */
+    inline bool parseFloat(const char *&p, const char *end, float &value)
+    {
+      const char *s = p;
+      bool negative = false;
+      if (s < end && (*s == '-' || *s == '+'))
+        negative = (*s++ == '-');
+      uint64_t mantissa = 0;
+      int exp10 = 0;
+      bool anyDigits = false;
+      for (;s < end && isDigit(*s); ++s) {
+        if (mantissa < 10000000000000000ull)
+          mantissa = 10*mantissa + (*s-'0');
+        else
+          exp10++;
+        anyDigits = true;
+      }
+      if (s < end && *s == '.')
+        for (++s;s < end && isDigit(*s); ++s) {
+          if (mantissa < 10000000000000000ull) {
+            mantissa = 10*mantissa + (*s-'0');
+            exp10--;
+          }
+          anyDigits = true;
+        }
+      if (!anyDigits)
+        return false;
+      if (s < end && (*s == 'e' || *s == 'E')) {
+        const char *e = s+1;
+        int64_t exponent;
+        if (parseInt(e,end,exponent)) {
+          exp10 += (int)std::max(int64_t(-1000),std::min(int64_t(1000),exponent));
+          s = e;
+        }
+      }
+      // powers of ten up to 1e22 are exact in double precision, so in
+      // the common case this is a single (correctly rounded) multiply
+      // or divide
+      static const double exactPowers[23] = {
+        1e0,1e1,1e2,1e3,1e4,1e5,1e6,1e7,1e8,1e9,1e10,1e11,
+        1e12,1e13,1e14,1e15,1e16,1e17,1e18,1e19,1e20,1e21,1e22
+      };
+      double result = double(mantissa);
+      if (mantissa != 0 && exp10 != 0) {
+        const int absExp = exp10 < 0 ? -exp10 : exp10;
+        const double scale
+          = absExp <= 22 ? exactPowers[absExp] : std::pow(10.,double(absExp));
+        result = exp10 < 0 ? result / scale : result * scale;
+      }
+      value = float(negative ? -result : result);
+      p = s;
+      return true;
+    }
+
+    /*! the 1-based line number that p is in */
+    inline size_t lineNumber(const char *begin, const char *p)
+    {
+      size_t line = 1;
+      for (;begin < p; ++begin)
+        line += (*begin == '\n');
+      return line;
+    }
+    
+    // ------------------------------------------------------------------
+    // OBJ
+    // ------------------------------------------------------------------
+
+    /*! one line-aligned chunk of an OBJ file */
+    struct OBJChunk {
+      const char *begin, *end;
+      size_t numVertices  = 0;
+      size_t numTriangles = 0;
+      /*! where this chunk's vertices and triangles go in the output */
+      size_t vertexOffset = 0, triangleOffset = 0;
+      /*! where parsing failed, if it did */
+      const char *error = 0;
+    };
+
+    /*! for each line in [p,end) that starts with a 'v' or 'f' token,
+        calls vertexFct(p) or faceFct(p), respectively, with p
+        pointing past that token. The functors advance p (ideally to
+        the end of the line); and return false if the line is
+        malformed, in which case this returns that line's position
+        (and else, null) */
+    template<typename VertexFct, typename FaceFct>
+    inline const char *forEachOBJLine(const char *p, const char *end,
+                                      const VertexFct &vertexFct,
+                                      const FaceFct &faceFct)
+    {
+      while (p < end) {
+        skipBlanks(p,end);
+        if (end-p >= 2 && isBlank(p[1])) {
+          const char *line = p;
+          p += 2;
+          if (*line == 'v' && !vertexFct(p)) return line;
+          if (*line == 'f' && !faceFct(p))   return line;
+        }
+        skipLine(p,end);
+      }
+      return 0;
+    }
+
+    /*! advances p past the next token of a face line, and returns
+        false if there is none */
+    inline bool nextFaceToken(const char *&p, const char *end)
+    {
+      skipBlanks(p,end);
+      return p < end && *p != '\n' && *p != '#';
+    }
+
+    inline void skipToken(const char *&p, const char *end)
+    { while (p < end && !isBlank(*p) && *p != '\n') ++p; }
+    
+    /*! parses the OBJ data in [begin,end), using chunks of (roughly)
+        the given size. Called by host::loadOBJ() with the mapped
+        file, but also works on any other in-memory OBJ data */
+    inline void parseOBJ(std::vector<vec3i>  &indices,
+                         std::vector<vec3f>  &vertices,
+                         const char          *begin,
+                         const char          *end,
+                         size_t               chunkSize,
+                         const std::string   &fileName)
+    {
+      // split into chunks, each ending at the end of a line
+      const size_t size = end-begin;
+      const size_t numChunks = std::max(size_t(1),divRoundUp(size,chunkSize));
+      std::vector<const char *> chunkBegins(numChunks+1);
+      for (size_t i=0;i<numChunks;i++) {
+        const char *p = begin + i*chunkSize;
+        if (i > 0)
+          while (p < end && p[-1] != '\n') ++p;
+        chunkBegins[i] = p;
+      }
+      chunkBegins[numChunks] = end;
+      std::vector<OBJChunk> chunks(numChunks);
+      for (size_t i=0;i<numChunks;i++) {
+        chunks[i].begin = chunkBegins[i];
+        chunks[i].end   = chunkBegins[i+1];
+      }
+
+      // pass 1: count vertices and triangles
+      host::parallel_for
+        (numChunks,
+         [&](size_t chunkID) {
+          OBJChunk &chunk = chunks[chunkID];
+          const char *end = chunk.end;
+          chunk.error = forEachOBJLine
+            (chunk.begin,end,
+             [&](const char *&) { chunk.numVertices++; return true; },
+             [&](const char *&p) {
+              int numCorners = 0;
+              for (;nextFaceToken(p,end);numCorners++)
+                skipToken(p,end);
+              chunk.numTriangles += std::max(0,numCorners-2);
+              return true;
+            });
+        },1);
+      
+      size_t numVertices = 0, numTriangles = 0;
+      for (auto &chunk : chunks) {
+        chunk.vertexOffset   = numVertices;
+        chunk.triangleOffset = numTriangles;
+        numVertices  += chunk.numVertices;
+        numTriangles += chunk.numTriangles;
+      }
+      if (numVertices > size_t(INT_MAX))
+        throw std::runtime_error("cuBQL: '"+fileName+"' has more vertices than "
+                                 "can be indexed with 32-bit ints");
+      vertices.resize(numVertices);
+      indices.resize(numTriangles);
+
+      // pass 2: parse into place
+      host::parallel_for
+        (numChunks,
+         [&](size_t chunkID) {
+          OBJChunk &chunk = chunks[chunkID];
+          const char *end = chunk.end;
+          vec3f *vertex   = vertices.data()+chunk.vertexOffset;
+          vec3i *triangle = indices.data()+chunk.triangleOffset;
+          auto parseVertex = [&](const char *&p) {
+            vec3f v;
+            for (int d=0;d<3;d++) {
+              skipBlanks(p,end);
+              if (!parseFloat(p,end,v[d])) return false;
+            }
+            *vertex++ = v;
+            return true;
+          };
+          auto parseFace = [&](const char *&p) {
+            // relative (negative) indices refer to the vertices
+            // before this line
+            const int64_t numVerticesSoFar
+              = int64_t(vertex-vertices.data());
+            int corner[2] = { -1, -1 };
+            for (int i=0;nextFaceToken(p,end);i++) {
+              int64_t idx;
+              if (!parseInt(p,end,idx)) return false;
+              // skip texture coordinate and normal indices, if any
+              skipToken(p,end);
+              idx = (idx < 0) ? numVerticesSoFar+idx : idx-1;
+              if (idx < 0 || idx >= int64_t(numVertices)) return false;
+              if (i == 0)
+                corner[0] = int(idx);
+              else if (i == 1)
+                corner[1] = int(idx);
+              else {
+                *triangle++ = vec3i(corner[0],corner[1],int(idx));
+                corner[1] = int(idx);
+              }
+            }
+            return true;
+          };
+          if (!chunk.error)
+            chunk.error = forEachOBJLine(chunk.begin,end,parseVertex,parseFace);
+        },1);
+
+      for (auto &chunk : chunks)
+        if (chunk.error)
+          throw std::runtime_error
+            ("cuBQL: malformed vertex or face (or invalid vertex index) in line "
+             +std::to_string(lineNumber(begin,chunk.error))+" of '"+fileName+"'");
+    }
+
+    // ------------------------------------------------------------------
+    // PLY
+    // ------------------------------------------------------------------
+    
+    enum PLYType {
+      PLY_INT8, PLY_UINT8, PLY_INT16, PLY_UINT16,
+      PLY_INT32, PLY_UINT32, PLY_FLOAT32, PLY_FLOAT64
+    };
+    enum PLYFormat { PLY_ASCII, PLY_BINARY_LITTLE_ENDIAN, PLY_BINARY_BIG_ENDIAN };
+    
+    struct PLYProperty {
+      std::string name;
+      PLYType     type;
+      /*! for list properties, 'type' is the type of the entries, and
+          this the type of the entry count */
+      bool        isList = false;
+      PLYType     countType;
+    };
+
+    struct PLYElement {
+      std::string              name;
+      size_t                   count;
+      std::vector<PLYProperty> properties;
+    };
+
+    inline int sizeOf(PLYType type)
+    {
+      static const int sizes[] = { 1,1,2,2,4,4,4,8 };
+      return sizes[type];
+    }
+
+    inline bool parseType(const std::string &name, PLYType &type)
+    {
+      static const char *names[][2] = {
+        { "char", "int8" }, { "uchar", "uint8" },
+        { "short", "int16" }, { "ushort", "uint16" },
+        { "int", "int32" }, { "uint", "uint32" },
+        { "float", "float32" }, { "double", "float64" }
+      };
+      for (int i=0;i<8;i++)
+        if (name == names[i][0] || name == names[i][1]) {
+          type = PLYType(i);
+          return true;
+        }
+      return false;
+    }
+
+    /*! reads one binary value of given type at p, swapping its bytes
+        if the file's endianness differs from the host's */
+    inline double readBinary(const uint8_t *p, PLYType type, bool swapBytes)
+    {
+      uint8_t bytes[8];
+      const int size = sizeOf(type);
+      for (int i=0;i<size;i++)
+        bytes[i] = p[swapBytes ? size-1-i : i];
+      switch (type) {
+      case PLY_INT8:    { int8_t   v; memcpy(&v,bytes,1); return v; }
+      case PLY_UINT8:   { uint8_t  v; memcpy(&v,bytes,1); return v; }
+      case PLY_INT16:   { int16_t  v; memcpy(&v,bytes,2); return v; }
+      case PLY_UINT16:  { uint16_t v; memcpy(&v,bytes,2); return v; }
+      case PLY_INT32:   { int32_t  v; memcpy(&v,bytes,4); return v; }
+      case PLY_UINT32:  { uint32_t v; memcpy(&v,bytes,4); return v; }
+      case PLY_FLOAT32: { float    v; memcpy(&v,bytes,4); return v; }
+      default:          { double   v; memcpy(&v,bytes,8); return v; }
+      }
+    }
+
+    /*! reads the PLY data in [begin,end) - i.e., a PLY file that has
+        already been mapped or read into memory */
+    inline void parsePLY(std::vector<vec3i>  &indices,
+                         std::vector<vec3f>  &vertices,
+                         const char          *begin,
+                         const char          *end,
+                         const std::string   &fileName)
+    {
+      auto fail = [&](const std::string &what) {
+        throw std::runtime_error("cuBQL: "+what+" in PLY file '"+fileName+"'");
+      };
+      
+      // ---------- header ----------
+      const char *p = begin;
+      auto nextWord = [&]() {
+        skipBlanks(p,end);
+        const char *word = p;
+        skipToken(p,end);
+        return std::string(word,p);
+      };
+      if (nextWord() != "ply") fail("missing 'ply' magic");
+      PLYFormat format = PLY_ASCII;
+      bool haveFormat = false;
+      std::vector<PLYElement> elements;
+      while (true) {
+        skipLine(p,end);
+        if (p == end) fail("unterminated header");
+        const std::string keyword = nextWord();
+        if (keyword == "end_header") {
+          skipLine(p,end);
+          break;
+        } else if (keyword == "format") {
+          const std::string name = nextWord();
+          if (name == "ascii")                     format = PLY_ASCII;
+          else if (name == "binary_little_endian") format = PLY_BINARY_LITTLE_ENDIAN;
+          else if (name == "binary_big_endian")    format = PLY_BINARY_BIG_ENDIAN;
+          else fail("unknown format '"+name+"'");
+          haveFormat = true;
+        } else if (keyword == "element") {
+          PLYElement element;
+          element.name = nextWord();
+          int64_t count;
+          skipBlanks(p,end);
+          if (!parseInt(p,end,count) || count < 0)
+            fail("invalid count for element '"+element.name+"'");
+          element.count = size_t(count);
+          elements.push_back(element);
+        } else if (keyword == "property") {
+          if (elements.empty()) fail("property before first element");
+          PLYProperty property;
+          std::string type = nextWord();
+          if (type == "list") {
+            property.isList = true;
+            if (!parseType(nextWord(),property.countType))
+              fail("invalid list count type");
+            type = nextWord();
+          }
+          if (!parseType(type,property.type))
+            fail("invalid property type '"+type+"'");
+          property.name = nextWord();
+          elements.back().properties.push_back(property);
+        } else if (keyword != "comment" && keyword != "obj_info" && !keyword.empty())
+          fail("unknown header keyword '"+keyword+"'");
+      }
+      if (!haveFormat) fail("missing format");
+
+      // ---------- body ----------
+      const uint16_t one = 1;
+      const bool hostIsLittleEndian = *(const uint8_t *)&one == 1;
+      const bool swapBytes
+        = (format == PLY_BINARY_LITTLE_ENDIAN && !hostIsLittleEndian)
+        || (format == PLY_BINARY_BIG_ENDIAN && hostIsLittleEndian);
+      /*! reads the next value of the given type, in either format */
+      auto readValue = [&](PLYType type) -> double {
+        if (format != PLY_ASCII) {
+          if (end-p < sizeOf(type)) fail("unexpected end of file");
+          double value = readBinary((const uint8_t *)p,type,swapBytes);
+          p += sizeOf(type);
+          return value;
+        }
+        while (p < end && (isBlank(*p) || *p == '\n')) ++p;
+        float value;
+        int64_t intValue;
+        if (type == PLY_FLOAT32 || type == PLY_FLOAT64) {
+          if (!parseFloat(p,end,value)) fail("malformed value");
+          return value;
+        }
+        if (!parseInt(p,end,intValue)) fail("malformed value");
+        return double(intValue);
+      };
+      
+      bool haveVertices = false;
+      for (auto &element : elements) {
+        const bool isVertex = (element.name == "vertex");
+        const bool isFace   = (element.name == "face");
+        int coordProperty[3] = { -1, -1, -1 };
+        int indexProperty = -1;
+        bool fixedSize = true;
+        size_t recordSize = 0;
+        size_t coordOffset[3] = { 0, 0, 0 };
+        for (int i=0;i<(int)element.properties.size();i++) {
+          const PLYProperty &property = element.properties[i];
+          for (int d=0;d<3;d++)
+            if (!property.isList && property.name == std::string(1,char('x'+d))) {
+              coordProperty[d] = i;
+              coordOffset[d] = recordSize;
+            }
+          if (property.isList
+              && (property.name == "vertex_indices" || property.name == "vertex_index"))
+            indexProperty = i;
+          fixedSize = fixedSize && !property.isList;
+          recordSize += sizeOf(property.type);
+        }
+        if (isVertex) {
+          if (coordProperty[0] < 0 || coordProperty[1] < 0 || coordProperty[2] < 0)
+            fail("vertex element without x, y, and z");
+          if (element.count > size_t(INT_MAX))
+            fail("more vertices than can be indexed with 32-bit ints");
+          haveVertices = true;
+          vertices.resize(element.count);
+        }
+        if (isFace && indexProperty < 0)
+          fail("face element without vertex_indices");
+
+        if (format != PLY_ASCII && fixedSize && !isFace) {
+          // fixed-size binary records: skip or read them in parallel
+          if (size_t(end-p) / std::max(recordSize,size_t(1)) < element.count)
+            fail("unexpected end of file");
+          if (isVertex) {
+            const uint8_t *records = (const uint8_t *)p;
+            host::parallel_for
+              (element.count,
+               [&](size_t vertexID) {
+                const uint8_t *record = records + vertexID*recordSize;
+                vec3f &vertex = vertices[vertexID];
+                for (int d=0;d<3;d++)
+                  vertex[d]
+                    = float(readBinary(record+coordOffset[d],
+                                       element.properties[coordProperty[d]].type,
+                                       swapBytes));
+              },1024);
+          }
+          p += element.count*recordSize;
+          continue;
+        }
+
+        for (size_t recordID=0;recordID<element.count;recordID++)
+          for (int i=0;i<(int)element.properties.size();i++) {
+            const PLYProperty &property = element.properties[i];
+            if (!property.isList) {
+              const double value = readValue(property.type);
+              for (int d=0;d<3;d++)
+                if (isVertex && i == coordProperty[d])
+                  vertices[recordID][d] = float(value);
+              continue;
+            }
+            const double count = readValue(property.countType);
+            if (count < 0 || count > double(INT_MAX)) fail("invalid list size");
+            if (!(isFace && i == indexProperty)) {
+              for (int j=0;j<int(count);j++)
+                readValue(property.type);
+              continue;
+            }
+            int corner[2] = { -1, -1 };
+            for (int j=0;j<int(count);j++) {
+              const double idx = readValue(property.type);
+              if (idx < 0 || idx > double(INT_MAX)) fail("invalid vertex index");
+              if (j == 0)
+                corner[0] = int(idx);
+              else if (j == 1)
+                corner[1] = int(idx);
+              else {
+                indices.push_back(vec3i(corner[0],corner[1],int(idx)));
+                corner[1] = int(idx);
+              }
+            }
+          }
+      }
+      if (!haveVertices) fail("no vertex element");
+      // the face element may (in theory) come before the vertex one,
+      // so we can only check the indices at the end
+      for (auto triangle : indices)
+        for (int d=0;d<3;d++)
+          if (triangle[d] >= (int)vertices.size())
+            fail("invalid vertex index "+std::to_string(triangle[d]));
+    }
+    
+  } // ::cuBQL::meshFile_impl
+
+  namespace host {
+    
+    inline void loadOBJ(std::vector<vec3i>  &indices,
+                        std::vector<vec3f>  &vertices,
+                        const std::string   &fileName)
+    {
+      io_impl::MappedFile file(fileName);
+      const char *begin = (const char *)file.data;
+      // chunks need to be large enough to amortize the per-chunk
+      // overhead, but small enough to balance the load
+      meshFile_impl::parseOBJ(indices,vertices,begin,begin+file.size,
+                              size_t(1)<<20,fileName);
+    }
+    
+    inline void loadPLY(std::vector<vec3i>  &indices,
+                        std::vector<vec3f>  &vertices,
+                        const std::string   &fileName)
+    {
+      io_impl::MappedFile file(fileName);
+      const char *begin = (const char *)file.data;
+      indices.clear();
+      vertices.clear();
+      meshFile_impl::parsePLY(indices,vertices,begin,begin+file.size,fileName);
+    }
+
+    inline void loadTriangleMesh(std::vector<vec3i>  &indices,
+                                 std::vector<vec3f>  &vertices,
+                                 const std::string   &fileName)
+    {
+      const size_t dot = fileName.find_last_of('.');
+      std::string extension
+        = (dot == std::string::npos) ? std::string() : fileName.substr(dot+1);
+      for (auto &c : extension) c = (char)tolower(c);
+      if (extension == "obj")
+        loadOBJ(indices,vertices,fileName);
+      else if (extension == "ply")
+        loadPLY(indices,vertices,fileName);
+      else
+        throw std::runtime_error("cuBQL: cannot load '"+fileName+"' - only .obj and "
+                                 ".ply triangle meshes are supported");
+    }
+    
+  } // ::cuBQL::host
+} // ::cuBQL
@@ -0,0 +1,250 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+
+/*! building BVHs over more boxes than fit into device - or even host
+    - memory. buildOutOfCore() reads the boxes from a memory-mapped
+    file, and:
+
+    - sorts them into spatially coherent chunks of at most
+      'maxPrimsPerChunk' boxes each (by the cell of a coarse
+      Morton-ordered grid over the boxes' centers that each box's
+      center falls into). Only the boxes' chunk assignments get
+      written (to a temporary file), never the boxes themselves;
+
+    - builds one BVH per chunk with gpuBuilder(), and writes each
+      chunk's nodes and primIDs right into their place in the output
+      file;
+
+    - builds a top-level tree over the chunks' root nodes, on the
+      host, and writes that (plus the file header) last.
+
+    The result is a regular BVH file (see bvhFile.h) that can be
+    loaded with MappedBVH<BinaryBVH<T,D,index_t>>. Device memory use
+    is that of a gpuBuilder() build over maxPrimsPerChunk boxes; host
+    memory use is that of staging one chunk, plus a fixed amount for
+    the grid. With the default index_t of uint32_t the input can have
+    at most 2^32-1 boxes; use index_t=uint64_t (ie, a BinaryBVH64)
+    for more than that. The chunking itself is shared with the
+    in-memory gpuBuilder() for BinaryBVH64 (impl/chunked_builder.h). */
+#pragma once
+
+#include "cuBQL/io/bvhFile.h"
+#include "cuBQL/impl/chunked_builder.h"
+#include <cstdio>
+#include <limits>
+
+namespace cuBQL {
+
+  /*! builds a BVH over the boxes in the file 'boxesFileName' - which
+      must be a plain array of box_t<T,D>, without any header - and
+      writes it to 'bvhFileName'; see top of this file. Boxes that are
+      inverted (ie, invalid) will not be referenced by the BVH, same
+      as with gpuBuilder(). Throws a std::runtime_error if either file
+      cannot be accessed, if there are no valid boxes, or if there
+      are more boxes than index_t can index. */
+  template<typename T, int D, typename index_t=uint32_t>
+  void buildOutOfCore(const std::string &bvhFileName,
+                      const std::string &boxesFileName,
+                      BuildConfig        buildConfig      = BuildConfig(),
+                      size_t             maxPrimsPerChunk = size_t(1)<<24,
+                      cudaStream_t       s=0,
+                      GpuMemoryResource &memResource=defaultGpuMemResource());
+
+  // ==================================================================
+  // IMPLEMENTATION
+  // ==================================================================
+
+  namespace outOfCore_impl {
+    /*! number of primIDs buffered per chunk before they get written
+        out to the temporary file */
+    enum { bufferSize = 1<<14 };
+    
+    inline void writeAt(std::fstream &file, uint64_t offset,
+                        const void *data, size_t size)
+    {
+      file.seekp(offset);
+      file.write((const char *)data,size);
+    }
+  } // ::cuBQL::outOfCore_impl
+
+#ifdef __CUDACC__
+  template<typename T, int D, typename index_t>
+  void buildOutOfCore(const std::string &bvhFileName,
+                      const std::string &boxesFileName,
+                      BuildConfig        buildConfig,
+                      size_t             maxPrimsPerChunk,
+                      cudaStream_t       s,
+                      GpuMemoryResource &memResource)
+  {
+    using namespace chunkedBuilder_impl;
+    using namespace outOfCore_impl;
+    using box_t = cuBQL::box_t<T,D>;
+    using Node  = BinaryBVHNode<T,D>;
+    
+    const io_impl::MappedFile input(boxesFileName);
+    if (input.size % sizeof(box_t) != 0)
+      throw std::runtime_error("cuBQL: size of '"+boxesFileName
+                               +"' is not a multiple of the box size");
+    const box_t *boxes = (const box_t *)input.data;
+    const uint64_t numBoxes = input.size / sizeof(box_t);
+    if (numBoxes >= std::numeric_limits<index_t>::max())
+      throw std::runtime_error("cuBQL: '"+boxesFileName+"' has more boxes than "
+                               "fit into "+std::to_string(8*sizeof(index_t))
+                               +"-bit primIDs");
+    maxPrimsPerChunk = std::max(maxPrimsPerChunk,size_t(1));
+
+    // ------------------------------------------------------------------
+    // passes 1 and 2: bounds of the (valid) boxes' centers, number of
+    // boxes per cell, and from that, the chunks
+    // ------------------------------------------------------------------
+    const cuBQL::box_t<double,D> centerBounds = computeCenterBounds(boxes,numBoxes);
+    if (centerBounds.empty())
+      throw std::runtime_error("cuBQL: '"+boxesFileName+"' has no valid boxes");
+    const Grid<T,D> grid(centerBounds);
+    const std::vector<uint64_t> cellBegin = computeCellBegin(grid,boxes,numBoxes);
+    const uint64_t numPrims = cellBegin.back();
+    const std::vector<uint64_t> chunkBegin = makeChunks(cellBegin,maxPrimsPerChunk);
+    const int numChunks = int(chunkBegin.size()-1);
+
+    const std::string partitionFileName = bvhFileName+".partition.tmp";
+    const std::string tmpFileName = bvhFileName+".tmp";
+    box_t *d_boxes = 0;
+    try {
+      // ------------------------------------------------------------------
+      // pass 3: write each chunk's primIDs to the partition file, in
+      // the order the chunks come in
+      // ------------------------------------------------------------------
+      std::fstream partition(partitionFileName,std::ios::in|std::ios::out
+                             |std::ios::binary|std::ios::trunc);
+      if (!partition)
+        throw std::runtime_error("cuBQL: could not create '"+partitionFileName+"'");
+      {
+        std::vector<uint64_t> cellCursor(cellBegin.begin(),cellBegin.end()-1);
+        std::vector<uint64_t> chunkCursor(chunkBegin.begin(),chunkBegin.end()-1);
+        std::vector<std::vector<index_t>> buffers(numChunks);
+        auto flush = [&](int chunkID) {
+          std::vector<index_t> &buffer = buffers[chunkID];
+          writeAt(partition,chunkCursor[chunkID]*sizeof(index_t),
+                  buffer.data(),buffer.size()*sizeof(index_t));
+          chunkCursor[chunkID] += buffer.size();
+          buffer.clear();
+        };
+        std::vector<uint32_t> cells(blockSize);
+        for (uint64_t blockBegin=0;blockBegin<numBoxes;blockBegin+=blockSize) {
+          const uint64_t blockEnd = std::min(numBoxes,blockBegin+blockSize);
+          host::parallel_for(blockEnd-blockBegin,[&](size_t i) {
+            const box_t &box = boxes[blockBegin+i];
+            cells[i] = box.empty() ? uint32_t(-1) : grid.cellOf(box);
+          },4096);
+          for (uint64_t i=blockBegin;i<blockEnd;i++) {
+            const uint32_t cell = cells[i-blockBegin];
+            if (cell == uint32_t(-1)) continue;
+            const uint64_t pos = cellCursor[cell]++;
+            const int chunkID
+              = int(std::upper_bound(chunkBegin.begin(),chunkBegin.end(),pos)
+                    - chunkBegin.begin()) - 1;
+            buffers[chunkID].push_back(index_t(i));
+            if (buffers[chunkID].size() >= bufferSize)
+              flush(chunkID);
+          }
+        }
+        for (int chunkID=0;chunkID<numChunks;chunkID++)
+          flush(chunkID);
+      }
+      if (!partition)
+        throw std::runtime_error("cuBQL: error writing '"+partitionFileName+"'");
+
+      // ------------------------------------------------------------------
+      // pass 4: build the chunks, and write them to the output file
+      // ------------------------------------------------------------------
+      BVHFileHeader header
+        = bvhFile_impl::makeHeader(BinaryBVH<T,D,index_t>(),buildConfig);
+      header.numPrims      = numPrims;
+      header.primIDsOffset = bvhFile_impl::alignUp(sizeof(header));
+      header.nodesOffset
+        = bvhFile_impl::alignUp(header.primIDsOffset + numPrims*sizeof(index_t));
+      std::fstream out(tmpFileName,std::ios::in|std::ios::out
+                       |std::ios::binary|std::ios::trunc);
+      if (!out)
+        throw std::runtime_error("cuBQL: could not open '"+tmpFileName+"' for writing");
+      
+      // the top-level tree takes the first 2*numChunks nodes (root,
+      // unused node 1, and one pair per inner node); chunks' nodes
+      // come after that
+      uint64_t numNodes = 2*uint64_t(numChunks);
+      std::vector<Node> chunkRoots(numChunks);
+      size_t maxChunkSize = 0;
+      for (int chunkID=0;chunkID<numChunks;chunkID++)
+        maxChunkSize = std::max(maxChunkSize,
+                                size_t(chunkBegin[chunkID+1]-chunkBegin[chunkID]));
+      CUBQL_CUDA_CHECK(memResource.malloc((void**)&d_boxes,maxChunkSize*sizeof(box_t),s));
+      std::vector<index_t> chunkPrimIDs;
+      std::vector<Node>    chunkNodes;
+      std::vector<index_t> chunkBVHPrimIDs;
+      for (int chunkID=0;chunkID<numChunks;chunkID++) {
+        const uint64_t primOffset = chunkBegin[chunkID];
+        const uint64_t numChunkPrims = chunkBegin[chunkID+1]-primOffset;
+        chunkPrimIDs.resize(numChunkPrims);
+        partition.seekg(primOffset*sizeof(index_t));
+        partition.read((char *)chunkPrimIDs.data(),numChunkPrims*sizeof(index_t));
+        if (!partition)
+          throw std::runtime_error("cuBQL: error reading '"+partitionFileName+"'");
+        buildChunk(chunkNodes,chunkBVHPrimIDs,boxes,chunkPrimIDs,numNodes,primOffset,
+                   d_boxes,buildConfig,s,memResource);
+
+        // the chunk's nodes 2 and up go right after the nodes written
+        // so far; its root becomes a leaf of the top-level tree
+        chunkRoots[chunkID] = chunkNodes[0];
+        if (chunkNodes.size() > 2) {
+          writeAt(out,header.nodesOffset+numNodes*sizeof(Node),
+                  chunkNodes.data()+2,(chunkNodes.size()-2)*sizeof(Node));
+          numNodes += chunkNodes.size()-2;
+        }
+        writeAt(out,header.primIDsOffset+primOffset*sizeof(index_t),
+                chunkBVHPrimIDs.data(),numChunkPrims*sizeof(index_t));
+      }
+      CUBQL_CUDA_CHECK(memResource.free(d_boxes,s));
+      d_boxes = 0;
+      partition.close();
+      std::remove(partitionFileName.c_str());
+
+      // ------------------------------------------------------------------
+      // top-level tree, and header
+      // ------------------------------------------------------------------
+      const std::vector<Node> topLevel = buildTopLevel(chunkRoots);
+      writeAt(out,header.nodesOffset,topLevel.data(),topLevel.size()*sizeof(Node));
+      if (numNodes > std::numeric_limits<index_t>::max())
+        throw std::runtime_error("cuBQL: BVH over '"+boxesFileName+"' has too many nodes");
+      header.numNodes = numNodes;
+      writeAt(out,0,&header,sizeof(header));
+      out.close();
+      if (!out)
+        throw std::runtime_error("cuBQL: error writing BVH to '"+tmpFileName+"'");
+      std::remove(bvhFileName.c_str());
+      if (std::rename(tmpFileName.c_str(),bvhFileName.c_str()) != 0)
+        throw std::runtime_error("cuBQL: could not rename '"+tmpFileName
+                                 +"' to '"+bvhFileName+"'");
+    } catch (...) {
+      if (d_boxes) memResource.free(d_boxes,s);
+      std::remove(partitionFileName.c_str());
+      std::remove(tmpFileName.c_str());
+      throw;
+    }
+  }
+#endif
+  
+} // ::cuBQL
@@ -0,0 +1,480 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+
+/*! queries over BVH files that are too large to keep in memory as a
+    whole: a PagedBVH keeps the top few levels of the tree resident,
+    and fetches everything below that - nodes and primIDs - from a
+    memory mapping of the file through a fixed-size cache of pages
+    (with CLOCK replacement). Pages that have been copied into the
+    cache get released from the mapping again, so the memory this
+    uses is bounded by the resident levels plus the cache, no matter
+    how large the file; once the working set of a batch of queries
+    exceeds the cache, queries get slower (more page misses), but
+    never fail.
+
+    Any BVH file (see bvhFile.h) works, but savePagedBVH() writes one
+    that pages much better: the resident levels come first, and
+    everything below gets grouped into treelets of (up to) a page's
+    worth of nodes, each of which sits in a single page where
+    possible - so a query that descends through a subtree faults in
+    one page per treelet, rather than one per node.
+
+    A PagedBVH is host-only, and not thread-safe; for multi-threaded
+    queries use one PagedBVH per thread (all threads' mappings of the
+    same file share the same physical pages anyway). */
+#pragma once
+
+#include "cuBQL/io/bvhFile.h"
+#include <unordered_map>
+
+namespace cuBQL {
+
+  /*! writes the given BVH the same way saveBVH() does, but with its
+      nodes re-ordered for paging: the top numResidentLevels levels
+      first, and then page-sized treelets. The bvh's arrays can be in
+      host, managed, or device memory. */
+  template<typename T, int D>
+  void savePagedBVH(const std::string    &fileName,
+                    const BinaryBVH<T,D> &bvh,
+                    BuildConfig           buildConfig = BuildConfig(),
+                    int                   numResidentLevels = 10);
+  
+  /*! a BinaryBVH<T,D> whose top levels are resident, and whose other
+      nodes (and primIDs) get paged in from the file on demand; see
+      top of this file */
+  template<typename T, int D>
+  struct PagedBVH {
+    using Node = typename BinaryBVH<T,D>::Node;
+    enum { pageSize = BVHFileHeader::alignment };
+
+    /*! counters for how node and primID accesses got served */
+    struct Stats {
+      /*! node accesses served from the resident levels */
+      size_t residentHits = 0;
+      /*! accesses to pages that were already in the cache */
+      size_t pageHits     = 0;
+      /*! accesses that had to fetch a page from the file */
+      size_t pageMisses   = 0;
+      /*! pages that got dropped from the cache to make room */
+      size_t evictions    = 0;
+    };
+    
+    /*! maps the given BVH file (which gets validated the same way as
+        by MappedBVH), and keeps its top numResidentLevels levels
+        resident; and up to maxCachedPages pages of everything
+        else */
+    PagedBVH(const std::string &fileName,
+             int                numResidentLevels = 10,
+             size_t             maxCachedPages    = 1<<16);
+
+    /*! returns (a copy of) the given node */
+    inline Node getNode(uint32_t nodeID);
+    
+    /*! returns the primIDs of the given leaf node; these stay valid
+        until the next call to this function */
+    inline const uint32_t *getPrimIDs(const Node &leaf);
+
+    inline size_t numCachedPages() const { return pageSlots.size(); }
+
+    uint32_t    numNodes, numPrims;
+    BuildConfig buildConfig;
+    /*! nodes [0,numResidentNodes) are resident. With a file from
+        savePagedBVH(), those are exactly the top numResidentLevels
+        levels; for other files, it is the front of the nodes[] array
+        up to the last node of those levels, but at most twice as
+        many nodes as there are in those levels */
+    uint32_t    numResidentNodes;
+    Stats       stats;
+  private:
+    /*! copies 'size' bytes starting at byte 'offset' of the nodes[]
+        (region 0) or primIDs[] (region 1) array */
+    inline void read(int region, uint64_t offset, void *dst, size_t size);
+    /*! the cached copy of the given page of the given region */
+    inline const uint8_t *fetchPage(int region, uint64_t page);
+    
+    MappedBVH<BinaryBVH<T,D>> mapped;
+    const uint8_t *regions[2];
+    uint64_t       regionSizes[2];
+    /*! the part of the file mapping that holds the header and both
+        regions */
+    const uint8_t *mappingBegin, *mappingEnd;
+    std::vector<Node>     residentNodes;
+    std::vector<uint8_t>  cache;
+    size_t                maxCachedPages;
+    /*! (region,page) key of each slot in the cache, and whether it
+        got used since the clock hand last passed it */
+    std::vector<uint64_t> slotKeys;
+    std::vector<bool>     slotUsed;
+    size_t                clockHand = 0;
+    std::unordered_map<uint64_t,size_t> pageSlots;
+    std::vector<uint32_t> leafPrimIDs;
+  };
+
+  /*! same as shrinkingRadiusQuery_forEachLeaf_byBoxDistance() in
+      queries/shrinkingRadiusQuery.h, for a PagedBVH. The traversal
+      stack grows as required, so unlike the in-memory version this
+      never drops any nodes */
+  template<typename T, int D, typename SqrDistanceToBox, typename Lambda>
+  void shrinkingRadiusQuery_forEachLeaf_byBoxDistance(PagedBVH<T,D>          &bvh,
+                                                      const SqrDistanceToBox &sqrDistanceToBox,
+                                                      float                   sqrMaxSearchRadius,
+                                                      const Lambda           &lambda);
+
+  /*! same as shrinkingRadiusQuery_forEachPrim() in
+      queries/shrinkingRadiusQuery.h, for a PagedBVH */
+  template<typename T, int D, typename Lambda>
+  void shrinkingRadiusQuery_forEachPrim(PagedBVH<T,D> &bvh,
+                                        vec_t<T,D>     queryPoint,
+                                        float          sqrMaxSearchRadius,
+                                        const Lambda  &lambda);
+
+  /*! same as fixedBoxQuery_forEachPrim() in queries/fixedBoxQuery.h,
+      for a PagedBVH: calls lambda(primID) for every prim in every leaf
+      whose bounds overlap the query box */
+  template<typename T, int D, typename Lambda>
+  void fixedBoxQuery_forEachPrim(PagedBVH<T,D> &bvh,
+                                 box_t<T,D>     queryBox,
+                                 const Lambda  &lambda);
+
+  // ==================================================================
+  // IMPLEMENTATION
+  // ==================================================================
+
+  namespace pagedBVH_impl {
+    /*! a fault on a file mapping maps in more than just the faulting
+        page: linux maps all (already cached) pages of an aligned
+        'fault-around' window, and the whole large folio the page is
+        part of - which can be up to 2MB. Releasing only the page we
+        copied would leave all of those resident, so we always release
+        the whole aligned window of this size around it */
+    enum { releaseWindowBytes = 2*1024*1024 };
+    
+    /*! releases the given range of a (read-only, file-backed) mapping
+        from this process's memory - together with whatever else the
+        fault that brought it in may have mapped around it, within
+        [mappingBegin,mappingEnd); the next access will fault it in
+        again */
+    inline void releasePages(const uint8_t *begin, size_t size,
+                             const uint8_t *mappingBegin,
+                             const uint8_t *mappingEnd)
+    {
+#ifndef _WIN32
+      const size_t systemPageSize = (size_t)sysconf(_SC_PAGESIZE);
+      const size_t window = std::max(size_t(releaseWindowBytes),systemPageSize);
+      // the mapping starts at a page boundary; its last page is
+      // mapped in full even if the file ends inside of it
+      const size_t first
+        = std::max(size_t(begin)/window*window,size_t(mappingBegin));
+      const size_t last
+        = std::min(divRoundUp(size_t(begin)+size,window)*window,
+                   divRoundUp(size_t(mappingEnd),systemPageSize)*systemPageSize);
+      if (last > first)
+        madvise((void *)first,last-first,MADV_DONTNEED);
+#endif
+    }
+  } // ::cuBQL::pagedBVH_impl
+  
+  template<typename T, int D>
+  void savePagedBVH(const std::string    &fileName,
+                    const BinaryBVH<T,D> &bvh,
+                    BuildConfig           buildConfig,
+                    int                   numResidentLevels)
+  {
+    using Node = typename BinaryBVH<T,D>::Node;
+    std::vector<Node> nodes(bvh.numNodes);
+    CUBQL_CUDA_CALL(Memcpy(nodes.data(),bvh.nodes,bvh.numNodes*sizeof(Node),
+                           cudaMemcpyDefault));
+    // treelets are made of whole pairs, so keep this even
+    const size_t nodesPerPage
+      = std::max(size_t(2),(BVHFileHeader::alignment/sizeof(Node)) & ~size_t(1));
+    
+    std::vector<Node>     ordered(2);
+    std::vector<uint32_t> newID(bvh.numNodes,0);
+    ordered[0] = nodes[0];
+    memset((void *)&ordered[1],0,sizeof(Node));
+    auto addPair = [&](uint32_t firstChild) {
+      for (int i=0;i<2;i++) {
+        newID[firstChild+i] = (uint32_t)ordered.size();
+        ordered.push_back(nodes[firstChild+i]);
+      }
+    };
+    auto isInner = [&](uint32_t nodeID) { return nodes[nodeID].admin.count == 0; };
+
+    // the resident levels, breadth-first; 'level' ends up with the
+    // nodes whose children go into treelets
+    std::vector<uint32_t> level = { 0 };
+    for (int depth=1;depth<numResidentLevels;depth++) {
+      std::vector<uint32_t> nextLevel;
+      for (auto nodeID : level)
+        if (isInner(nodeID)) {
+          const uint32_t firstChild = (uint32_t)nodes[nodeID].admin.offset;
+          addPair(firstChild);
+          nextLevel.push_back(firstChild+0);
+          nextLevel.push_back(firstChild+1);
+        }
+      level.swap(nextLevel);
+    }
+
+    // treelets: each starts with the children of a node that is
+    // already placed, and grows breadth-first until it fills a page;
+    // treelets that do not fit into what is left of the current page
+    // start on a new one. Treelets get placed depth-first, so that
+    // subtrees stay close to each other in the file
+    std::vector<uint32_t> pending;
+    for (auto it=level.rbegin();it!=level.rend();++it)
+      if (isInner(*it)) pending.push_back(*it);
+    std::vector<uint32_t> treelet, treeletParents;
+    while (!pending.empty()) {
+      const uint32_t parentID = pending.back();
+      pending.pop_back();
+      treelet.clear();
+      treeletParents = { parentID };
+      for (size_t i=0;i<treeletParents.size();i++) {
+        const uint32_t nodeID = treeletParents[i];
+        const uint32_t firstChild = (uint32_t)nodes[nodeID].admin.offset;
+        if (2*treelet.size()+2 > nodesPerPage) {
+          pending.push_back(nodeID);
+          continue;
+        }
+        treelet.push_back(firstChild);
+        for (int c=0;c<2;c++)
+          if (isInner(firstChild+c)) treeletParents.push_back(firstChild+c);
+      }
+      const size_t usedInPage = ordered.size() % nodesPerPage;
+      if (usedInPage != 0 && usedInPage+2*treelet.size() > nodesPerPage) {
+        const size_t padding = nodesPerPage-usedInPage;
+        ordered.resize(ordered.size()+padding);
+        memset((void *)(ordered.data()+ordered.size()-padding),0,padding*sizeof(Node));
+      }
+      for (auto firstChild : treelet)
+        addPair(firstChild);
+    }
+
+    for (auto &node : ordered)
+      if (node.admin.count == 0 && node.admin.offset != 0)
+        node.admin.offset = newID[node.admin.offset];
+    
+    BinaryBVH<T,D> paged = bvh;
+    paged.nodes    = ordered.data();
+    paged.numNodes = (uint32_t)ordered.size();
+    saveBVH(fileName,paged,buildConfig);
+  }
+  
+  template<typename T, int D>
+  PagedBVH<T,D>::PagedBVH(const std::string &fileName,
+                          int                numResidentLevels,
+                          size_t             maxCachedPages)
+    : mapped(fileName),
+      maxCachedPages(std::max(maxCachedPages,size_t(1)))
+  {
+    numNodes    = mapped.bvh.numNodes;
+    numPrims    = mapped.bvh.numPrims;
+    buildConfig = mapped.buildConfig;
+    regions[0]     = (const uint8_t *)mapped.bvh.nodes;
+    regionSizes[0] = uint64_t(numNodes)*sizeof(Node);
+    regions[1]     = (const uint8_t *)mapped.bvh.primIDs;
+    regionSizes[1] = uint64_t(numPrims)*sizeof(uint32_t);
+    mappingBegin   = regions[0]-mapped.header.nodesOffset;
+    mappingEnd     = std::max(regions[0]+regionSizes[0],regions[1]+regionSizes[1]);
+
+    // the resident nodes are all nodes up to the last one in the top
+    // numResidentLevels levels; with a file from savePagedBVH(),
+    // that is exactly those levels, but other layouts may have those
+    // spread out much further
+    uint32_t lastResident = 0, numTopNodes = 1;
+    std::vector<uint32_t> level = { 0 };
+    for (int depth=1;depth<numResidentLevels && !level.empty();depth++) {
+      std::vector<uint32_t> nextLevel;
+      for (auto nodeID : level) {
+        const Node &node = mapped.bvh.nodes[nodeID];
+        if (node.admin.count != 0) continue;
+        for (int c=0;c<2;c++) {
+          nextLevel.push_back(uint32_t(node.admin.offset+c));
+          lastResident = std::max(lastResident,nextLevel.back());
+        }
+      }
+      numTopNodes += (uint32_t)nextLevel.size();
+      level.swap(nextLevel);
+    }
+    numResidentNodes
+      = std::min(numNodes,std::min(lastResident+1,2*numTopNodes+2));
+    residentNodes.assign(mapped.bvh.nodes,mapped.bvh.nodes+numResidentNodes);
+    // the above (and validating the header) touched nodes that may
+    // lie anywhere in the file, so release all of it
+    pagedBVH_impl::releasePages(mappingBegin,mappingEnd-mappingBegin,
+                                mappingBegin,mappingEnd);
+  }
+
+  template<typename T, int D>
+  const uint8_t *PagedBVH<T,D>::fetchPage(int region, uint64_t page)
+  {
+    const uint64_t key = (page << 1) | region;
+    auto it = pageSlots.find(key);
+    if (it != pageSlots.end()) {
+      stats.pageHits++;
+      slotUsed[it->second] = true;
+      return cache.data()+it->second*pageSize;
+    }
+    stats.pageMisses++;
+    size_t slot;
+    if (slotKeys.size() < maxCachedPages) {
+      slot = slotKeys.size();
+      slotKeys.push_back(key);
+      slotUsed.push_back(true);
+      cache.resize(slotKeys.size()*pageSize);
+    } else {
+      // CLOCK: evict the first page that has not been used since the
+      // hand last passed it
+      while (slotUsed[clockHand]) {
+        slotUsed[clockHand] = false;
+        clockHand = (clockHand+1) % maxCachedPages;
+      }
+      slot = clockHand;
+      clockHand = (clockHand+1) % maxCachedPages;
+      pageSlots.erase(slotKeys[slot]);
+      stats.evictions++;
+      slotKeys[slot] = key;
+      slotUsed[slot] = true;
+    }
+    pageSlots[key] = slot;
+    const uint64_t begin = page*pageSize;
+    const size_t size = (size_t)std::min(uint64_t(pageSize),regionSizes[region]-begin);
+    memcpy(cache.data()+slot*pageSize,regions[region]+begin,size);
+    pagedBVH_impl::releasePages(regions[region]+begin,size,
+                                mappingBegin,mappingEnd);
+    return cache.data()+slot*pageSize;
+  }
+  
+  template<typename T, int D>
+  void PagedBVH<T,D>::read(int region, uint64_t offset, void *dst, size_t size)
+  {
+    uint8_t *out = (uint8_t *)dst;
+    while (size > 0) {
+      const uint64_t page = offset / pageSize;
+      const size_t inPage = size_t(offset % pageSize);
+      const size_t num = std::min(size,size_t(pageSize)-inPage);
+      memcpy(out,fetchPage(region,page)+inPage,num);
+      out += num;
+      offset += num;
+      size -= num;
+    }
+  }
+
+  template<typename T, int D>
+  typename PagedBVH<T,D>::Node PagedBVH<T,D>::getNode(uint32_t nodeID)
+  {
+    if (nodeID < numResidentNodes) {
+      stats.residentHits++;
+      return residentNodes[nodeID];
+    }
+    Node node;
+    read(0,uint64_t(nodeID)*sizeof(Node),&node,sizeof(Node));
+    return node;
+  }
+  
+  template<typename T, int D>
+  const uint32_t *PagedBVH<T,D>::getPrimIDs(const Node &leaf)
+  {
+    leafPrimIDs.resize(leaf.admin.count);
+    read(1,uint64_t(leaf.admin.offset)*sizeof(uint32_t),
+         leafPrimIDs.data(),leaf.admin.count*sizeof(uint32_t));
+    return leafPrimIDs.data();
+  }
+
+  template<typename T, int D, typename SqrDistanceToBox, typename Lambda>
+  void shrinkingRadiusQuery_forEachLeaf_byBoxDistance(PagedBVH<T,D>          &bvh,
+                                                      const SqrDistanceToBox &sqrDistanceToBox,
+                                                      float                   sqrMaxSearchRadius,
+                                                      const Lambda           &lambda)
+  {
+    using Node = typename PagedBVH<T,D>::Node;
+    float sqrCullDist = sqrMaxSearchRadius;
+    std::vector<std::pair<float,Node>> stack;
+    Node node = bvh.getNode(0);
+    if (sqrDistanceToBox(node.bounds) >= sqrCullDist) return;
+    while (true) {
+      // descend to the closer child, pushing the other one if it is
+      // in range, too
+      while (node.admin.count == 0) {
+        const Node n0 = bvh.getNode(uint32_t(node.admin.offset+0));
+        const Node n1 = bvh.getNode(uint32_t(node.admin.offset+1));
+        const float d0 = sqrDistanceToBox(n0.bounds);
+        const float d1 = sqrDistanceToBox(n1.bounds);
+        if (std::min(d0,d1) >= sqrCullDist) break;
+        node = (d0 < d1) ? n0 : n1;
+        if (std::max(d0,d1) < sqrCullDist)
+          stack.push_back({ std::max(d0,d1), (d0 < d1) ? n1 : n0 });
+      }
+      if (node.admin.count != 0) {
+        const float leafResult
+          = lambda(bvh.getPrimIDs(node),(int)node.admin.count);
+        if (leafResult < 0.f) return;
+        sqrCullDist = std::min(sqrCullDist,leafResult);
+      }
+      while (true) {
+        if (stack.empty()) return;
+        const std::pair<float,Node> entry = stack.back();
+        stack.pop_back();
+        if (entry.first < sqrCullDist) {
+          node = entry.second;
+          break;
+        }
+      }
+    }
+  }
+
+  template<typename T, int D, typename Lambda>
+  void shrinkingRadiusQuery_forEachPrim(PagedBVH<T,D> &bvh,
+                                        vec_t<T,D>     queryPoint,
+                                        float          sqrMaxSearchRadius,
+                                        const Lambda  &lambda)
+  {
+    shrinkingRadiusQuery_forEachLeaf_byBoxDistance
+      (bvh,
+       [queryPoint](const box_t<T,D> &box) { return fSqrDistance(box,queryPoint); },
+       sqrMaxSearchRadius,
+       [&](const uint32_t *primIDs, int numPrims) {
+         float leafResult = INFINITY;
+         for (int i=0;i<numPrims;i++)
+           leafResult = std::min(leafResult,lambda(primIDs[i]));
+         return leafResult;
+       });
+  }
+  
+  template<typename T, int D, typename Lambda>
+  void fixedBoxQuery_forEachPrim(PagedBVH<T,D> &bvh,
+                                 box_t<T,D>     queryBox,
+                                 const Lambda  &lambda)
+  {
+    using Node = typename PagedBVH<T,D>::Node;
+    std::vector<Node> stack = { bvh.getNode(0) };
+    while (!stack.empty()) {
+      const Node node = stack.back();
+      stack.pop_back();
+      if (!node.bounds.overlaps(queryBox)) continue;
+      if (node.admin.count == 0) {
+        stack.push_back(bvh.getNode(uint32_t(node.admin.offset+0)));
+        stack.push_back(bvh.getNode(uint32_t(node.admin.offset+1)));
+        continue;
+      }
+      const uint32_t *primIDs = bvh.getPrimIDs(node);
+      for (int i=0;i<(int)node.admin.count;i++)
+        lambda(primIDs[i]);
+    }
+  }
+  
+} // ::cuBQL
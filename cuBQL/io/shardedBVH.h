@@ -0,0 +1,569 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+
+/*! BVHs over point sets that get split into several independently
+    built - and independently re-buildable - shards, eg, for data
+    sets that do not fit into a single machine's memory.
+    partitionByMortonRange() splits the points into shards of equal
+    size by ranges of their Morton order; each shard then is a
+    PointShard, which can be
+
+    - an InProcessShard, built with gpuBuilder() in this process;
+
+    - a MappedShard, mmap'ed from the files that
+      InProcessShard::save() wrote; or
+
+    - a RemoteShard, which sends its queries (as plain byte messages)
+      to a ShardService that can live anywhere else;
+      LocalShardService is a stand-in for such a service that answers
+      them with a shard of its own.
+
+    A ShardedBVH keeps a small top-level BVH over the shards' bounds,
+    and answers fcp() and knn() queries by visiting the shards in
+    order of their distance to the query point, carrying the
+    (shrinking) query radius from one shard to the next, and merging
+    each shard's hits into the k closest overall. All of this runs on
+    the host; primIDs are always the points' indices in the full,
+    un-sharded input. */
+#pragma once
+
+#include "cuBQL/io/bvhFile.h"
+#include "cuBQL/impl/chunked_builder.h"
+#include "cuBQL/queries/shrinkingRadiusQuery.h"
+#include <memory>
+#include <queue>
+
+namespace cuBQL {
+
+  /*! one point found by a shard query */
+  struct ShardHit {
+    /*! index of the point in the full (un-sharded) input */
+    uint64_t primID;
+    float    sqrDistance;
+  };
+
+  /*! one shard of a ShardedBVH; see top of this file */
+  struct PointShard {
+    virtual ~PointShard() = default;
+    /*! bounds of all of this shard's points */
+    virtual box3f getBounds() = 0;
+    /*! appends to 'hits' the (up to) k points of this shard that are
+        closest to 'query' and closer than sqrt(sqrMaxDist), in no
+        particular order */
+    virtual void knn(std::vector<ShardHit> &hits,
+                     vec3f query, int k, float sqrMaxDist) = 0;
+  };
+
+  /*! splits the given (host-readable) points, by ranges of their
+      Morton order, into numShards shards of equal size (up to one
+      point); returns each shard's primIDs */
+  inline std::vector<std::vector<uint64_t>>
+  partitionByMortonRange(const vec3f *points, uint64_t numPoints, int numShards);
+
+  /*! a shard whose BVH (and a copy of its points) lives in this
+      process */
+  struct InProcessShard : public PointShard {
+    /*! builds the shard over the points allPoints[primIDs[i]], with
+        gpuBuilder() and in managed memory (so host-side queries can
+        use it); allPoints[] must be host-readable */
+    InProcessShard(const vec3f                 *allPoints,
+                   const std::vector<uint64_t> &primIDs,
+                   BuildConfig                  buildConfig = BuildConfig(),
+                   cudaStream_t                 s = 0);
+    InProcessShard(const InProcessShard &) = delete;
+    InProcessShard &operator=(const InProcessShard &) = delete;
+    inline ~InProcessShard() override;
+
+    inline box3f getBounds() override;
+    inline void knn(std::vector<ShardHit> &hits,
+                    vec3f query, int k, float sqrMaxDist) override;
+
+    /*! writes this shard into 'fileName' (its BVH; see bvhFile.h)
+        and fileName+".points" (its points, and their primIDs), for
+        MappedShard to load */
+    inline void save(const std::string &fileName) const;
+
+    /*! the shard's points, and their primIDs in the full input; the
+        BVH's primIDs index into these */
+    std::vector<vec3f>    points;
+    std::vector<uint64_t> primIDs;
+    bvh3f                 bvh;
+    BuildConfig           buildConfig;
+  };
+
+  /*! a shard mapped from files written by InProcessShard::save();
+      throws a std::runtime_error if those cannot be loaded */
+  struct MappedShard : public PointShard {
+    inline explicit MappedShard(const std::string &fileName);
+
+    inline box3f getBounds() override;
+    inline void knn(std::vector<ShardHit> &hits,
+                    vec3f query, int k, float sqrMaxDist) override;
+
+    MappedBVH<bvh3f>   mapped;
+  private:
+    io_impl::MappedFile pointsFile;
+    const vec3f        *points  = 0;
+    const uint64_t     *primIDs = 0;
+  };
+
+  /*! the other end of a RemoteShard: handles one request message,
+      and returns the response message. How messages get there (and
+      back) is up to the implementation */
+  struct ShardService {
+    virtual ~ShardService() = default;
+    virtual std::vector<char> call(const std::vector<char> &request) = 0;
+  };
+
+  /*! a ShardService that answers requests with a shard in this same
+      process; a stand-in for one that runs elsewhere */
+  struct LocalShardService : public ShardService {
+    inline explicit LocalShardService(std::shared_ptr<PointShard> shard)
+      : shard(shard)
+    {}
+    inline std::vector<char> call(const std::vector<char> &request) override;
+
+    std::shared_ptr<PointShard> shard;
+  };
+
+  /*! a shard that forwards its queries to a ShardService; throws a
+      std::runtime_error on malformed responses */
+  struct RemoteShard : public PointShard {
+    inline explicit RemoteShard(std::shared_ptr<ShardService> service)
+      : service(service)
+    {}
+
+    inline box3f getBounds() override;
+    inline void knn(std::vector<ShardHit> &hits,
+                    vec3f query, int k, float sqrMaxDist) override;
+
+    std::shared_ptr<ShardService> service;
+  };
+
+  /*! a point set split into shards, with a top-level BVH over the
+      shards' bounds; see top of this file */
+  struct ShardedBVH {
+    ShardedBVH() = default;
+    inline explicit ShardedBVH(const std::vector<std::shared_ptr<PointShard>> &shards);
+
+    /*! replaces shard shardID (eg, by one that got re-built over
+        changed points), and updates the top-level BVH */
+    inline void setShard(int shardID, std::shared_ptr<PointShard> shard);
+    /*! re-builds the top-level BVH over the shards' bounds; required
+        after changing any of the shards in shards[] directly */
+    inline void update();
+
+    /*! returns the primID of the point closest to 'query' that is
+        closer than sqrt(sqrMaxDist), and sets sqrMaxDist to its
+        square distance; or returns -1, and leaves sqrMaxDist
+        unchanged, if there is no such point */
+    inline int64_t fcp(vec3f query, float &sqrMaxDist);
+    /*! returns the (up to) k points closest to 'query' that are
+        closer than sqrt(sqrMaxDist), sorted by distance */
+    inline std::vector<ShardHit> knn(vec3f query, int k, float sqrMaxDist = INFINITY);
+
+    std::vector<std::shared_ptr<PointShard>> shards;
+    /*! number of shard queries that fcp() and knn() issued so far */
+    uint64_t numShardQueries = 0;
+  private:
+    /*! the top-level BVH over the (non-empty) shards; each of its
+        leaves has one shard, whose shardID is in topPrimIDs[] */
+    std::vector<bvh3f::Node> topNodes;
+    std::vector<uint32_t>    topPrimIDs;
+  };
+
+  // ==================================================================
+  // IMPLEMENTATION
+  // ==================================================================
+
+  namespace shardedBVH_impl {
+    /*! what InProcessShard builds its BVH in */
+    inline GpuMemoryResource &managedMem()
+    {
+      static ManagedMemMemoryResource memResource;
+      return memResource;
+    }
+
+    /*! hits ordered by distance, with ties broken by primID */
+    inline bool closer(const ShardHit &a, const ShardHit &b)
+    {
+      return a.sqrDistance < b.sqrDistance
+        || (a.sqrDistance == b.sqrDistance && a.primID < b.primID);
+    }
+
+    /*! adds 'hit' to a max-heap of the (up to) k closest hits;
+        returns the square distance that further hits have to beat */
+    inline float insert(std::vector<ShardHit> &heap, int k,
+                        const ShardHit &hit, float sqrMaxDist)
+    {
+      if ((int)heap.size() == k) {
+        if (!closer(hit,heap.front())) return sqrMaxDist;
+        std::pop_heap(heap.begin(),heap.end(),closer);
+        heap.back() = hit;
+      } else
+        heap.push_back(hit);
+      std::push_heap(heap.begin(),heap.end(),closer);
+      return ((int)heap.size() == k)
+        ? std::min(sqrMaxDist,heap.front().sqrDistance)
+        : sqrMaxDist;
+    }
+
+    /*! the k-nearest query that InProcessShard and MappedShard
+        share; bvh.primIDs index into points[] and primIDs[] */
+    inline void knn(std::vector<ShardHit> &hits,
+                    const bvh3f           &bvh,
+                    const vec3f           *points,
+                    const uint64_t        *primIDs,
+                    vec3f query, int k, float sqrMaxDist)
+    {
+      if (k <= 0 || bvh.numNodes == 0) return;
+      std::vector<ShardHit> heap;
+      shrinkingRadiusQuery_forEachPrim
+        (bvh,query,sqrMaxDist,[&](uint32_t primID)->float {
+          const float sqrDist = fSqrDistance(points[primID],query);
+          if (sqrDist < sqrMaxDist)
+            sqrMaxDist = insert(heap,k,{ primIDs[primID],sqrDist },sqrMaxDist);
+          return sqrMaxDist;
+        });
+      hits.insert(hits.end(),heap.begin(),heap.end());
+    }
+
+    /*! the header of the ".points" file that InProcessShard::save()
+        writes next to the shard's BVH file */
+    struct PointsFileHeader {
+      char     magic[8];
+      uint64_t numPoints;
+      uint64_t pointsOffset;
+      uint64_t primIDsOffset;
+    };
+
+    /*! the messages between RemoteShard and a ShardService: a request
+        is a RequestType, followed by (for KNN) a KNNRequest; a
+        response to GET_BOUNDS is a box3f, one to KNN a uint64_t
+        number of hits, followed by the hits themselves */
+    enum RequestType : uint32_t { GET_BOUNDS = 1, KNN = 2 };
+    struct KNNRequest {
+      vec3f   query;
+      int32_t k;
+      float   sqrMaxDist;
+    };
+
+    template<typename T>
+    void append(std::vector<char> &message, const T &value)
+    {
+      message.insert(message.end(),(const char *)&value,(const char *)(&value+1));
+    }
+
+    /*! reads a T from the message, at 'offset' (which it advances) */
+    template<typename T>
+    T read(const std::vector<char> &message, size_t &offset)
+    {
+      if (offset + sizeof(T) > message.size())
+        throw std::runtime_error("cuBQL: malformed shard message");
+      T value;
+      memcpy((void *)&value,message.data()+offset,sizeof(T));
+      offset += sizeof(T);
+      return value;
+    }
+  } // ::cuBQL::shardedBVH_impl
+
+  inline std::vector<std::vector<uint64_t>>
+  partitionByMortonRange(const vec3f *points, uint64_t numPoints, int numShards)
+  {
+    using namespace chunkedBuilder_impl;
+    if (numShards < 1)
+      throw std::runtime_error("cuBQL: need at least one shard");
+    std::vector<std::vector<uint64_t>> shards(numShards);
+    if (numPoints == 0) return shards;
+
+    box_t<double,3> bounds;
+    bounds.set_empty();
+    for (uint64_t i=0;i<numPoints;i++)
+      bounds.grow(vec_t<double,3>(points[i].x,points[i].y,points[i].z));
+    const Grid<float,3> grid(bounds);
+    std::vector<uint32_t> cells(numPoints);
+    host::parallel_for(numPoints,[&](size_t i) {
+      cells[i] = grid.cellOf(box3f(points[i],points[i]));
+    },4096);
+
+    // counting sort by cell, then equal-size ranges of that order
+    std::vector<uint64_t> cellBegin(Grid<float,3>::numCells+1,0);
+    for (auto cell : cells) cellBegin[cell+1]++;
+    for (size_t cell=0;cell<Grid<float,3>::numCells;cell++)
+      cellBegin[cell+1] += cellBegin[cell];
+    std::vector<uint64_t> sorted(numPoints);
+    for (uint64_t i=0;i<numPoints;i++)
+      sorted[cellBegin[cells[i]]++] = i;
+    for (int shardID=0;shardID<numShards;shardID++)
+      shards[shardID].assign(sorted.begin()+numPoints*shardID/numShards,
+                             sorted.begin()+numPoints*(shardID+1)/numShards);
+    return shards;
+  }
+
+  // ------------------------------------------------------------------
+  // InProcessShard
+  // ------------------------------------------------------------------
+
+#ifdef __CUDACC__
+  inline InProcessShard::InProcessShard(const vec3f                 *allPoints,
+                                        const std::vector<uint64_t> &primIDs,
+                                        BuildConfig                  buildConfig,
+                                        cudaStream_t                 s)
+    : points(primIDs.size()),
+      primIDs(primIDs),
+      buildConfig(buildConfig)
+  {
+    if (primIDs.size() > uint64_t(uint32_t(-1)))
+      throw std::runtime_error("cuBQL: too many points for one shard");
+    const uint32_t numPoints = (uint32_t)primIDs.size();
+    for (uint32_t i=0;i<numPoints;i++)
+      points[i] = allPoints[primIDs[i]];
+    if (numPoints == 0) return;
+
+    box3f *boxes = 0;
+    CUBQL_CUDA_CALL(MallocManaged((void **)&boxes,numPoints*sizeof(box3f)));
+    for (uint32_t i=0;i<numPoints;i++)
+      boxes[i] = box3f(points[i],points[i]);
+    gpuBuilder(bvh,boxes,numPoints,buildConfig,s,shardedBVH_impl::managedMem());
+    CUBQL_CUDA_CALL(StreamSynchronize(s));
+    CUBQL_CUDA_CALL(Free(boxes));
+  }
+#endif
+
+  inline InProcessShard::~InProcessShard()
+  {
+    if (bvh.nodes)
+      cuBQL::free(bvh,0,shardedBVH_impl::managedMem());
+  }
+
+  inline box3f InProcessShard::getBounds()
+  {
+    return bvh.numNodes ? box3f(bvh.nodes[0].bounds) : box3f();
+  }
+
+  inline void InProcessShard::knn(std::vector<ShardHit> &hits,
+                                  vec3f query, int k, float sqrMaxDist)
+  {
+    shardedBVH_impl::knn(hits,bvh,points.data(),primIDs.data(),query,k,sqrMaxDist);
+  }
+
+  inline void InProcessShard::save(const std::string &fileName) const
+  {
+    using namespace bvhFile_impl;
+    saveBVH(fileName,bvh,buildConfig);
+
+    shardedBVH_impl::PointsFileHeader header;
+    memset(&header,0,sizeof(header));
+    memcpy(header.magic,"cuBQLpts",8);
+    header.numPoints     = points.size();
+    header.pointsOffset  = alignUp(sizeof(header));
+    header.primIDsOffset = alignUp(header.pointsOffset + points.size()*sizeof(vec3f));
+    const std::string pointsFileName = fileName+".points";
+    std::ofstream out(pointsFileName,std::ios::binary);
+    if (!out)
+      throw std::runtime_error("cuBQL: could not open '"+pointsFileName+"' for writing");
+    out.write((const char *)&header,sizeof(header));
+    padTo(out,header.pointsOffset);
+    out.write((const char *)points.data(),points.size()*sizeof(vec3f));
+    padTo(out,header.primIDsOffset);
+    out.write((const char *)primIDs.data(),primIDs.size()*sizeof(uint64_t));
+    if (!out)
+      throw std::runtime_error("cuBQL: error writing points to '"+pointsFileName+"'");
+  }
+
+  // ------------------------------------------------------------------
+  // MappedShard
+  // ------------------------------------------------------------------
+
+  inline MappedShard::MappedShard(const std::string &fileName)
+    : mapped(fileName),
+      pointsFile(fileName+".points")
+  {
+    shardedBVH_impl::PointsFileHeader header;
+    auto fail = [&](const std::string &why)
+    { throw std::runtime_error("cuBQL: cannot load '"+fileName+".points' - "+why); };
+    if (pointsFile.size < sizeof(header))
+      fail("file too small");
+    memcpy(&header,pointsFile.data,sizeof(header));
+    if (memcmp(header.magic,"cuBQLpts",8) != 0)
+      fail("not a cuBQL points file");
+    if (header.numPoints != mapped.bvh.numPrims)
+      fail("number of points does not match the BVH");
+    if (header.pointsOffset > pointsFile.size
+        || header.numPoints > (pointsFile.size-header.pointsOffset)/sizeof(vec3f)
+        || header.primIDsOffset > pointsFile.size
+        || header.numPoints > (pointsFile.size-header.primIDsOffset)/sizeof(uint64_t))
+      fail("file truncated");
+    if (header.pointsOffset % alignof(vec3f) || header.primIDsOffset % alignof(uint64_t))
+      fail("misaligned arrays");
+    points  = (const vec3f *)(pointsFile.data+header.pointsOffset);
+    primIDs = (const uint64_t *)(pointsFile.data+header.primIDsOffset);
+  }
+
+  inline box3f MappedShard::getBounds()
+  {
+    return mapped.bvh.numNodes ? box3f(mapped.bvh.nodes[0].bounds) : box3f();
+  }
+
+  inline void MappedShard::knn(std::vector<ShardHit> &hits,
+                               vec3f query, int k, float sqrMaxDist)
+  {
+    shardedBVH_impl::knn(hits,mapped.bvh,points,primIDs,query,k,sqrMaxDist);
+  }
+
+  // ------------------------------------------------------------------
+  // LocalShardService and RemoteShard
+  // ------------------------------------------------------------------
+
+  inline std::vector<char> LocalShardService::call(const std::vector<char> &request)
+  {
+    using namespace shardedBVH_impl;
+    size_t offset = 0;
+    std::vector<char> response;
+    switch (read<uint32_t>(request,offset)) {
+    case GET_BOUNDS:
+      append(response,shard->getBounds());
+      break;
+    case KNN: {
+      const KNNRequest knn = read<KNNRequest>(request,offset);
+      std::vector<ShardHit> hits;
+      shard->knn(hits,knn.query,knn.k,knn.sqrMaxDist);
+      append(response,uint64_t(hits.size()));
+      for (auto &hit : hits)
+        append(response,hit);
+    } break;
+    default:
+      throw std::runtime_error("cuBQL: unknown shard request");
+    }
+    if (offset != request.size())
+      throw std::runtime_error("cuBQL: malformed shard message");
+    return response;
+  }
+
+  inline box3f RemoteShard::getBounds()
+  {
+    using namespace shardedBVH_impl;
+    std::vector<char> request;
+    append(request,uint32_t(GET_BOUNDS));
+    const std::vector<char> response = service->call(request);
+    size_t offset = 0;
+    const box3f bounds = read<box3f>(response,offset);
+    if (offset != response.size())
+      throw std::runtime_error("cuBQL: malformed shard message");
+    return bounds;
+  }
+
+  inline void RemoteShard::knn(std::vector<ShardHit> &hits,
+                               vec3f query, int k, float sqrMaxDist)
+  {
+    using namespace shardedBVH_impl;
+    std::vector<char> request;
+    append(request,uint32_t(KNN));
+    append(request,KNNRequest{ query,k,sqrMaxDist });
+    const std::vector<char> response = service->call(request);
+    size_t offset = 0;
+    const uint64_t numHits = read<uint64_t>(response,offset);
+    if (numHits > uint64_t(std::max(k,0))
+        || numHits != (response.size()-offset)/sizeof(ShardHit)
+        || (response.size()-offset) % sizeof(ShardHit))
+      throw std::runtime_error("cuBQL: malformed shard message");
+    for (uint64_t i=0;i<numHits;i++)
+      hits.push_back(read<ShardHit>(response,offset));
+  }
+
+  // ------------------------------------------------------------------
+  // ShardedBVH
+  // ------------------------------------------------------------------
+
+  inline ShardedBVH::ShardedBVH(const std::vector<std::shared_ptr<PointShard>> &shards)
+    : shards(shards)
+  {
+    update();
+  }
+
+  inline void ShardedBVH::setShard(int shardID, std::shared_ptr<PointShard> shard)
+  {
+    shards.at(shardID) = shard;
+    update();
+  }
+
+  inline void ShardedBVH::update()
+  {
+    std::vector<bvh3f::Node> leaves;
+    topPrimIDs.clear();
+    for (int shardID=0;shardID<(int)shards.size();shardID++) {
+      const box3f bounds = shards[shardID]->getBounds();
+      if (bounds.empty()) continue;
+      bvh3f::Node leaf;
+      leaf.bounds = bounds;
+      leaf.admin.offsetAndCountBits = 0;
+      leaf.admin.offset = (uint64_t)leaves.size();
+      leaf.admin.count  = 1;
+      leaves.push_back(leaf);
+      topPrimIDs.push_back(shardID);
+    }
+    topNodes.clear();
+    if (!leaves.empty())
+      topNodes = chunkedBuilder_impl::buildTopLevel(leaves);
+  }
+
+  inline int64_t ShardedBVH::fcp(vec3f query, float &sqrMaxDist)
+  {
+    const std::vector<ShardHit> hits = knn(query,1,sqrMaxDist);
+    if (hits.empty()) return -1;
+    sqrMaxDist = hits[0].sqrDistance;
+    return (int64_t)hits[0].primID;
+  }
+
+  inline std::vector<ShardHit> ShardedBVH::knn(vec3f query, int k, float sqrMaxDist)
+  {
+    using namespace shardedBVH_impl;
+    std::vector<ShardHit> heap, hits;
+    if (k <= 0 || topNodes.empty()) return heap;
+
+    // best-first over the top-level BVH, so shards get visited in
+    // order of distance, and we can stop at the first one that is
+    // farther away than the k-th closest hit so far
+    using Entry = std::pair<float,uint32_t>;
+    std::priority_queue<Entry,std::vector<Entry>,std::greater<Entry>> queue;
+    queue.push({ fSqrDistance(topNodes[0].bounds,query),0u });
+    while (!queue.empty()) {
+      const Entry entry = queue.top();
+      queue.pop();
+      if (entry.first >= sqrMaxDist) break;
+      const bvh3f::Node &node = topNodes[entry.second];
+      if (node.admin.count == 0) {
+        for (int c=0;c<2;c++) {
+          const uint32_t childID = uint32_t(node.admin.offset+c);
+          const float childDist = fSqrDistance(topNodes[childID].bounds,query);
+          if (childDist < sqrMaxDist)
+            queue.push({ childDist,childID });
+        }
+        continue;
+      }
+      hits.clear();
+      shards[topPrimIDs[node.admin.offset]]->knn(hits,query,k,sqrMaxDist);
+      numShardQueries++;
+      for (auto &hit : hits)
+        if (hit.sqrDistance < sqrMaxDist)
+          sqrMaxDist = insert(heap,k,hit,sqrMaxDist);
+    }
+    std::sort_heap(heap.begin(),heap.end(),closer);
+    return heap;
+  }
+
+} // ::cuBQL
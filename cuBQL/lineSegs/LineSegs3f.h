@@ -17,6 +17,7 @@
 #pragma once
 
 #include "cuBQL/bvh.h"
+#include "cuBQL/queries/segmentQuery.h"
 
 namespace cuBQL {
   namespace lineSegs {
@@ -61,6 +62,33 @@ namespace cuBQL {
              const IndexedSegment *const __restrict__ segments,
              const vec3f          *const __restrict__ vertices);
 
+    /*! result of a fcp query for a query segment (rather than a
+        query point) */
+    struct SegmentFCPResult {
+      inline __cubql_both void clear(float maxDistSqr) { primID = -1; sqrDistance = maxDistSqr; }
+
+      int   primID;
+      /*! where the two closest points are, along the found segment
+          (u) and along the query segment (t); 0 being the respective
+          begin point, 1 the end point */
+      float u, t;
+      float sqrDistance;
+    };
+
+    /*! same as fcp() above, but for a query segment: finds the
+        segment (among segments[] and vertices[]) closest to the
+        query segment, within the max query distance passed to
+        result.clear(). Nodes get culled by their distance to the
+        query segment (see segmentQuery.h), so this is a single
+        traversal rather than one point query per sample along the
+        query segment. Works on both host and device */
+    inline __cubql_both
+    void fcp(SegmentFCPResult &result,
+             const Segment                            querySegment,
+             const bvh3f                              bvh,
+             const IndexedSegment *const __restrict__ segments,
+             const vec3f          *const __restrict__ vertices);
+
     
     // ==================================================================
     // implementation
@@ -81,6 +109,25 @@ namespace cuBQL {
       and return the square distance to that point. */
     inline __device__
     CPResult closestPoint(const vec3f queryPoint, const Segment segment);
+
+    /*! result of a closest-points computation between two segments */
+    struct SegmentCPResult {
+      /*! the closest point on the query segment, at
+          querySegment.begin + t*(querySegment.end-querySegment.begin),
+          and on the other segment, at
+          segment.begin + u*(segment.end-segment.begin) */
+      vec3f queryPoint, point;
+      float t, u;
+
+      float sqrDistance;
+    };
+
+    /*! computes the pair of closest points between the two segments;
+        this is the clamped line-line test from Ericson's "Real-Time
+        Collision Detection" (5.1.9), including for segments that are
+        (nearly) parallel, or that have zero length */
+    inline __cubql_both
+    SegmentCPResult closestPoints(const Segment querySegment, const Segment segment);
     
     
 
@@ -169,5 +216,74 @@ namespace cuBQL {
         }
       }
     }
+
+    inline __cubql_both
+    SegmentCPResult closestPoints(const Segment querySegment, const Segment segment)
+    {
+      const vec3f d1 = querySegment.end - querySegment.begin;
+      const vec3f d2 = segment.end - segment.begin;
+      const vec3f r  = querySegment.begin - segment.begin;
+      const float a = dot(d1,d1);
+      const float e = dot(d2,d2);
+      const float f = dot(d2,r);
+      float t, u;
+      if (a == 0.f && e == 0.f) {
+        // both are points
+        t = u = 0.f;
+      } else if (a == 0.f) {
+        t = 0.f;
+        u = clamp(f/e);
+      } else {
+        const float c = dot(d1,r);
+        if (e == 0.f) {
+          u = 0.f;
+          t = clamp(-c/a);
+        } else {
+          const float b = dot(d1,d2);
+          const float denom = a*e-b*b;
+          // for (nearly) parallel segments any t is as good as any
+          // other; pick the start, and let u's clamping below fix it
+          t = (denom > 1e-10f*a*e) ? clamp((b*f-c*e)/denom) : 0.f;
+          u = (b*t+f)/e;
+          if (u < 0.f) {
+            u = 0.f;
+            t = clamp(-c/a);
+          } else if (u > 1.f) {
+            u = 1.f;
+            t = clamp((b-c)/a);
+          }
+        }
+      }
+      SegmentCPResult result;
+      result.t = t;
+      result.u = u;
+      result.queryPoint  = querySegment.begin + t*d1;
+      result.point       = segment.begin + u*d2;
+      result.sqrDistance = sqrDistance(result.queryPoint,result.point);
+      return result;
+    }
+
+    inline __cubql_both
+    void fcp(SegmentFCPResult &result,
+             const Segment                            querySegment,
+             const bvh3f                              bvh,
+             const IndexedSegment *const __restrict__ segments,
+             const vec3f          *const __restrict__ vertices)
+    {
+      auto perPrim=[&result,querySegment,segments,vertices](uint32_t primID)->float {
+        const IndexedSegment indices = segments[primID];
+        const Segment segment{vertices[indices.begin],vertices[indices.end]};
+        const SegmentCPResult primResult = closestPoints(querySegment,segment);
+        if (primResult.sqrDistance < result.sqrDistance) {
+          result.primID = primID;
+          result.u = primResult.u;
+          result.t = primResult.t;
+          result.sqrDistance = primResult.sqrDistance;
+        }
+        return result.sqrDistance;
+      };
+      segmentQuery_forEachPrim(bvh,querySegment.begin,querySegment.end,
+                               result.sqrDistance,perPrim);
+    }
   }
 }
@@ -195,6 +195,23 @@ namespace cuBQL {
     return sqrDistance(closestPoint,point);
   }
 
+  /*! approximate-conservative square distance between two boxes
+      (ie, the square of the smallest distance between any point in
+      box a and any point in box b); zero if the two boxes
+      overlap. as with all other fSqrDistance functions the result is
+      returned in floats */
+  template<typename T, int D> inline __cubql_both
+  float fSqrDistance(box_t<T,D> a, box_t<T,D> b)
+  {
+    float sum = 0.f;
+    CUBQL_PRAGMA_UNROLL
+      for (int i=0;i<D;i++) {
+        T gap = max(max(a.lower[i]-b.upper[i],b.lower[i]-a.upper[i]),T(0));
+        sum += fSqrLength(gap);
+      }
+    return sum;
+  }
+
   template<typename T, int D> inline __cubql_both
   box_t<T,D> &grow(box_t<T,D> &b, vec_t<T,D> v)
   { b.grow(v); return b; }
@@ -0,0 +1,196 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+/*! minimal host-side SIMD wrapper, used by the host-side leaf
+    kernels that evaluate all prims of a leaf at once (see
+    cuBQL/points/leafSoA.h and cuBQL/triangles/leafSoA.h). Provides a
+    'vfloat' of simd::width floats, and a matching 'vbool' mask type,
+    with only the few operations those kernels need.
+
+    Which instruction set gets used depends on what the host compiler
+    is allowed to use: AVX-512 if __AVX512F__ is defined, AVX2 if
+    __AVX2__ is defined, else a plain-C++ fallback that the compiler
+    may or may not auto-vectorize. So to actually get SIMD code,
+    compile the host code with -mavx2, -mavx512f, or -march=native
+    (under nvcc, via -Xcompiler). Device code never uses this. */
+#pragma once
+
+#include "cuBQL/math/common.h"
+#if !defined(__CUDA_ARCH__) && (defined(__AVX512F__) || defined(__AVX2__))
+# include <immintrin.h>
+#endif
+
+namespace cuBQL {
+  namespace simd {
+
+    /*! index of the lowest set bit; 'bits' must not be zero */
+    inline int firstSetBit(unsigned bits)
+    {
+#ifdef _MSC_VER
+      unsigned long index;
+      _BitScanForward(&index,bits);
+      return (int)index;
+#else
+      return __builtin_ctz(bits);
+#endif
+    }
+
+#if !defined(__CUDA_ARCH__) && defined(__AVX512F__)
+    // ==================================================================
+    // AVX-512
+    // ==================================================================
+    enum { width = 16 };
+    struct vbool  { __mmask16 m; };
+    struct vfloat { __m512 v; };
+
+    inline vfloat load(const float *ptr)  { return { _mm512_loadu_ps(ptr) }; }
+    inline void store(float *ptr, vfloat a) { _mm512_storeu_ps(ptr,a.v); }
+    inline vfloat broadcast(float f)      { return { _mm512_set1_ps(f) }; }
+    /*! (0,1,2,...,width-1) */
+    inline vfloat laneIndex()
+    { return { _mm512_setr_ps(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15) }; }
+
+    inline vfloat operator+(vfloat a, vfloat b) { return { _mm512_add_ps(a.v,b.v) }; }
+    inline vfloat operator-(vfloat a, vfloat b) { return { _mm512_sub_ps(a.v,b.v) }; }
+    inline vfloat operator*(vfloat a, vfloat b) { return { _mm512_mul_ps(a.v,b.v) }; }
+    inline vfloat operator/(vfloat a, vfloat b) { return { _mm512_div_ps(a.v,b.v) }; }
+    inline vfloat min(vfloat a, vfloat b) { return { _mm512_min_ps(a.v,b.v) }; }
+    inline vfloat max(vfloat a, vfloat b) { return { _mm512_max_ps(a.v,b.v) }; }
+
+    inline vbool operator< (vfloat a, vfloat b) { return { _mm512_cmp_ps_mask(a.v,b.v,_CMP_LT_OQ) }; }
+    inline vbool operator<=(vfloat a, vfloat b) { return { _mm512_cmp_ps_mask(a.v,b.v,_CMP_LE_OQ) }; }
+    inline vbool operator>=(vfloat a, vfloat b) { return { _mm512_cmp_ps_mask(a.v,b.v,_CMP_GE_OQ) }; }
+    inline vbool operator!=(vfloat a, vfloat b) { return { _mm512_cmp_ps_mask(a.v,b.v,_CMP_NEQ_UQ) }; }
+    inline vbool operator&&(vbool a, vbool b) { return { __mmask16(a.m & b.m) }; }
+    /*! one bit per lane, lane 0 in the lowest bit */
+    inline unsigned movemask(vbool a) { return (unsigned)a.m; }
+
+    /*! returns, per lane, m ? a : b */
+    inline vfloat select(vbool m, vfloat a, vfloat b)
+    { return { _mm512_mask_blend_ps(m.m,b.v,a.v) }; }
+
+    /*! returns the smallest value across all lanes, and (in 'lane')
+        the (lowest) lane that holds that value */
+    inline float reduce_min(vfloat a, int &lane)
+    {
+      const float m = _mm512_reduce_min_ps(a.v);
+      lane = firstSetBit((unsigned)_mm512_cmp_ps_mask(a.v,_mm512_set1_ps(m),_CMP_EQ_OQ));
+      return m;
+    }
+#elif !defined(__CUDA_ARCH__) && defined(__AVX2__)
+    // ==================================================================
+    // AVX2
+    // ==================================================================
+    enum { width = 8 };
+    struct vbool  { __m256 m; };
+    struct vfloat { __m256 v; };
+
+    inline vfloat load(const float *ptr)  { return { _mm256_loadu_ps(ptr) }; }
+    inline void store(float *ptr, vfloat a) { _mm256_storeu_ps(ptr,a.v); }
+    inline vfloat broadcast(float f)      { return { _mm256_set1_ps(f) }; }
+    /*! (0,1,2,...,width-1) */
+    inline vfloat laneIndex()
+    { return { _mm256_setr_ps(0,1,2,3,4,5,6,7) }; }
+
+    inline vfloat operator+(vfloat a, vfloat b) { return { _mm256_add_ps(a.v,b.v) }; }
+    inline vfloat operator-(vfloat a, vfloat b) { return { _mm256_sub_ps(a.v,b.v) }; }
+    inline vfloat operator*(vfloat a, vfloat b) { return { _mm256_mul_ps(a.v,b.v) }; }
+    inline vfloat operator/(vfloat a, vfloat b) { return { _mm256_div_ps(a.v,b.v) }; }
+    inline vfloat min(vfloat a, vfloat b) { return { _mm256_min_ps(a.v,b.v) }; }
+    inline vfloat max(vfloat a, vfloat b) { return { _mm256_max_ps(a.v,b.v) }; }
+
+    inline vbool operator< (vfloat a, vfloat b) { return { _mm256_cmp_ps(a.v,b.v,_CMP_LT_OQ) }; }
+    inline vbool operator<=(vfloat a, vfloat b) { return { _mm256_cmp_ps(a.v,b.v,_CMP_LE_OQ) }; }
+    inline vbool operator>=(vfloat a, vfloat b) { return { _mm256_cmp_ps(a.v,b.v,_CMP_GE_OQ) }; }
+    inline vbool operator!=(vfloat a, vfloat b) { return { _mm256_cmp_ps(a.v,b.v,_CMP_NEQ_UQ) }; }
+    inline vbool operator&&(vbool a, vbool b) { return { _mm256_and_ps(a.m,b.m) }; }
+    /*! one bit per lane, lane 0 in the lowest bit */
+    inline unsigned movemask(vbool a) { return (unsigned)_mm256_movemask_ps(a.m); }
+
+    /*! returns, per lane, m ? a : b */
+    inline vfloat select(vbool m, vfloat a, vfloat b)
+    { return { _mm256_blendv_ps(b.v,a.v,m.m) }; }
+
+    /*! returns the smallest value across all lanes, and (in 'lane')
+        the (lowest) lane that holds that value */
+    inline float reduce_min(vfloat a, int &lane)
+    {
+      __m256 m = _mm256_min_ps(a.v,_mm256_permute2f128_ps(a.v,a.v,0x01));
+      m = _mm256_min_ps(m,_mm256_shuffle_ps(m,m,_MM_SHUFFLE(1,0,3,2)));
+      m = _mm256_min_ps(m,_mm256_shuffle_ps(m,m,_MM_SHUFFLE(2,3,0,1)));
+      lane = firstSetBit((unsigned)_mm256_movemask_ps(_mm256_cmp_ps(a.v,m,_CMP_EQ_OQ)));
+      return _mm256_cvtss_f32(m);
+    }
+#else
+    // ==================================================================
+    // plain C++ fallback
+    // ==================================================================
+    enum { width = 8 };
+    struct vbool  { bool  m[width]; };
+    struct vfloat { float v[width]; };
+
+    inline vfloat load(const float *ptr)
+    { vfloat r; for (int i=0;i<width;i++) r.v[i] = ptr[i]; return r; }
+    inline void store(float *ptr, vfloat a)
+    { for (int i=0;i<width;i++) ptr[i] = a.v[i]; }
+    inline vfloat broadcast(float f)
+    { vfloat r; for (int i=0;i<width;i++) r.v[i] = f; return r; }
+    /*! (0,1,2,...,width-1) */
+    inline vfloat laneIndex()
+    { vfloat r; for (int i=0;i<width;i++) r.v[i] = float(i); return r; }
+
+# define CUBQL_SIMD_BINARY_OP(ret_t,name,expr)                     \
+    inline ret_t name(vfloat a, vfloat b)                           \
+    { ret_t r; for (int i=0;i<width;i++) expr; return r; }
+    CUBQL_SIMD_BINARY_OP(vfloat,operator+,r.v[i] = a.v[i]+b.v[i])
+    CUBQL_SIMD_BINARY_OP(vfloat,operator-,r.v[i] = a.v[i]-b.v[i])
+    CUBQL_SIMD_BINARY_OP(vfloat,operator*,r.v[i] = a.v[i]*b.v[i])
+    CUBQL_SIMD_BINARY_OP(vfloat,operator/,r.v[i] = a.v[i]/b.v[i])
+    CUBQL_SIMD_BINARY_OP(vfloat,min,r.v[i] = std::min(a.v[i],b.v[i]))
+    CUBQL_SIMD_BINARY_OP(vfloat,max,r.v[i] = std::max(a.v[i],b.v[i]))
+    CUBQL_SIMD_BINARY_OP(vbool,operator<, r.m[i] = a.v[i] <  b.v[i])
+    CUBQL_SIMD_BINARY_OP(vbool,operator<=,r.m[i] = a.v[i] <= b.v[i])
+    CUBQL_SIMD_BINARY_OP(vbool,operator>=,r.m[i] = a.v[i] >= b.v[i])
+    CUBQL_SIMD_BINARY_OP(vbool,operator!=,r.m[i] = a.v[i] != b.v[i])
+# undef CUBQL_SIMD_BINARY_OP
+    inline vbool operator&&(vbool a, vbool b)
+    { vbool r; for (int i=0;i<width;i++) r.m[i] = a.m[i] && b.m[i]; return r; }
+    /*! one bit per lane, lane 0 in the lowest bit */
+    inline unsigned movemask(vbool a)
+    { unsigned r = 0; for (int i=0;i<width;i++) r |= unsigned(a.m[i]) << i; return r; }
+
+    /*! returns, per lane, m ? a : b */
+    inline vfloat select(vbool m, vfloat a, vfloat b)
+    { vfloat r; for (int i=0;i<width;i++) r.v[i] = m.m[i] ? a.v[i] : b.v[i]; return r; }
+
+    /*! returns the smallest value across all lanes, and (in 'lane')
+        the (lowest) lane that holds that value */
+    inline float reduce_min(vfloat a, int &lane)
+    {
+      lane = 0;
+      for (int i=1;i<width;i++)
+        if (a.v[i] < a.v[lane]) lane = i;
+      return a.v[lane];
+    }
+#endif
+
+    /*! dot product of two 3D vectors of vfloats */
+    inline vfloat dot(vfloat ax, vfloat ay, vfloat az,
+                      vfloat bx, vfloat by, vfloat bz)
+    { return ax*bx + ay*by + az*bz; }
+
+  } // ::cuBQL::simd
+} // ::cuBQL
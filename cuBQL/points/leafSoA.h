@@ -0,0 +1,168 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+/*! host-side, SIMD-accelerated closest-point queries on point
+    data. Instead of visiting a leaf's points one at a time through
+    bvh.primIDs[], the points get stored in 'leaf order' (ie, slot i
+    holds the point bvh.primIDs[i]) as a struct of arrays, so all
+    points of a leaf are contiguous, and simd::width of them can be
+    evaluated with a few vector instructions, followed by a horizontal
+    min across the lanes. (see cuBQL/math/simd.h for which instruction
+    sets get used.)
+
+    Since one vector step costs about the same as one scalar point
+    test, this works best with leaves that have about simd::width
+    points; consider building the BVH with
+    buildConfig.makeLeafThreshold set to (or slightly below)
+    simd::width */
+#pragma once
+
+#include "cuBQL/bvh.h"
+#include "cuBQL/math/simd.h"
+#include "cuBQL/queries/shrinkingRadiusQuery.h"
+#include "cuBQL/impl/parallel_for.h"
+#include <vector>
+
+namespace cuBQL {
+  namespace points {
+
+    /*! points in leaf order, as struct of arrays; each array gets
+        padded by simd::width, so a vector load starting at any valid
+        slot is always within the array */
+    struct LeafSoA {
+      std::vector<float> x, y, z;
+    };
+
+    namespace host {
+      /*! creates the leaf-order point arrays for the given BVH */
+      inline void buildLeafSoA(LeafSoA     &soa,
+                               const bvh3f  bvh,
+                               const vec3f *dataPoints);
+
+      /*! host-side, SIMD version of points::fcp_excluding() */
+      inline int fcp_excluding(int            primIDtoIgnore,
+                               const vec3f    queryPoint,
+                               const bvh3f    bvh,
+                               const LeafSoA &soa,
+                               float          sqrMaxQueryDist=INFINITY);
+
+      /*! host-side, SIMD version of points::fcp() */
+      inline int fcp(const vec3f    queryPoint,
+                     const bvh3f    bvh,
+                     const LeafSoA &soa,
+                     float          sqrMaxQueryDist=INFINITY);
+
+      /*! runs fcp() for each of the given query points, using host
+          threads; results[i] is the closest point to queryPoints[i],
+          or -1 */
+      inline void fcp(int           *results,
+                      const vec3f   *queryPoints,
+                      int            numQueries,
+                      const bvh3f    bvh,
+                      const LeafSoA &soa,
+                      float          sqrMaxQueryDist=INFINITY);
+    }
+
+    // ==================================================================
+    // implementation
+    // ==================================================================
+
+    namespace host {
+      inline void buildLeafSoA(LeafSoA     &soa,
+                               const bvh3f  bvh,
+                               const vec3f *dataPoints)
+      {
+        const size_t numSlots = bvh.numPrims + simd::width;
+        soa.x.assign(numSlots,0.f);
+        soa.y.assign(numSlots,0.f);
+        soa.z.assign(numSlots,0.f);
+        for (size_t i=0;i<bvh.numPrims;i++) {
+          const vec3f point = dataPoints[bvh.primIDs[i]];
+          soa.x[i] = point.x;
+          soa.y[i] = point.y;
+          soa.z[i] = point.z;
+        }
+      }
+
+      inline int fcp_excluding(int            primIDtoIgnore,
+                               const vec3f    queryPoint,
+                               const bvh3f    bvh,
+                               const LeafSoA &soa,
+                               float          maxQueryDistSquare)
+      {
+        int result = -1;
+        const simd::vfloat qx = simd::broadcast(queryPoint.x);
+        const simd::vfloat qy = simd::broadcast(queryPoint.y);
+        const simd::vfloat qz = simd::broadcast(queryPoint.z);
+        const simd::vfloat inf = simd::broadcast(INFINITY);
+        auto perLeaf = [&](const uint32_t *leafPrims, size_t numPrims)->float {
+          const int leafBegin = int(leafPrims - bvh.primIDs);
+          const int leafEnd   = leafBegin + (int)numPrims;
+          // slot of the excluded prim, if it is in this leaf
+          int ignoreSlot = -1;
+          if (primIDtoIgnore >= 0)
+            for (int i=0;i<(int)numPrims;i++)
+              if ((int)leafPrims[i] == primIDtoIgnore) ignoreSlot = leafBegin+i;
+
+          for (int begin=leafBegin;begin<leafEnd;begin+=simd::width) {
+            const simd::vfloat dx = simd::load(&soa.x[begin]) - qx;
+            const simd::vfloat dy = simd::load(&soa.y[begin]) - qy;
+            const simd::vfloat dz = simd::load(&soa.z[begin]) - qz;
+            simd::vfloat dist2 = dx*dx + dy*dy + dz*dz;
+            // mask out lanes past the end of the leaf, and the
+            // excluded prim (NaNs fail the '<' test, too)
+            const simd::vfloat lane = simd::laneIndex();
+            const simd::vbool valid
+              = (lane < simd::broadcast(float(leafEnd-begin)))
+              && (lane != simd::broadcast(float(ignoreSlot-begin)))
+              && (dist2 < simd::broadcast(maxQueryDistSquare));
+            dist2 = simd::select(valid,dist2,inf);
+            int   minLane;
+            float minDist2 = simd::reduce_min(dist2,minLane);
+            if (minDist2 < maxQueryDistSquare) {
+              maxQueryDistSquare = minDist2;
+              result = bvh.primIDs[begin+minLane];
+            }
+          }
+          return maxQueryDistSquare;
+        };
+        shrinkingRadiusQuery_forEachLeaf(bvh,queryPoint,maxQueryDistSquare,perLeaf);
+        return result;
+      }
+
+      inline int fcp(const vec3f    queryPoint,
+                     const bvh3f    bvh,
+                     const LeafSoA &soa,
+                     float          maxQueryDistSquare)
+      {
+        return fcp_excluding(-1,queryPoint,bvh,soa,maxQueryDistSquare);
+      }
+
+      inline void fcp(int           *results,
+                      const vec3f   *queryPoints,
+                      int            numQueries,
+                      const bvh3f    bvh,
+                      const LeafSoA &soa,
+                      float          sqrMaxQueryDist)
+      {
+        cuBQL::host::parallel_for(numQueries,[&](size_t queryID) {
+          results[queryID] = fcp(queryPoints[queryID],bvh,soa,sqrMaxQueryDist);
+        });
+      }
+    } // ::cuBQL::points::host
+
+  } // ::cuBQL::points
+} // ::cuBQL
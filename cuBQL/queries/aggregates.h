@@ -0,0 +1,387 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+/*! per-node aggregates ("augmented BVH"): for each node of a BVH,
+    stores the aggregate (eg, count, sum, min/max, ...) of some
+    user-provided per-prim value over all prims in that node's
+    subtree. With those, range queries that only want the aggregate
+    over all prims in a range (eg, 'how many prims, and what total
+    weight, are in this box') no longer have to visit every prim in
+    that range: any subtree that is fully contained in the query
+    range can be folded in from its node's aggregate without
+    descending any further.
+
+    An aggregate type agg_t can be any (trivially-copyable) type that
+    provides two static functions
+
+      static __cubql_both agg_t empty();
+      static __cubql_both agg_t combine(const agg_t &a, const agg_t &b);
+
+    where combine() has to be associative and commutative, and
+    empty() has to be the neutral element of combine(). See
+    CountAndSum and MinMax below for examples. */
+#pragma once
+
+#include "cuBQL/queries/rangeQuery.h"
+#include "cuBQL/impl/bottomUp.h"
+
+namespace cuBQL {
+
+  /*! aggregate that counts prims, and sums up a per-prim weight. For
+      each prim, use CountAndSum{1,weight} as its value */
+  struct CountAndSum {
+    uint32_t count;
+    float    sum;
+
+    static inline __cubql_both CountAndSum empty()
+    { return { 0u, 0.f }; }
+    static inline __cubql_both CountAndSum combine(const CountAndSum &a,
+                                                   const CountAndSum &b)
+    { return { a.count+b.count, a.sum+b.sum }; }
+  };
+
+  /*! aggregate that tracks the min and max of a per-prim
+      value. For each prim, use MinMax{value,value} as its value */
+  struct MinMax {
+    float lower;
+    float upper;
+
+    static inline __cubql_both MinMax empty()
+    { return { +INFINITY, -INFINITY }; }
+    static inline __cubql_both MinMax combine(const MinMax &a,
+                                              const MinMax &b)
+    { return { min(a.lower,b.lower), max(a.upper,b.upper) }; }
+  };
+
+#ifdef __CUDACC__
+  /*! computes, for each node of the BVH, the aggregate of the
+      primValues[] of all prims in that node's subtree, and writes
+      those into nodeAggregates[] (which must have bvh.numNodes
+      entries). This runs bottom-up on the GPU, using the same
+      bottom-up pass as refit() (see impl/bottomUp.h); all arrays
+      must be device-accessible. Does not sync. */
+  template<typename agg_t, typename T, int D>
+  void computeAggregates(agg_t               *nodeAggregates,
+                         const BinaryBVH<T,D> bvh,
+                         const agg_t         *primValues,
+                         cudaStream_t         s=0,
+                         GpuMemoryResource   &memResource=defaultGpuMemResource());
+
+  /*! same as refit(), but also re-computes the per-node aggregates in
+      the same bottom-up pass; use this if both the prims' boxes and
+      their values have changed */
+  template<typename agg_t, typename T, int D>
+  void refit(BinaryBVH<T,D>      &bvh,
+             const box_t<T,D>    *boxes,
+             agg_t               *nodeAggregates,
+             const agg_t         *primValues,
+             cudaStream_t         s=0,
+             GpuMemoryResource   &memResource=defaultGpuMemResource());
+#endif
+
+  /*! returns the aggregate of primValues[] over all prims within the
+      given query range (a box_t<T,D> or a ball_t<T,D>, see
+      rangeQuery.h); prims can be points (vec_t<T,D>) or boxes
+      (box_t<T,D>), with the same in-range semantics as
+      rangeQuery_forEachPrim(). Subtrees whose bounds are fully inside
+      the query range are folded in from nodeAggregates[] without
+      descending into them. */
+  template<typename agg_t, typename query_t, typename prim_t, typename T, int D>
+  inline __cubql_both
+  agg_t aggregateQuery(const BinaryBVH<T,D> bvh,
+                       const agg_t         *nodeAggregates,
+                       const agg_t         *primValues,
+                       const prim_t        *prims,
+                       const query_t       &queryRange);
+
+#ifdef __CUDACC__
+  /*! batched version of aggregateQuery(), with one GPU thread per
+      query; results[i] is the aggregate for queries[i]. Does not
+      sync. */
+  template<typename agg_t, typename query_t, typename prim_t, typename T, int D>
+  void aggregateQuery(agg_t               *results,
+                      const query_t       *queries,
+                      int                  numQueries,
+                      const BinaryBVH<T,D> bvh,
+                      const agg_t         *nodeAggregates,
+                      const agg_t         *primValues,
+                      const prim_t        *prims,
+                      cudaStream_t         s=0);
+#endif
+
+  namespace host {
+    /*! host-side equivalent of cuBQL::computeAggregates(); all
+        arrays must be host-readable */
+    template<typename agg_t, typename T, int D>
+    void computeAggregates(agg_t               *nodeAggregates,
+                           const BinaryBVH<T,D> bvh,
+                           const agg_t         *primValues);
+
+    /*! host-side equivalent of the batched cuBQL::aggregateQuery(),
+        using host threads */
+    template<typename agg_t, typename query_t, typename prim_t, typename T, int D>
+    void aggregateQuery(agg_t               *results,
+                        const query_t       *queries,
+                        int                  numQueries,
+                        const BinaryBVH<T,D> bvh,
+                        const agg_t         *nodeAggregates,
+                        const agg_t         *primValues,
+                        const prim_t        *prims);
+  }
+
+
+  // ==================================================================
+  // IMPLEMENTATION
+  // ==================================================================
+
+  namespace aggregates_impl {
+    /*! @{ is the given box fully inside the given query range? */
+    template<typename T, int D> inline __cubql_both
+    bool contains(const box_t<T,D> &query, const box_t<T,D> &box)
+    {
+      return !(any_less_than(box.lower,query.lower)
+               || any_less_than(query.upper,box.upper));
+    }
+    template<typename T, int D> inline __cubql_both
+    bool contains(const ball_t<T,D> &query, const box_t<T,D> &box)
+    {
+      // square distance to the box' corner that is furthest away
+      float sqrDist = 0.f;
+      CUBQL_PRAGMA_UNROLL
+        for (int i=0;i<D;i++) {
+          float d = max(fabsf(float(box.get_lower(i)-query.center[i])),
+                        fabsf(float(box.get_upper(i)-query.center[i])));
+          sqrDist += d*d;
+        }
+      return sqrDist <= query.radius*query.radius;
+    }
+    /*! @} */
+  } // ::cuBQL::aggregates_impl
+
+  template<typename agg_t, typename query_t, typename prim_t, typename T, int D>
+  inline __cubql_both
+  agg_t aggregateQuery(const BinaryBVH<T,D> bvh,
+                       const agg_t         *nodeAggregates,
+                       const agg_t         *primValues,
+                       const prim_t        *prims,
+                       const query_t       &queryRange)
+  {
+    agg_t result = agg_t::empty();
+    if (bvh.numNodes == 0) return result;
+
+    const int stackSize = 64;
+    uint32_t traversalStack[stackSize], *stackPtr = traversalStack;
+    uint32_t nodeID = 0;
+    while (true) {
+      const typename BinaryBVH<T,D>::Node node = bvh.nodes[nodeID];
+      if (!rangeQuery_impl::overlaps(queryRange,node.bounds)) {
+        // subtree completely outside - skip
+      } else if (aggregates_impl::contains(queryRange,node.bounds)) {
+        // subtree completely inside - fold in without descending
+        result = agg_t::combine(result,nodeAggregates[nodeID]);
+      } else if (node.admin.count != 0) {
+        // leaf that only partially overlaps: test each prim
+        for (int i=0;i<(int)node.admin.count;i++) {
+          const uint32_t primID = bvh.primIDs[node.admin.offset+i];
+          if (rangeQuery_impl::inRange(queryRange,prims[primID]))
+            result = agg_t::combine(result,primValues[primID]);
+        }
+      } else {
+        if (stackPtr >= traversalStack+stackSize) {
+          // printf("stack overflow\n");
+          return result;
+        }
+        *stackPtr++ = node.admin.offset+1;
+        nodeID = node.admin.offset+0;
+        continue;
+      }
+      if (stackPtr == traversalStack)
+        return result;
+      nodeID = *--stackPtr;
+    }
+  }
+
+#ifdef __CUDACC__
+  namespace aggregates_impl {
+    /*! bottomUp_impl op that computes the per-node aggregates; if
+        boxes is non-null, the nodes' bounds get re-computed as well
+        (ie, this also does what refit() does) */
+    template<typename agg_t, typename T, int D>
+    struct ComputeAggregatesOp {
+      inline __device__ void leaf(uint32_t nodeID) const
+      {
+        typename BinaryBVH<T,D>::Node &node = bvh.nodes[nodeID];
+        box_t<T,D> bounds; bounds.set_empty();
+        agg_t      agg = agg_t::empty();
+        for (int i=0;i<(int)node.admin.count;i++) {
+          const uint32_t primID = bvh.primIDs[node.admin.offset+i];
+          agg = agg_t::combine(agg,primValues[primID]);
+          if (boxes) bounds.grow(boxes[primID]);
+        }
+        nodeAggregates[nodeID] = agg;
+        if (boxes) node.bounds = bounds;
+      }
+      inline __device__ void inner(uint32_t nodeID) const
+      {
+        typename BinaryBVH<T,D>::Node &node = bvh.nodes[nodeID];
+        const uint32_t c0 = node.admin.offset+0;
+        const uint32_t c1 = node.admin.offset+1;
+        nodeAggregates[nodeID] = agg_t::combine(nodeAggregates[c0],nodeAggregates[c1]);
+        if (boxes) {
+          box_t<T,D> bounds = bvh.nodes[c0].bounds;
+          bounds.grow(bvh.nodes[c1].bounds);
+          node.bounds = bounds;
+        }
+      }
+
+      BinaryBVH<T,D>    bvh;
+      const box_t<T,D> *boxes;
+      agg_t            *nodeAggregates;
+      const agg_t      *primValues;
+    };
+
+    /*! node 1 is unused, but should still have a well-defined value */
+    template<typename agg_t>
+    __global__
+    void clearUnusedNode(agg_t *nodeAggregates)
+    {
+      nodeAggregates[1] = agg_t::empty();
+    }
+
+    template<typename agg_t, typename T, int D>
+    void computeBottomUp(BinaryBVH<T,D>     bvh,
+                         const box_t<T,D>  *boxes,
+                         agg_t             *nodeAggregates,
+                         const agg_t       *primValues,
+                         cudaStream_t       s,
+                         GpuMemoryResource &memResource)
+    {
+      if (bvh.numNodes > 1)
+        clearUnusedNode<<<1,1,0,s>>>(nodeAggregates);
+      bottomUp_impl::bottomUp
+        (bvh,ComputeAggregatesOp<agg_t,T,D>{ bvh,boxes,nodeAggregates,primValues },
+         s,memResource);
+    }
+
+    template<typename agg_t, typename query_t, typename prim_t, typename T, int D>
+    __global__
+    void aggregateQuery(agg_t               *results,
+                        const query_t       *queries,
+                        int                  numQueries,
+                        const BinaryBVH<T,D> bvh,
+                        const agg_t         *nodeAggregates,
+                        const agg_t         *primValues,
+                        const prim_t        *prims)
+    {
+      const int tid = threadIdx.x+blockIdx.x*blockDim.x;
+      if (tid >= numQueries) return;
+      results[tid] = cuBQL::aggregateQuery(bvh,nodeAggregates,primValues,prims,queries[tid]);
+    }
+  } // ::cuBQL::aggregates_impl
+
+  template<typename agg_t, typename T, int D>
+  void computeAggregates(agg_t               *nodeAggregates,
+                         const BinaryBVH<T,D> bvh,
+                         const agg_t         *primValues,
+                         cudaStream_t         s,
+                         GpuMemoryResource   &memResource)
+  {
+    aggregates_impl::computeBottomUp(bvh,(const box_t<T,D>*)0,
+                                     nodeAggregates,primValues,s,memResource);
+    // we're not syncing here - let APP do that
+  }
+
+  template<typename agg_t, typename T, int D>
+  void refit(BinaryBVH<T,D>      &bvh,
+             const box_t<T,D>    *boxes,
+             agg_t               *nodeAggregates,
+             const agg_t         *primValues,
+             cudaStream_t         s,
+             GpuMemoryResource   &memResource)
+  {
+    aggregates_impl::computeBottomUp(bvh,boxes,nodeAggregates,primValues,s,memResource);
+    // we're not syncing here - let APP do that
+  }
+
+  template<typename agg_t, typename query_t, typename prim_t, typename T, int D>
+  void aggregateQuery(agg_t               *results,
+                      const query_t       *queries,
+                      int                  numQueries,
+                      const BinaryBVH<T,D> bvh,
+                      const agg_t         *nodeAggregates,
+                      const agg_t         *primValues,
+                      const prim_t        *prims,
+                      cudaStream_t         s)
+  {
+    if (numQueries <= 0) return;
+    aggregates_impl::aggregateQuery<<<divRoundUp(numQueries,128),128,0,s>>>
+      (results,queries,numQueries,bvh,nodeAggregates,primValues,prims);
+    // we're not syncing here - let APP do that
+  }
+#endif
+
+  namespace host {
+    template<typename agg_t, typename T, int D>
+    void computeAggregates(agg_t               *nodeAggregates,
+                           const BinaryBVH<T,D> bvh,
+                           const agg_t         *primValues)
+    {
+      if (bvh.numNodes == 0) return;
+      if (bvh.numNodes > 1)
+        nodeAggregates[1] = agg_t::empty();
+      /* iterative post-order traversal: each node gets pushed twice,
+         once on the way down (lowest bit 0) and once to compute it
+         after both its children are done (lowest bit 1) */
+      std::vector<uint64_t> stack;
+      stack.push_back(0);
+      while (!stack.empty()) {
+        const uint64_t top    = stack.back(); stack.pop_back();
+        const uint32_t nodeID = uint32_t(top >> 1);
+        const typename BinaryBVH<T,D>::Node::Admin node = bvh.nodes[nodeID].admin;
+        if (node.count != 0) {
+          agg_t agg = agg_t::empty();
+          for (int i=0;i<(int)node.count;i++)
+            agg = agg_t::combine(agg,primValues[bvh.primIDs[node.offset+i]]);
+          nodeAggregates[nodeID] = agg;
+        } else if (top & 1) {
+          nodeAggregates[nodeID]
+            = agg_t::combine(nodeAggregates[node.offset+0],
+                             nodeAggregates[node.offset+1]);
+        } else {
+          stack.push_back(top | 1);
+          stack.push_back(uint64_t(node.offset+0) << 1);
+          stack.push_back(uint64_t(node.offset+1) << 1);
+        }
+      }
+    }
+
+    template<typename agg_t, typename query_t, typename prim_t, typename T, int D>
+    void aggregateQuery(agg_t               *results,
+                        const query_t       *queries,
+                        int                  numQueries,
+                        const BinaryBVH<T,D> bvh,
+                        const agg_t         *nodeAggregates,
+                        const agg_t         *primValues,
+                        const prim_t        *prims)
+    {
+      parallel_for(numQueries,[&](size_t queryID) {
+        results[queryID]
+          = cuBQL::aggregateQuery(bvh,nodeAggregates,primValues,prims,queries[queryID]);
+      });
+    }
+  } // ::cuBQL::host
+
+} // ::cuBQL
@@ -0,0 +1,142 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+/*! 'is there any primitive within radius r' predicate queries; unlike
+    fcp() or knn() these do not care *which* prim is closest, and
+    terminate traversal as soon as the first qualifying prim is
+    found */
+#pragma once
+
+#include "cuBQL/queries/rangeQuery.h"
+
+namespace cuBQL {
+
+  /*! returns true if there is any primitive (points, ie vec_t<T,D>,
+      or boxes, ie box_t<T,D>) within (square) distance
+      sqrMaxDist of the query point for which
+      predicate(primID) returns true; traversal terminates at the
+      first such primitive. The predicate can be used to exclude
+      certain prims (eg, the query point itself, or prims of the same
+      object); it should have a signature of
+      [](uint32_t primID)->bool */
+  template<typename prim_t, typename T, int D, typename Predicate>
+  inline __cubql_both
+  bool anyWithin(const BinaryBVH<T,D> bvh,
+                 const prim_t        *prims,
+                 const vec_t<T,D>     queryPoint,
+                 float                sqrMaxDist,
+                 const Predicate     &predicate);
+
+  /*! same as above, but without a predicate - ie, returns true if
+      there's any prim at all within the given distance */
+  template<typename prim_t, typename T, int D>
+  inline __cubql_both
+  bool anyWithin(const BinaryBVH<T,D> bvh,
+                 const prim_t        *prims,
+                 const vec_t<T,D>     queryPoint,
+                 float                sqrMaxDist);
+
+  namespace host {
+    /*! batched host-side variant of cuBQL::anyWithin(): for each
+        queryPoints[i], writes into results[i] whether there's any
+        prim within sqrMaxDist of it that fulfills the given
+        predicate. Uses host threads; all arrays must be
+        host-readable. */
+    template<typename prim_t, typename T, int D, typename Predicate>
+    void anyWithin(bool                *results,
+                   const vec_t<T,D>    *queryPoints,
+                   int                  numQueries,
+                   float                sqrMaxDist,
+                   const BinaryBVH<T,D> bvh,
+                   const prim_t        *prims,
+                   const Predicate     &predicate);
+
+    template<typename prim_t, typename T, int D>
+    void anyWithin(bool                *results,
+                   const vec_t<T,D>    *queryPoints,
+                   int                  numQueries,
+                   float                sqrMaxDist,
+                   const BinaryBVH<T,D> bvh,
+                   const prim_t        *prims);
+  }
+
+
+  // ==================================================================
+  // IMPLEMENTATION
+  // ==================================================================
+
+  template<typename prim_t, typename T, int D, typename Predicate>
+  inline __cubql_both
+  bool anyWithin(const BinaryBVH<T,D> bvh,
+                 const prim_t        *prims,
+                 const vec_t<T,D>     queryPoint,
+                 float                sqrMaxDist,
+                 const Predicate     &predicate)
+  {
+    const sqrBall_t<T,D> queryBall{ queryPoint, sqrMaxDist };
+    bool found = false;
+    rangeQuery_forEachPrim(bvh,prims,queryBall,
+                           [&found,&predicate](uint32_t primID)->int
+                           {
+                             if (!predicate(primID))
+                               return CUBQL_CONTINUE_TRAVERSAL;
+                             found = true;
+                             return CUBQL_TERMINATE_TRAVERSAL;
+                           });
+    return found;
+  }
+
+  template<typename prim_t, typename T, int D>
+  inline __cubql_both
+  bool anyWithin(const BinaryBVH<T,D> bvh,
+                 const prim_t        *prims,
+                 const vec_t<T,D>     queryPoint,
+                 float                sqrMaxDist)
+  {
+    return anyWithin(bvh,prims,queryPoint,sqrMaxDist,
+                     [](uint32_t)->bool { return true; });
+  }
+
+  namespace host {
+    template<typename prim_t, typename T, int D, typename Predicate>
+    void anyWithin(bool                *results,
+                   const vec_t<T,D>    *queryPoints,
+                   int                  numQueries,
+                   float                sqrMaxDist,
+                   const BinaryBVH<T,D> bvh,
+                   const prim_t        *prims,
+                   const Predicate     &predicate)
+    {
+      parallel_for(numQueries,[&](size_t queryID) {
+        results[queryID]
+          = cuBQL::anyWithin(bvh,prims,queryPoints[queryID],sqrMaxDist,predicate);
+      });
+    }
+
+    template<typename prim_t, typename T, int D>
+    void anyWithin(bool                *results,
+                   const vec_t<T,D>    *queryPoints,
+                   int                  numQueries,
+                   float                sqrMaxDist,
+                   const BinaryBVH<T,D> bvh,
+                   const prim_t        *prims)
+    {
+      host::anyWithin(results,queryPoints,numQueries,sqrMaxDist,bvh,prims,
+                      [](uint32_t)->bool { return true; });
+    }
+  } // ::cuBQL::host
+
+} // ::cuBQL
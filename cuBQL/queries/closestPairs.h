@@ -0,0 +1,353 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+/*! closest-pair queries between two sets of primitives (points or
+    boxes) that each have their own BVH, built on top of the
+    dual-tree traversal in dualTreeQuery.h */
+#pragma once
+
+#include "cuBQL/queries/dualTreeQuery.h"
+#include "cuBQL/impl/parallel_for.h"
+
+namespace cuBQL {
+
+  /*! result of a closest-pair query: the pair of primitives (one from
+      set A, one from set B) that are closest to each other, and
+      their square distance. primA and primB will be -1 if no pair
+      could be found within the initial query radius passed to
+      clear() */
+  struct ClosestPairResult {
+    inline __cubql_both void clear(float maxDistSqr)
+    { primA = -1; primB = -1; sqrDistance = maxDistSqr; }
+
+    int   primA;
+    int   primB;
+    float sqrDistance;
+  };
+
+  /*! finds the (single) closest pair of primitives between set A
+      and set B. 'result' should have been cleared via
+      result.clear(maxSearchDistSquared) before calling this; only
+      pairs closer than this will be reported. prim types can be
+      vec_t<T,D> (points) or box_t<T,D> (boxes), in any
+      combination. This is a single-threaded function that can be
+      called on either host or device. */
+  template<typename primA_t, typename primB_t, typename T, int D>
+  inline __cubql_both
+  void closestPair(ClosestPairResult   &result,
+                   const BinaryBVH<T,D> bvhA,
+                   const primA_t       *primsA,
+                   const BinaryBVH<T,D> bvhB,
+                   const primB_t       *primsB);
+
+  /*! for each of the primitives in the subtree of bvhA rooted in
+      node 'subtreeOfA', finds the closest primitive in set B, and
+      stores that in resultsForEachPrimInA[primID]. This is a
+      simultaneous dual-tree descent from (subtreeOfA,root of bvhB):
+      a node of A gets culled against a node of B only if it cannot
+      contain a closer pair for _any_ of the prims in A's subtree, so
+      the upper parts of bvhB get traversed once per subtree of A,
+      not once per primitive. Calling this with subtreeOfA=0 handles
+      all of A in one traversal.
+
+      To track those per-node cull distances, sqrNodeCullDistsOfA[]
+      needs one entry per node of bvhA, each of which has to be
+      initialized to an upper bound of the results of all prims in
+      that node's subtree (usually, the same maximum search distance
+      that resultsForEachPrimInA[] got cleared to). Only entries of
+      nodes within the given subtree get read or written, so
+      different threads can process disjoint subtrees of A in
+      parallel. */
+  template<typename primA_t, typename primB_t, typename T, int D>
+  inline __cubql_both
+  void closestPairs_forSubtreeOfA(ClosestPairResult   *resultsForEachPrimInA,
+                                  float               *sqrNodeCullDistsOfA,
+                                  uint32_t             subtreeOfA,
+                                  const BinaryBVH<T,D> bvhA,
+                                  const primA_t       *primsA,
+                                  const BinaryBVH<T,D> bvhB,
+                                  const primB_t       *primsB);
+
+#ifdef __CUDACC__
+  /*! for each primitive in set A, finds the closest primitive in set
+      B (up to the given maximum square search distance), and writes
+      that into resultsForEachPrimInA[primID]. Runs on the GPU: the
+      top levels of bvhA get split into (roughly 32-prim) subtrees,
+      each of which then gets handled by one thread via
+      closestPairs_forSubtreeOfA(). All arrays must be device-readable,
+      and resultsForEachPrimInA[] must have bvhA.numPrims entries; the
+      per-node cull distances get allocated through the given memory
+      resource. This function does NOT sync; the app has to do that
+      before reading the results. */
+  template<typename primA_t, typename primB_t, typename T, int D>
+  void allClosestPairs(ClosestPairResult   *resultsForEachPrimInA,
+                       float                sqrMaxSearchDist,
+                       const BinaryBVH<T,D> bvhA,
+                       const primA_t       *primsA,
+                       const BinaryBVH<T,D> bvhB,
+                       const primB_t       *primsB,
+                       cudaStream_t         s=0,
+                       GpuMemoryResource   &memResource=defaultGpuMemResource());
+#endif
+
+  namespace host {
+    /*! host-side equivalent of cuBQL::allClosestPairs(), using host
+        threads (with fewer, larger subtrees of A per thread); all
+        arrays must be host-readable (host or managed memory) */
+    template<typename primA_t, typename primB_t, typename T, int D>
+    void allClosestPairs(ClosestPairResult   *resultsForEachPrimInA,
+                         float                sqrMaxSearchDist,
+                         const BinaryBVH<T,D> bvhA,
+                         const primA_t       *primsA,
+                         const BinaryBVH<T,D> bvhB,
+                         const primB_t       *primsB);
+  }
+
+
+  // ==================================================================
+  // IMPLEMENTATION
+  // ==================================================================
+
+  namespace closestPairs_impl {
+    /*! @{ (square) distance between two primitives of different
+        types; always computed in float */
+    template<typename T, int D> inline __cubql_both
+    float primSqrDistance(const vec_t<T,D> &a, const vec_t<T,D> &b)
+    { return fSqrDistance(a,b); }
+    template<typename T, int D> inline __cubql_both
+    float primSqrDistance(const box_t<T,D> &a, const box_t<T,D> &b)
+    { return fSqrDistance(a,b); }
+    template<typename T, int D> inline __cubql_both
+    float primSqrDistance(const box_t<T,D> &a, const vec_t<T,D> &b)
+    { return fSqrDistance(a,b); }
+    template<typename T, int D> inline __cubql_both
+    float primSqrDistance(const vec_t<T,D> &a, const box_t<T,D> &b)
+    { return fSqrDistance(b,a); }
+    /*! @} */
+
+    /*! the subtree of bvhA that task 'taskID' (out of
+        1<<taskDepth tasks) is responsible for: the node reached by
+        following taskID's bits (from the top) down from the root. If
+        that path hits a leaf above taskDepth only the first of the
+        tasks below that leaf handles it; all others return -1 */
+    template<typename T, int D>
+    inline __cubql_both
+    int subtreeOfTask(const BinaryBVH<T,D> bvhA, uint32_t taskID, int taskDepth)
+    {
+      uint32_t nodeID = 0;
+      for (int level=0;level<taskDepth;level++) {
+        const typename BinaryBVH<T,D>::Node::Admin admin = bvhA.nodes[nodeID].admin;
+        const int bit = taskDepth-1-level;
+        if (admin.count != 0)
+          return (taskID & ((2u << bit)-1)) == 0 ? (int)nodeID : -1;
+        nodeID = admin.offset + ((taskID >> bit) & 1);
+      }
+      return (int)nodeID;
+    }
+
+    /*! number of levels of bvhA to split into separate tasks, such
+        that each task gets (for a balanced tree) about primsPerTask
+        prims */
+    inline int taskDepthFor(uint32_t numPrims, uint32_t primsPerTask)
+    {
+      int depth = 0;
+      while (depth < 24 && (uint64_t(primsPerTask) << depth) < numPrims)
+        depth++;
+      return depth;
+    }
+  } // ::cuBQL::closestPairs_impl
+
+  template<typename primA_t, typename primB_t, typename T, int D>
+  inline __cubql_both
+  void closestPair(ClosestPairResult   &result,
+                   const BinaryBVH<T,D> bvhA,
+                   const primA_t       *primsA,
+                   const BinaryBVH<T,D> bvhB,
+                   const primB_t       *primsB)
+  {
+    auto leafPairCode
+      = [&result,primsA,primsB](const uint32_t *leafPrimsA, int numPrimsA,
+                                const uint32_t *leafPrimsB, int numPrimsB)->float
+      {
+        for (int i=0;i<numPrimsA;i++) {
+          const uint32_t primA = leafPrimsA[i];
+          const primA_t  a     = primsA[primA];
+          for (int j=0;j<numPrimsB;j++) {
+            const uint32_t primB = leafPrimsB[j];
+            float dist2 = closestPairs_impl::primSqrDistance(a,primsB[primB]);
+            if (dist2 >= result.sqrDistance) continue;
+            result.primA       = primA;
+            result.primB       = primB;
+            result.sqrDistance = dist2;
+          }
+        }
+        return result.sqrDistance;
+      };
+    dualTreeQuery_forEachLeafPair(bvhA,0,bvhB,0,result.sqrDistance,leafPairCode);
+  }
+
+  template<typename primA_t, typename primB_t, typename T, int D>
+  inline __cubql_both
+  void closestPairs_forSubtreeOfA(ClosestPairResult   *results,
+                                  float               *sqrNodeCullDists,
+                                  uint32_t             subtreeOfA,
+                                  const BinaryBVH<T,D> bvhA,
+                                  const primA_t       *primsA,
+                                  const BinaryBVH<T,D> bvhB,
+                                  const primB_t       *primsB)
+  {
+    /* a node's cull distance is the max of its prims' current
+       results; for inner nodes we refresh it from the children
+       whenever it gets asked for. Children's values can be stale
+       (too large) themselves, but never too small, so this is always
+       conservative, and gets tighter the more often a node gets
+       visited */
+    auto sqrCullDistOfNodeA
+      = [sqrNodeCullDists,bvhA](uint32_t nodeID)->float
+      {
+        const typename BinaryBVH<T,D>::Node::Admin admin = bvhA.nodes[nodeID].admin;
+        if (admin.count == 0)
+          sqrNodeCullDists[nodeID] = max(sqrNodeCullDists[admin.offset+0],
+                                         sqrNodeCullDists[admin.offset+1]);
+        return sqrNodeCullDists[nodeID];
+      };
+    auto leafPairCode
+      = [results,sqrNodeCullDists,bvhA,primsA,bvhB,primsB](uint32_t leafA, uint32_t leafB)->bool
+      {
+        const typename BinaryBVH<T,D>::Node::Admin a = bvhA.nodes[leafA].admin;
+        const typename BinaryBVH<T,D>::Node::Admin b = bvhB.nodes[leafB].admin;
+        float leafResult = 0.f;
+        for (int i=0;i<(int)a.count;i++) {
+          const uint32_t     primA  = bvhA.primIDs[a.offset+i];
+          const primA_t      pa     = primsA[primA];
+          ClosestPairResult &result = results[primA];
+          for (int j=0;j<(int)b.count;j++) {
+            const uint32_t primB = bvhB.primIDs[b.offset+j];
+            float dist2 = closestPairs_impl::primSqrDistance(pa,primsB[primB]);
+            if (dist2 >= result.sqrDistance) continue;
+            result.primB       = primB;
+            result.sqrDistance = dist2;
+          }
+          leafResult = max(leafResult,result.sqrDistance);
+        }
+        sqrNodeCullDists[leafA] = leafResult;
+        return true;
+      };
+    dualTreeQuery_forEachLeafPair_perNodeA(bvhA,subtreeOfA,bvhB,0,
+                                           sqrCullDistOfNodeA,leafPairCode);
+  }
+
+#ifdef __CUDACC__
+  namespace closestPairs_impl {
+    template<typename result_t>
+    __global__
+    void clearResults(result_t *results, int numResults, float sqrMaxSearchDist)
+    {
+      const int tid = threadIdx.x+blockIdx.x*blockDim.x;
+      if (tid >= numResults) return;
+      results[tid].clear(sqrMaxSearchDist);
+      results[tid].primA = tid;
+    }
+
+    template<typename scalar_t>
+    __global__
+    void clearCullDists(scalar_t *sqrNodeCullDists, int numNodes, scalar_t sqrMaxSearchDist)
+    {
+      const int tid = threadIdx.x+blockIdx.x*blockDim.x;
+      if (tid >= numNodes) return;
+      sqrNodeCullDists[tid] = sqrMaxSearchDist;
+    }
+
+    template<typename primA_t, typename primB_t, typename T, int D>
+    __global__
+    void allClosestPairs(ClosestPairResult   *results,
+                         float               *sqrNodeCullDists,
+                         int                  taskDepth,
+                         const BinaryBVH<T,D> bvhA,
+                         const primA_t       *primsA,
+                         const BinaryBVH<T,D> bvhB,
+                         const primB_t       *primsB)
+    {
+      const int taskID = threadIdx.x+blockIdx.x*blockDim.x;
+      if (taskID >= (1<<taskDepth)) return;
+      const int subtree = subtreeOfTask(bvhA,taskID,taskDepth);
+      if (subtree < 0) return;
+      closestPairs_forSubtreeOfA(results,sqrNodeCullDists,subtree,
+                                 bvhA,primsA,bvhB,primsB);
+    }
+  } // ::cuBQL::closestPairs_impl
+
+  template<typename primA_t, typename primB_t, typename T, int D>
+  void allClosestPairs(ClosestPairResult   *resultsForEachPrimInA,
+                       float                sqrMaxSearchDist,
+                       const BinaryBVH<T,D> bvhA,
+                       const primA_t       *primsA,
+                       const BinaryBVH<T,D> bvhB,
+                       const primB_t       *primsB,
+                       cudaStream_t         s,
+                       GpuMemoryResource   &memResource)
+  {
+    const int numPrims = (int)bvhA.numPrims;
+    const int numNodes = (int)bvhA.numNodes;
+    if (numPrims == 0) return;
+    float *sqrNodeCullDists = 0;
+    CUBQL_CUDA_CHECK(memResource.malloc((void**)&sqrNodeCullDists,
+                                        numNodes*sizeof(float),s));
+    closestPairs_impl::clearResults<<<divRoundUp(numPrims,1024),1024,0,s>>>
+      (resultsForEachPrimInA,numPrims,sqrMaxSearchDist);
+    closestPairs_impl::clearCullDists<<<divRoundUp(numNodes,1024),1024,0,s>>>
+      (sqrNodeCullDists,numNodes,sqrMaxSearchDist);
+    const int taskDepth = closestPairs_impl::taskDepthFor(numPrims,32);
+    const int numTasks  = 1<<taskDepth;
+    closestPairs_impl::allClosestPairs<<<divRoundUp(numTasks,128),128,0,s>>>
+      (resultsForEachPrimInA,sqrNodeCullDists,taskDepth,bvhA,primsA,bvhB,primsB);
+    CUBQL_CUDA_CHECK(memResource.free(sqrNodeCullDists,s));
+    // we're not syncing here - let APP do that
+  }
+#endif
+
+  namespace host {
+    template<typename primA_t, typename primB_t, typename T, int D>
+    void allClosestPairs(ClosestPairResult   *resultsForEachPrimInA,
+                         float                sqrMaxSearchDist,
+                         const BinaryBVH<T,D> bvhA,
+                         const primA_t       *primsA,
+                         const BinaryBVH<T,D> bvhB,
+                         const primB_t       *primsB)
+    {
+      for (int i=0;i<(int)bvhA.numPrims;i++) {
+        resultsForEachPrimInA[i].clear(sqrMaxSearchDist);
+        resultsForEachPrimInA[i].primA = i;
+      }
+      if (bvhA.numPrims == 0) return;
+      std::vector<float> sqrNodeCullDists(bvhA.numNodes,sqrMaxSearchDist);
+      const int taskDepth = closestPairs_impl::taskDepthFor(bvhA.numPrims,1024);
+      parallel_for
+        (size_t(1)<<taskDepth,
+         [&](size_t taskID) {
+           const int subtree
+             = closestPairs_impl::subtreeOfTask(bvhA,(uint32_t)taskID,taskDepth);
+           if (subtree < 0) return;
+           closestPairs_forSubtreeOfA(resultsForEachPrimInA,sqrNodeCullDists.data(),
+                                      (uint32_t)subtree,bvhA,primsA,bvhB,primsB);
+         },
+         /* each task is an entire subtree of ~1024 prims, so hand
+            them out one at a time */
+         1);
+    }
+  } // ::cuBQL::host
+
+} // ::cuBQL
@@ -0,0 +1,25 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+/*! definitions shared by the different query kernels; kept separate
+    (and free of any device-only includes) so that host-side queries
+    can use them, too */
+#pragma once
+
+/*! return values for per-prim or per-leaf query callbacks that can
+    end traversal early */
+#define CUBQL_TERMINATE_TRAVERSAL 1
+#define CUBQL_CONTINUE_TRAVERSAL  0
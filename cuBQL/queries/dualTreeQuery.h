@@ -0,0 +1,256 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+#include "cuBQL/bvh.h"
+
+namespace cuBQL {
+
+  /*! performs a 'shrinking radius' dual-tree traversal over two
+      BVHes (which may or may not be the same BVH): starting with the
+      pair of nodes (rootA,rootB), this traversal walks pairs of nodes
+      - one from each tree - and iterates through all pairs of leaves
+      whose bounding boxes are within a given (square) distance of
+      each other. For each such leaf pair it calls the provided
+      lambda, which gets passed the primIDs of both leaves, and which
+      then returns a new (square) cull distance; as with
+      shrinkingRadiusQuery_forEachLeaf this cull distance can only
+      ever be *shrunk* during traversal, and a negative return value
+      will terminate traversal. Node pairs whose (square) box-box
+      distance is larger than the current cull distance will be
+      skipped, so pairs of overlapping nodes will always be visited
+      even for a cull distance of 0.
+
+      When splitting a pair of inner nodes the traversal always
+      descends into the 'larger' of the two nodes (as measured by
+      the sum of its box' edge lengths), and always visits the closer
+      of the two resulting child pairs first.
+
+      The traversal stack holds 128 node pairs, which suffices as long
+      as the sum of the two subtrees' depths stays below that; since
+      every down-step pushes at most one pair and makes one of the two
+      nodes deeper, that is the worst case. Overflowing it is caught
+      by an assert() in debug builds; with NDEBUG it terminates the
+      traversal, so some leaf pairs would not be visited.
+
+      the lambda should have a signature of
+      [](const uint32_t *leafPrimsA, int numPrimsA,
+         const uint32_t *leafPrimsB, int numPrimsB)->float
+  */
+  template<typename T, int D, typename Lambda>
+  inline __cubql_both
+  void dualTreeQuery_forEachLeafPair(const BinaryBVH<T,D> bvhA,
+                                     uint32_t             rootA,
+                                     const BinaryBVH<T,D> bvhB,
+                                     uint32_t             rootB,
+                                     float                sqrMaxSearchDist,
+                                     const Lambda        &lambdaToExecuteForEachLeafPair);
+
+  /*! the same dual-tree traversal as dualTreeQuery_forEachLeafPair,
+      but with a cull distance that depends on the node of tree A: a
+      pair of nodes (nodeA,nodeB) gets culled if their (square)
+      box-box distance is larger than sqrCullDistOfNodeA(nodeA). This
+      is what's needed for 'all-pairs' queries in which every prim of
+      A has its own search radius (such as finding, for each prim in
+      A, the closest prim in B): the cull distance of a node of A is
+      then the largest search radius of any prim in its subtree, and
+      culling a pair of nodes prunes all of A's prims in that subtree
+      at once.
+
+      sqrCullDistOfNodeA gets called repeatedly for the same node,
+      and may return a smaller value each time, but never a larger
+      one. The leaf pair lambda gets the node IDs of the two leaves,
+      and returns false to terminate traversal:
+      [](uint32_t leafA, uint32_t leafB)->bool
+  */
+  template<typename T, int D, typename CullDistLambda, typename LeafPairLambda>
+  inline __cubql_both
+  void dualTreeQuery_forEachLeafPair_perNodeA(const BinaryBVH<T,D>  bvhA,
+                                              uint32_t              rootA,
+                                              const BinaryBVH<T,D>  bvhB,
+                                              uint32_t              rootB,
+                                              const CullDistLambda &sqrCullDistOfNodeA,
+                                              const LeafPairLambda &lambdaToExecuteForEachLeafPair);
+
+
+
+  // ==================================================================
+  // IMPLEMENTATION
+  // ==================================================================
+
+  namespace dualTree_impl {
+    /*! the metric we use to decide which of the two nodes of a node
+        pair to split */
+    template<typename T, int D>
+    inline __cubql_both
+    float sumOfEdgeLengths(const box_t<T,D> &box)
+    {
+      float sum = 0.f;
+      CUBQL_PRAGMA_UNROLL
+        for (int i=0;i<D;i++)
+          sum += float(box.get_upper(i) - box.get_lower(i));
+      return sum;
+    }
+  } // ::cuBQL::dualTree_impl
+
+  template<typename T, int D, typename CullDistLambda, typename LeafPairLambda>
+  inline __cubql_both
+  void dualTreeQuery_forEachLeafPair_perNodeA(const BinaryBVH<T,D>  bvhA,
+                                              uint32_t              rootA,
+                                              const BinaryBVH<T,D>  bvhB,
+                                              uint32_t              rootB,
+                                              const CullDistLambda &sqrCullDistOfNodeA,
+                                              const LeafPairLambda &lambdaToExecuteForEachLeafPair)
+  {
+    using node_t = typename BinaryBVH<T,D>::Node;
+    if (bvhA.numNodes == 0 || bvhB.numNodes == 0) return;
+
+    struct StackEntry {
+      uint32_t nodeA;
+      uint32_t nodeB;
+      float    dist;
+    };
+    /* every down-step pushes at most one pair, and every down-step
+       reduces the depth of one of the two nodes; so this is bounded
+       by the sum of the two trees' depths */
+    const int stackSize = 128;
+    StackEntry traversalStack[stackSize], *stackPtr = traversalStack;
+
+    uint32_t nodeA = rootA;
+    uint32_t nodeB = rootB;
+    if (fSqrDistance(bvhA.nodes[nodeA].bounds,bvhB.nodes[nodeB].bounds)
+        > sqrCullDistOfNodeA(nodeA))
+      return;
+
+    // ------------------------------------------------------------------
+    // traverse until there's nothing left to traverse:
+    // ------------------------------------------------------------------
+    while (true) {
+      bool foundLeafPair = false;
+
+      // ------------------------------------------------------------------
+      // traverse node pairs downward; breaking out if we either find
+      // a pair of leaves within the current search radius, or found a
+      // dead-end at which we need to pop
+      // ------------------------------------------------------------------
+      while (true) {
+        const node_t a = bvhA.nodes[nodeA];
+        const node_t b = bvhB.nodes[nodeB];
+        const bool aIsLeaf = (a.admin.count != 0);
+        const bool bIsLeaf = (b.admin.count != 0);
+        if (aIsLeaf && bIsLeaf) {
+          foundLeafPair = true;
+          break;
+        }
+
+        const bool splitA
+          = bIsLeaf
+          || (!aIsLeaf && (dualTree_impl::sumOfEdgeLengths(a.bounds)
+                           >= dualTree_impl::sumOfEdgeLengths(b.bounds)));
+        uint32_t n0A = nodeA, n1A = nodeA, n0B = nodeB, n1B = nodeB;
+        float d0, d1, cull0, cull1;
+        if (splitA) {
+          n0A = a.admin.offset+0;
+          n1A = a.admin.offset+1;
+          d0 = fSqrDistance(bvhA.nodes[n0A].bounds,b.bounds);
+          d1 = fSqrDistance(bvhA.nodes[n1A].bounds,b.bounds);
+          cull0 = sqrCullDistOfNodeA(n0A);
+          cull1 = sqrCullDistOfNodeA(n1A);
+        } else {
+          n0B = b.admin.offset+0;
+          n1B = b.admin.offset+1;
+          d0 = fSqrDistance(a.bounds,bvhB.nodes[n0B].bounds);
+          d1 = fSqrDistance(a.bounds,bvhB.nodes[n1B].bounds);
+          cull0 = cull1 = sqrCullDistOfNodeA(nodeA);
+        }
+        const bool o0 = (d0 <= cull0);
+        const bool o1 = (d1 <= cull1);
+        if (!o0 && !o1)
+          // both child pairs are too far away; this is a dead end
+          break;
+
+        if (!o1) {
+          nodeA = n0A; nodeB = n0B;
+        } else if (!o0) {
+          nodeA = n1A; nodeB = n1B;
+        } else {
+          StackEntry far;
+          if (d0 <= d1) {
+            nodeA = n0A; nodeB = n0B;
+            far = StackEntry{ n1A, n1B, d1 };
+          } else {
+            nodeA = n1A; nodeB = n1B;
+            far = StackEntry{ n0A, n0B, d0 };
+          }
+          if (stackPtr >= traversalStack+stackSize) {
+            assert(false && "dual-tree traversal stack overflow");
+            // printf("stack overflow\n");
+            return;
+          }
+          *stackPtr++ = far;
+        }
+      }
+
+      if (foundLeafPair && !lambdaToExecuteForEachLeafPair(nodeA,nodeB))
+        return;
+      // ------------------------------------------------------------------
+      // pop next un-traversed node pair from stack, discarding any
+      // pairs that are more distant than whatever cull distance we
+      // now have
+      // ------------------------------------------------------------------
+      while (true) {
+        if (stackPtr == traversalStack)
+          return;
+        StackEntry fromStack = *--stackPtr;
+        if (fromStack.dist <= sqrCullDistOfNodeA(fromStack.nodeA)) {
+          nodeA = fromStack.nodeA;
+          nodeB = fromStack.nodeB;
+          break;
+        }
+      }
+    }
+  }
+
+  template<typename T, int D, typename Lambda>
+  inline __cubql_both
+  void dualTreeQuery_forEachLeafPair(const BinaryBVH<T,D> bvhA,
+                                     uint32_t             rootA,
+                                     const BinaryBVH<T,D> bvhB,
+                                     uint32_t             rootB,
+                                     float                sqrMaxSearchDist,
+                                     const Lambda        &lambdaToExecuteForEachLeafPair)
+  {
+    float sqrCullDist = sqrMaxSearchDist;
+    dualTreeQuery_forEachLeafPair_perNodeA
+      (bvhA,rootA,bvhB,rootB,
+       [&sqrCullDist](uint32_t)->float { return sqrCullDist; },
+       [&](uint32_t leafA, uint32_t leafB)->bool
+       {
+         // we're at a valid pair of leaves: call the lambda and see if
+         // that gave us a new, closer cull radius
+         const typename BinaryBVH<T,D>::Node::Admin a = bvhA.nodes[leafA].admin;
+         const typename BinaryBVH<T,D>::Node::Admin b = bvhB.nodes[leafB].admin;
+         float leafResult
+           = lambdaToExecuteForEachLeafPair(bvhA.primIDs+a.offset,(int)a.count,
+                                            bvhB.primIDs+b.offset,(int)b.count);
+         if (leafResult < 0.f) return false;
+         sqrCullDist = min(sqrCullDist,leafResult);
+         return true;
+       });
+  }
+
+} // ::cuBQL
@@ -0,0 +1,336 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+/*! Barnes-Hut style far-field evaluation: for a given query point,
+    evaluates the sum of some kernel function (gravity, a Gaussian
+    density kernel, inverse-distance weights, ...) over all prims of a
+    BVH, but approximates any subtree that is 'far enough away' from
+    the query point by a single source at that subtree's center of
+    mass, using the per-node aggregates from aggregates.h.
+
+    A subtree gets approximated (instead of being opened) if
+
+      size(node.bounds) < theta * distance(queryPoint,centerOfMass)
+
+    where size is the largest extent of the node's box; theta=0 will
+    always open all nodes (ie, is exact, and O(N) per query), larger
+    values trade accuracy for speed (0.5 is a common choice). With a
+    reasonable theta this turns the O(N^2) 'all points against all
+    points' evaluation into something close to O(N log N).
+
+    The per-prim values (and thus the per-node aggregates) have to be
+    of an aggregate type (see aggregates.h) that also has
+
+      float weight;
+      __cubql_both vec_t<float,D> center() const;
+
+    members: subtrees whose aggregate has a weight of exactly 0 are
+    skipped entirely (center() usually isn't even defined for those),
+    and center() is where a subtree's stand-in source gets placed;
+    see PointMass and WeightedSample below. The kernel
+    is a functor with a signature of
+
+      __cubql_both void operator()(result_t &result,
+                                   const vec_t<float,D> &queryPoint,
+                                   const agg_t &source) const;
+
+    which adds the contribution of 'source' (which can be either a
+    single prim's value, or the aggregate of an entire subtree) to
+    'result'. See GravityKernel, GaussianKernel, and
+    InverseDistanceKernel for examples. */
+#pragma once
+
+#include "cuBQL/queries/aggregates.h"
+
+namespace cuBQL {
+
+  /*! aggregate of a set of weighted points: total weight, and the
+      weight-weighted sum of positions (so center() is the center of
+      mass). use PointMass::make(position,weight) for the per-prim
+      values */
+  template<int D>
+  struct PointMass {
+    using vec_t = cuBQL::vec_t<float,D>;
+
+    vec_t weightedPosition;
+    float weight;
+
+    static inline __cubql_both PointMass make(const vec_t &position, float weight)
+    { return { position*weight, weight }; }
+    static inline __cubql_both PointMass empty()
+    { return { vec_t(0.f), 0.f }; }
+    static inline __cubql_both PointMass combine(const PointMass &a,
+                                                 const PointMass &b)
+    { return { a.weightedPosition+b.weightedPosition, a.weight+b.weight }; }
+
+    inline __cubql_both vec_t center() const
+    { return weightedPosition * (1.f/weight); }
+  };
+
+  /*! same as PointMass, but with an additional scalar value per point
+      (eg, for scattered-data interpolation); value() returns the
+      weighted average of those values */
+  template<int D>
+  struct WeightedSample {
+    using vec_t = cuBQL::vec_t<float,D>;
+
+    vec_t weightedPosition;
+    float weight;
+    float weightedValue;
+
+    static inline __cubql_both
+    WeightedSample make(const vec_t &position, float value, float weight=1.f)
+    { return { position*weight, weight, value*weight }; }
+    static inline __cubql_both WeightedSample empty()
+    { return { vec_t(0.f), 0.f, 0.f }; }
+    static inline __cubql_both WeightedSample combine(const WeightedSample &a,
+                                                      const WeightedSample &b)
+    {
+      return { a.weightedPosition+b.weightedPosition,
+               a.weight+b.weight,
+               a.weightedValue+b.weightedValue };
+    }
+
+    inline __cubql_both vec_t center() const
+    { return weightedPosition * (1.f/weight); }
+    inline __cubql_both float value() const
+    { return weightedValue * (1.f/weight); }
+  };
+
+  /*! (softened) gravitational acceleration:
+      result += weight * (c-q) / (|c-q|^2+softening^2)^(3/2) */
+  template<int D>
+  struct GravityKernel {
+    float softening = 1e-3f;
+
+    template<typename agg_t>
+    inline __cubql_both
+    void operator()(vec_t<float,D> &result,
+                    const vec_t<float,D> &queryPoint,
+                    const agg_t &source) const
+    {
+      const vec_t<float,D> delta = source.center() - queryPoint;
+      const float r2  = dot(delta,delta) + softening*softening;
+      const float rcp = 1.f/sqrtf(r2);
+      result = result + delta * (source.weight * rcp*rcp*rcp);
+    }
+  };
+
+  /*! (un-normalized) Gaussian kernel density:
+      result += weight * exp(-|c-q|^2 / (2 sigma^2)) */
+  template<int D>
+  struct GaussianKernel {
+    float sigma = 1.f;
+
+    template<typename agg_t>
+    inline __cubql_both
+    void operator()(float &result,
+                    const vec_t<float,D> &queryPoint,
+                    const agg_t &source) const
+    {
+      const float r2 = fSqrDistance(source.center(),queryPoint);
+      result += source.weight * expf(-r2/(2.f*sigma*sigma));
+    }
+  };
+
+  /*! result type for InverseDistanceKernel; value() is the
+      interpolated value */
+  struct InverseDistanceResult {
+    float weightedValueSum = 0.f;
+    float weightSum        = 0.f;
+
+    inline __cubql_both float value() const
+    { return weightedValueSum / weightSum; }
+  };
+
+  /*! Shepard-style inverse distance weighting, with weights of
+      1/(|c-q|^2+smoothing^2)^(power/2); for use with WeightedSample
+      values */
+  template<int D>
+  struct InverseDistanceKernel {
+    float power     = 2.f;
+    float smoothing = 1e-6f;
+
+    inline __cubql_both
+    void operator()(InverseDistanceResult &result,
+                    const vec_t<float,D> &queryPoint,
+                    const WeightedSample<D> &source) const
+    {
+      const float r2 = fSqrDistance(source.center(),queryPoint) + smoothing*smoothing;
+      const float w  = source.weight * powf(r2,-.5f*power);
+      result.weightedValueSum += w * source.value();
+      result.weightSum        += w;
+    }
+  };
+
+  /*! evaluates the given kernel for the given query point, adding the
+      contributions of all prims (or of far-away subtrees standing in
+      for them) to 'result' (which is NOT cleared by this
+      function). nodeAggregates[] must have been computed from
+      primValues[] via computeAggregates() (or refit() with
+      aggregates). */
+  template<typename result_t, typename agg_t, typename Kernel, typename T, int D>
+  inline __cubql_both
+  void farField_eval(result_t             &result,
+                     const BinaryBVH<T,D>  bvh,
+                     const agg_t          *nodeAggregates,
+                     const agg_t          *primValues,
+                     const vec_t<float,D> &queryPoint,
+                     float                 theta,
+                     const Kernel         &kernel);
+
+#ifdef __CUDACC__
+  /*! batched version of farField_eval(), with one GPU thread per
+      query point; results[i] will get the sum for queryPoints[i]
+      added to it, so has to be initialized (eg, to zero) before
+      calling this. Does not sync. */
+  template<typename result_t, typename agg_t, typename Kernel, typename T, int D>
+  void farField(result_t             *results,
+                const vec_t<float,D> *queryPoints,
+                int                   numQueries,
+                const BinaryBVH<T,D>  bvh,
+                const agg_t          *nodeAggregates,
+                const agg_t          *primValues,
+                float                 theta,
+                const Kernel         &kernel,
+                cudaStream_t          s=0);
+#endif
+
+  namespace host {
+    /*! host-side equivalent of the batched cuBQL::farField(), using
+        host threads */
+    template<typename result_t, typename agg_t, typename Kernel, typename T, int D>
+    void farField(result_t             *results,
+                  const vec_t<float,D> *queryPoints,
+                  int                   numQueries,
+                  const BinaryBVH<T,D>  bvh,
+                  const agg_t          *nodeAggregates,
+                  const agg_t          *primValues,
+                  float                 theta,
+                  const Kernel         &kernel);
+  }
+
+
+  // ==================================================================
+  // IMPLEMENTATION
+  // ==================================================================
+
+  template<typename result_t, typename agg_t, typename Kernel, typename T, int D>
+  inline __cubql_both
+  void farField_eval(result_t             &result,
+                     const BinaryBVH<T,D>  bvh,
+                     const agg_t          *nodeAggregates,
+                     const agg_t          *primValues,
+                     const vec_t<float,D> &queryPoint,
+                     float                 theta,
+                     const Kernel         &kernel)
+  {
+    if (bvh.numNodes == 0) return;
+    const float theta2 = theta*theta;
+
+    const int stackSize = 64;
+    uint32_t traversalStack[stackSize], *stackPtr = traversalStack;
+    uint32_t nodeID = 0;
+    while (true) {
+      const typename BinaryBVH<T,D>::Node node = bvh.nodes[nodeID];
+      const agg_t &agg = nodeAggregates[nodeID];
+      float size = 0.f;
+      CUBQL_PRAGMA_UNROLL
+        for (int i=0;i<D;i++)
+          size = max(size,float(node.bounds.get_upper(i)-node.bounds.get_lower(i)));
+
+      if (agg.weight == 0.f) {
+        // nothing in this subtree that could contribute anything
+      } else if (size*size < theta2*fSqrDistance(agg.center(),queryPoint)) {
+        // far enough away: use the aggregate as a stand-in for the
+        // entire subtree
+        kernel(result,queryPoint,agg);
+      } else if (node.admin.count != 0) {
+        for (int i=0;i<(int)node.admin.count;i++)
+          kernel(result,queryPoint,primValues[bvh.primIDs[node.admin.offset+i]]);
+      } else {
+        if (stackPtr >= traversalStack+stackSize) {
+          // printf("stack overflow\n");
+          return;
+        }
+        *stackPtr++ = node.admin.offset+1;
+        nodeID = node.admin.offset+0;
+        continue;
+      }
+      if (stackPtr == traversalStack)
+        return;
+      nodeID = *--stackPtr;
+    }
+  }
+
+#ifdef __CUDACC__
+  namespace farField_impl {
+    template<typename result_t, typename agg_t, typename Kernel, typename T, int D>
+    __global__
+    void farField(result_t             *results,
+                  const vec_t<float,D> *queryPoints,
+                  int                   numQueries,
+                  const BinaryBVH<T,D>  bvh,
+                  const agg_t          *nodeAggregates,
+                  const agg_t          *primValues,
+                  float                 theta,
+                  const Kernel          kernel)
+    {
+      const int tid = threadIdx.x+blockIdx.x*blockDim.x;
+      if (tid >= numQueries) return;
+      result_t result = results[tid];
+      farField_eval(result,bvh,nodeAggregates,primValues,queryPoints[tid],theta,kernel);
+      results[tid] = result;
+    }
+  } // ::cuBQL::farField_impl
+
+  template<typename result_t, typename agg_t, typename Kernel, typename T, int D>
+  void farField(result_t             *results,
+                const vec_t<float,D> *queryPoints,
+                int                   numQueries,
+                const BinaryBVH<T,D>  bvh,
+                const agg_t          *nodeAggregates,
+                const agg_t          *primValues,
+                float                 theta,
+                const Kernel         &kernel,
+                cudaStream_t          s)
+  {
+    if (numQueries <= 0) return;
+    farField_impl::farField<<<divRoundUp(numQueries,128),128,0,s>>>
+      (results,queryPoints,numQueries,bvh,nodeAggregates,primValues,theta,kernel);
+    // we're not syncing here - let APP do that
+  }
+#endif
+
+  namespace host {
+    template<typename result_t, typename agg_t, typename Kernel, typename T, int D>
+    void farField(result_t             *results,
+                  const vec_t<float,D> *queryPoints,
+                  int                   numQueries,
+                  const BinaryBVH<T,D>  bvh,
+                  const agg_t          *nodeAggregates,
+                  const agg_t          *primValues,
+                  float                 theta,
+                  const Kernel         &kernel)
+    {
+      parallel_for(numQueries,[&](size_t queryID) {
+        farField_eval(results[queryID],bvh,nodeAggregates,primValues,
+                      queryPoints[queryID],theta,kernel);
+      });
+    }
+  } // ::cuBQL::host
+
+} // ::cuBQL
@@ -17,6 +17,7 @@
 #pragma once
 
 #include "cuBQL/bvh.h"
+#include <type_traits>
 
 #if DO_STATS
 # define STATS(a) a
@@ -31,28 +32,57 @@
   
 namespace cuBQL {
 
-  template<int D>
+  /*! the (signed) type that fcp() and friends return primIDs as, for
+      a BVH of the given index type: int for a regular BinaryBVH,
+      int64_t for a BinaryBVH64 */
+  template<typename index_t>
+  using fcp_result_t = typename std::make_signed<index_t>::type;
+
+  namespace fcp_impl {
+    /*! a node that traversal still has to visit, and its distance */
+    template<typename index_t>
+    struct CUBQL_ALIGN(8) StackEntry {
+      index_t nodeID;
+      float   dist;
+    };
+  }
+  
+  /*! approximate variant of fcp(): returns a prim whose distance is
+      within a factor of (1+epsilon) of the distance to the true
+      closest prim. This is done by culling all subtrees whose
+      (square) distance to the query is more than
+      maxQueryDistSquare/(1+epsilon)^2, which - depending on data
+      distribution - can skip a significant number of nodes that
+      the exact query would have to visit just to confirm that they
+      don't contain anything closer. epsilon=0 gives exactly the same
+      results as fcp() */
+  template<int D, typename index_t>
   inline __device__
-  int fcp(const BinaryBVH<float,D> bvh,
+  fcp_result_t<index_t>
+  fcp_approx(const BinaryBVH<float,D,index_t> bvh,
 #if USE_BOXES
-          const box_t<float,D>    *prims,
+             const box_t<float,D>    *prims,
 #else
-          const vec_t<float,D>    *prims,
+             const vec_t<float,D>    *prims,
 #endif
-          const vec_t<float,D>     query,
-          /* in: SQUARE of max search distance; out: sqrDist of closest point */
-          float          &maxQueryDistSquare
+             const vec_t<float,D>     query,
+             /* in: SQUARE of max search distance; out: sqrDist of found point */
+             float          &maxQueryDistSquare,
+             float           epsilon
 #if DO_STATS
-          , Stats *d_stats = 0
+             , Stats *d_stats = 0
 #endif
-          )
+             )
   {
-    int result = -1;
+    fcp_result_t<index_t> result = -1;
+    /* nodes get culled if their distance is larger than the current
+       max query dist times this */
+    const float cullScale = 1.f/((1.f+epsilon)*(1.f+epsilon));
     
-    int2 stackBase[32], *stackPtr = stackBase;
-    int nodeID = 0;
-    int offset = 0;
-    int count  = 0;
+    fcp_impl::StackEntry<index_t> stackBase[32], *stackPtr = stackBase;
+    index_t nodeID = 0;
+    index_t offset = 0;
+    int     count  = 0;
 #if DO_STATS
     int numNodes = 0, numPrims = 0;
 #endif
@@ -66,24 +96,21 @@ namespace cuBQL {
         if (count>0)
           // leaf
           break;
-        typename BinaryBVH<float,D>::Node child0 = bvh.nodes[offset+0];
-        typename BinaryBVH<float,D>::Node child1 = bvh.nodes[offset+1];
+        BinaryBVHNode<float,D> child0 = bvh.nodes[offset+0];
+        BinaryBVHNode<float,D> child1 = bvh.nodes[offset+1];
         float dist0 = fSqrDistance(child0.bounds,query);
         float dist1 = fSqrDistance(child1.bounds,query);
-        int closeChild = offset + ((dist0 > dist1) ? 1 : 0);
-        if (dist1 < maxQueryDistSquare) {
-          float dist = max(dist0,dist1);
-          int distBits = __float_as_int(dist);
-          *stackPtr++ = make_int2(closeChild^1,distBits);
-        }
-        if (min(dist0,dist1) > maxQueryDistSquare) {
+        index_t closeChild = offset + ((dist0 > dist1) ? 1 : 0);
+        if (dist1 < maxQueryDistSquare*cullScale)
+          *stackPtr++ = { closeChild^1, max(dist0,dist1) };
+        if (min(dist0,dist1) > maxQueryDistSquare*cullScale) {
           count = 0;
           break;
         }
         nodeID = closeChild;
       }
       for (int i=0;i<count;i++) {
-        int primID = bvh.primIDs[offset+i];
+        index_t primID = bvh.primIDs[offset+i];
 #if DO_STATS
         numPrims++;
 #endif
@@ -103,13 +130,42 @@ namespace cuBQL {
           return result;
         }
         --stackPtr;
-        if (__int_as_float(stackPtr->y) > maxQueryDistSquare) continue;
-        nodeID = stackPtr->x;
+        if (stackPtr->dist > maxQueryDistSquare*cullScale) continue;
+        nodeID = stackPtr->nodeID;
         break;
       }
     }
   }
 
+  /*! 'fcp' = "find closest point", on a binary BVH. Given an input
+      query point, and a BVH over point (or box) data, find the (index
+      of) the data prim that is closest to the given query point, up
+      to the given maximum (square) query distance. Returns -1 if no
+      such prim could be found */
+  template<int D, typename index_t>
+  inline __device__
+  fcp_result_t<index_t>
+  fcp(const BinaryBVH<float,D,index_t> bvh,
+#if USE_BOXES
+      const box_t<float,D>    *prims,
+#else
+      const vec_t<float,D>    *prims,
+#endif
+      const vec_t<float,D>     query,
+      /* in: SQUARE of max search distance; out: sqrDist of closest point */
+      float          &maxQueryDistSquare
+#if DO_STATS
+      , Stats *d_stats = 0
+#endif
+      )
+  {
+    return fcp_approx(bvh,prims,query,maxQueryDistSquare,0.f
+#if DO_STATS
+                      ,d_stats
+#endif
+                      );
+  }
+
 
 
 //   // inline __device__
@@ -17,13 +17,11 @@
 #pragma once
 
 #include "cuBQL/bvh.h"
+#include "cuBQL/queries/common.h"
 #include <nvfunctional>
 
 namespace cuBQL {
 
-#define CUBQL_TERMINATE_TRAVERSAL 1
-#define CUBQL_CONTINUE_TRAVERSAL  0
-  
   /*! This query finds all primitives within a given fixed (ie, never
     changing) axis-aligned cartesian box, and calls the provided
     callback-lambda for each such prim. The provided lambda can do
@@ -35,18 +33,21 @@ namespace cuBQL {
     
     for this "for each prim' variant, the lambda should have a signature of
     [](int primID)->int
+
+    (the primIDs passed to the lambda are of the BVH's index_t, ie,
+    uint64_t for a BinaryBVH64)
   */
-  template<typename T, int D>
+  template<typename T, int D, typename index_t>
   inline __device__
-  void fixedBoxQuery_forEachPrim(const BinaryBVH<T,D>,
+  void fixedBoxQuery_forEachPrim(const BinaryBVH<T,D,index_t>,
                                  const box3f queryBox,
-                                 const nvstd::function<int(uint32_t)> &lambdaToCallOnEachPrim);
+                                 const nvstd::function<int(typename BinaryBVH<T,D,index_t>::index_t)> &lambdaToCallOnEachPrim);
   
-  template<typename T, int D>
+  template<typename T, int D, typename index_t>
   inline __device__
-  void fixedBoxQuery_forEachLeaf(const BinaryBVH<T,D>,
+  void fixedBoxQuery_forEachLeaf(const BinaryBVH<T,D,index_t>,
                                  const box3f queryBox,
-                                 const nvstd::function<int(const uint32_t *, size_t)> &lambdaToCallOnEachPrim);
+                                 const nvstd::function<int(const typename BinaryBVH<T,D,index_t>::index_t *, size_t)> &lambdaToCallOnEachPrim);
   
 
 
@@ -55,11 +56,11 @@ namespace cuBQL {
   // IMPLEMENTATION
   // ==================================================================
 
-  template<typename T, int D>
+  template<typename T, int D, typename index_t>
   inline __device__
-  void fixedBoxQuery_forEachLeaf(const BinaryBVH<T,D> bvh,
+  void fixedBoxQuery_forEachLeaf(const BinaryBVH<T,D,index_t> bvh,
                                  const box3f queryBox,
-                                 const nvstd::function<int(const uint32_t *, size_t)> &lambdaToCallOnEachLeaf)
+                                 const nvstd::function<int(const typename BinaryBVH<T,D,index_t>::index_t *, size_t)> &lambdaToCallOnEachLeaf)
   {
     struct StackEntry {
       uint32_t idx;
@@ -82,8 +83,8 @@ namespace cuBQL {
           // out of down-travesal and let leaf code pop in.
           break;
 
-        uint32_t n0Idx = node.offset+0;
-        uint32_t n1Idx = node.offset+1;
+        index_t n0Idx = node.offset+0;
+        index_t n1Idx = node.offset+1;
         bvh3f::node_t n0 = bvh.nodes[n0Idx];
         bvh3f::node_t n1 = bvh.nodes[n1Idx];
         bool o0 = queryBox.overlaps(n0.bounds);
@@ -123,20 +124,20 @@ namespace cuBQL {
     }
   }
 
-  template<typename T, int D>
+  template<typename T, int D, typename index_t>
   inline __device__
-  void fixedBoxQuery_forEachPrim(const BinaryBVH<T,D> bvh,
+  void fixedBoxQuery_forEachPrim(const BinaryBVH<T,D,index_t> bvh,
                                  const box3f queryBox,
-                                 const nvstd::function<int(uint32_t)> &lambdaToCallOnEachPrim)
+                                 const nvstd::function<int(typename BinaryBVH<T,D,index_t>::index_t)> &lambdaToCallOnEachPrim)
   {
-    auto leafCode = [&lambdaToCallOnEachPrim](const uint32_t *primIDs, size_t numPrims) -> int
+    auto leafCode = [&lambdaToCallOnEachPrim](const index_t *primIDs, size_t numPrims) -> int
     {
       for (int i=0;i<(int)numPrims;i++)
         if (lambdaToCallOnEachPrim(primIDs[i]) == CUBQL_TERMINATE_TRAVERSAL)
           return CUBQL_TERMINATE_TRAVERSAL;
       return CUBQL_CONTINUE_TRAVERSAL;
     };
-    fixedBoxQuery_forEachLeaf(bvh,queryBox,leafCode);
+    fixedBoxQuery_forEachLeaf<T,D,index_t>(bvh,queryBox,leafCode);
   }
   
 } // ::cubql
@@ -0,0 +1,357 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+
+/*! two-level BVHs, for instancing: a top-level BVH over instances,
+    each of which places a (shared) bottom-level BVH into the world
+    with an affine transform, so scenes that re-use the same object
+    many times do not have to store - or build - it more than once.
+
+    The queries in here take their query point, ray, or box in world
+    space, traverse the top level, and for each instance they reach
+    transform the query into that instance's object space and
+    traverse its bottom-level BVH. Distances always are world-space
+    distances, also for non-rigid (scaling or shearing) transforms:
+    bottom-level boxes get culled by a lower bound of their
+    world-space distance (see Instance::minScale), and the callbacks
+    have to return world-space distances, too. Ray distances need no
+    rescaling at all, since rays do not get re-normalized in object
+    space. */
+#pragma once
+
+#include "cuBQL/queries/shrinkingRadiusQuery.h"
+#include "cuBQL/queries/rayQuery.h"
+#include "cuBQL/queries/rangeQuery.h"
+#include "cuBQL/math/affine.h"
+
+namespace cuBQL {
+
+  /*! one instance of a bottom-level BVH; create via Instance::make() */
+  struct Instance {
+    /*! an instance of 'object', placed into the world by the
+        object-to-world transform 'xfm' */
+    static inline __cubql_both
+    Instance make(const bvh3f *object, const affine3f &xfm);
+
+    /*! (conservative) world-space bounds of this instance */
+    inline __cubql_both box3f worldBounds() const;
+
+    /*! object-to-world transform */
+    affine3f     xfm;
+    /*! world-to-object transform */
+    affine3f     invXfm;
+    /*! (a lower bound of) the smallest factor by which xfm can scale
+        a distance, ie, of the smallest singular value of its linear
+        part; object-space distances times this are lower bounds of
+        world-space distances */
+    float        minScale;
+    /*! the shared bottom-level BVH; it (as well as its nodes and
+        primIDs) must be readable wherever the queries run */
+    const bvh3f *object;
+  };
+
+  /*! a top-level BVH over instances; see top of this file */
+  struct TwoLevelBVH {
+    /*! BVH over the instances' world-space bounds; its primIDs are
+        indices into instances[] */
+    bvh3f           topLevel;
+    const Instance *instances    = 0;
+    uint32_t        numInstances = 0;
+  };
+
+  /*! performs a shrinking-radius query (see shrinkingRadiusQuery.h)
+      around a world-space query point, and calls the lambda for each
+      prim of each instance that may be within the current radius.
+      The lambda should have a signature of
+      [](int instanceID, uint32_t primID)->float, and return the
+      SQUARE of the new (world-space) culling radius, eg, the square
+      world-space distance to that prim if it is closer than
+      anything found before; a negative value terminates the query */
+  template<typename Lambda>
+  inline __cubql_both
+  void shrinkingRadiusQuery_forEachPrim(const TwoLevelBVH &bvh,
+                                        vec3f              queryPoint,
+                                        float              sqrMaxSearchRadius,
+                                        const Lambda      &lambdaToCallOnEachPrim);
+
+  /*! front-to-back ray traversal (see rayQuery.h) of all instances
+      and their prims; the lambda gets called with the ray in that
+      instance's object space - with the same tMin/tMax, since t
+      values are the same in both spaces - and should have a
+      signature of
+      [](int instanceID, const Ray &objectSpaceRay, uint32_t primID)->float;
+      it returns the new tMax, or a negative value to terminate */
+  template<typename Lambda>
+  inline __cubql_both
+  void rayQuery_forEachPrim(const TwoLevelBVH &bvh,
+                            const Ray          worldSpaceRay,
+                            const Lambda      &lambdaToCallOnEachPrim);
+
+  /*! iterates over all bottom-level leaves whose bounds overlap the
+      (object-space bounds of the) given world-space box; the lambda
+      should have a signature of
+      [](int instanceID, const uint32_t *primIDs, int numPrims)->int,
+      and return either CUBQL_CONTINUE_TRAVERSAL or
+      CUBQL_TERMINATE_TRAVERSAL. For non-axis-aligned transforms
+      those leaves are only candidates; the lambda has to check its
+      prims against the world-space box itself */
+  template<typename Lambda>
+  inline __cubql_both
+  void rangeQuery_forEachLeaf(const TwoLevelBVH &bvh,
+                              const box3f       &worldSpaceBox,
+                              const Lambda      &lambdaToCallOnEachLeaf);
+
+#ifdef __CUDACC__
+  /*! builds the top-level BVH over the given instances (which, as
+      well as what they point to, must be device-readable, and stay
+      alive for as long as the two-level BVH is in use) */
+  inline void gpuBuilder(TwoLevelBVH       &bvh,
+                         const Instance    *instances,
+                         uint32_t           numInstances,
+                         BuildConfig        buildConfig = BuildConfig(),
+                         cudaStream_t       s = 0,
+                         GpuMemoryResource &memResource = defaultGpuMemResource());
+
+  /*! refits the top-level BVH after the instances' transforms (in
+      the same instances[] array it got built over) have changed */
+  inline void refit(TwoLevelBVH       &bvh,
+                    cudaStream_t       s = 0,
+                    GpuMemoryResource &memResource = defaultGpuMemResource());
+#endif
+
+  /*! frees the top-level BVH; the instances and bottom-level BVHs
+      are the caller's */
+  inline void free(TwoLevelBVH       &bvh,
+                   cudaStream_t       s = 0,
+                   GpuMemoryResource &memResource = defaultGpuMemResource());
+
+  // ==================================================================
+  // IMPLEMENTATION
+  // ==================================================================
+
+  namespace instancing_impl {
+    inline __cubql_both double ddot(const vec3f &a, const vec3f &b)
+    { return double(a.x)*b.x + double(a.y)*b.y + double(a.z)*b.z; }
+
+    /*! smallest singular value of l (ie, square root of the smallest
+        eigenvalue of the symmetric l^T*l, in closed form), with a
+        little margin for the rounding in both this and the distances
+        it gets applied to */
+    inline __cubql_both float minScale(const LinearSpace3f &l)
+    {
+      const double a00 = ddot(l.vx,l.vx), a11 = ddot(l.vy,l.vy), a22 = ddot(l.vz,l.vz);
+      const double a01 = ddot(l.vx,l.vy), a02 = ddot(l.vx,l.vz), a12 = ddot(l.vy,l.vz);
+      const double trace = a00+a11+a22;
+      const double q  = trace/3.;
+      const double p1 = a01*a01 + a02*a02 + a12*a12;
+      const double p2 = (a00-q)*(a00-q) + (a11-q)*(a11-q) + (a22-q)*(a22-q) + 2.*p1;
+      double minEigen = q;
+      if (p2 > 0.) {
+        const double p = sqrt(p2/6.);
+        const double b00 = (a00-q)/p, b11 = (a11-q)/p, b22 = (a22-q)/p;
+        const double b01 = a01/p, b02 = a02/p, b12 = a12/p;
+        const double detB
+          = b00*(b11*b22-b12*b12) - b01*(b01*b22-b12*b02) + b02*(b01*b12-b11*b02);
+        const double phi = acos(max(-1.,min(1.,.5*detB)))/3.;
+        // 2.094... = 2*pi/3
+        minEigen = q + 2.*p*cos(phi+2.0943951023931957);
+      }
+      minEigen = max(0.,minEigen-1e-12*trace);
+      return float(sqrt(minEigen)*(1.-1e-5));
+    }
+
+    /*! bounds of the given box, transformed by xfm */
+    inline __cubql_both box3f xfmBounds(const affine3f &xfm, const box3f &box)
+    {
+      box3f result;
+      if (box.empty()) return result;
+      for (int i=0;i<8;i++)
+        result.grow(xfmPoint(xfm,vec3f((i&1) ? box.upper.x : box.lower.x,
+                                       (i&2) ? box.upper.y : box.lower.y,
+                                       (i&4) ? box.upper.z : box.lower.z)));
+      return result;
+    }
+
+#ifdef __CUDACC__
+    template<typename instance_t>
+    __global__
+    void computeWorldBounds(box3f *bounds, const instance_t *instances, uint32_t numInstances)
+    {
+      const uint32_t tid = threadIdx.x+blockIdx.x*blockDim.x;
+      if (tid >= numInstances) return;
+      bounds[tid] = instances[tid].worldBounds();
+    }
+#endif
+  } // ::cuBQL::instancing_impl
+
+  inline __cubql_both
+  Instance Instance::make(const bvh3f *object, const affine3f &xfm)
+  {
+    Instance instance;
+    instance.xfm      = xfm;
+    instance.invXfm   = rcp(xfm);
+    instance.minScale = instancing_impl::minScale(xfm.l);
+    instance.object   = object;
+    return instance;
+  }
+
+  inline __cubql_both box3f Instance::worldBounds() const
+  {
+    if (object->numNodes == 0) return box3f();
+    return instancing_impl::xfmBounds(xfm,object->nodes[0].bounds);
+  }
+
+  template<typename Lambda>
+  inline __cubql_both
+  void shrinkingRadiusQuery_forEachPrim(const TwoLevelBVH &bvh,
+                                        vec3f              queryPoint,
+                                        float              sqrMaxSearchRadius,
+                                        const Lambda      &lambdaToCallOnEachPrim)
+  {
+    if (bvh.topLevel.numNodes == 0) return;
+    float sqrCullDist = sqrMaxSearchRadius;
+    bool  terminated  = false;
+    auto perInstance = [&](const uint32_t *instanceIDs, int numInstances)->float {
+      for (int i=0;i<numInstances;i++) {
+        const int       instanceID = instanceIDs[i];
+        const Instance &instance   = bvh.instances[instanceID];
+        const bvh3f     object     = *instance.object;
+        if (object.numNodes == 0) continue;
+        const vec3f objectQuery = xfmPoint(instance.invXfm,queryPoint);
+        const float sqrScale = instance.minScale*instance.minScale;
+        // lower bound of the world-space distance to anything in that box
+        auto sqrDistanceToBox = [objectQuery,sqrScale](const box3f &box)->float
+          { return sqrScale*sqrDistance(objectQuery,box); };
+        if (sqrDistanceToBox(object.nodes[0].bounds) >= sqrCullDist) continue;
+        auto perLeaf = [&](const uint32_t *primIDs, int numPrims)->float {
+          for (int j=0;j<numPrims;j++) {
+            const float primResult = lambdaToCallOnEachPrim(instanceID,primIDs[j]);
+            if (primResult < 0.f) { terminated = true; return -1.f; }
+            sqrCullDist = min(sqrCullDist,primResult);
+          }
+          return sqrCullDist;
+        };
+        shrinkingRadiusQuery_forEachLeaf_byBoxDistance
+          (object,sqrDistanceToBox,sqrCullDist,perLeaf);
+        if (terminated) return -1.f;
+      }
+      return sqrCullDist;
+    };
+    shrinkingRadiusQuery_forEachLeaf(bvh.topLevel,queryPoint,sqrMaxSearchRadius,perInstance);
+  }
+
+  template<typename Lambda>
+  inline __cubql_both
+  void rayQuery_forEachPrim(const TwoLevelBVH &bvh,
+                            const Ray          worldSpaceRay,
+                            const Lambda      &lambdaToCallOnEachPrim)
+  {
+    float tMax       = worldSpaceRay.tMax;
+    bool  terminated = false;
+    auto perInstance = [&](const uint32_t *instanceIDs, int numInstances)->float {
+      for (int i=0;i<numInstances;i++) {
+        const int       instanceID = instanceIDs[i];
+        const Instance &instance   = bvh.instances[instanceID];
+        const bvh3f     object     = *instance.object;
+        Ray objectRay;
+        objectRay.origin    = xfmPoint(instance.invXfm,worldSpaceRay.origin);
+        objectRay.direction = xfmVector(instance.invXfm,worldSpaceRay.direction);
+        objectRay.tMin      = worldSpaceRay.tMin;
+        objectRay.tMax      = tMax;
+        auto perPrim = [&](uint32_t primID)->float {
+          const float primResult = lambdaToCallOnEachPrim(instanceID,objectRay,primID);
+          if (primResult < 0.f) { terminated = true; return -1.f; }
+          objectRay.tMax = tMax = min(tMax,primResult);
+          return tMax;
+        };
+        cuBQL::rayQuery_forEachPrim(object,objectRay,perPrim);
+        if (terminated) return -1.f;
+      }
+      return tMax;
+    };
+    rayQuery_forEachLeaf(bvh.topLevel,worldSpaceRay,perInstance);
+  }
+
+  template<typename Lambda>
+  inline __cubql_both
+  void rangeQuery_forEachLeaf(const TwoLevelBVH &bvh,
+                              const box3f       &worldSpaceBox,
+                              const Lambda      &lambdaToCallOnEachLeaf)
+  {
+    auto perInstance = [&](const uint32_t *instanceIDs, int numInstances)->int {
+      for (int i=0;i<numInstances;i++) {
+        const int       instanceID = instanceIDs[i];
+        const Instance &instance   = bvh.instances[instanceID];
+        const box3f objectBox = instancing_impl::xfmBounds(instance.invXfm,worldSpaceBox);
+        bool terminated = false;
+        auto perLeaf = [&](const uint32_t *primIDs, int numPrims)->int {
+          if (lambdaToCallOnEachLeaf(instanceID,primIDs,numPrims)
+              == CUBQL_TERMINATE_TRAVERSAL)
+            terminated = true;
+          return terminated ? CUBQL_TERMINATE_TRAVERSAL : CUBQL_CONTINUE_TRAVERSAL;
+        };
+        cuBQL::rangeQuery_forEachLeaf(*instance.object,objectBox,perLeaf);
+        if (terminated) return CUBQL_TERMINATE_TRAVERSAL;
+      }
+      return CUBQL_CONTINUE_TRAVERSAL;
+    };
+    cuBQL::rangeQuery_forEachLeaf(bvh.topLevel,worldSpaceBox,perInstance);
+  }
+
+#ifdef __CUDACC__
+  inline void gpuBuilder(TwoLevelBVH       &bvh,
+                         const Instance    *instances,
+                         uint32_t           numInstances,
+                         BuildConfig        buildConfig,
+                         cudaStream_t       s,
+                         GpuMemoryResource &memResource)
+  {
+    bvh = TwoLevelBVH();
+    bvh.instances    = instances;
+    bvh.numInstances = numInstances;
+    if (numInstances == 0) return;
+    box3f *worldBounds = 0;
+    CUBQL_CUDA_CHECK(memResource.malloc((void**)&worldBounds,numInstances*sizeof(box3f),s));
+    instancing_impl::computeWorldBounds<<<divRoundUp(numInstances,128u),128,0,s>>>
+      (worldBounds,instances,numInstances);
+    gpuBuilder(bvh.topLevel,worldBounds,numInstances,buildConfig,s,memResource);
+    CUBQL_CUDA_CHECK(memResource.free(worldBounds,s));
+  }
+
+  inline void refit(TwoLevelBVH       &bvh,
+                    cudaStream_t       s,
+                    GpuMemoryResource &memResource)
+  {
+    if (bvh.topLevel.numNodes == 0) return;
+    box3f *worldBounds = 0;
+    CUBQL_CUDA_CHECK(memResource.malloc((void**)&worldBounds,bvh.numInstances*sizeof(box3f),s));
+    instancing_impl::computeWorldBounds<<<divRoundUp(bvh.numInstances,128u),128,0,s>>>
+      (worldBounds,bvh.instances,bvh.numInstances);
+    refit(bvh.topLevel,worldBounds,s,memResource);
+    CUBQL_CUDA_CHECK(memResource.free(worldBounds,s));
+  }
+#endif
+
+  inline void free(TwoLevelBVH       &bvh,
+                   cudaStream_t       s,
+                   GpuMemoryResource &memResource)
+  {
+    if (bvh.topLevel.nodes)
+      cuBQL::free(bvh.topLevel,s,memResource);
+    bvh = TwoLevelBVH();
+  }
+
+} // ::cuBQL
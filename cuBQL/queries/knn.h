@@ -131,6 +131,71 @@ namespace cuBQL {
     // compiler will turn that into insertfield op
     return uint32_t(itemID) | (uint64_t(__float_as_uint(dist)) << 32);
   }
+
+  /*! same as KNNResults, but for 64-bit item IDs (as found in, eg, a
+      BinaryBVH64): since a distance and such an ID no longer fit
+      into a single 64-bit word, they get stored in separate arrays
+      here (and compared as a pair). Unused slots have an item ID of
+      uint64_t(-2). */
+  template<int K>
+  struct KNNResults64 {
+
+    inline __device__ void     clear(float initialMaxDist);
+    inline __device__ float    insert(float dist, uint64_t ID);
+    inline __device__ float    getDist(int i) const { return dists[i]; }
+    inline __device__ uint64_t getItem(int i) const { return items[i]; }
+    float    maxDist2;
+  private:
+    /*! whether slot i comes after (dist,ID) in (dist,ID) order */
+    inline __device__ bool isAfter(int i, float dist, uint64_t ID) const
+    { return dists[i] > dist || (dists[i] == dist && items[i] > ID); }
+    
+    int      count;
+    float    dists[K];
+    uint64_t items[K];
+  };
+
+  template<int K> __device__
+  void KNNResults64<K>::clear(float initialMaxDist)
+  {
+    count = 0;
+#pragma unroll
+    for (int i=0;i<K;i++) {
+      dists[i] = INFINITY;
+      items[i] = uint64_t(-2);
+    }
+    maxDist2 = initialMaxDist;
+  }
+  
+  template<int K> __device__
+  float KNNResults64<K>::insert(float dist, uint64_t ID)
+  {
+    if (dist > maxDist2) 
+      return maxDist2;
+    
+    int pos = 0;
+    while (1) {
+      // pos of first child in heap
+      int cc = 2*pos+1;
+      if (cc >= K)
+        // does not have any children
+        break;
+      int c1 = cc+1;
+      if (c1 < K && isAfter(c1,dists[cc],items[cc]))
+        cc = c1;
+      
+      if (!isAfter(cc,dist,ID))
+        break;
+      dists[pos] = dists[cc];
+      items[pos] = items[cc];
+      pos = cc;
+    }
+    dists[pos] = dist;
+    items[pos] = ID;
+    count = min(K,count+1);
+    maxDist2 = min(maxDist2,getDist(0));
+    return maxDist2;
+  }
   
 
 
@@ -138,29 +203,36 @@ namespace cuBQL {
 
 
 
-  template<typename ResultList, int D>
+  /*! approximate variant of knn(): culls all subtrees whose (square)
+      distance to the query is more than results.maxDist2/(1+epsilon)^2,
+      so each of the k returned items will be within a factor of
+      (1+epsilon) of the distance to the corresponding true k nearest
+      neighbor. epsilon=0 gives exactly the same results as knn().
+      For a BinaryBVH64, use a KNNResults64 as result list */
+  template<typename ResultList, int D, typename index_t>
   inline __device__
-  void knn(ResultList &results,
-           const BinaryBVH<float,D> bvh,
+  void knn_approx(ResultList &results,
+                  const BinaryBVH<float,D,index_t> bvh,
 #if USE_BOXES
-           const box_t<float,D>    *prims,
+                  const box_t<float,D>    *prims,
 #else
-           const vec_t<float,D>    *prims,
+                  const vec_t<float,D>    *prims,
 #endif
-           const vec_t<float,D>     query
-           // ,
-          /* in: SQUARE of max search distance; out: sqrDist of closest point */
-          // float          &maxQueryDistSquare
+                  const vec_t<float,D>     query,
+                  float                    epsilon
 #if DO_STATS
-          , Stats *d_stats
+                  , Stats *d_stats
 #endif
-          )
+                  )
   {
+    /* nodes get culled if their distance is larger than the current
+       max query dist times this */
+    const float cullScale = 1.f/((1.f+epsilon)*(1.f+epsilon));
     
-    int2 stackBase[32], *stackPtr = stackBase;
-    int nodeID = 0;
-    int offset = 0;
-    int count  = 0;
+    fcp_impl::StackEntry<index_t> stackBase[32], *stackPtr = stackBase;
+    index_t nodeID = 0;
+    index_t offset = 0;
+    int     count  = 0;
 #if DO_STATS
     int numNodes = 0, numPrims = 0;
 #endif
@@ -174,24 +246,21 @@ namespace cuBQL {
         if (count>0)
           // leaf
           break;
-        typename BinaryBVH<float,D>::Node child0 = bvh.nodes[offset+0];
-        typename BinaryBVH<float,D>::Node child1 = bvh.nodes[offset+1];
+        BinaryBVHNode<float,D> child0 = bvh.nodes[offset+0];
+        BinaryBVHNode<float,D> child1 = bvh.nodes[offset+1];
         float dist0 = fSqrDistance(child0.bounds,query);
         float dist1 = fSqrDistance(child1.bounds,query);
-        int closeChild = offset + ((dist0 > dist1) ? 1 : 0);
-        if (dist1 < results.maxDist2) {
-          float dist = max(dist0,dist1);
-          int distBits = __float_as_int(dist);
-          *stackPtr++ = make_int2(closeChild^1,distBits);
-        }
-        if (min(dist0,dist1) > results.maxDist2) {
+        index_t closeChild = offset + ((dist0 > dist1) ? 1 : 0);
+        if (dist1 < results.maxDist2*cullScale)
+          *stackPtr++ = { closeChild^1, max(dist0,dist1) };
+        if (min(dist0,dist1) > results.maxDist2*cullScale) {
           count = 0;
           break;
         }
         nodeID = closeChild;
       }
       for (int i=0;i<count;i++) {
-        int primID = bvh.primIDs[offset+i];
+        index_t primID = bvh.primIDs[offset+i];
 #if DO_STATS
         numPrims++;
 #endif
@@ -218,13 +287,35 @@ namespace cuBQL {
           return;
         }
         --stackPtr;
-        if (__int_as_float(stackPtr->y) > results.maxDist2) continue;
-        nodeID = stackPtr->x;
+        if (stackPtr->dist > results.maxDist2*cullScale) continue;
+        nodeID = stackPtr->nodeID;
         break;
       }
     }
   }
 
+  template<typename ResultList, int D, typename index_t>
+  inline __device__
+  void knn(ResultList &results,
+           const BinaryBVH<float,D,index_t> bvh,
+#if USE_BOXES
+           const box_t<float,D>    *prims,
+#else
+           const vec_t<float,D>    *prims,
+#endif
+           const vec_t<float,D>     query
+#if DO_STATS
+          , Stats *d_stats
+#endif
+          )
+  {
+    knn_approx(results,bvh,prims,query,0.f
+#if DO_STATS
+               ,d_stats
+#endif
+               );
+  }
+
   
 //   template<
 //   inline __device__
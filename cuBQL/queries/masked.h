@@ -0,0 +1,359 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+/*! category-filtered ('masked') queries: each prim carries a
+    category bitmask (eg, one bit for each layer, material, or object
+    ID it belongs to), and each query comes with a query mask; only
+    prims whose mask has at least one bit in common with the query
+    mask will be reported.
+
+    The per-node masks (the OR of all prim masks in that node's
+    subtree) are just another per-node aggregate (see aggregates.h):
+    compute them via computeAggregates() after building the BVH, and
+    update them via refit(bvh,boxes,nodeMasks,primMasks) when
+    refitting. Traversal then skips all subtrees whose node mask does
+    not match the query mask, rather than visiting them and rejecting
+    their prims one by one - which for selective masks removes entire
+    branches from traversal. */
+#pragma once
+
+#include "cuBQL/queries/aggregates.h"
+
+namespace cuBQL {
+
+  /*! per-prim and per-node category mask; bits_t can be uint32_t or
+      uint64_t for up to 32 or 64 categories, respectively */
+  template<typename bits_t>
+  struct CategoryMask {
+    bits_t bits;
+
+    /*! mask for a prim that belongs to (only) the given category */
+    static inline __cubql_both CategoryMask make(int category)
+    { return { bits_t(bits_t(1) << category) }; }
+    static inline __cubql_both CategoryMask empty()
+    { return { bits_t(0) }; }
+    static inline __cubql_both CategoryMask combine(const CategoryMask &a,
+                                                    const CategoryMask &b)
+    { return { bits_t(a.bits | b.bits) }; }
+
+    inline __cubql_both bool matches(bits_t queryMask) const
+    { return (bits & queryMask) != 0; }
+  };
+  using CategoryMask32 = CategoryMask<uint32_t>;
+  using CategoryMask64 = CategoryMask<uint64_t>;
+
+  /*! same as shrinkingRadiusQuery_forEachLeaf(), but only visits
+      leaves that can contain prims matching the given query mask;
+      any subtree whose node mask has no bit in common with queryMask
+      gets skipped entirely. Note the leaves' prims themselves are not
+      filtered by this function, since the lambda may want to check
+      (and reject) prims based on their distance first.
+
+      the lambda should have a signature of
+      [](const uint32_t *primIDs, int numPrims)->float
+  */
+  template<typename bits_t, typename T, int D, typename Lambda>
+  inline __cubql_both
+  void maskedQuery_forEachLeaf(const BinaryBVH<T,D>      bvh,
+                               const CategoryMask<bits_t> *nodeMasks,
+                               bits_t                    queryMask,
+                               const vec_t<T,D>          queryPoint,
+                               float                     sqrMaxSearchDist,
+                               const Lambda             &lambdaToCallOnEachLeaf);
+
+  /*! masked variant of fcp(): finds the closest prim (point or box)
+      whose category matches queryMask, up to the given maximum
+      (square) query distance; returns -1 if no such prim could be
+      found */
+  template<typename bits_t, typename prim_t, typename T, int D>
+  inline __cubql_both
+  int fcp_masked(const BinaryBVH<T,D>       bvh,
+                 const prim_t              *prims,
+                 const CategoryMask<bits_t> *nodeMasks,
+                 const CategoryMask<bits_t> *primMasks,
+                 bits_t                     queryMask,
+                 const vec_t<T,D>           query,
+                 /* in: SQUARE of max search distance; out: sqrDist of found prim */
+                 float                     &maxQueryDistSquare);
+
+#ifdef __CUDACC__
+  /*! masked variant of knn(); like knn() this is device-only, since
+      KNNResults is. 'results' has to have been cleared before
+      calling this */
+  template<typename ResultList, typename bits_t, typename prim_t, typename T, int D>
+  inline __device__
+  void knn_masked(ResultList                &results,
+                  const BinaryBVH<T,D>       bvh,
+                  const prim_t              *prims,
+                  const CategoryMask<bits_t> *nodeMasks,
+                  const CategoryMask<bits_t> *primMasks,
+                  bits_t                     queryMask,
+                  const vec_t<T,D>           query);
+#endif
+
+  /*! masked variant of rangeQuery_forEachPrim(): calls the lambda
+      for each prim within the query range (a box_t or ball_t) whose
+      category matches queryMask. lambda signature is
+      [](uint32_t primID)->int, returning CUBQL_TERMINATE_TRAVERSAL or
+      CUBQL_CONTINUE_TRAVERSAL */
+  template<typename bits_t, typename query_t, typename prim_t,
+           typename T, int D, typename Lambda>
+  inline __cubql_both
+  void rangeQuery_masked_forEachPrim(const BinaryBVH<T,D>       bvh,
+                                     const prim_t              *prims,
+                                     const CategoryMask<bits_t> *nodeMasks,
+                                     const CategoryMask<bits_t> *primMasks,
+                                     bits_t                     queryMask,
+                                     const query_t             &queryRange,
+                                     const Lambda              &lambdaToCallOnEachPrim);
+
+  /*! returns the number of prims within the query range whose
+      category matches queryMask */
+  template<typename bits_t, typename query_t, typename prim_t, typename T, int D>
+  inline __cubql_both
+  int rangeQuery_masked_count(const BinaryBVH<T,D>       bvh,
+                              const prim_t              *prims,
+                              const CategoryMask<bits_t> *nodeMasks,
+                              const CategoryMask<bits_t> *primMasks,
+                              bits_t                     queryMask,
+                              const query_t             &queryRange);
+
+
+  // ==================================================================
+  // IMPLEMENTATION
+  // ==================================================================
+
+  namespace masked_impl {
+    /*! @{ (square) distance between a prim and the query point */
+    template<typename T, int D> inline __cubql_both
+    float primSqrDistance(const vec_t<T,D> &prim, const vec_t<T,D> &query)
+    { return fSqrDistance(prim,query); }
+    template<typename T, int D> inline __cubql_both
+    float primSqrDistance(const box_t<T,D> &prim, const vec_t<T,D> &query)
+    { return fSqrDistance(prim,query); }
+    /*! @} */
+  } // ::cuBQL::masked_impl
+
+  template<typename bits_t, typename T, int D, typename Lambda>
+  inline __cubql_both
+  void maskedQuery_forEachLeaf(const BinaryBVH<T,D>      bvh,
+                               const CategoryMask<bits_t> *nodeMasks,
+                               bits_t                    queryMask,
+                               const vec_t<T,D>          queryPoint,
+                               float                     sqrMaxSearchDist,
+                               const Lambda             &lambdaToCallOnEachLeaf)
+  {
+    if (bvh.numNodes == 0 || !nodeMasks[0].matches(queryMask)) return;
+
+    float sqrCullDist = sqrMaxSearchDist;
+    struct StackEntry {
+      uint32_t idx;
+      float    dist;
+    };
+    const int stackSize = 64;
+    StackEntry traversalStack[stackSize], *stackPtr = traversalStack;
+    uint32_t nodeID = 0;
+    // ------------------------------------------------------------------
+    // traverse until there's nothing left to traverse:
+    // ------------------------------------------------------------------
+    while (true) {
+
+      // ------------------------------------------------------------------
+      // traverse INNER nodes downward; breaking out if we either find
+      // a (matching) leaf within the current search radius, or found
+      // a dead-end at which we need to pop
+      // ------------------------------------------------------------------
+      typename BinaryBVH<T,D>::Node::Admin node = bvh.nodes[nodeID].admin;
+      while (node.count == 0) {
+        const uint32_t n0Idx = node.offset+0;
+        const uint32_t n1Idx = node.offset+1;
+        // children without any matching prims get skipped explicitly,
+        // before looking at their distance at all (treating them as
+        // 'infinitely far away' would not be enough: with an
+        // unbounded search radius, INFINITY <= INFINITY, and they'd
+        // still get traversed)
+        const bool m0 = nodeMasks[n0Idx].matches(queryMask);
+        const bool m1 = nodeMasks[n1Idx].matches(queryMask);
+        const float d0 = m0 ? fSqrDistance(bvh.nodes[n0Idx].bounds,queryPoint) : 0.f;
+        const float d1 = m1 ? fSqrDistance(bvh.nodes[n1Idx].bounds,queryPoint) : 0.f;
+        const bool o0 = m0 && d0 <= sqrCullDist;
+        const bool o1 = m1 && d1 <= sqrCullDist;
+        if (!o0 && !o1) {
+          // both children are too far away (or don't match); this is
+          // a dead end
+          break;
+        }
+        if (!o1) {
+          nodeID = n0Idx;
+        } else if (!o0) {
+          nodeID = n1Idx;
+        } else {
+          uint32_t farID;
+          if (d0 <= d1) {
+            nodeID = n0Idx;
+            farID  = n1Idx;
+          } else {
+            nodeID = n1Idx;
+            farID  = n0Idx;
+          }
+          if (stackPtr >= traversalStack+stackSize) {
+            // printf("stack overflow\n");
+            return;
+          }
+          *stackPtr++ = StackEntry{ farID, max(d0,d1) };
+        }
+        node = bvh.nodes[nodeID].admin;
+      }
+
+      if (node.count != 0) {
+        // we're at a valid leaf: call the lambda and see if that gave
+        // us a new, closer cull radius
+        float leafResult
+          = lambdaToCallOnEachLeaf(bvh.primIDs+node.offset,(int)node.count);
+        if (leafResult < 0.f) return;
+        sqrCullDist = min(sqrCullDist,leafResult);
+      }
+      // ------------------------------------------------------------------
+      // pop next un-traversed node from stack, discarding any nodes
+      // that are more distant than whatever query radius we now have
+      // ------------------------------------------------------------------
+      while (true) {
+        if (stackPtr == traversalStack)
+          return;
+        StackEntry fromStack = *--stackPtr;
+        if (fromStack.dist <= sqrCullDist) {
+          nodeID = fromStack.idx;
+          break;
+        }
+      }
+    }
+  }
+
+  template<typename bits_t, typename prim_t, typename T, int D>
+  inline __cubql_both
+  int fcp_masked(const BinaryBVH<T,D>       bvh,
+                 const prim_t              *prims,
+                 const CategoryMask<bits_t> *nodeMasks,
+                 const CategoryMask<bits_t> *primMasks,
+                 bits_t                     queryMask,
+                 const vec_t<T,D>           query,
+                 float                     &maxQueryDistSquare)
+  {
+    int result = -1;
+    auto leafCode
+      = [&](const uint32_t *primIDs, int numPrims)->float
+      {
+        for (int i=0;i<numPrims;i++) {
+          const uint32_t primID = primIDs[i];
+          if (!primMasks[primID].matches(queryMask)) continue;
+          float dist2 = masked_impl::primSqrDistance(prims[primID],query);
+          if (dist2 >= maxQueryDistSquare) continue;
+          maxQueryDistSquare = dist2;
+          result             = primID;
+        }
+        return maxQueryDistSquare;
+      };
+    maskedQuery_forEachLeaf(bvh,nodeMasks,queryMask,query,maxQueryDistSquare,leafCode);
+    return result;
+  }
+
+#ifdef __CUDACC__
+  template<typename ResultList, typename bits_t, typename prim_t, typename T, int D>
+  inline __device__
+  void knn_masked(ResultList                &results,
+                  const BinaryBVH<T,D>       bvh,
+                  const prim_t              *prims,
+                  const CategoryMask<bits_t> *nodeMasks,
+                  const CategoryMask<bits_t> *primMasks,
+                  bits_t                     queryMask,
+                  const vec_t<T,D>           query)
+  {
+    auto leafCode
+      = [&](const uint32_t *primIDs, int numPrims)->float
+      {
+        for (int i=0;i<numPrims;i++) {
+          const uint32_t primID = primIDs[i];
+          if (!primMasks[primID].matches(queryMask)) continue;
+          float dist2 = masked_impl::primSqrDistance(prims[primID],query);
+          if (dist2 >= results.maxDist2) continue;
+          results.insert(dist2,primID);
+        }
+        return results.maxDist2;
+      };
+    maskedQuery_forEachLeaf(bvh,nodeMasks,queryMask,query,results.maxDist2,leafCode);
+  }
+#endif
+
+  template<typename bits_t, typename query_t, typename prim_t,
+           typename T, int D, typename Lambda>
+  inline __cubql_both
+  void rangeQuery_masked_forEachPrim(const BinaryBVH<T,D>       bvh,
+                                     const prim_t              *prims,
+                                     const CategoryMask<bits_t> *nodeMasks,
+                                     const CategoryMask<bits_t> *primMasks,
+                                     bits_t                     queryMask,
+                                     const query_t             &queryRange,
+                                     const Lambda              &lambdaToCallOnEachPrim)
+  {
+    if (bvh.numNodes == 0) return;
+    const int stackSize = 64;
+    uint32_t traversalStack[stackSize], *stackPtr = traversalStack;
+    uint32_t nodeID = 0;
+    while (true) {
+      const typename BinaryBVH<T,D>::Node node = bvh.nodes[nodeID];
+      if (!nodeMasks[nodeID].matches(queryMask)
+          || !rangeQuery_impl::overlaps(queryRange,node.bounds)) {
+        // nothing in here that we could be interested in
+      } else if (node.admin.count != 0) {
+        for (int i=0;i<(int)node.admin.count;i++) {
+          const uint32_t primID = bvh.primIDs[node.admin.offset+i];
+          if (!primMasks[primID].matches(queryMask)) continue;
+          if (!rangeQuery_impl::inRange(queryRange,prims[primID])) continue;
+          if (lambdaToCallOnEachPrim(primID) == CUBQL_TERMINATE_TRAVERSAL)
+            return;
+        }
+      } else {
+        if (stackPtr >= traversalStack+stackSize) {
+          // printf("stack overflow\n");
+          return;
+        }
+        *stackPtr++ = node.admin.offset+1;
+        nodeID = node.admin.offset+0;
+        continue;
+      }
+      if (stackPtr == traversalStack)
+        return;
+      nodeID = *--stackPtr;
+    }
+  }
+
+  template<typename bits_t, typename query_t, typename prim_t, typename T, int D>
+  inline __cubql_both
+  int rangeQuery_masked_count(const BinaryBVH<T,D>       bvh,
+                              const prim_t              *prims,
+                              const CategoryMask<bits_t> *nodeMasks,
+                              const CategoryMask<bits_t> *primMasks,
+                              bits_t                     queryMask,
+                              const query_t             &queryRange)
+  {
+    int count = 0;
+    rangeQuery_masked_forEachPrim(bvh,prims,nodeMasks,primMasks,queryMask,queryRange,
+                                  [&count](uint32_t)->int
+                                  { count++; return CUBQL_CONTINUE_TRAVERSAL; });
+    return count;
+  }
+
+} // ::cuBQL
@@ -0,0 +1,255 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+/*! incremental ("best-first") nearest neighbor queries: rather than
+    finding a fixed number of k nearest neighbors, this returns one
+    neighbor at a time, in order of increasing distance, for as long
+    as the caller keeps asking for more. This is useful if the caller
+    needs 'the nearest prim that fulfills some condition', where that
+    condition is expensive and should only be evaluated lazily, and
+    where it's not known up front how many neighbors need to be
+    looked at */
+#pragma once
+
+#include "cuBQL/bvh.h"
+
+namespace cuBQL {
+
+  /*! resumable best-first nearest neighbor traversal. Example:
+
+      NearestIterator<vec3f> it(bvh,points,queryPoint);
+      uint32_t primID; float sqrDist;
+      while (it.next(primID,sqrDist))
+        if (isWhatIWant(primID)) break;
+
+      prim_t can be a vec_t<T,D> (points) or box_t<T,D> (boxes).
+
+      Internally this uses a min-priority queue (a binary heap) of
+      both nodes and prims, ordered by (square) distance to the query
+      point. Since this has to work on the device, too, that heap has a
+      fixed capacity of HeapSize entries; if it ever overflows, the
+      most distant entry gets dropped, and the iterator remembers the
+      distance of that entry: all results returned up to that distance
+      are still correct (and in order), but once next() would have to
+      return anything beyond that distance it will stop, and
+      wasTruncated() will return true. Larger HeapSize make this less
+      likely, at the cost of more (register/stack) memory.
+
+      Each heap entry packs its distance and a 32-bit payload into a
+      single 64-bit key, where the payload's top bit (IS_PRIM) tells
+      prims from nodes; so both prim and node IDs have to be below
+      2^31. This is checked by an assert() in debug builds.
+  */
+  template<typename prim_t, int HeapSize=64>
+  struct NearestIterator {
+    using scalar_t = typename prim_t::scalar_t;
+    enum { numDims = prim_t::numDims };
+    using bvh_t  = BinaryBVH<scalar_t,numDims>;
+    using vec_t  = cuBQL::vec_t<scalar_t,numDims>;
+
+    /*! creates an iterator over all prims within (square) distance
+        sqrMaxDist of the query point */
+    inline __cubql_both
+    NearestIterator(const bvh_t   bvh,
+                    const prim_t *prims,
+                    const vec_t   queryPoint,
+                    float         sqrMaxDist = INFINITY);
+
+    /*! finds the next-closest prim (if one exists), and returns true
+        if such was found, or false if there are no more prims (within
+        the max query distance). */
+    inline __cubql_both
+    bool next(uint32_t &primID, float &sqrDist);
+
+    /*! returns true if next() stopped early because the heap
+        overflowed, and some prims beyond what was returned so far may
+        have been lost */
+    inline __cubql_both
+    bool wasTruncated() const { return truncated; }
+
+  private:
+    inline __cubql_both static uint64_t makeEntry(float dist, uint32_t payload);
+    inline __cubql_both static float    getDist(uint64_t entry);
+    inline __cubql_both void     push(float dist, uint32_t payload);
+    inline __cubql_both uint64_t pop();
+
+    /*! bit in the entry's payload that marks it as a prim rather than
+        a node */
+    enum : uint32_t { IS_PRIM = 0x80000000u };
+
+    const bvh_t   bvh;
+    const prim_t *prims;
+    const vec_t   queryPoint;
+    const float   sqrMaxDist;
+    /*! (square) distance of the closest entry we ever had to drop */
+    float         sqrTruncationDist = INFINITY;
+    bool          truncated = false;
+    int           numEntries = 0;
+    uint64_t      heap[HeapSize];
+  };
+
+
+  // ==================================================================
+  // IMPLEMENTATION
+  // ==================================================================
+
+  namespace nearestIterator_impl {
+    /*! @{ (square) distance between query point and a prim */
+    template<typename T, int D> inline __cubql_both
+    float primSqrDistance(const vec_t<T,D> &prim, const vec_t<T,D> &query)
+    { return fSqrDistance(prim,query); }
+    template<typename T, int D> inline __cubql_both
+    float primSqrDistance(const box_t<T,D> &prim, const vec_t<T,D> &query)
+    { return fSqrDistance(prim,query); }
+    /*! @} */
+
+    /*! @{ float<->bits conversion that works on both host and device
+        (__float_as_uint() etc are device-only) */
+    inline __cubql_both uint32_t floatAsBits(float f)
+    { union { float f; uint32_t u; } v; v.f = f; return v.u; }
+    inline __cubql_both float bitsAsFloat(uint32_t u)
+    { union { float f; uint32_t u; } v; v.u = u; return v.f; }
+    /*! @} */
+  } // ::cuBQL::nearestIterator_impl
+
+  template<typename prim_t, int HeapSize>
+  inline __cubql_both
+  NearestIterator<prim_t,HeapSize>::NearestIterator(const bvh_t   bvh,
+                                                    const prim_t *prims,
+                                                    const vec_t   queryPoint,
+                                                    float         sqrMaxDist)
+    : bvh(bvh), prims(prims), queryPoint(queryPoint), sqrMaxDist(sqrMaxDist)
+  {
+    // prim and node IDs share the payload with the IS_PRIM bit
+    assert(bvh.numPrims <= IS_PRIM && bvh.numNodes <= IS_PRIM);
+    if (bvh.numNodes == 0) return;
+    float rootDist = fSqrDistance(bvh.nodes[0].bounds,queryPoint);
+    if (rootDist <= sqrMaxDist)
+      push(rootDist,0);
+  }
+
+  template<typename prim_t, int HeapSize>
+  inline __cubql_both
+  uint64_t NearestIterator<prim_t,HeapSize>::makeEntry(float dist, uint32_t payload)
+  {
+    // distances are never negative, so the float's bits sort the
+    // same way the floats do
+    return uint64_t(payload) | (uint64_t(nearestIterator_impl::floatAsBits(dist)) << 32);
+  }
+
+  template<typename prim_t, int HeapSize>
+  inline __cubql_both
+  float NearestIterator<prim_t,HeapSize>::getDist(uint64_t entry)
+  {
+    return nearestIterator_impl::bitsAsFloat(uint32_t(entry >> 32));
+  }
+
+  template<typename prim_t, int HeapSize>
+  inline __cubql_both
+  void NearestIterator<prim_t,HeapSize>::push(float dist, uint32_t payload)
+  {
+    uint64_t entry = makeEntry(dist,payload);
+    int pos;
+    if (numEntries < HeapSize) {
+      pos = numEntries++;
+    } else {
+      /* heap is full: find the most distant entry (which has to be
+         one of the heap's leaves, ie, in the second half), and drop
+         either that one or the new one, whichever is further away */
+      int maxPos = HeapSize/2;
+      for (int i=maxPos+1;i<HeapSize;i++)
+        if (heap[i] > heap[maxPos]) maxPos = i;
+      if (entry >= heap[maxPos]) {
+        sqrTruncationDist = min(sqrTruncationDist,dist);
+        return;
+      }
+      sqrTruncationDist = min(sqrTruncationDist,getDist(heap[maxPos]));
+      pos = maxPos;
+    }
+    // sift up
+    while (pos > 0) {
+      int parent = (pos-1)/2;
+      if (heap[parent] <= entry) break;
+      heap[pos] = heap[parent];
+      pos = parent;
+    }
+    heap[pos] = entry;
+  }
+
+  template<typename prim_t, int HeapSize>
+  inline __cubql_both
+  uint64_t NearestIterator<prim_t,HeapSize>::pop()
+  {
+    uint64_t top  = heap[0];
+    uint64_t last = heap[--numEntries];
+    // sift down
+    int pos = 0;
+    while (true) {
+      int cc = 2*pos+1;
+      if (cc >= numEntries) break;
+      if (cc+1 < numEntries && heap[cc+1] < heap[cc]) cc++;
+      if (last <= heap[cc]) break;
+      heap[pos] = heap[cc];
+      pos = cc;
+    }
+    heap[pos] = last;
+    return top;
+  }
+
+  template<typename prim_t, int HeapSize>
+  inline __cubql_both
+  bool NearestIterator<prim_t,HeapSize>::next(uint32_t &primID, float &sqrDist)
+  {
+    while (numEntries > 0) {
+      if (getDist(heap[0]) > sqrTruncationDist) {
+        // whatever comes next might be further away than something we
+        // had to drop - we cannot guarantee the order any more
+        truncated = true;
+        return false;
+      }
+      const uint64_t entry   = pop();
+      const float    dist    = getDist(entry);
+      const uint32_t payload = uint32_t(entry);
+      if (payload & IS_PRIM) {
+        primID  = payload & ~IS_PRIM;
+        sqrDist = dist;
+        return true;
+      }
+      const typename bvh_t::Node::Admin node = bvh.nodes[payload].admin;
+      if (node.count != 0) {
+        for (int i=0;i<(int)node.count;i++) {
+          uint32_t leafPrim = bvh.primIDs[node.offset+i];
+          float primDist
+            = nearestIterator_impl::primSqrDistance(prims[leafPrim],queryPoint);
+          if (primDist <= sqrMaxDist)
+            push(primDist,leafPrim | IS_PRIM);
+        }
+      } else {
+        for (int c=0;c<2;c++) {
+          uint32_t childID = uint32_t(node.offset)+c;
+          float childDist = fSqrDistance(bvh.nodes[childID].bounds,queryPoint);
+          if (childDist <= sqrMaxDist)
+            push(childDist,childID);
+        }
+      }
+    }
+    // the heap ran empty - but if we ever had to drop anything, that
+    // is what would have come next
+    truncated = (sqrTruncationDist != INFINITY);
+    return false;
+  }
+
+} // ::cuBQL
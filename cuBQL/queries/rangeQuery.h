@@ -0,0 +1,487 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+/*! range queries: find all primitives (points or boxes) that are
+    within a given query range, where that range is either a ball
+    (ie, 'all prims within radius r of point p') or an axis-aligned
+    box.
+
+    For batches of such queries the results are returned in a
+    'compressed sparse row' (CSR) form: for query i, the IDs of all
+    primitives in range are stored in primIDs[offsets[i]] through
+    primIDs[offsets[i+1]-1]. These are computed in two passes - one
+    that only counts the results of each query, then an exclusive
+    prefix sum over those counts, then one that writes the results -
+    so no query ever has to atomically allocate space in a global
+    output array. */
+#pragma once
+
+#include "cuBQL/bvh.h"
+#include "cuBQL/queries/common.h"
+#include "cuBQL/impl/parallel_for.h"
+#include <vector>
+#ifdef __CUDACC__
+# include <cub/cub.cuh>
+#endif
+
+namespace cuBQL {
+
+  /*! a ball-shaped query range; a prim is in range if its (square)
+      distance to the center is at most radius*radius */
+  template<typename T, int D>
+  struct ball_t {
+    vec_t<T,D> center;
+    float      radius;
+  };
+
+  using ball2f = ball_t<float,2>;
+  using ball3f = ball_t<float,3>;
+  using ball4f = ball_t<float,4>;
+
+  /*! a ball-shaped query range given by its square radius; a prim is
+      in range if its (square) distance to the center is at most
+      sqrRadius. For callers that already have a square distance
+      this avoids the sqrt()-then-square round trip of ball_t, which
+      can move prims that are exactly at that distance in or out of
+      range */
+  template<typename T, int D>
+  struct sqrBall_t {
+    vec_t<T,D> center;
+    float      sqrRadius;
+  };
+
+  /*! (device-side) result of a batch of range queries, in CSR form:
+      the results of query i are primIDs[offsets[i]..offsets[i+1]).
+      Both arrays will get (re-)allocated by the query if they are
+      too small, so the same result can be re-used across multiple
+      batches without having to re-allocate every time. Free via
+      cuBQL::free(result,...). Each single query can have at most
+      numPrims results, but a batch of them can easily have more
+      than 2^32 in total, so offsets are 64-bit */
+  struct RangeQueryResult {
+    /*! numQueries+1 entries; offsets[numQueries] == numResults */
+    uint64_t *offsets    = 0;
+    uint32_t *primIDs    = 0;
+    uint32_t  numQueries = 0;
+    uint64_t  numResults = 0;
+    uint32_t  offsetsCapacity = 0;
+    uint64_t  primIDsCapacity = 0;
+  };
+
+  /*! iterates over all leaves of the BVH whose bounding boxes
+      overlap the given query range (a ball_t<T,D>, sqrBall_t<T,D>,
+      or box_t<T,D>), and calls the provided lambda for each such
+      leaf. The lambda should have a signature of
+      [](const uint32_t *primIDs, int numPrims)->int, and return
+      either CUBQL_CONTINUE_TRAVERSAL or CUBQL_TERMINATE_TRAVERSAL */
+  template<typename query_t, typename T, int D, typename Lambda>
+  inline __cubql_both
+  void rangeQuery_forEachLeaf(const BinaryBVH<T,D> bvh,
+                              const query_t       &queryRange,
+                              const Lambda        &lambdaToCallOnEachLeaf);
+
+  /*! iterates over all primitives that are actually inside the given
+      query range (a ball_t<T,D>, sqrBall_t<T,D>, or box_t<T,D>);
+      prims can be either vec_t<T,D> (points) or box_t<T,D>
+      (boxes). The lambda should have a signature of
+      [](uint32_t primID)->int, and return either
+      CUBQL_CONTINUE_TRAVERSAL or CUBQL_TERMINATE_TRAVERSAL */
+  template<typename query_t, typename prim_t, typename T, int D, typename Lambda>
+  inline __cubql_both
+  void rangeQuery_forEachPrim(const BinaryBVH<T,D> bvh,
+                              const prim_t        *prims,
+                              const query_t       &queryRange,
+                              const Lambda        &lambdaToCallOnEachPrim);
+
+  /*! returns the number of prims within the given query range */
+  template<typename query_t, typename prim_t, typename T, int D>
+  inline __cubql_both
+  uint32_t rangeQuery_count(const BinaryBVH<T,D> bvh,
+                            const prim_t        *prims,
+                            const query_t       &queryRange);
+
+#ifdef __CUDACC__
+  /*! for a batch of queries (each either a ball_t<T,D> or a
+      box_t<T,D>), computes only the number of prims that are within
+      each query's range, and writes those into counts[queryID]. All
+      arrays must be device-readable. Does not sync. */
+  template<typename query_t, typename prim_t, typename T, int D>
+  void rangeQuery_count(uint32_t            *counts,
+                        const query_t       *queries,
+                        int                  numQueries,
+                        const BinaryBVH<T,D> bvh,
+                        const prim_t        *prims,
+                        cudaStream_t         s=0);
+
+  /*! for a batch of queries (each either a ball_t<T,D> or a
+      box_t<T,D>), computes the IDs of all prims within each query's
+      range, and stores them in CSR form in 'result' (see
+      RangeQueryResult). Uses a count pass, an exclusive prefix sum,
+      and a fill pass; since it has to read back the total number
+      of results this function DOES sync the stream. */
+  template<typename query_t, typename prim_t, typename T, int D>
+  void rangeQuery(RangeQueryResult    &result,
+                  const query_t       *queries,
+                  int                  numQueries,
+                  const BinaryBVH<T,D> bvh,
+                  const prim_t        *prims,
+                  cudaStream_t         s=0,
+                  GpuMemoryResource   &memResource=defaultGpuMemResource());
+
+  /*! frees the memory allocated by rangeQuery() */
+  inline void free(RangeQueryResult  &result,
+                   cudaStream_t       s=0,
+                   GpuMemoryResource &memResource=defaultGpuMemResource());
+#endif
+
+  namespace host {
+    /*! host-side equivalent of cuBQL::rangeQuery_count() */
+    template<typename query_t, typename prim_t, typename T, int D>
+    void rangeQuery_count(uint32_t            *counts,
+                          const query_t       *queries,
+                          int                  numQueries,
+                          const BinaryBVH<T,D> bvh,
+                          const prim_t        *prims);
+
+    /*! host-side equivalent of cuBQL::rangeQuery(), using host
+        threads; all arrays must be host-readable. 'offsets' will
+        have numQueries+1 entries on return */
+    template<typename query_t, typename prim_t, typename T, int D>
+    void rangeQuery(std::vector<uint64_t> &offsets,
+                    std::vector<uint32_t> &primIDs,
+                    const query_t         *queries,
+                    int                    numQueries,
+                    const BinaryBVH<T,D>   bvh,
+                    const prim_t          *prims);
+  }
+
+
+  // ==================================================================
+  // IMPLEMENTATION
+  // ==================================================================
+
+  namespace rangeQuery_impl {
+    /*! @{ does the given query range overlap the given node box? */
+    template<typename T, int D> inline __cubql_both
+    bool overlaps(const box_t<T,D> &query, const box_t<T,D> &nodeBounds)
+    { return query.overlaps(nodeBounds); }
+    template<typename T, int D> inline __cubql_both
+    bool overlaps(const ball_t<T,D> &query, const box_t<T,D> &nodeBounds)
+    { return fSqrDistance(nodeBounds,query.center) <= query.radius*query.radius; }
+    template<typename T, int D> inline __cubql_both
+    bool overlaps(const sqrBall_t<T,D> &query, const box_t<T,D> &nodeBounds)
+    { return fSqrDistance(nodeBounds,query.center) <= query.sqrRadius; }
+    /*! @} */
+
+    /*! @{ is the given primitive inside the given query range? */
+    template<typename T, int D> inline __cubql_both
+    bool inRange(const box_t<T,D> &query, const vec_t<T,D> &point)
+    { return query.overlaps(box_t<T,D>(point)); }
+    template<typename T, int D> inline __cubql_both
+    bool inRange(const box_t<T,D> &query, const box_t<T,D> &box)
+    { return query.overlaps(box); }
+    template<typename T, int D> inline __cubql_both
+    bool inRange(const ball_t<T,D> &query, const vec_t<T,D> &point)
+    { return fSqrDistance(point,query.center) <= query.radius*query.radius; }
+    template<typename T, int D> inline __cubql_both
+    bool inRange(const ball_t<T,D> &query, const box_t<T,D> &box)
+    { return fSqrDistance(box,query.center) <= query.radius*query.radius; }
+    template<typename T, int D> inline __cubql_both
+    bool inRange(const sqrBall_t<T,D> &query, const vec_t<T,D> &point)
+    { return fSqrDistance(point,query.center) <= query.sqrRadius; }
+    template<typename T, int D> inline __cubql_both
+    bool inRange(const sqrBall_t<T,D> &query, const box_t<T,D> &box)
+    { return fSqrDistance(box,query.center) <= query.sqrRadius; }
+    /*! @} */
+  } // ::cuBQL::rangeQuery_impl
+
+  template<typename query_t, typename T, int D, typename Lambda>
+  inline __cubql_both
+  void rangeQuery_forEachLeaf(const BinaryBVH<T,D> bvh,
+                              const query_t       &queryRange,
+                              const Lambda        &lambdaToCallOnEachLeaf)
+  {
+    using node_t = typename BinaryBVH<T,D>::Node;
+    if (bvh.numNodes == 0) return;
+    if (!rangeQuery_impl::overlaps(queryRange,bvh.nodes[0].bounds)) return;
+
+    const int stackSize = 64;
+    typename node_t::Admin traversalStack[stackSize], *stackPtr = traversalStack;
+    typename node_t::Admin node = bvh.nodes[0].admin;
+    // ------------------------------------------------------------------
+    // traverse until there's nothing left to traverse:
+    // ------------------------------------------------------------------
+    while (true) {
+
+      // ------------------------------------------------------------------
+      // traverse INNER nodes downward; breaking out if we either find
+      // a leaf that overlaps the query range, or found a dead-end
+      // at which we need to pop
+      // ------------------------------------------------------------------
+      while (true) {
+        if (node.count != 0)
+          // this is a leaf; step out of down-traversal and let leaf
+          // code pop in.
+          break;
+
+        node_t n0 = bvh.nodes[node.offset+0];
+        node_t n1 = bvh.nodes[node.offset+1];
+        bool o0 = rangeQuery_impl::overlaps(queryRange,n0.bounds);
+        bool o1 = rangeQuery_impl::overlaps(queryRange,n1.bounds);
+        if (o0) {
+          if (o1) {
+            if (stackPtr >= traversalStack+stackSize) {
+              // printf("stack overflow\n");
+              return;
+            }
+            *stackPtr++ = n1.admin;
+          }
+          node = n0.admin;
+        } else {
+          if (o1) {
+            node = n1.admin;
+          } else {
+            // neither child overlaps the range; this is a dead end
+            node.count = 0;
+            break;
+          }
+        }
+      }
+
+      if (node.count != 0) {
+        // we're at a valid leaf: call the lambda and see if that
+        // wants us to terminate
+        int leafResult
+          = lambdaToCallOnEachLeaf(bvh.primIDs+node.offset,(int)node.count);
+        if (leafResult == CUBQL_TERMINATE_TRAVERSAL)
+          return;
+      }
+      // ------------------------------------------------------------------
+      // pop next un-traversed node from stack
+      // ------------------------------------------------------------------
+      if (stackPtr == traversalStack)
+        return;
+      node = *--stackPtr;
+    }
+  }
+
+  template<typename query_t, typename prim_t, typename T, int D, typename Lambda>
+  inline __cubql_both
+  void rangeQuery_forEachPrim(const BinaryBVH<T,D> bvh,
+                              const prim_t        *prims,
+                              const query_t       &queryRange,
+                              const Lambda        &lambdaToCallOnEachPrim)
+  {
+    auto leafCode
+      = [prims,&queryRange,&lambdaToCallOnEachPrim](const uint32_t *primIDs, int numPrims)->int
+      {
+        for (int i=0;i<numPrims;i++) {
+          const uint32_t primID = primIDs[i];
+          if (!rangeQuery_impl::inRange(queryRange,prims[primID])) continue;
+          if (lambdaToCallOnEachPrim(primID) == CUBQL_TERMINATE_TRAVERSAL)
+            return CUBQL_TERMINATE_TRAVERSAL;
+        }
+        return CUBQL_CONTINUE_TRAVERSAL;
+      };
+    rangeQuery_forEachLeaf(bvh,queryRange,leafCode);
+  }
+
+  template<typename query_t, typename prim_t, typename T, int D>
+  inline __cubql_both
+  uint32_t rangeQuery_count(const BinaryBVH<T,D> bvh,
+                            const prim_t        *prims,
+                            const query_t       &queryRange)
+  {
+    uint32_t count = 0;
+    rangeQuery_forEachPrim(bvh,prims,queryRange,
+                           [&count](uint32_t)->int
+                           { count++; return CUBQL_CONTINUE_TRAVERSAL; });
+    return count;
+  }
+
+#ifdef __CUDACC__
+  namespace rangeQuery_impl {
+    template<typename count_t, typename query_t, typename prim_t, typename T, int D>
+    __global__
+    void countResults(count_t             *counts,
+                      const query_t       *queries,
+                      int                  numQueries,
+                      const BinaryBVH<T,D> bvh,
+                      const prim_t        *prims)
+    {
+      const int tid = threadIdx.x+blockIdx.x*blockDim.x;
+      if (tid >= numQueries) return;
+      counts[tid] = rangeQuery_count(bvh,prims,queries[tid]);
+    }
+
+    template<typename query_t, typename prim_t, typename T, int D>
+    __global__
+    void writeResults(uint32_t            *primIDs,
+                      const uint64_t      *offsets,
+                      const query_t       *queries,
+                      int                  numQueries,
+                      const BinaryBVH<T,D> bvh,
+                      const prim_t        *prims)
+    {
+      const int tid = threadIdx.x+blockIdx.x*blockDim.x;
+      if (tid >= numQueries) return;
+      uint64_t out = offsets[tid];
+      rangeQuery_forEachPrim(bvh,prims,queries[tid],
+                             [primIDs,&out](uint32_t primID)->int
+                             { primIDs[out++] = primID; return CUBQL_CONTINUE_TRAVERSAL; });
+    }
+  } // ::cuBQL::rangeQuery_impl
+
+  template<typename query_t, typename prim_t, typename T, int D>
+  void rangeQuery_count(uint32_t            *counts,
+                        const query_t       *queries,
+                        int                  numQueries,
+                        const BinaryBVH<T,D> bvh,
+                        const prim_t        *prims,
+                        cudaStream_t         s)
+  {
+    if (numQueries <= 0) return;
+    rangeQuery_impl::countResults<<<divRoundUp(numQueries,128),128,0,s>>>
+      (counts,queries,numQueries,bvh,prims);
+    // we're not syncing here - let APP do that
+  }
+
+  template<typename query_t, typename prim_t, typename T, int D>
+  void rangeQuery(RangeQueryResult    &result,
+                  const query_t       *queries,
+                  int                  numQueries,
+                  const BinaryBVH<T,D> bvh,
+                  const prim_t        *prims,
+                  cudaStream_t         s,
+                  GpuMemoryResource   &memResource)
+  {
+    result.numQueries = numQueries;
+    result.numResults = 0;
+    const uint32_t numOffsets = numQueries+1;
+    if (numOffsets > result.offsetsCapacity) {
+      if (result.offsets)
+        CUBQL_CUDA_CHECK(memResource.free(result.offsets,s));
+      CUBQL_CUDA_CHECK(memResource.malloc((void**)&result.offsets,
+                                          numOffsets*sizeof(uint64_t),s));
+      result.offsetsCapacity = numOffsets;
+    }
+
+    // ------------------------------------------------------------------
+    // pass 1: count results per query; with one extra (always-zero)
+    // counter at the end so the prefix sum also gives the total. We
+    // count in 64 bits so the prefix sum gets done in 64 bits, too
+    // ------------------------------------------------------------------
+    uint64_t *counts = 0;
+    CUBQL_CUDA_CHECK(memResource.malloc((void**)&counts,numOffsets*sizeof(uint64_t),s));
+    CUBQL_CUDA_CALL(MemsetAsync(counts+numQueries,0,sizeof(uint64_t),s));
+    if (numQueries > 0)
+      rangeQuery_impl::countResults<<<divRoundUp(numQueries,128),128,0,s>>>
+        (counts,queries,numQueries,bvh,prims);
+
+    // ------------------------------------------------------------------
+    // exclusive prefix sum over counts gives the CSR offsets
+    // ------------------------------------------------------------------
+    void   *d_temp_storage     = 0;
+    size_t  temp_storage_bytes = 0;
+    cub::DeviceScan::ExclusiveSum(d_temp_storage,temp_storage_bytes,
+                                  counts,result.offsets,(int)numOffsets,s);
+    CUBQL_CUDA_CHECK(memResource.malloc(&d_temp_storage,temp_storage_bytes,s));
+    cub::DeviceScan::ExclusiveSum(d_temp_storage,temp_storage_bytes,
+                                  counts,result.offsets,(int)numOffsets,s);
+    CUBQL_CUDA_CHECK(memResource.free(d_temp_storage,s));
+    CUBQL_CUDA_CHECK(memResource.free(counts,s));
+
+    uint64_t numResults = 0;
+    CUBQL_CUDA_CALL(MemcpyAsync(&numResults,result.offsets+numQueries,sizeof(numResults),
+                                cudaMemcpyDefault,s));
+    CUBQL_CUDA_CALL(StreamSynchronize(s));
+
+    // ------------------------------------------------------------------
+    // grow primIDs if required, then run pass 2: write results
+    // ------------------------------------------------------------------
+    if (numResults > result.primIDsCapacity) {
+      if (result.primIDs)
+        CUBQL_CUDA_CHECK(memResource.free(result.primIDs,s));
+      CUBQL_CUDA_CHECK(memResource.malloc((void**)&result.primIDs,
+                                          numResults*sizeof(uint32_t),s));
+      result.primIDsCapacity = numResults;
+    }
+    result.numResults = numResults;
+    if (numResults > 0)
+      rangeQuery_impl::writeResults<<<divRoundUp(numQueries,128),128,0,s>>>
+        (result.primIDs,result.offsets,queries,numQueries,bvh,prims);
+  }
+
+  inline void free(RangeQueryResult  &result,
+                   cudaStream_t       s,
+                   GpuMemoryResource &memResource)
+  {
+    if (result.offsets)
+      CUBQL_CUDA_CHECK(memResource.free(result.offsets,s));
+    if (result.primIDs)
+      CUBQL_CUDA_CHECK(memResource.free(result.primIDs,s));
+    result = RangeQueryResult();
+  }
+#endif
+
+  namespace host {
+    template<typename query_t, typename prim_t, typename T, int D>
+    void rangeQuery_count(uint32_t            *counts,
+                          const query_t       *queries,
+                          int                  numQueries,
+                          const BinaryBVH<T,D> bvh,
+                          const prim_t        *prims)
+    {
+      parallel_for(numQueries,[&](size_t queryID) {
+        counts[queryID] = cuBQL::rangeQuery_count(bvh,prims,queries[queryID]);
+      });
+    }
+
+    template<typename query_t, typename prim_t, typename T, int D>
+    void rangeQuery(std::vector<uint64_t> &offsets,
+                    std::vector<uint32_t> &primIDs,
+                    const query_t         *queries,
+                    int                    numQueries,
+                    const BinaryBVH<T,D>   bvh,
+                    const prim_t          *prims)
+    {
+      offsets.resize(numQueries+1);
+      parallel_for(numQueries,[&](size_t queryID) {
+        offsets[queryID] = cuBQL::rangeQuery_count(bvh,prims,queries[queryID]);
+      });
+      // in-place exclusive prefix sum; this is cheap enough compared
+      // to the queries themselves to do serially
+      uint64_t sum = 0;
+      for (int i=0;i<numQueries;i++) {
+        uint64_t count = offsets[i];
+        offsets[i] = sum;
+        sum += count;
+      }
+      offsets[numQueries] = sum;
+
+      primIDs.resize(sum);
+      uint32_t *out = primIDs.data();
+      parallel_for(numQueries,[&](size_t queryID) {
+        uint64_t pos = offsets[queryID];
+        cuBQL::rangeQuery_forEachPrim(bvh,prims,queries[queryID],
+                                      [out,&pos](uint32_t primID)->int
+                                      { out[pos++] = primID; return CUBQL_CONTINUE_TRAVERSAL; });
+      });
+    }
+  } // ::cuBQL::host
+
+} // ::cuBQL
+
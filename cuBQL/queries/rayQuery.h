@@ -0,0 +1,237 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+/*! generic ray traversal over a 3D BVH; this only does the
+    traversal, the actual primitive intersection is done by the
+    callback (see, for example, cuBQL/triangles/rays.h) */
+#pragma once
+
+#include "cuBQL/bvh.h"
+
+namespace cuBQL {
+
+  /*! a ray, with origin, direction, and a [tMin,tMax] interval along
+      that ray that we're interested in. direction does not have to
+      be normalized */
+  struct Ray {
+    vec3f origin;
+    vec3f direction;
+    float tMin = 0.f;
+    float tMax = INFINITY;
+  };
+
+  /*! performs a front-to-back traversal of all leaves whose bounding
+      boxes are intersected by the given ray within [ray.tMin,tMax],
+      and calls the provided lambda for each such leaf. As with the
+      'shrinking radius' queries this lambda returns a new value for
+      tMax (eg, the distance to the closest hit found so far), which
+      can only ever be *shrunk*; a negative return value will
+      terminate traversal (as would, for example, be done for a
+      any-hit query).
+
+      Box tests use the 'slab' test with precomputed inverse ray
+      direction; children are visited in an order determined by the
+      ray's direction octant (ie, the sign bits of its direction), so
+      the closer child will usually be visited first.
+
+      the lambda should have a signature of
+      [](const uint32_t *primIDs, int numPrims)->float
+  */
+  template<typename Lambda>
+  inline __cubql_both
+  void rayQuery_forEachLeaf(const bvh3f   bvh,
+                            const Ray     ray,
+                            const Lambda &lambdaToCallOnEachLeaf);
+
+  /*! same as rayQuery_forEachLeaf(), but calls the lambda once per
+      primitive, with signature [](uint32_t primID)->float */
+  template<typename Lambda>
+  inline __cubql_both
+  void rayQuery_forEachPrim(const bvh3f   bvh,
+                            const Ray     ray,
+                            const Lambda &lambdaToCallOnEachPrim);
+
+
+
+  // ==================================================================
+  // IMPLEMENTATION
+  // ==================================================================
+
+  namespace rayQuery_impl {
+    /*! per-ray values that the traversal pre-computes only once */
+    struct RayInfo {
+      inline __cubql_both RayInfo(const Ray &ray);
+
+      vec3f org;
+      vec3f rcpDir;
+      /*! the ray's direction octant: for each dimension, whether the
+          direction is negative in that dimension */
+      bool  dirIsNeg[3];
+    };
+
+    inline __cubql_both RayInfo::RayInfo(const Ray &ray)
+      : org(ray.origin)
+    {
+      CUBQL_PRAGMA_UNROLL
+        for (int i=0;i<3;i++) {
+          float d = ray.direction[i];
+          /* avoid 1/0 (and the 0*inf=NaN that that could produce in
+             the slab test) for axis-parallel rays */
+          if (fabsf(d) < 1e-20f) d = (d < 0.f) ? -1e-20f : 1e-20f;
+          rcpDir[i]   = 1.f/d;
+          dirIsNeg[i] = (d < 0.f);
+        }
+    }
+
+    /*! slab test: returns the distance at which the ray enters the
+        box, or INFINITY if it does not hit the box within
+        [tMin,tMax] */
+    inline __cubql_both
+    float intersect(const RayInfo &ray, const box3f &box, float tMin, float tMax)
+    {
+      vec3f t_lo = (box.lower - ray.org) * ray.rcpDir;
+      vec3f t_hi = (box.upper - ray.org) * ray.rcpDir;
+      vec3f t_nr = min(t_lo,t_hi);
+      vec3f t_fr = max(t_lo,t_hi);
+      float t0 = max(tMin,reduce_max(t_nr));
+      float t1 = min(tMax,reduce_min(t_fr));
+      return (t0 <= t1) ? t0 : INFINITY;
+    }
+
+    /*! returns true if child 1 should be visited before child 0; the
+        children's order is determined by the dimension in which their
+        centers are furthest apart, and the ray's direction sign in
+        that dimension */
+    inline __cubql_both
+    bool visitChild1First(const RayInfo &ray, const box3f &b0, const box3f &b1)
+    {
+      vec3f delta = b1.twice_center() - b0.twice_center();
+      vec3f absDelta(fabsf(delta.x),fabsf(delta.y),fabsf(delta.z));
+      int dim
+        = (absDelta.x >= absDelta.y)
+        ? (absDelta.x >= absDelta.z ? 0 : 2)
+        : (absDelta.y >= absDelta.z ? 1 : 2);
+      return (delta[dim] < 0.f) != ray.dirIsNeg[dim];
+    }
+  } // ::cuBQL::rayQuery_impl
+
+  template<typename Lambda>
+  inline __cubql_both
+  void rayQuery_forEachLeaf(const bvh3f   bvh,
+                            const Ray     ray,
+                            const Lambda &lambdaToCallOnEachLeaf)
+  {
+    if (bvh.numNodes == 0) return;
+    const rayQuery_impl::RayInfo rayInfo(ray);
+    const float tMin = ray.tMin;
+    float tMax = ray.tMax;
+
+    struct StackEntry {
+      bvh3f::node_t::Admin node;
+      float                dist;
+    };
+    const int stackSize = 64;
+    StackEntry traversalStack[stackSize], *stackPtr = traversalStack;
+
+    if (rayQuery_impl::intersect(rayInfo,bvh.nodes[0].bounds,tMin,tMax) == INFINITY)
+      return;
+    bvh3f::node_t::Admin node = bvh.nodes[0].admin;
+    // ------------------------------------------------------------------
+    // traverse until there's nothing left to traverse:
+    // ------------------------------------------------------------------
+    while (true) {
+
+      // ------------------------------------------------------------------
+      // traverse INNER nodes downward; breaking out if we either find
+      // a leaf hit by the ray, or found a dead-end at which we need
+      // to pop
+      // ------------------------------------------------------------------
+      while (true) {
+        if (node.count != 0)
+          // this is a leaf; step out of down-traversal and let leaf
+          // code pop in.
+          break;
+
+        bvh3f::node_t n0 = bvh.nodes[node.offset+0];
+        bvh3f::node_t n1 = bvh.nodes[node.offset+1];
+        if (rayQuery_impl::visitChild1First(rayInfo,n0.bounds,n1.bounds)) {
+          bvh3f::node_t tmp = n0; n0 = n1; n1 = tmp;
+        }
+        float d0 = rayQuery_impl::intersect(rayInfo,n0.bounds,tMin,tMax);
+        float d1 = rayQuery_impl::intersect(rayInfo,n1.bounds,tMin,tMax);
+        if (d0 != INFINITY) {
+          if (d1 != INFINITY) {
+            if (stackPtr >= traversalStack+stackSize) {
+              // printf("stack overflow\n");
+              return;
+            }
+            *stackPtr++ = { n1.admin, d1 };
+          }
+          node = n0.admin;
+        } else if (d1 != INFINITY) {
+          node = n1.admin;
+        } else {
+          // ray misses both children; this is a dead end
+          node.count = 0;
+          break;
+        }
+      }
+
+      if (node.count != 0) {
+        // we're at a valid leaf: call the lambda and see if that gave
+        // us a new, closer tMax
+        float leafResult
+          = lambdaToCallOnEachLeaf(bvh.primIDs+node.offset,(int)node.count);
+        if (leafResult < 0.f) return;
+        tMax = min(tMax,leafResult);
+      }
+      // ------------------------------------------------------------------
+      // pop next un-traversed node from stack, discarding any nodes
+      // that the ray enters only after the closest hit found so far
+      // ------------------------------------------------------------------
+      while (true) {
+        if (stackPtr == traversalStack)
+          return;
+        StackEntry fromStack = *--stackPtr;
+        if (fromStack.dist <= tMax) {
+          node = fromStack.node;
+          break;
+        }
+      }
+    }
+  }
+
+  template<typename Lambda>
+  inline __cubql_both
+  void rayQuery_forEachPrim(const bvh3f   bvh,
+                            const Ray     ray,
+                            const Lambda &lambdaToCallOnEachPrim)
+  {
+    auto leafCode
+      = [&lambdaToCallOnEachPrim,&ray](const uint32_t *primIDs, int numPrims)->float
+      {
+        float tMax = ray.tMax;
+        for (int i=0;i<numPrims;i++) {
+          float primResult = lambdaToCallOnEachPrim(primIDs[i]);
+          if (primResult < 0.f) return -1.f;
+          tMax = min(tMax,primResult);
+        }
+        return tMax;
+      };
+    rayQuery_forEachLeaf(bvh,ray,leafCode);
+  }
+
+} // ::cuBQL
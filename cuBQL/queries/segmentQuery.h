@@ -0,0 +1,150 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+
+/*! 'shrinking radius' queries for a query line segment (rather than
+    a query point): leaves get visited in order of their bounding
+    boxes' distance to the segment, and culled as soon as that
+    distance exceeds the current query radius. This is what the
+    segment-to-segment and segment-to-triangle closest-point queries
+    (eg, for capsule or swept-sphere clearance checks) in
+    lineSegs/LineSegs3f.h and triangles/segmentFCP.h are built on. */
+#pragma once
+
+#include "cuBQL/queries/shrinkingRadiusQuery.h"
+
+namespace cuBQL {
+
+  /*! (square) distance between the line segment [segBegin,segEnd]
+      and the given box; 0 if the segment overlaps the box */
+  inline __cubql_both
+  float sqrDistance(vec3f segBegin, vec3f segEnd, box3f box);
+
+  /*! same as shrinkingRadiusQuery_forEachLeaf(), but for the query
+      segment [segBegin,segEnd]: calls the lambda for each leaf whose
+      bounding box is within the current query radius of that
+      segment, and the lambda returns the (square) new query radius */
+  template<typename Lambda>
+  inline __cubql_both
+  void segmentQuery_forEachLeaf(bvh3f        bvh,
+                                vec3f        segBegin,
+                                vec3f        segEnd,
+                                float        sqrMaxSearchRadius,
+                                const Lambda &lambdaToExecuteForEachCandidateLeaf);
+
+  /*! same as segmentQuery_forEachLeaf(), but calling the lambda for
+      each prim (by primID) in the candidate leaves */
+  template<typename Lambda>
+  inline __cubql_both
+  void segmentQuery_forEachPrim(bvh3f        bvh,
+                                vec3f        segBegin,
+                                vec3f        segEnd,
+                                float        sqrMaxSearchRadius,
+                                const Lambda &lambdaToExecuteForEachCandidate);
+
+  // ==================================================================
+  // IMPLEMENTATION
+  // ==================================================================
+
+  namespace segmentQuery_impl {
+    /*! derivative (up to a factor of 2) of the square distance
+        between point org+t*dir and the box, with respect to t */
+    inline __cubql_both
+    float slope(vec3f org, vec3f dir, box3f box, float t)
+    {
+      const vec3f p = org + t*dir;
+      return dot(dir,p-min(max(p,box.lower),box.upper));
+    }
+  }
+
+  inline __cubql_both
+  float sqrDistance(vec3f segBegin, vec3f segEnd, box3f box)
+  {
+    using segmentQuery_impl::slope;
+    const vec3f dir = segEnd - segBegin;
+    /* the square distance of segBegin+t*dir to the box is a convex,
+       piecewise quadratic function of t, whose pieces are delimited
+       by where the segment crosses the box's slabs; so we first check
+       whether the minimum is at one of the end points, and otherwise
+       narrow [t0,t1] down to the one piece that the slope changes
+       sign in, and minimize that piece's quadratic */
+    if (slope(segBegin,dir,box,0.f) >= 0.f)
+      return sqrDistance(segBegin,box);
+    if (slope(segBegin,dir,box,1.f) <= 0.f)
+      return sqrDistance(segEnd,box);
+    float t0 = 0.f, t1 = 1.f;
+    for (int d=0;d<3;d++) {
+      if (dir[d] == 0.f) continue;
+      const float rcpDir = 1.f/dir[d];
+      const float slabs[2] = {
+        (box.lower[d]-segBegin[d])*rcpDir,
+        (box.upper[d]-segBegin[d])*rcpDir
+      };
+      for (int i=0;i<2;i++) {
+        const float t = slabs[i];
+        if (t <= t0 || t >= t1) continue;
+        if (slope(segBegin,dir,box,t) < 0.f) t0 = t; else t1 = t;
+      }
+    }
+    // within [t0,t1], each dimension is either always below, always
+    // inside, or always above the box
+    const vec3f mid = segBegin + (.5f*(t0+t1))*dir;
+    float num = 0.f, den = 0.f;
+    for (int d=0;d<3;d++) {
+      if (mid[d] >= box.lower[d] && mid[d] <= box.upper[d]) continue;
+      const float plane = (mid[d] < box.lower[d]) ? box.lower[d] : box.upper[d];
+      num += (segBegin[d]-plane)*dir[d];
+      den += dir[d]*dir[d];
+    }
+    const float t = (den > 0.f) ? clamp(-num/den,t0,t1) : t0;
+    return sqrDistance(segBegin+t*dir,box);
+  }
+
+  template<typename Lambda>
+  inline __cubql_both
+  void segmentQuery_forEachLeaf(bvh3f        bvh,
+                                vec3f        segBegin,
+                                vec3f        segEnd,
+                                float        sqrMaxSearchRadius,
+                                const Lambda &lambdaToExecuteForEachCandidateLeaf)
+  {
+    auto sqrDistanceToBox = [segBegin,segEnd](const box3f &box)->float
+      { return sqrDistance(segBegin,segEnd,box); };
+    shrinkingRadiusQuery_forEachLeaf_byBoxDistance
+      (bvh,sqrDistanceToBox,sqrMaxSearchRadius,lambdaToExecuteForEachCandidateLeaf);
+  }
+
+  template<typename Lambda>
+  inline __cubql_both
+  void segmentQuery_forEachPrim(bvh3f        bvh,
+                                vec3f        segBegin,
+                                vec3f        segEnd,
+                                float        sqrMaxSearchRadius,
+                                const Lambda &lambdaToExecuteForEachCandidate)
+  {
+    auto leafCode
+      = [&lambdaToExecuteForEachCandidate](const uint32_t *leafPrims,
+                                           size_t numPrims)->float
+      {
+        float leafResult = INFINITY;
+        for (int i=0;i<(int)numPrims;i++)
+          leafResult = min(leafResult,lambdaToExecuteForEachCandidate(leafPrims[i]));
+        return leafResult;
+      };
+    segmentQuery_forEachLeaf(bvh,segBegin,segEnd,sqrMaxSearchRadius,leafCode);
+  }
+
+} // ::cuBQL
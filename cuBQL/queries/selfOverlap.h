@@ -0,0 +1,293 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+/*! 'broadphase' style self-overlap query: finds all pairs of
+    primitives (within the same BVH) whose boxes overlap.
+
+    The way this works is that every overlapping pair of prims has
+    exactly one node in the BVH that is the lowest common ancestor of
+    the two leaves the prims live in; so if each inner node only
+    reports the overlapping pairs *between* its two subtrees (using
+    a dual-tree traversal with a cull distance of zero), and each
+    leaf only reports the pairs within that leaf, then each
+    unordered pair gets found exactly once - and all nodes can be
+    processed independently and in parallel */
+#pragma once
+
+#include "cuBQL/queries/dualTreeQuery.h"
+#include "cuBQL/impl/parallel_for.h"
+#include <vector>
+#ifdef __CUDACC__
+# include <cub/cub.cuh>
+#endif
+
+namespace cuBQL {
+
+  /*! a pair of overlapping primitives; always with primA < primB */
+  struct PrimPair {
+    uint32_t primA;
+    uint32_t primB;
+  };
+
+  /*! (device-side) output buffer for the self-overlap query. the
+      query will (re-)allocate this buffer if it is too small to hold
+      all results, so the same buffer can be re-used from one frame
+      to the next without having to re-allocate every time. Free via
+      cuBQL::free(buffer,...). Counts are 64-bit because the number
+      of overlapping pairs is quadratic in the number of prims, and
+      can easily exceed 2^32 for heavily overlapping inputs. */
+  struct PrimPairBuffer {
+    PrimPair *pairs    = 0;
+    uint64_t  numPairs = 0;
+    uint64_t  capacity = 0;
+  };
+
+  /*! calls the provided lambda for each pair of overlapping
+      primitives whose lowest common ancestor in the BVH is the given
+      node (ie, for a leaf node all pairs within that leaf, for an
+      inner node all pairs between its two subtrees). Calling this for
+      all nodes (other than the always-unused node 1) of the BVH will
+      report each overlapping pair exactly once.
+
+      the lambda should have a signature of
+      [](uint32_t primA, uint32_t primB)->void, and will always be
+      called with primA < primB.
+  */
+  template<typename T, int D, typename Lambda>
+  inline __cubql_both
+  void selfOverlap_forEachPairInNode(const BinaryBVH<T,D> bvh,
+                                     const box_t<T,D>    *boxes,
+                                     uint32_t             nodeID,
+                                     const Lambda        &lambdaToCallOnEachPair);
+
+#ifdef __CUDACC__
+  /*! computes all pairs of overlapping boxes, using a two-pass
+      (count, exclusive prefix sum, fill) scheme on the GPU. boxes[]
+      must be the same array the BVH was built over (or a refitted
+      version of it), and must be device-readable. the result gets
+      written to 'result', which will get grown (using the given
+      memory resource) if required. Unlike most other cuBQL query
+      functions this does sync the stream, because it has to read
+      back the number of pairs. */
+  template<typename T, int D>
+  void selfOverlap(PrimPairBuffer      &result,
+                   const BinaryBVH<T,D> bvh,
+                   const box_t<T,D>    *boxes,
+                   cudaStream_t         s=0,
+                   GpuMemoryResource   &memResource=defaultGpuMemResource());
+
+  /*! frees the memory allocated by selfOverlap() */
+  inline void free(PrimPairBuffer    &buffer,
+                   cudaStream_t       s=0,
+                   GpuMemoryResource &memResource=defaultGpuMemResource());
+#endif
+
+  namespace host {
+    /*! host-side equivalent of cuBQL::selfOverlap(), using host
+        threads with per-thread output buffers; all arrays must be
+        host-readable. Results will be in no particular order. */
+    template<typename T, int D>
+    void selfOverlap(std::vector<PrimPair> &result,
+                     const BinaryBVH<T,D>   bvh,
+                     const box_t<T,D>      *boxes);
+  }
+
+
+  // ==================================================================
+  // IMPLEMENTATION
+  // ==================================================================
+
+  template<typename T, int D, typename Lambda>
+  inline __cubql_both
+  void selfOverlap_forEachPairInNode(const BinaryBVH<T,D> bvh,
+                                     const box_t<T,D>    *boxes,
+                                     uint32_t             nodeID,
+                                     const Lambda        &lambdaToCallOnEachPair)
+  {
+    const typename BinaryBVH<T,D>::Node::Admin node = bvh.nodes[nodeID].admin;
+    if (node.count != 0) {
+      // leaf: all pairs within this leaf
+      const uint32_t *leafPrims = bvh.primIDs+node.offset;
+      for (int i=0;i<(int)node.count;i++) {
+        const uint32_t   primA = leafPrims[i];
+        const box_t<T,D> boxA  = boxes[primA];
+        for (int j=i+1;j<(int)node.count;j++) {
+          const uint32_t primB = leafPrims[j];
+          if (!boxA.overlaps(boxes[primB])) continue;
+          lambdaToCallOnEachPair(min(primA,primB),max(primA,primB));
+        }
+      }
+      return;
+    }
+
+    // inner node: all pairs between the left and the right subtree
+    auto leafPairCode
+      = [boxes,&lambdaToCallOnEachPair](const uint32_t *leafPrimsA, int numPrimsA,
+                                        const uint32_t *leafPrimsB, int numPrimsB)->float
+      {
+        for (int i=0;i<numPrimsA;i++) {
+          const uint32_t   primA = leafPrimsA[i];
+          const box_t<T,D> boxA  = boxes[primA];
+          for (int j=0;j<numPrimsB;j++) {
+            const uint32_t primB = leafPrimsB[j];
+            if (!boxA.overlaps(boxes[primB])) continue;
+            lambdaToCallOnEachPair(min(primA,primB),max(primA,primB));
+          }
+        }
+        // cull distance of zero: only ever visit overlapping node pairs
+        return 0.f;
+      };
+    dualTreeQuery_forEachLeafPair(bvh,node.offset+0,bvh,node.offset+1,
+                                  0.f,leafPairCode);
+  }
+
+#ifdef __CUDACC__
+  namespace selfOverlap_impl {
+    template<typename T, int D>
+    __global__
+    void countPairs(uint64_t            *pairCounts,
+                    const BinaryBVH<T,D> bvh,
+                    const box_t<T,D>    *boxes)
+    {
+      const int nodeID = threadIdx.x+blockIdx.x*blockDim.x;
+      if (nodeID > bvh.numNodes) return;
+      uint64_t count = 0;
+      if (nodeID != 1 && nodeID < bvh.numNodes)
+        selfOverlap_forEachPairInNode(bvh,boxes,nodeID,
+                                      [&count](uint32_t, uint32_t) { count++; });
+      // note we have one more counter than nodes; that last one
+      // always stays 0, so its prefix sum is the total number of pairs
+      pairCounts[nodeID] = count;
+    }
+
+    template<typename T, int D>
+    __global__
+    void writePairs(PrimPair            *pairs,
+                    const uint64_t      *pairOffsets,
+                    const BinaryBVH<T,D> bvh,
+                    const box_t<T,D>    *boxes)
+    {
+      const int nodeID = threadIdx.x+blockIdx.x*blockDim.x;
+      if (nodeID == 1 || nodeID >= bvh.numNodes) return;
+      uint64_t out = pairOffsets[nodeID];
+      selfOverlap_forEachPairInNode(bvh,boxes,nodeID,
+                                    [pairs,&out](uint32_t primA, uint32_t primB)
+                                    { pairs[out++] = PrimPair{ primA, primB }; });
+    }
+  } // ::cuBQL::selfOverlap_impl
+
+  template<typename T, int D>
+  void selfOverlap(PrimPairBuffer      &result,
+                   const BinaryBVH<T,D> bvh,
+                   const box_t<T,D>    *boxes,
+                   cudaStream_t         s,
+                   GpuMemoryResource   &memResource)
+  {
+    result.numPairs = 0;
+    if (bvh.numNodes == 0) return;
+
+    const int numCounters = int(bvh.numNodes)+1;
+    uint64_t *pairCounts  = 0;
+    uint64_t *pairOffsets = 0;
+    CUBQL_CUDA_CHECK(memResource.malloc((void**)&pairCounts,numCounters*sizeof(uint64_t),s));
+    CUBQL_CUDA_CHECK(memResource.malloc((void**)&pairOffsets,numCounters*sizeof(uint64_t),s));
+
+    // ------------------------------------------------------------------
+    // pass 1: count how many pairs each node will produce
+    // ------------------------------------------------------------------
+    selfOverlap_impl::countPairs<<<divRoundUp(numCounters,128),128,0,s>>>
+      (pairCounts,bvh,boxes);
+
+    // ------------------------------------------------------------------
+    // exclusive prefix sum over those counts, so each node knows
+    // where to write its pairs to
+    // ------------------------------------------------------------------
+    void   *d_temp_storage     = 0;
+    size_t  temp_storage_bytes = 0;
+    cub::DeviceScan::ExclusiveSum(d_temp_storage,temp_storage_bytes,
+                                  pairCounts,pairOffsets,numCounters,s);
+    CUBQL_CUDA_CHECK(memResource.malloc(&d_temp_storage,temp_storage_bytes,s));
+    cub::DeviceScan::ExclusiveSum(d_temp_storage,temp_storage_bytes,
+                                  pairCounts,pairOffsets,numCounters,s);
+    CUBQL_CUDA_CHECK(memResource.free(d_temp_storage,s));
+
+    uint64_t numPairs = 0;
+    CUBQL_CUDA_CALL(MemcpyAsync(&numPairs,pairOffsets+numCounters-1,sizeof(numPairs),
+                                cudaMemcpyDefault,s));
+    CUBQL_CUDA_CALL(StreamSynchronize(s));
+
+    // ------------------------------------------------------------------
+    // grow output buffer if required, then run pass 2: write pairs
+    // ------------------------------------------------------------------
+    if (numPairs > result.capacity) {
+      if (result.pairs)
+        CUBQL_CUDA_CHECK(memResource.free(result.pairs,s));
+      CUBQL_CUDA_CHECK(memResource.malloc((void**)&result.pairs,
+                                          numPairs*sizeof(PrimPair),s));
+      result.capacity = numPairs;
+    }
+    result.numPairs = numPairs;
+    if (numPairs > 0)
+      selfOverlap_impl::writePairs<<<divRoundUp(numCounters,128),128,0,s>>>
+        (result.pairs,pairOffsets,bvh,boxes);
+
+    CUBQL_CUDA_CHECK(memResource.free(pairOffsets,s));
+    CUBQL_CUDA_CHECK(memResource.free(pairCounts,s));
+  }
+
+  inline void free(PrimPairBuffer    &buffer,
+                   cudaStream_t       s,
+                   GpuMemoryResource &memResource)
+  {
+    if (buffer.pairs)
+      CUBQL_CUDA_CHECK(memResource.free(buffer.pairs,s));
+    buffer.pairs    = 0;
+    buffer.numPairs = 0;
+    buffer.capacity = 0;
+  }
+#endif
+
+  namespace host {
+    template<typename T, int D>
+    void selfOverlap(std::vector<PrimPair> &result,
+                     const BinaryBVH<T,D>   bvh,
+                     const box_t<T,D>      *boxes)
+    {
+      result.clear();
+      std::vector<std::vector<PrimPair>> perThreadPairs(getNumThreads());
+      parallel_for_with_threadID
+        (bvh.numNodes,
+         [&](int threadID, size_t nodeID) {
+           if (nodeID == 1) return;
+           std::vector<PrimPair> &pairs = perThreadPairs[threadID];
+           selfOverlap_forEachPairInNode(bvh,boxes,(uint32_t)nodeID,
+                                         [&pairs](uint32_t primA, uint32_t primB)
+                                         { pairs.push_back(PrimPair{ primA, primB }); });
+         },
+         /* some nodes are much more expensive than others, so use
+            smaller blocks than by default */
+         16);
+      size_t numPairs = 0;
+      for (auto &pairs : perThreadPairs)
+        numPairs += pairs.size();
+      result.reserve(numPairs);
+      for (auto &pairs : perThreadPairs)
+        result.insert(result.end(),pairs.begin(),pairs.end());
+    }
+  } // ::cuBQL::host
+
+} // ::cuBQL
+
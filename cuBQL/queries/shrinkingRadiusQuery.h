@@ -32,38 +32,28 @@ namespace cuBQL {
     return dot(v,v);
   }
 
-  /*! performs a 'shrinking radius (leaf-)query', which iterate
-      through all bvh leaves that overlap a given query ball that is
-      centered around a fixed point in space, and whose radius may by
-      successively reduced (shrunk) durin that query. Every time the
-      query reaches a new candidate leaf it calls the provided
-      callback function, which, after processing the given leaf, can
-      then return a new maximum query radius which, if smaller than
-      the radius of the query ball at that point in time, will from
-      that point on be used as new query radius. Note that the query
-      radius can only be *shrunk* during traversal; if the
-      user-provided callback returns a radius larger than what the
-      query ball has already been shrunk to the existing smaller value
-      will be used. */
-  template<typename Lambda>
+  /*! same as shrinkingRadiusQuery_forEachLeaf() (below), but for a
+      query object other than a point: 'sqrDistanceToBox' returns the
+      (square) distance between the query object and a given box3f,
+      and has to be a lower bound of the distance to any primitive
+      inside that box. This is what the point queries, as well as,
+      eg, the segment queries in segmentQuery.h, are built on. Works
+      for both BinaryBVH<float,3> and BinaryBVH64<float,3>; the leaf
+      lambda gets the leaf's primIDs as a pointer to the BVH's
+      index_t. */
+  template<typename index_t, typename SqrDistanceToBox, typename Lambda>
   inline __cubql_both
-  void shrinkingRadiusQuery_forEachLeaf
-  (bvh3f bvh,
-   vec3f queryPoint,
+  void shrinkingRadiusQuery_forEachLeaf_byBoxDistance
+  (BinaryBVH<float,3,index_t> bvh,
+   const SqrDistanceToBox &sqrDistanceToBox,
    float sqrMaxSearchRadius,
-   /*! lambda that gets called for each leaf that may contain any
-     primitives. if this lamdba does find a new, better result than
-     whatever the query had before this lambda MUST return the SQUARE
-     of the new culling radius */
-   // nvstd::function<float(const uint32_t*,uint64_t)> lambdaToExecuteForEachCandidateLeaf,
-   const Lambda &lambdaToExecuteForEachCandidateLeaf,
-   bool dbg = false)
+   const Lambda &lambdaToExecuteForEachCandidateLeaf)
   {
     float sqrCullDist = sqrMaxSearchRadius;
     struct StackEntry {
       union {
         struct {
-          uint32_t idx;
+          index_t  idx;
           float    dist;
         };
         uint64_t forALign;
@@ -88,19 +78,19 @@ namespace cuBQL {
           // out of down-travesal and let leaf code pop in.
           break;
 
-        uint32_t n0Idx = node.offset+0;
-        uint32_t n1Idx = node.offset+1;
+        index_t n0Idx = node.offset+0;
+        index_t n1Idx = node.offset+1;
         bvh3f::node_t n0 = bvh.nodes[n0Idx];
         bvh3f::node_t n1 = bvh.nodes[n1Idx];
-        float d0 = sqrDistance(queryPoint,n0.bounds);
-        float d1 = sqrDistance(queryPoint,n1.bounds);
+        float d0 = sqrDistanceToBox(n0.bounds);
+        float d1 = sqrDistanceToBox(n1.bounds);
         if (min(d0,d1) >= sqrCullDist) {
           // both children are too far away; this is a dead end
           node.count = 0;
           break;
         }
 
-        uint32_t farID;
+        index_t farID;
         if (d0 < d1) {
           // go left side, possibly pop right side
           node = n0.admin;
@@ -147,6 +137,40 @@ namespace cuBQL {
       }
     }
   }
+
+  /*! performs a 'shrinking radius (leaf-)query', which iterate
+      through all bvh leaves that overlap a given query ball that is
+      centered around a fixed point in space, and whose radius may by
+      successively reduced (shrunk) durin that query. Every time the
+      query reaches a new candidate leaf it calls the provided
+      callback function, which, after processing the given leaf, can
+      then return a new maximum query radius which, if smaller than
+      the radius of the query ball at that point in time, will from
+      that point on be used as new query radius. Note that the query
+      radius can only be *shrunk* during traversal; if the
+      user-provided callback returns a radius larger than what the
+      query ball has already been shrunk to the existing smaller value
+      will be used. */
+  template<typename index_t, typename Lambda>
+  inline __cubql_both
+  void shrinkingRadiusQuery_forEachLeaf
+  (BinaryBVH<float,3,index_t> bvh,
+   vec3f queryPoint,
+   float sqrMaxSearchRadius,
+   /*! lambda that gets called for each leaf that may contain any
+     primitives. if this lamdba does find a new, better result than
+     whatever the query had before this lambda MUST return the SQUARE
+     of the new culling radius */
+   // nvstd::function<float(const uint32_t*,uint64_t)> lambdaToExecuteForEachCandidateLeaf,
+   const Lambda &lambdaToExecuteForEachCandidateLeaf,
+   bool dbg = false)
+  {
+    auto sqrDistanceToBox = [queryPoint](const box3f &box)->float
+      { return sqrDistance(queryPoint,box); };
+    shrinkingRadiusQuery_forEachLeaf_byBoxDistance
+      (bvh,sqrDistanceToBox,sqrMaxSearchRadius,lambdaToExecuteForEachCandidateLeaf);
+  }
+
   /*! performs a 'shrinking radius (primitive-)query', which iterate
       through all bvh leaves that overlap a given query ball that is
       centered around a fixed point in space, and whose radius may by
@@ -160,11 +184,11 @@ namespace cuBQL {
       user-provided callback returns a radius larger than what the
       query ball has already been shrunk to the existing smaller value
       will be used. */
-  template<typename Lambda>
+  template<typename index_t, typename Lambda>
   inline __cubql_both
   void shrinkingRadiusQuery_forEachPrim
   (/* the bvh we're querying into */
-   bvh3f bvh,
+   BinaryBVH<float,3,index_t> bvh,
    /*! the center of out query ball */
    vec3f queryPoint,
    /*! the SQUARE of the maximum query radius to which we want to
@@ -179,7 +203,7 @@ namespace cuBQL {
    bool dbg = false)
   {
     auto leafCode
-      = [lambdaToExecuteForEachCandidate](const uint32_t *leafPrims,
+      = [lambdaToExecuteForEachCandidate](const index_t *leafPrims,
                                           size_t numPrims)->float
       {
         float leafResult = INFINITY;
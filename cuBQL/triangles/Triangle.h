@@ -0,0 +1,42 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+#include "cuBQL/math/vec.h"
+
+namespace cuBQL {
+  namespace triangles {
+
+    /*! a triangle, with the actual (3D) coordinates of its three
+        vertices */
+    struct Triangle {
+      vec3f a, b, c;
+    };
+
+    /*! returns the triangle with index 'primID' in an indexed
+        triangle mesh given by indices[] and vertices[] */
+    inline __cubql_both
+    Triangle getTriangle(const vec3i *const __restrict__ indices,
+                         const vec3f *const __restrict__ vertices,
+                         int primID)
+    {
+      vec3i index = indices[primID];
+      return Triangle{vertices[index.x],vertices[index.y],vertices[index.z]};
+    }
+
+  } // ::cuBQL::triangles
+} // ::cuBQL
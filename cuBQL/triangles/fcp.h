@@ -17,25 +17,52 @@
 #pragma once
 
 #include "cuBQL/bvh.h"
-// we're stealing the line seg test for edges
-#include "cuBQL/lineSegs/LineSegs3f.h"
 #include "cuBQL/queries/shrinkingRadiusQuery.h"
+#include "cuBQL/triangles/Triangle.h"
 
 namespace cuBQL {
   namespace triangles {
 
-    /*! a line segment, referring to two input points that define the
-        two opposite corners of that line segment */
-    struct Triangle {
-      vec3f a, b, c;
+    /*! which part of a triangle a closest point lies on; this is
+        required to pick the right pseudo-normal when computing the
+        sign of a distance (see sdf.h) */
+    enum Feature {
+      FEATURE_FACE = 0,
+      FEATURE_EDGE_AB, FEATURE_EDGE_BC, FEATURE_EDGE_CA,
+      FEATURE_VERTEX_A, FEATURE_VERTEX_B, FEATURE_VERTEX_C
     };
 
+    /*! result of a closest-point intersection operation */
+    struct CPResult {
+      vec3f point;
+      
+      /*! barycentric coordinates of the closest point, such that
+          point = a + u*(b-a) + v*(c-a) */
+      float u, v;
+
+      /*! whether the closest point is inside the triangle, on one of
+          its edges, or on one of its vertices */
+      Feature feature;
+
+      float sqrDistance;
+    };
+    
     /*! result of a fcp (find closest point) query */
     struct FCPResult {
-      inline __device__ void clear(float maxDistSqr) { primID = -1; sqrDistance = maxDistSqr; }
+      inline __cubql_both void clear(float maxDistSqr) { primID = -1; sqrDistance = maxDistSqr; }
+
+      /*! makes the given closest point on triangle 'primID' the
+          result */
+      inline __cubql_both void set(int primID, const CPResult &cp);
       
       int   primID;
-      // float u, v;
+      /*! closest point on the surface, its barycentrics within
+          triangle 'primID' (point = a + u*(b-a) + v*(c-a)), and
+          which of the triangle's features it lies on; these are only
+          valid if primID >= 0 */
+      vec3f point;
+      float u, v;
+      Feature feature;
       float sqrDistance;
     };
 
@@ -57,61 +84,177 @@ namespace cuBQL {
     // implementation
     // ==================================================================
     
-    /*! result of a closest-point intersection operation */
-    struct CPResult {
-      vec3f point;
-      
-      /*! parameterized distance along the line triangle of where the
-          hit is; u=0 being begin point, u=1 being end point */
-      float u, v;
-
-      float sqrDistance;
-    };
-    
     /*! compute point on 'triangle' that is closest to 'queryPoint',
-      and return the square distance to that point. */
-    inline __device__
+      and return the square distance to that point. This uses the
+      region-based test from Ericson's "Real-Time Collision Detection"
+      (5.1.5), which classifies the query point against the
+      triangle's vertex, edge, and face regions, and only needs dot
+      products (no normalization, and no square roots) */
+    inline __cubql_both
     CPResult closestPoint(const vec3f queryPoint, const Triangle triangle);
-    
-    
 
+    /*! whether the triangle spanned by edges ab and ac is degenerate,
+        ie, a line segment or a point (up to rounding) */
+    inline __cubql_both
+    bool isDegenerate(const vec3f ab, const vec3f ac);
 
-    /*! compute point on 'triangle' that is closest to 'queryPoint',
-      and return the square distance to that point. */
-    inline __device__
+    /*! closest point to 'queryPoint' on any of the three edges of the
+        triangle (a, a+ab, a+ac); this is the closest point on a
+        degenerate triangle */
+    inline __cubql_both
+    CPResult closestPointOnEdges(const vec3f queryPoint,
+                                 const vec3f a,
+                                 const vec3f ab,
+                                 const vec3f ac);
+
+    inline __cubql_both
+    void FCPResult::set(int primID, const CPResult &cp)
+    {
+      this->primID = primID;
+      point        = cp.point;
+      u            = cp.u;
+      v            = cp.v;
+      feature      = cp.feature;
+      sqrDistance  = cp.sqrDistance;
+    }
+
+    inline __cubql_both
+    bool isDegenerate(const vec3f ab, const vec3f ac)
+    {
+      const vec3f N = cross(ab,ac);
+      return dot(N,N) <= 1e-10f*dot(ab,ab)*dot(ac,ac);
+    }
+
+    inline __cubql_both
+    CPResult closestPointOnEdges(const vec3f q,
+                                 const vec3f a,
+                                 const vec3f ab,
+                                 const vec3f ac)
+    {
+      const vec3f edgeBegin[3] = { a, a+ab, a+ac };
+      const vec3f edgeDir[3]   = { ab, ac-ab, -ac };
+      CPResult result;
+      result.sqrDistance = INFINITY;
+      for (int i=0;i<3;i++) {
+        const float len2 = dot(edgeDir[i],edgeDir[i]);
+        const float t
+          = (len2 > 0.f)
+          ? fminf(1.f,fmaxf(0.f,dot(q-edgeBegin[i],edgeDir[i])/len2))
+          : 0.f;
+        const vec3f point = edgeBegin[i] + t*edgeDir[i];
+        const float dist = sqrDistance(q,point);
+        if (!(dist < result.sqrDistance)) continue;
+        result.point = point;
+        result.sqrDistance = dist;
+        if (i == 0) {
+          result.u = t; result.v = 0.f;
+          result.feature
+            = (t <= 0.f) ? FEATURE_VERTEX_A
+            : (t >= 1.f) ? FEATURE_VERTEX_B : FEATURE_EDGE_AB;
+        } else if (i == 1) {
+          result.u = 1.f-t; result.v = t;
+          result.feature
+            = (t <= 0.f) ? FEATURE_VERTEX_B
+            : (t >= 1.f) ? FEATURE_VERTEX_C : FEATURE_EDGE_BC;
+        } else {
+          result.u = 0.f; result.v = 1.f-t;
+          result.feature
+            = (t <= 0.f) ? FEATURE_VERTEX_C
+            : (t >= 1.f) ? FEATURE_VERTEX_A : FEATURE_EDGE_CA;
+        }
+      }
+      return result;
+    }
+
+
+    inline __cubql_both
     CPResult closestPoint(const vec3f q, const Triangle triangle)
     {
-      vec3f a = triangle.a;
-      vec3f b = triangle.b;
-      vec3f c = triangle.c;
-      vec3f N = cross(b-a,c-a);
-      vec3f Nab = cross(b-a,N);
-      vec3f Nbc = cross(c-b,N);
-      vec3f Nca = cross(a-c,N);
+      const vec3f a = triangle.a;
+      const vec3f b = triangle.b;
+      const vec3f c = triangle.c;
+      const vec3f ab = b-a;
+      const vec3f ac = c-a;
       CPResult result;
-      lineSegs::Segment edge;
-      bool edgeTest = true;
-      if (dot(q-a,Nab) >= 0.f) {
-        edge = { a, b };
-        // do edge test below
-      } else if (dot(q-b,Nbc) >= 0.f) {
-        edge = { b, c };
-        // do edge test below
-      } else if (dot(q-c,Nca) >= 0.f) {
-        edge = { c, a };
-        // do edge test below
-      } else {
-        // point must be inside.
-        N = normalize(N);
-        float dist = dot(q-a,N);
-        result.point = q - dist*N;
-        edgeTest = false;
+
+      // vertex region outside A
+      const vec3f ap = q-a;
+      const float d1 = dot(ab,ap);
+      const float d2 = dot(ac,ap);
+      if (d1 <= 0.f && d2 <= 0.f) {
+        result.u = 0.f; result.v = 0.f; result.feature = FEATURE_VERTEX_A;
+        result.point = a;
+        result.sqrDistance = sqrDistance(q,result.point);
+        return result;
       }
-      if (edgeTest) {
-        lineSegs::CPResult cp = lineSegs::closestPoint(q,edge);
-        result.point = cp.point;
+
+      // vertex region outside B
+      const vec3f bp = q-b;
+      const float d3 = dot(ab,bp);
+      const float d4 = dot(ac,bp);
+      if (d3 >= 0.f && d4 <= d3) {
+        result.u = 1.f; result.v = 0.f; result.feature = FEATURE_VERTEX_B;
+        result.point = b;
+        result.sqrDistance = sqrDistance(q,result.point);
+        return result;
       }
 
+      // edge region of AB. For each edge, the denominator is that
+      // edge's squared length, so it is only zero for a zero-length
+      // edge (eg, a==b); such an edge's region is empty, so we skip
+      // it (rather than dividing 0 by 0), and leave the query to the
+      // other edges' and vertices' regions
+      const float vc = d1*d4 - d3*d2;
+      if (vc <= 0.f && d1 >= 0.f && d3 <= 0.f && (d1-d3) > 0.f) {
+        const float t = d1 / (d1-d3);
+        result.u = t; result.v = 0.f; result.feature = FEATURE_EDGE_AB;
+        result.point = a + t*ab;
+        result.sqrDistance = sqrDistance(q,result.point);
+        return result;
+      }
+
+      // vertex region outside C
+      const vec3f cp = q-c;
+      const float d5 = dot(ab,cp);
+      const float d6 = dot(ac,cp);
+      if (d6 >= 0.f && d5 <= d6) {
+        result.u = 0.f; result.v = 1.f; result.feature = FEATURE_VERTEX_C;
+        result.point = c;
+        result.sqrDistance = sqrDistance(q,result.point);
+        return result;
+      }
+
+      // edge region of CA
+      const float vb = d5*d2 - d1*d6;
+      if (vb <= 0.f && d2 >= 0.f && d6 <= 0.f && (d2-d6) > 0.f) {
+        const float t = d2 / (d2-d6);
+        result.u = 0.f; result.v = t; result.feature = FEATURE_EDGE_CA;
+        result.point = a + t*ac;
+        result.sqrDistance = sqrDistance(q,result.point);
+        return result;
+      }
+
+      // edge region of BC
+      const float va = d3*d6 - d5*d4;
+      if (va <= 0.f && (d4-d3) >= 0.f && (d5-d6) >= 0.f && ((d4-d3)+(d5-d6)) > 0.f) {
+        const float t = (d4-d3) / ((d4-d3)+(d5-d6));
+        result.u = 1.f-t; result.v = t; result.feature = FEATURE_EDGE_BC;
+        result.point = b + t*(c-b);
+        result.sqrDistance = sqrDistance(q,result.point);
+        return result;
+      }
+
+      // inside face region - unless the triangle is degenerate, in
+      // which case rounding can make the region tests above miss all
+      // of its edges, and the face's barycentrics would be
+      // meaningless
+      const float sum = va+vb+vc;
+      if (sum <= 0.f || isDegenerate(ab,ac))
+        return closestPointOnEdges(q,a,ab,ac);
+      result.u = vb / sum;
+      result.v = vc / sum;
+      result.feature = FEATURE_FACE;
+      result.point = a + result.u*ab + result.v*ac;
       result.sqrDistance = sqrDistance(q,result.point);
       return result;
     }
@@ -142,10 +285,8 @@ namespace cuBQL {
         vec3i index = indices[primID];
         Triangle triangle{vertices[index.x],vertices[index.y],vertices[index.z]};
         CPResult primResult = closestPoint(queryPoint,triangle);
-        if (primResult.sqrDistance < result.sqrDistance) {
-          result.primID = primID;
-          result.sqrDistance = primResult.sqrDistance;
-        }
+        if (primResult.sqrDistance < result.sqrDistance)
+          result.set(primID,primResult);
         return result.sqrDistance;
       };
       cuBQL::shrinkingRadiusQuery_forEachPrim(bvh,queryPoint,result.sqrDistance,perPrim);
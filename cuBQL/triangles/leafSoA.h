@@ -0,0 +1,252 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+/*! host-side, SIMD-accelerated closest-point queries on triangle
+    meshes; this is the triangle equivalent of
+    cuBQL/points/leafSoA.h. Triangles are stored in leaf order as a
+    struct of arrays of the same values PrecomputedTriangle stores
+    (see precomputed.h), and the region-based closest-point test is
+    evaluated for simd::width triangles at once, in a branch-free
+    form: all regions' (u,v)'s get computed for all lanes, and the
+    right one is then selected per lane. */
+#pragma once
+
+#include "cuBQL/triangles/precomputed.h"
+#include "cuBQL/math/simd.h"
+#include <vector>
+
+namespace cuBQL {
+  namespace triangles {
+
+    /*! triangles in leaf order, as struct of arrays; each array gets
+        padded by simd::width, so a vector load starting at any valid
+        slot is always within the array */
+    struct LeafSoA {
+      /*! the precomputed triangle in the given slot */
+      inline PrecomputedTriangle operator[](size_t slot) const;
+
+      std::vector<float> ax, ay, az;
+      std::vector<float> abx, aby, abz;
+      std::vector<float> acx, acy, acz;
+      std::vector<float> ab_ab, ab_ac, ac_ac;
+      /*! 1 for triangles that are degenerate (see isDegenerate()),
+          0 otherwise; the vector code skips those, and they get
+          handled by the scalar closestPoint() instead */
+      std::vector<float> degenerate;
+    };
+
+    namespace host {
+      /*! creates the leaf-order triangle arrays for the given BVH */
+      inline void buildLeafSoA(LeafSoA     &soa,
+                               const bvh3f  bvh,
+                               const vec3i *indices,
+                               const vec3f *vertices);
+
+      /*! host-side, SIMD version of triangles::fcp(); as with that
+          one, 'result' has to be initialized with the max query
+          distance before calling this. The vector code only computes
+          distances, so the winning triangle's point, barycentrics and
+          feature get filled in by one scalar closestPoint() at the
+          end of the query */
+      inline void fcp(FCPResult     &result,
+                      const vec3f    queryPoint,
+                      const bvh3f    bvh,
+                      const LeafSoA &soa);
+
+      /*! runs fcp() for each of the given query points, using host
+          threads */
+      inline void fcp(FCPResult     *results,
+                      const vec3f   *queryPoints,
+                      int            numQueries,
+                      const bvh3f    bvh,
+                      const LeafSoA &soa,
+                      float          sqrMaxQueryDist=INFINITY);
+    }
+
+    // ==================================================================
+    // implementation
+    // ==================================================================
+
+    inline PrecomputedTriangle LeafSoA::operator[](size_t slot) const
+    {
+      PrecomputedTriangle pt;
+      pt.a     = vec3f(ax[slot],ay[slot],az[slot]);
+      pt.ab    = vec3f(abx[slot],aby[slot],abz[slot]);
+      pt.ac    = vec3f(acx[slot],acy[slot],acz[slot]);
+      pt.ab_ab = ab_ab[slot];
+      pt.ab_ac = ab_ac[slot];
+      pt.ac_ac = ac_ac[slot];
+      return pt;
+    }
+
+    namespace host {
+      inline void buildLeafSoA(LeafSoA     &soa,
+                               const bvh3f  bvh,
+                               const vec3i *indices,
+                               const vec3f *vertices)
+      {
+        const size_t numSlots = bvh.numPrims + simd::width;
+        std::vector<float> *arrays[] = {
+          &soa.ax, &soa.ay, &soa.az, &soa.abx, &soa.aby, &soa.abz,
+          &soa.acx, &soa.acy, &soa.acz, &soa.ab_ab, &soa.ab_ac, &soa.ac_ac,
+          &soa.degenerate
+        };
+        for (auto array : arrays)
+          array->assign(numSlots,0.f);
+        for (size_t i=0;i<bvh.numPrims;i++) {
+          const PrecomputedTriangle pt
+            = PrecomputedTriangle::make(getTriangle(indices,vertices,bvh.primIDs[i]));
+          soa.ax[i]  = pt.a.x;  soa.ay[i]  = pt.a.y;  soa.az[i]  = pt.a.z;
+          soa.abx[i] = pt.ab.x; soa.aby[i] = pt.ab.y; soa.abz[i] = pt.ab.z;
+          soa.acx[i] = pt.ac.x; soa.acy[i] = pt.ac.y; soa.acz[i] = pt.ac.z;
+          soa.ab_ab[i] = pt.ab_ab;
+          soa.ab_ac[i] = pt.ab_ac;
+          soa.ac_ac[i] = pt.ac_ac;
+          soa.degenerate[i] = isDegenerate(pt.ab,pt.ac) ? 1.f : 0.f;
+        }
+      }
+
+      /*! square distance from q to the closest point on each of the
+          simd::width triangles starting at the given slot */
+      inline simd::vfloat sqrDistances(const LeafSoA &soa, size_t slot,
+                                       const vec3f queryPoint,
+                                       simd::vfloat qx, simd::vfloat qy, simd::vfloat qz)
+      {
+        using namespace simd;
+        const vfloat zero = broadcast(0.f), one = broadcast(1.f);
+        const vfloat ax  = load(&soa.ax[slot]),  ay  = load(&soa.ay[slot]),  az  = load(&soa.az[slot]);
+        const vfloat abx = load(&soa.abx[slot]), aby = load(&soa.aby[slot]), abz = load(&soa.abz[slot]);
+        const vfloat acx = load(&soa.acx[slot]), acy = load(&soa.acy[slot]), acz = load(&soa.acz[slot]);
+        const vfloat apx = qx-ax, apy = qy-ay, apz = qz-az;
+        const vfloat d1 = dot(abx,aby,abz,apx,apy,apz);
+        const vfloat d2 = dot(acx,acy,acz,apx,apy,apz);
+        const vfloat d3 = d1 - load(&soa.ab_ab[slot]);
+        const vfloat d4 = d2 - load(&soa.ab_ac[slot]);
+        const vfloat d5 = d1 - load(&soa.ab_ac[slot]);
+        const vfloat d6 = d2 - load(&soa.ac_ac[slot]);
+        const vfloat va = d3*d6 - d5*d4;
+        const vfloat vb = d5*d2 - d1*d6;
+        const vfloat vc = d1*d4 - d3*d2;
+
+        /* same cases as in closestPoint(q,PrecomputedTriangle), but
+           applied in reverse order, so the one that the scalar
+           version would check first is the one that sticks */
+        const vfloat sum = va+vb+vc;
+        vfloat u = vb/sum;
+        vfloat v = vc/sum;
+        const vbool degenerate = sum <= zero;
+        u = select(degenerate,zero,u);
+        v = select(degenerate,zero,v);
+        const vfloat tBC = (d4-d3)/((d4-d3)+(d5-d6));
+        const vbool onBC = (va <= zero) && (d4-d3 >= zero) && (d5-d6 >= zero);
+        u = select(onBC,one-tBC,u);
+        v = select(onBC,tBC,v);
+        const vbool onCA = (vb <= zero) && (d2 >= zero) && (d6 <= zero);
+        u = select(onCA,zero,u);
+        v = select(onCA,d2/(d2-d6),v);
+        const vbool atC = (d6 >= zero) && (d5 <= d6);
+        u = select(atC,zero,u);
+        v = select(atC,one,v);
+        const vbool onAB = (vc <= zero) && (d1 >= zero) && (d3 <= zero);
+        u = select(onAB,d1/(d1-d3),u);
+        v = select(onAB,zero,v);
+        const vbool atB = (d3 >= zero) && (d4 <= d3);
+        u = select(atB,one,u);
+        v = select(atB,zero,v);
+        const vbool atA = (d1 <= zero) && (d2 <= zero);
+        u = select(atA,zero,u);
+        v = select(atA,zero,v);
+
+        // q - closest point = ap - u*ab - v*ac
+        const vfloat dx = apx - u*abx - v*acx;
+        const vfloat dy = apy - u*aby - v*acy;
+        const vfloat dz = apz - u*abz - v*acz;
+        vfloat dist2 = dx*dx + dy*dy + dz*dz;
+
+        /* the above is only valid for non-degenerate triangles (for
+           others, some of the divisions are 0/0); those are rare, so
+           just re-do them in scalar code */
+        unsigned degenerateLanes = movemask(zero < load(&soa.degenerate[slot]));
+        if (degenerateLanes) {
+          float laneDist2[width];
+          store(laneDist2,dist2);
+          while (degenerateLanes) {
+            const int lane = firstSetBit(degenerateLanes);
+            degenerateLanes &= degenerateLanes-1;
+            laneDist2[lane] = closestPoint(queryPoint,soa[slot+lane]).sqrDistance;
+          }
+          dist2 = load(laneDist2);
+        }
+        return dist2;
+      }
+
+      inline void fcp(FCPResult     &result,
+                      const vec3f    queryPoint,
+                      const bvh3f    bvh,
+                      const LeafSoA &soa)
+      {
+        const simd::vfloat qx = simd::broadcast(queryPoint.x);
+        const simd::vfloat qy = simd::broadcast(queryPoint.y);
+        const simd::vfloat qz = simd::broadcast(queryPoint.z);
+        const simd::vfloat inf = simd::broadcast(INFINITY);
+        int closestSlot = -1;
+        auto perLeaf = [&](const uint32_t *leafPrims, size_t numPrims)->float {
+          const int leafBegin = int(leafPrims - bvh.primIDs);
+          const int leafEnd   = leafBegin + (int)numPrims;
+          for (int begin=leafBegin;begin<leafEnd;begin+=simd::width) {
+            simd::vfloat dist2 = sqrDistances(soa,begin,queryPoint,qx,qy,qz);
+            // mask out lanes past the end of the leaf
+            const simd::vbool valid
+              = (simd::laneIndex() < simd::broadcast(float(leafEnd-begin)))
+              && (dist2 < simd::broadcast(result.sqrDistance));
+            dist2 = simd::select(valid,dist2,inf);
+            int   minLane;
+            float minDist2 = simd::reduce_min(dist2,minLane);
+            if (minDist2 < result.sqrDistance) {
+              result.sqrDistance = minDist2;
+              result.primID = bvh.primIDs[begin+minLane];
+              closestSlot = begin+minLane;
+            }
+          }
+          return result.sqrDistance;
+        };
+        shrinkingRadiusQuery_forEachLeaf(bvh,queryPoint,result.sqrDistance,perLeaf);
+        if (closestSlot < 0)
+          return;
+        const CPResult closest = closestPoint(queryPoint,soa[closestSlot]);
+        result.point   = closest.point;
+        result.u       = closest.u;
+        result.v       = closest.v;
+        result.feature = closest.feature;
+      }
+
+      inline void fcp(FCPResult     *results,
+                      const vec3f   *queryPoints,
+                      int            numQueries,
+                      const bvh3f    bvh,
+                      const LeafSoA &soa,
+                      float          sqrMaxQueryDist)
+      {
+        cuBQL::host::parallel_for(numQueries,[&](size_t queryID) {
+          FCPResult &result = results[queryID];
+          result.clear(sqrMaxQueryDist);
+          fcp(result,queryPoints[queryID],bvh,soa);
+        });
+      }
+    } // ::cuBQL::triangles::host
+
+  } // ::cuBQL::triangles
+} // ::cuBQL
@@ -0,0 +1,301 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+/*! optional, precomputed per-triangle records for faster
+    closest-point queries on triangle meshes.
+
+    The closest-point test in fcp.h has to, on every visit of a
+    candidate triangle, gather three vertices through the index
+    buffer, compute the two edges, and then do six dot products with
+    the query point. Of those six, four are (query-independent) edge
+    dot products plus one of the other two; so if we store, per
+    triangle, vertex a, the two edges ab and ac, and the three edge
+    dot products (ab.ab, ab.ac, ac.ac), each visit only needs two dot
+    products, and a single, non-indirect load. This costs 48 bytes
+    per triangle (vs 12 bytes of indices plus shared vertices), so
+    whether that's worth it depends on how often each triangle gets
+    visited; see samples/fcpTriangles.cu for a benchmark.
+
+    The records can be stored either in prim order (record[primID]),
+    or in leaf order (record[i] belonging to bvh.primIDs[i]), in
+    which case all triangles of a leaf are contiguous in memory; and
+    either as array-of-structs (PrecomputedTriangle*) or as
+    struct-of-arrays (PrecomputedTrianglesSoA). */
+#pragma once
+
+#include "cuBQL/triangles/fcp.h"
+#include "cuBQL/impl/parallel_for.h"
+#include <vector>
+
+namespace cuBQL {
+  namespace triangles {
+
+    /*! a triangle, with everything the closest-point test needs
+        that does not depend on the query point */
+    struct PrecomputedTriangle {
+      static inline __cubql_both PrecomputedTriangle make(const Triangle &triangle);
+
+      vec3f a;
+      vec3f ab;
+      vec3f ac;
+      float ab_ab, ab_ac, ac_ac;
+    };
+
+    /*! struct-of-arrays storage of precomputed triangles; all four
+        arrays have one entry per triangle */
+    struct PrecomputedTrianglesSoA {
+      inline __cubql_both PrecomputedTriangle operator[](size_t i) const;
+      inline __cubql_both void set(size_t i, const PrecomputedTriangle &triangle) const;
+
+      vec3f *a;
+      vec3f *ab;
+      vec3f *ac;
+      /*! (ab.ab, ab.ac, ac.ac) */
+      vec3f *dots;
+    };
+
+    /*! whether precomputed triangles are stored in prim order (ie,
+        triangles[primID]) or in the BVH's leaf order (ie,
+        triangles[i] is prim bvh.primIDs[i]) */
+    enum PrecomputedLayout { PRIM_ORDER = 0, LEAF_ORDER };
+
+    /*! same as closestPoint(queryPoint,Triangle), but on a
+        precomputed triangle */
+    inline __cubql_both
+    CPResult closestPoint(const vec3f queryPoint, const PrecomputedTriangle &triangle);
+
+    /*! same as fcp() in fcp.h, but using precomputed triangles
+        (either a PrecomputedTriangle* or a PrecomputedTrianglesSoA,
+        in the given layout) instead of indices[] and vertices[] */
+    template<typename PrecomputedArray>
+    inline __cubql_both
+    void fcp(FCPResult              &result,
+             const vec3f             queryPoint,
+             const bvh3f             bvh,
+             const PrecomputedArray &triangles,
+             PrecomputedLayout       layout);
+
+#ifdef __CUDACC__
+    /*! computes the precomputed triangles for the given mesh, in the
+        given layout, on the GPU. 'triangles' is either a
+        PrecomputedTriangle* or a PrecomputedTrianglesSoA with
+        bvh.numPrims entries. Does not sync. */
+    template<typename PrecomputedArray>
+    void precomputeTriangles(PrecomputedArray   triangles,
+                             PrecomputedLayout  layout,
+                             const bvh3f        bvh,
+                             const vec3i       *indices,
+                             const vec3f       *vertices,
+                             cudaStream_t       s=0);
+#endif
+
+    namespace host {
+      /*! host-side equivalent of cuBQL::triangles::precomputeTriangles() */
+      template<typename PrecomputedArray>
+      void precomputeTriangles(PrecomputedArray   triangles,
+                               PrecomputedLayout  layout,
+                               const bvh3f        bvh,
+                               const vec3i       *indices,
+                               const vec3f       *vertices);
+    }
+
+    // ==================================================================
+    // implementation
+    // ==================================================================
+
+    inline __cubql_both
+    PrecomputedTriangle PrecomputedTriangle::make(const Triangle &triangle)
+    {
+      PrecomputedTriangle pt;
+      pt.a     = triangle.a;
+      pt.ab    = triangle.b - triangle.a;
+      pt.ac    = triangle.c - triangle.a;
+      pt.ab_ab = dot(pt.ab,pt.ab);
+      pt.ab_ac = dot(pt.ab,pt.ac);
+      pt.ac_ac = dot(pt.ac,pt.ac);
+      return pt;
+    }
+
+    inline __cubql_both
+    PrecomputedTriangle PrecomputedTrianglesSoA::operator[](size_t i) const
+    {
+      PrecomputedTriangle pt;
+      pt.a  = a[i];
+      pt.ab = ab[i];
+      pt.ac = ac[i];
+      const vec3f d = dots[i];
+      pt.ab_ab = d.x;
+      pt.ab_ac = d.y;
+      pt.ac_ac = d.z;
+      return pt;
+    }
+
+    inline __cubql_both
+    void PrecomputedTrianglesSoA::set(size_t i, const PrecomputedTriangle &pt) const
+    {
+      a[i]    = pt.a;
+      ab[i]   = pt.ab;
+      ac[i]   = pt.ac;
+      dots[i] = vec3f(pt.ab_ab,pt.ab_ac,pt.ac_ac);
+    }
+
+    /*! this is the same region-based test as closestPoint() in fcp.h,
+        with d3..d6 derived from d1, d2, and the precomputed edge dot
+        products (eg, d3 = ab.(q-b) = ab.(q-a) - ab.ab) */
+    inline __cubql_both
+    CPResult closestPoint(const vec3f q, const PrecomputedTriangle &triangle)
+    {
+      const vec3f ap = q - triangle.a;
+      const float d1 = dot(triangle.ab,ap);
+      const float d2 = dot(triangle.ac,ap);
+      const float d3 = d1 - triangle.ab_ab;
+      const float d4 = d2 - triangle.ab_ac;
+      const float d5 = d1 - triangle.ab_ac;
+      const float d6 = d2 - triangle.ac_ac;
+      const float va = d3*d6 - d5*d4;
+      const float vb = d5*d2 - d1*d6;
+      const float vc = d1*d4 - d3*d2;
+
+      CPResult result;
+      // as in closestPoint(q,Triangle), edge regions require a
+      // non-zero edge length, and degenerate triangles get handled
+      // edge by edge
+      if (d1 <= 0.f && d2 <= 0.f) {
+        result.u = 0.f; result.v = 0.f; result.feature = FEATURE_VERTEX_A;
+      } else if (d3 >= 0.f && d4 <= d3) {
+        result.u = 1.f; result.v = 0.f; result.feature = FEATURE_VERTEX_B;
+      } else if (vc <= 0.f && d1 >= 0.f && d3 <= 0.f && (d1-d3) > 0.f) {
+        result.u = d1 / (d1-d3); result.v = 0.f; result.feature = FEATURE_EDGE_AB;
+      } else if (d6 >= 0.f && d5 <= d6) {
+        result.u = 0.f; result.v = 1.f; result.feature = FEATURE_VERTEX_C;
+      } else if (vb <= 0.f && d2 >= 0.f && d6 <= 0.f && (d2-d6) > 0.f) {
+        result.u = 0.f; result.v = d2 / (d2-d6); result.feature = FEATURE_EDGE_CA;
+      } else if (va <= 0.f && (d4-d3) >= 0.f && (d5-d6) >= 0.f
+                 && ((d4-d3)+(d5-d6)) > 0.f) {
+        const float t = (d4-d3) / ((d4-d3)+(d5-d6));
+        result.u = 1.f-t; result.v = t; result.feature = FEATURE_EDGE_BC;
+      } else if (va+vb+vc <= 0.f || isDegenerate(triangle.ab,triangle.ac)) {
+        return closestPointOnEdges(q,triangle.a,triangle.ab,triangle.ac);
+      } else {
+        const float rcpSum = 1.f/(va+vb+vc);
+        result.u = vb*rcpSum; result.v = vc*rcpSum; result.feature = FEATURE_FACE;
+      }
+      result.point = triangle.a + result.u*triangle.ab + result.v*triangle.ac;
+      result.sqrDistance = sqrDistance(q,result.point);
+      return result;
+    }
+
+    template<typename PrecomputedArray>
+    inline __cubql_both
+    void fcp(FCPResult              &result,
+             const vec3f             queryPoint,
+             const bvh3f             bvh,
+             const PrecomputedArray &triangles,
+             PrecomputedLayout       layout)
+    {
+      auto perLeaf
+        = [&result,&triangles,queryPoint,bvh,layout]
+        (const uint32_t *leafPrims, size_t numPrims)->float
+        {
+          // in leaf order, this leaf's triangles are right where its
+          // primIDs are
+          const size_t leafBegin = leafPrims - bvh.primIDs;
+          for (int i=0;i<(int)numPrims;i++) {
+            const uint32_t primID = leafPrims[i];
+            const size_t   slot   = (layout == LEAF_ORDER) ? (leafBegin+i) : primID;
+            CPResult primResult = closestPoint(queryPoint,triangles[slot]);
+            if (primResult.sqrDistance < result.sqrDistance)
+              result.set(primID,primResult);
+          }
+          return result.sqrDistance;
+        };
+      cuBQL::shrinkingRadiusQuery_forEachLeaf(bvh,queryPoint,result.sqrDistance,perLeaf);
+    }
+
+    namespace precomputed_impl {
+      /*! @{ stores a precomputed triangle into either type of array */
+      inline __cubql_both
+      void store(PrecomputedTriangle *triangles, size_t i, const PrecomputedTriangle &pt)
+      { triangles[i] = pt; }
+      inline __cubql_both
+      void store(const PrecomputedTrianglesSoA &triangles, size_t i, const PrecomputedTriangle &pt)
+      { triangles.set(i,pt); }
+      /*! @} */
+
+      template<typename PrecomputedArray>
+      inline __cubql_both
+      void precompute(PrecomputedArray   triangles,
+                      PrecomputedLayout  layout,
+                      const bvh3f        bvh,
+                      const vec3i       *indices,
+                      const vec3f       *vertices,
+                      size_t             slot)
+      {
+        const uint32_t primID = (layout == LEAF_ORDER) ? bvh.primIDs[slot] : uint32_t(slot);
+        store(triangles,slot,PrecomputedTriangle::make(getTriangle(indices,vertices,primID)));
+      }
+    } // ::cuBQL::triangles::precomputed_impl
+
+#ifdef __CUDACC__
+    namespace precomputed_impl {
+      template<typename PrecomputedArray>
+      __global__
+      void precomputeTriangles(PrecomputedArray   triangles,
+                               PrecomputedLayout  layout,
+                               const bvh3f        bvh,
+                               const vec3i       *indices,
+                               const vec3f       *vertices)
+      {
+        const int tid = threadIdx.x+blockIdx.x*blockDim.x;
+        if (tid >= bvh.numPrims) return;
+        precompute(triangles,layout,bvh,indices,vertices,tid);
+      }
+    } // ::cuBQL::triangles::precomputed_impl
+
+    template<typename PrecomputedArray>
+    void precomputeTriangles(PrecomputedArray   triangles,
+                             PrecomputedLayout  layout,
+                             const bvh3f        bvh,
+                             const vec3i       *indices,
+                             const vec3f       *vertices,
+                             cudaStream_t       s)
+    {
+      const int numPrims = (int)bvh.numPrims;
+      if (numPrims == 0) return;
+      precomputed_impl::precomputeTriangles<<<divRoundUp(numPrims,1024),1024,0,s>>>
+        (triangles,layout,bvh,indices,vertices);
+      // we're not syncing here - let APP do that
+    }
+#endif
+
+    namespace host {
+      template<typename PrecomputedArray>
+      void precomputeTriangles(PrecomputedArray   triangles,
+                               PrecomputedLayout  layout,
+                               const bvh3f        bvh,
+                               const vec3i       *indices,
+                               const vec3f       *vertices)
+      {
+        cuBQL::host::parallel_for
+          (bvh.numPrims,
+           [&](size_t slot) {
+             precomputed_impl::precompute(triangles,layout,bvh,indices,vertices,slot);
+           });
+      }
+    } // ::cuBQL::triangles::host
+
+  } // ::cuBQL::triangles
+} // ::cuBQL
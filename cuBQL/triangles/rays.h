@@ -0,0 +1,143 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+/*! ray queries (closest-hit and any-hit) on triangle meshes, using
+    the same bvh3f (built over the triangles' bounding boxes) that's
+    also used for closest-point queries */
+#pragma once
+
+#include "cuBQL/queries/rayQuery.h"
+#include "cuBQL/triangles/Triangle.h"
+
+namespace cuBQL {
+  namespace triangles {
+
+    /*! result of a closest-hit query */
+    struct RayHit {
+      inline __cubql_both void clear() { primID = -1; t = INFINITY; u = v = 0.f; }
+      inline __cubql_both bool hadHit() const { return primID >= 0; }
+
+      int   primID;
+      /*! distance along the ray (in multiples of ray.direction) */
+      float t;
+      /*! barycentric coordinates of the hit point, relative to
+          vertices b and c of the hit triangle */
+      float u, v;
+    };
+
+    /*! finds the closest intersection between the given ray and any
+        of the triangles in the indices[]/vertices[] triangle mesh,
+        within [ray.tMin,ray.tMax]. if no such intersection exists
+        hit.primID will be -1 */
+    inline __cubql_both
+    void closestHit(RayHit      &hit,
+                    const Ray    ray,
+                    const bvh3f  bvh,
+                    const vec3i *const __restrict__ indices,
+                    const vec3f *const __restrict__ vertices);
+
+    /*! returns true if the ray intersects any of the triangles in
+        the indices[]/vertices[] triangle mesh within
+        [ray.tMin,ray.tMax]; terminates traversal at the first
+        intersection found (eg, for shadow rays and visibility
+        tests) */
+    inline __cubql_both
+    bool anyHit(const Ray    ray,
+                const bvh3f  bvh,
+                const vec3i *const __restrict__ indices,
+                const vec3f *const __restrict__ vertices);
+
+    /*! ray-triangle intersection (moeller-trumbore); returns true -
+        and fills in t, u, and v - if the ray hits the triangle within
+        [tMin,tMax]. both front- and back-facing hits are reported */
+    inline __cubql_both
+    bool intersect(const Ray &ray, const Triangle &triangle,
+                   float tMin, float tMax,
+                   float &t, float &u, float &v);
+
+    // ==================================================================
+    // implementation
+    // ==================================================================
+
+    inline __cubql_both
+    bool intersect(const Ray &ray, const Triangle &triangle,
+                   float tMin, float tMax,
+                   float &t, float &u, float &v)
+    {
+      const vec3f e1 = triangle.b - triangle.a;
+      const vec3f e2 = triangle.c - triangle.a;
+      const vec3f p = cross(ray.direction,e2);
+      const float det = dot(e1,p);
+      if (det == 0.f) return false;
+      const float rcpDet = 1.f/det;
+      const vec3f s = ray.origin - triangle.a;
+      const float hit_u = dot(s,p)*rcpDet;
+      if (hit_u < 0.f || hit_u > 1.f) return false;
+      const vec3f q = cross(s,e1);
+      const float hit_v = dot(ray.direction,q)*rcpDet;
+      if (hit_v < 0.f || hit_u+hit_v > 1.f) return false;
+      const float hit_t = dot(e2,q)*rcpDet;
+      if (hit_t < tMin || hit_t > tMax) return false;
+      t = hit_t;
+      u = hit_u;
+      v = hit_v;
+      return true;
+    }
+
+    inline __cubql_both
+    void closestHit(RayHit      &hit,
+                    const Ray    ray,
+                    const bvh3f  bvh,
+                    const vec3i *const __restrict__ indices,
+                    const vec3f *const __restrict__ vertices)
+    {
+      hit.clear();
+      hit.t = ray.tMax;
+      auto perPrim=[&hit,&ray,indices,vertices](uint32_t primID)->float {
+        float t, u, v;
+        if (intersect(ray,getTriangle(indices,vertices,primID),ray.tMin,hit.t,t,u,v)) {
+          hit.primID = primID;
+          hit.t = t;
+          hit.u = u;
+          hit.v = v;
+        }
+        return hit.t;
+      };
+      rayQuery_forEachPrim(bvh,ray,perPrim);
+      if (!hit.hadHit()) hit.t = INFINITY;
+    }
+
+    inline __cubql_both
+    bool anyHit(const Ray    ray,
+                const bvh3f  bvh,
+                const vec3i *const __restrict__ indices,
+                const vec3f *const __restrict__ vertices)
+    {
+      bool foundHit = false;
+      auto perPrim=[&foundHit,&ray,indices,vertices](uint32_t primID)->float {
+        float t, u, v;
+        if (!intersect(ray,getTriangle(indices,vertices,primID),ray.tMin,ray.tMax,t,u,v))
+          return ray.tMax;
+        foundHit = true;
+        // negative value terminates traversal
+        return -1.f;
+      };
+      rayQuery_forEachPrim(bvh,ray,perPrim);
+      return foundHit;
+    }
+
+  } // ::cuBQL::triangles
+} // ::cuBQL
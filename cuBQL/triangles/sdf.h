@@ -0,0 +1,381 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+/*! signed distance field (SDF) generation for triangle meshes: for
+    each cell of a regular 3D grid, computes the distance to the
+    closest point on the mesh, with the sign telling whether the cell
+    center is inside (negative) or outside (positive) the mesh.
+
+    The sign is computed with angle-weighted pseudo-normals (Baerentzen
+    and Aanaes, "Signed Distance Computation Using the Angle Weighted
+    Pseudonormal"): depending on whether the closest point lies on a
+    triangle's face, on one of its edges, or on one of its vertices,
+    the sign is that of the dot product between (queryPoint -
+    closestPoint) and that face's, edge's, or vertex's
+    pseudo-normal. This gives correct signs for any closed,
+    consistently oriented (but not necessarily convex) mesh.
+
+    The grid is processed in bricks of 4x4x4 cells, with one thread
+    per brick, walking the brick's cells in a 'snake' order such
+    that each cell is a direct neighbor of the previous one. Each
+    cell's query radius then gets seeded with the previous cell's
+    distance plus the distance between the two cells (the closest
+    point of the previous cell cannot be any further away than that),
+    so all but the first cell of each brick start with a tight search
+    radius rather than with an infinite one. */
+#pragma once
+
+#include "cuBQL/triangles/fcp.h"
+#include "cuBQL/impl/parallel_for.h"
+#include <vector>
+#include <map>
+#include <utility>
+
+namespace cuBQL {
+  namespace triangles {
+
+    /*! (device- or host-) pointers to the angle-weighted
+        pseudo-normals of a triangle mesh, as computed by
+        computePseudoNormals(). none of these have to be normalized */
+    struct PseudoNormals {
+      /*! one per triangle */
+      const vec3f *faceNormals;
+      /*! three per triangle, for edges ab, bc, and ca of that
+          triangle, in that order; both triangles sharing an edge
+          will have the same normal for that edge */
+      const vec3f *edgeNormals;
+      /*! one per vertex */
+      const vec3f *vertexNormals;
+    };
+
+    /*! computes the angle-weighted pseudo-normals of an indexed
+        triangle mesh, on the host. faceNormals and edgeNormals will
+        have one and three entries per triangle, vertexNormals one
+        per vertex; see PseudoNormals. The mesh should be closed and
+        consistently oriented (with normals pointing outside) for
+        the resulting signs to make sense */
+    inline void computePseudoNormals(std::vector<vec3f> &faceNormals,
+                                     std::vector<vec3f> &edgeNormals,
+                                     std::vector<vec3f> &vertexNormals,
+                                     const vec3i        *indices,
+                                     int                 numTriangles,
+                                     const vec3f        *vertices,
+                                     int                 numVertices);
+
+    /*! computes the signed distance from queryPoint to the given
+        triangle mesh, only considering triangles within the given
+        (square) search radius; returns INFINITY if no triangle could
+        be found within that radius */
+    inline __cubql_both
+    float signedDistance(const vec3f          queryPoint,
+                         const bvh3f          bvh,
+                         const vec3i         *indices,
+                         const vec3f         *vertices,
+                         const PseudoNormals &normals,
+                         float                sqrMaxSearchDist=INFINITY);
+
+#ifdef __CUDACC__
+    /*! computes a dims.x*dims.y*dims.z signed distance field over
+        the given triangle mesh; the grid's cells evenly subdivide
+        'bounds', and sdf[ix+dims.x*(iy+dims.y*iz)] will get the
+        signed distance for the center of cell (ix,iy,iz). All
+        pointers (including those in 'normals') must be
+        device-accessible; the pseudo-normals have to be computed on
+        the host via computePseudoNormals() and then uploaded. Does
+        not sync. */
+    inline void computeSDF(float               *sdf,
+                           const vec3i          dims,
+                           const box3f          bounds,
+                           const bvh3f          bvh,
+                           const vec3i         *indices,
+                           const vec3f         *vertices,
+                           const PseudoNormals &normals,
+                           cudaStream_t         s=0);
+#endif
+
+    namespace host {
+      /*! host-side equivalent of cuBQL::triangles::computeSDF(), using
+          host threads; all arrays must be host-readable */
+      inline void computeSDF(float               *sdf,
+                             const vec3i          dims,
+                             const box3f          bounds,
+                             const bvh3f          bvh,
+                             const vec3i         *indices,
+                             const vec3f         *vertices,
+                             const PseudoNormals &normals);
+
+      /*! same as above, but computes the pseudo-normals itself */
+      inline void computeSDF(float       *sdf,
+                             const vec3i  dims,
+                             const box3f  bounds,
+                             const bvh3f  bvh,
+                             const vec3i *indices,
+                             const vec3f *vertices);
+    }
+
+    // ==================================================================
+    // implementation
+    // ==================================================================
+
+    inline void computePseudoNormals(std::vector<vec3f> &faceNormals,
+                                     std::vector<vec3f> &edgeNormals,
+                                     std::vector<vec3f> &vertexNormals,
+                                     const vec3i        *indices,
+                                     int                 numTriangles,
+                                     const vec3f        *vertices,
+                                     int                 numVertices)
+    {
+      faceNormals.resize(numTriangles);
+      edgeNormals.resize(3*size_t(numTriangles));
+      vertexNormals.assign(numVertices,vec3f(0.f));
+
+      auto angle = [](vec3f a, vec3f b)->float {
+        const float la = sqrtf(dot(a,a)), lb = sqrtf(dot(b,b));
+        if (la == 0.f || lb == 0.f) return 0.f;
+        return acosf(std::max(-1.f,std::min(1.f,dot(a,b)/(la*lb))));
+      };
+      // each edge's normal is the sum of its adjacent faces' normals
+      // (each weighted with an angle of pi, which cancels out)
+      std::map<std::pair<int,int>,vec3f> sumOfEdgeNormals;
+      for (int triID=0;triID<numTriangles;triID++) {
+        const vec3i idx = indices[triID];
+        const vec3f a = vertices[idx.x], b = vertices[idx.y], c = vertices[idx.z];
+        vec3f N = cross(b-a,c-a);
+        const float len = sqrtf(dot(N,N));
+        N = (len > 0.f) ? N * (1.f/len) : vec3f(0.f);
+        faceNormals[triID] = N;
+
+        vertexNormals[idx.x] = vertexNormals[idx.x] + angle(b-a,c-a) * N;
+        vertexNormals[idx.y] = vertexNormals[idx.y] + angle(c-b,a-b) * N;
+        vertexNormals[idx.z] = vertexNormals[idx.z] + angle(a-c,b-c) * N;
+
+        const int edge[3][2] = { { idx.x,idx.y }, { idx.y,idx.z }, { idx.z,idx.x } };
+        for (int i=0;i<3;i++) {
+          std::pair<int,int> key(std::min(edge[i][0],edge[i][1]),
+                                 std::max(edge[i][0],edge[i][1]));
+          auto it = sumOfEdgeNormals.find(key);
+          if (it == sumOfEdgeNormals.end())
+            sumOfEdgeNormals[key] = N;
+          else
+            it->second = it->second + N;
+        }
+      }
+      for (int triID=0;triID<numTriangles;triID++) {
+        const vec3i idx = indices[triID];
+        const int edge[3][2] = { { idx.x,idx.y }, { idx.y,idx.z }, { idx.z,idx.x } };
+        for (int i=0;i<3;i++)
+          edgeNormals[3*size_t(triID)+i]
+            = sumOfEdgeNormals[std::make_pair(std::min(edge[i][0],edge[i][1]),
+                                              std::max(edge[i][0],edge[i][1]))];
+      }
+    }
+
+    namespace sdf_impl {
+      /*! edge length (in cells) of the bricks the grid is processed in */
+      enum { brickSize = 4 };
+
+      /*! returns the pseudo-normal of the given feature of the given
+          triangle */
+      inline __cubql_both
+      vec3f pseudoNormal(const PseudoNormals &normals,
+                         const vec3i         *indices,
+                         int                  primID,
+                         Feature              feature)
+      {
+        switch (feature) {
+        case FEATURE_EDGE_AB:  return normals.edgeNormals[3*primID+0];
+        case FEATURE_EDGE_BC:  return normals.edgeNormals[3*primID+1];
+        case FEATURE_EDGE_CA:  return normals.edgeNormals[3*primID+2];
+        case FEATURE_VERTEX_A: return normals.vertexNormals[indices[primID].x];
+        case FEATURE_VERTEX_B: return normals.vertexNormals[indices[primID].y];
+        case FEATURE_VERTEX_C: return normals.vertexNormals[indices[primID].z];
+        default:               return normals.faceNormals[primID];
+        }
+      }
+
+      /*! returns the center of the given cell */
+      inline __cubql_both
+      vec3f cellCenter(const vec3i dims, const box3f bounds,
+                       int ix, int iy, int iz)
+      {
+        const vec3f rel((ix+.5f)/dims.x,(iy+.5f)/dims.y,(iz+.5f)/dims.z);
+        return bounds.lower + rel * bounds.size();
+      }
+
+      /*! computes all cells of the given brick; the cells are visited
+          in 'snake' order, with each cell's search radius seeded from
+          the previous cell's result */
+      template<int BrickSize>
+      inline __cubql_both
+      void computeBrick(float               *sdf,
+                        const vec3i          dims,
+                        const box3f          bounds,
+                        const vec3i          brickID,
+                        const bvh3f          bvh,
+                        const vec3i         *indices,
+                        const vec3f         *vertices,
+                        const PseudoNormals &normals)
+      {
+        vec3f prevPoint;
+        float prevDist = INFINITY;
+        for (int i=0;i<BrickSize*BrickSize*BrickSize;i++) {
+          const int lz  = i / (BrickSize*BrickSize);
+          const int row = (i / BrickSize) % BrickSize;
+          const int col = i % BrickSize;
+          const int ly  = (lz  & 1) ? (BrickSize-1-row) : row;
+          const int lx  = (row & 1) ? (BrickSize-1-col) : col;
+          const int ix  = brickID.x*BrickSize+lx;
+          const int iy  = brickID.y*BrickSize+ly;
+          const int iz  = brickID.z*BrickSize+lz;
+          if (ix >= dims.x || iy >= dims.y || iz >= dims.z)
+            continue;
+
+          const vec3f point = cellCenter(dims,bounds,ix,iy,iz);
+          float sqrSearchDist = INFINITY;
+          if (prevDist != INFINITY) {
+            /* the previous cell's closest point is at most
+               |prevDist|+|point-prevPoint| away from this cell, so
+               this cell's closest point can't be any further away
+               than that; add a bit of slack for rounding */
+            const float r
+              = (fabsf(prevDist) + sqrtf(sqrDistance(point,prevPoint))) * 1.0001f
+              + 1e-20f;
+            sqrSearchDist = r*r;
+          }
+          float dist = signedDistance(point,bvh,indices,vertices,normals,sqrSearchDist);
+          sdf[ix+size_t(dims.x)*(iy+size_t(dims.y)*iz)] = dist;
+          prevPoint = point;
+          prevDist  = dist;
+        }
+      }
+    } // ::cuBQL::triangles::sdf_impl
+
+    inline __cubql_both
+    float signedDistance(const vec3f          queryPoint,
+                         const bvh3f          bvh,
+                         const vec3i         *indices,
+                         const vec3f         *vertices,
+                         const PseudoNormals &normals,
+                         float                sqrMaxSearchDist)
+    {
+      FCPResult closest;
+      closest.clear(sqrMaxSearchDist);
+      auto perPrim = [&](uint32_t primID)->float {
+        CPResult primResult
+          = closestPoint(queryPoint,getTriangle(indices,vertices,primID));
+        if (primResult.sqrDistance < closest.sqrDistance)
+          closest.set(primID,primResult);
+        return closest.sqrDistance;
+      };
+      shrinkingRadiusQuery_forEachPrim(bvh,queryPoint,sqrMaxSearchDist,perPrim);
+      if (closest.primID < 0)
+        return INFINITY;
+
+      const vec3f N
+        = sdf_impl::pseudoNormal(normals,indices,closest.primID,closest.feature);
+      const float dist = sqrtf(closest.sqrDistance);
+      return (dot(queryPoint-closest.point,N) < 0.f) ? -dist : dist;
+    }
+
+#ifdef __CUDACC__
+    namespace sdf_impl {
+      template<int BrickSize>
+      __global__
+      void computeBricks(float               *sdf,
+                         const vec3i          dims,
+                         const box3f          bounds,
+                         const vec3i          numBricks,
+                         const bvh3f          bvh,
+                         const vec3i         *indices,
+                         const vec3f         *vertices,
+                         const PseudoNormals  normals)
+      {
+        const int tid = threadIdx.x+blockIdx.x*blockDim.x;
+        if (tid >= numBricks.x*numBricks.y*numBricks.z) return;
+        const vec3i brickID(tid % numBricks.x,
+                            (tid / numBricks.x) % numBricks.y,
+                            tid / (numBricks.x*numBricks.y));
+        computeBrick<BrickSize>(sdf,dims,bounds,brickID,bvh,indices,vertices,normals);
+      }
+    } // ::cuBQL::triangles::sdf_impl
+
+    inline void computeSDF(float               *sdf,
+                           const vec3i          dims,
+                           const box3f          bounds,
+                           const bvh3f          bvh,
+                           const vec3i         *indices,
+                           const vec3f         *vertices,
+                           const PseudoNormals &normals,
+                           cudaStream_t         s)
+    {
+      const vec3i numBricks(divRoundUp(dims.x,(int)sdf_impl::brickSize),
+                            divRoundUp(dims.y,(int)sdf_impl::brickSize),
+                            divRoundUp(dims.z,(int)sdf_impl::brickSize));
+      const int numJobs = numBricks.x*numBricks.y*numBricks.z;
+      if (numJobs <= 0) return;
+      sdf_impl::computeBricks<sdf_impl::brickSize><<<divRoundUp(numJobs,64),64,0,s>>>
+        (sdf,dims,bounds,numBricks,bvh,indices,vertices,normals);
+      // we're not syncing here - let APP do that
+    }
+#endif
+
+    namespace host {
+      inline void computeSDF(float               *sdf,
+                             const vec3i          dims,
+                             const box3f          bounds,
+                             const bvh3f          bvh,
+                             const vec3i         *indices,
+                             const vec3f         *vertices,
+                             const PseudoNormals &normals)
+      {
+        const vec3i numBricks(divRoundUp(dims.x,(int)sdf_impl::brickSize),
+                              divRoundUp(dims.y,(int)sdf_impl::brickSize),
+                              divRoundUp(dims.z,(int)sdf_impl::brickSize));
+        cuBQL::host::parallel_for
+          (size_t(numBricks.x)*numBricks.y*numBricks.z,
+           [&](size_t jobID) {
+             const vec3i brickID(int(jobID % numBricks.x),
+                                 int((jobID / numBricks.x) % numBricks.y),
+                                 int(jobID / (size_t(numBricks.x)*numBricks.y)));
+             sdf_impl::computeBrick<sdf_impl::brickSize>(sdf,dims,bounds,brickID,bvh,indices,vertices,normals);
+           },
+           /* each job is already a full brick of cells */
+           1);
+      }
+
+      inline void computeSDF(float       *sdf,
+                             const vec3i  dims,
+                             const box3f  bounds,
+                             const bvh3f  bvh,
+                             const vec3i *indices,
+                             const vec3f *vertices)
+      {
+        const int numTriangles = (int)bvh.numPrims;
+        int numVertices = 0;
+        for (int i=0;i<numTriangles;i++)
+          numVertices = std::max(numVertices,1+reduce_max(indices[i]));
+        std::vector<vec3f> faceNormals, edgeNormals, vertexNormals;
+        computePseudoNormals(faceNormals,edgeNormals,vertexNormals,
+                             indices,numTriangles,vertices,numVertices);
+        const PseudoNormals normals
+          = { faceNormals.data(), edgeNormals.data(), vertexNormals.data() };
+        // (qualified, since ADL would also find the device version)
+        triangles::host::computeSDF(sdf,dims,bounds,bvh,indices,vertices,normals);
+      }
+    } // ::cuBQL::triangles::host
+
+  } // ::cuBQL::triangles
+} // ::cuBQL
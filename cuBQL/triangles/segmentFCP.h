@@ -0,0 +1,157 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+
+/*! closest-point queries between a query line segment and a triangle
+    mesh - eg, for clearance checks of a capsule or of a sphere swept
+    along a path, which otherwise would need many point queries along
+    each segment. Uses the same bvh3f (built over the triangles'
+    bounding boxes) as the point queries in fcp.h. */
+#pragma once
+
+#include "cuBQL/triangles/fcp.h"
+#include "cuBQL/triangles/rays.h"
+#include "cuBQL/lineSegs/LineSegs3f.h"
+#include "cuBQL/queries/segmentQuery.h"
+
+namespace cuBQL {
+  namespace triangles {
+
+    /*! result of a closest-point operation between a segment and a
+        triangle: the closest point on the triangle (with its
+        barycentrics and feature, as for point queries), plus the
+        closest point on the query segment, at
+        querySegment.begin + t*(querySegment.end-querySegment.begin) */
+    struct SegmentCPResult : public CPResult {
+      vec3f queryPoint;
+      float t;
+    };
+
+    /*! result of a fcp query for a query segment */
+    struct SegmentFCPResult : public FCPResult {
+      inline __cubql_both void set(int primID, const SegmentCPResult &cp);
+
+      /*! the closest point on the query segment, and where along
+          the segment it is */
+      vec3f queryPoint;
+      float t;
+    };
+
+    /*! computes the closest pair of points between the query segment
+        and the triangle; if the segment crosses the triangle, the
+        distance is 0 and the crossing point is returned */
+    inline __cubql_both
+    SegmentCPResult closestPoint(const lineSegs::Segment querySegment,
+                                 const Triangle          triangle);
+
+    /*! segment version of fcp(): finds the triangle (in the
+        triangles[]/vertices[] mesh) that is closest to the query
+        segment, within the max query distance passed to
+        result.clear(). Works on both host and device */
+    inline __cubql_both
+    void fcp(SegmentFCPResult &result,
+             const lineSegs::Segment         querySegment,
+             const bvh3f                     bvh,
+             const vec3i *const __restrict__ triangles,
+             const vec3f *const __restrict__ vertices);
+
+    // ==================================================================
+    // implementation
+    // ==================================================================
+
+    inline __cubql_both
+    void SegmentFCPResult::set(int primID, const SegmentCPResult &cp)
+    {
+      FCPResult::set(primID,cp);
+      queryPoint = cp.queryPoint;
+      t          = cp.t;
+    }
+
+    inline __cubql_both
+    SegmentCPResult closestPoint(const lineSegs::Segment querySegment,
+                                 const Triangle          triangle)
+    {
+      SegmentCPResult result;
+      const vec3f dir = querySegment.end - querySegment.begin;
+      float t, u, v;
+      if (intersect(Ray{querySegment.begin,dir},triangle,0.f,1.f,t,u,v)) {
+        result.t = t;
+        result.u = u;
+        result.v = v;
+        result.feature     = FEATURE_FACE;
+        result.queryPoint  = querySegment.begin + t*dir;
+        result.point       = triangle.a + u*(triangle.b-triangle.a) + v*(triangle.c-triangle.a);
+        result.sqrDistance = 0.f;
+        return result;
+      }
+
+      /* otherwise, one of the two closest points is either one of
+         the segment's end points, or on one of the triangle's
+         edges */
+      (CPResult &)result = closestPoint(querySegment.begin,triangle);
+      result.t = 0.f;
+      result.queryPoint = querySegment.begin;
+      const CPResult atEnd = closestPoint(querySegment.end,triangle);
+      if (atEnd.sqrDistance < result.sqrDistance) {
+        (CPResult &)result = atEnd;
+        result.t = 1.f;
+        result.queryPoint = querySegment.end;
+      }
+      const vec3f corners[3] = { triangle.a, triangle.b, triangle.c };
+      for (int edge=0;edge<3;edge++) {
+        const lineSegs::Segment edgeSegment{ corners[edge], corners[(edge+1)%3] };
+        const lineSegs::SegmentCPResult cp
+          = lineSegs::closestPoints(querySegment,edgeSegment);
+        if (!(cp.sqrDistance < result.sqrDistance)) continue;
+        // edges are AB, BC, and CA; u along the edge maps to the
+        // triangle's barycentrics accordingly
+        const float s = cp.u;
+        result.u = (edge == 0) ? s : ((edge == 1) ? 1.f-s : 0.f);
+        result.v = (edge == 0) ? 0.f : ((edge == 1) ? s : 1.f-s);
+        result.feature
+          = (s == 0.f)
+          ? Feature(FEATURE_VERTEX_A+edge)
+          : ((s == 1.f)
+             ? Feature(FEATURE_VERTEX_A+(edge+1)%3)
+             : Feature(FEATURE_EDGE_AB+edge));
+        result.t           = cp.t;
+        result.queryPoint  = cp.queryPoint;
+        result.point       = cp.point;
+        result.sqrDistance = cp.sqrDistance;
+      }
+      return result;
+    }
+
+    inline __cubql_both
+    void fcp(SegmentFCPResult &result,
+             const lineSegs::Segment         querySegment,
+             const bvh3f                     bvh,
+             const vec3i *const __restrict__ indices,
+             const vec3f *const __restrict__ vertices)
+    {
+      auto perPrim=[&result,querySegment,indices,vertices](uint32_t primID)->float {
+        const SegmentCPResult primResult
+          = closestPoint(querySegment,getTriangle(indices,vertices,primID));
+        if (primResult.sqrDistance < result.sqrDistance)
+          result.set(primID,primResult);
+        return result.sqrDistance;
+      };
+      segmentQuery_forEachPrim(bvh,querySegment.begin,querySegment.end,
+                               result.sqrDistance,perPrim);
+    }
+
+  } // ::cuBQL::triangles
+} // ::cuBQL
@@ -28,12 +28,28 @@
     512x512x512 cells (stretched over the bounding box of the model),
     then for each cell center, perform a bvh fcp closest-point query
     on those line segments.
+
+    4) run the same queries again using precomputed triangle records
+    (cuBQL/triangles/precomputed.h) in different layouts, to compare
+    their memory cost and speed against the on-the-fly version
+
+    5) compute a signed distance field over the same grid, using
+    cuBQL::triangles::computeSDF()
+
+    6) run host-side queries on a coarser grid, once with the plain
+    scalar per-triangle test, and once with the SIMD leaf kernels
+    from cuBQL/triangles/leafSoA.h over a BVH whose leaves are about
+    one SIMD vector wide
 */
 
 // cuBQL:
 #define CUBQL_GPU_BUILDER_IMPLEMENTATION 1
 #include "cuBQL/bvh.h"
 #include "cuBQL/triangles/fcp.h"
+#include "cuBQL/triangles/sdf.h"
+#include "cuBQL/triangles/precomputed.h"
+#include "cuBQL/triangles/leafSoA.h"
+#include "cuBQL/impl/parallel_for.h"
 #include "testing/helper/triangles.h"
 
 // std:
@@ -132,6 +148,67 @@ void runQueries(float       *results,
            result.sqrDistance);
 }
 
+/*! same as runQueries(), but on precomputed triangles */
+template<typename PrecomputedArray>
+__global__
+void runQueriesPrecomputed(float       *results,
+                           int          gridDim,
+                           bvh3f        trianglesBVH,
+                           const PrecomputedArray triangles,
+                           cuBQL::triangles::PrecomputedLayout layout)
+{
+  int tid = threadIdx.x+blockIdx.x*blockDim.x;
+  int numGridPoints = gridDim * gridDim * gridDim;
+  if (tid >= numGridPoints) return;
+
+  int ix = tid % gridDim;
+  int iy = (tid / gridDim) % gridDim;
+  int iz = tid / (gridDim*gridDim);
+
+  const box3f bbox = trianglesBVH.nodes[0].bounds;
+  vec3f relQueryPoint = vec3f{float((ix+.5f)/gridDim),
+                              float((iy+.5f)/gridDim),
+                              float((iz+.5f)/gridDim)};
+  vec3f queryPoint = bbox.lower + relQueryPoint * bbox.size();
+  cuBQL::triangles::FCPResult result;
+  result.clear(INFINITY);
+  cuBQL::triangles::fcp(result,queryPoint,trianglesBVH,triangles,layout);
+  results[tid] = sqrtf(result.sqrDistance);
+}
+
+/*! runs runQueriesPrecomputed() over the given precomputed
+    triangles, and prints timing and max difference to the reference
+    results */
+template<typename PrecomputedArray>
+void benchmarkPrecomputed(const char  *description,
+                          size_t       numBytes,
+                          double       referenceTime,
+                          const float *referenceResults,
+                          int          gridDim,
+                          bvh3f        trianglesBVH,
+                          const PrecomputedArray triangles,
+                          cuBQL::triangles::PrecomputedLayout layout)
+{
+  int numQueries = gridDim * gridDim * gridDim;
+  float *results = allocManaged<float>(numQueries);
+  // once for warm-up, once for timing
+  for (int rep=0;rep<2;rep++) {
+    double t0 = getCurrentTime();
+    runQueriesPrecomputed<<<divRoundUp(numQueries,1024),1024>>>
+      (results,gridDim,trianglesBVH,triangles,layout);
+    CUBQL_CUDA_SYNC_CHECK();
+    double t1 = getCurrentTime();
+    if (rep == 0) continue;
+    float maxDiff = 0.f;
+    for (int i=0;i<numQueries;i++)
+      maxDiff = std::max(maxDiff,fabsf(results[i]-referenceResults[i]));
+    std::cout << " - " << description << ": " << prettyNumber(numBytes) << "B, "
+              << prettyDouble(t1-t0) << "s (speedup "
+              << (referenceTime/(t1-t0)) << "x), max diff to reference "
+              << maxDiff << std::endl;
+  }
+  cudaFree(results);
+}
 
 int main(int ac, const char **av)
 {
@@ -214,5 +291,137 @@ int main(int ac, const char **av)
   std::ofstream out("distances.raw",std::ios::binary);
   out.write((const char *)sqrDist,numQueries*sizeof(float));
 #endif
+
+  // ------------------------------------------------------------------
+  // step 4: same queries on precomputed triangles
+  // ------------------------------------------------------------------
+  {
+    using cuBQL::triangles::PrecomputedTriangle;
+    using cuBQL::triangles::PrecomputedTrianglesSoA;
+    using cuBQL::triangles::PRIM_ORDER;
+    using cuBQL::triangles::LEAF_ORDER;
+    std::cout << "comparing to precomputed triangles:" << std::endl;
+    std::cout << " - on the fly (indices+vertices): "
+              << prettyNumber(h_indices.size()*sizeof(vec3i)
+                              +h_vertices.size()*sizeof(vec3f)) << "B, "
+              << prettyDouble(t1-t0) << "s" << std::endl;
+    PrecomputedTriangle *aos = allocManaged<PrecomputedTriangle>(numTriangles);
+    cuBQL::triangles::precomputeTriangles(aos,PRIM_ORDER,trianglesBVH,indices,vertices);
+    benchmarkPrecomputed("precomputed, prim order",numTriangles*sizeof(*aos),t1-t0,
+                         sqrDist,gridDim,trianglesBVH,aos,PRIM_ORDER);
+    cuBQL::triangles::precomputeTriangles(aos,LEAF_ORDER,trianglesBVH,indices,vertices);
+    benchmarkPrecomputed("precomputed, leaf order",numTriangles*sizeof(*aos),t1-t0,
+                         sqrDist,gridDim,trianglesBVH,aos,LEAF_ORDER);
+    PrecomputedTrianglesSoA soa;
+    soa.a    = allocManaged<vec3f>(numTriangles);
+    soa.ab   = allocManaged<vec3f>(numTriangles);
+    soa.ac   = allocManaged<vec3f>(numTriangles);
+    soa.dots = allocManaged<vec3f>(numTriangles);
+    cuBQL::triangles::precomputeTriangles(soa,LEAF_ORDER,trianglesBVH,indices,vertices);
+    benchmarkPrecomputed("precomputed, leaf order, SoA",4*numTriangles*sizeof(vec3f),t1-t0,
+                         sqrDist,gridDim,trianglesBVH,soa,LEAF_ORDER);
+    cudaFree(aos);
+    cudaFree(soa.a);
+    cudaFree(soa.ab);
+    cudaFree(soa.ac);
+    cudaFree(soa.dots);
+  }
+
+  // ------------------------------------------------------------------
+  // step 5: signed distance field over the same grid
+  // ------------------------------------------------------------------
+  std::vector<vec3f> h_faceNormals, h_edgeNormals, h_vertexNormals;
+  cuBQL::triangles::computePseudoNormals(h_faceNormals,h_edgeNormals,h_vertexNormals,
+                                         h_indices.data(),numTriangles,
+                                         h_vertices.data(),(int)h_vertices.size());
+  vec3f *faceNormals   = allocManaged<vec3f>((int)h_faceNormals.size());
+  vec3f *edgeNormals   = allocManaged<vec3f>((int)h_edgeNormals.size());
+  vec3f *vertexNormals = allocManaged<vec3f>((int)h_vertexNormals.size());
+  std::copy(h_faceNormals.begin(),h_faceNormals.end(),faceNormals);
+  std::copy(h_edgeNormals.begin(),h_edgeNormals.end(),edgeNormals);
+  std::copy(h_vertexNormals.begin(),h_vertexNormals.end(),vertexNormals);
+
+  box3f bounds;
+  for (auto vertex : h_vertices) bounds.grow(vertex);
+  float *sdf = allocManaged<float>(numQueries);
+  t0 = getCurrentTime();
+  cuBQL::triangles::computeSDF(sdf,vec3i(gridDim),bounds,trianglesBVH,indices,vertices,
+                               {faceNormals,edgeNormals,vertexNormals});
+  CUBQL_CUDA_SYNC_CHECK();
+  t1 = getCurrentTime();
+  std::cout << "computed signed distance field over the same grid, took "
+            << prettyDouble(t1-t0) << "s" << std::endl;
+#if 0
+  std::cout << "saving to sdf.raw" << std::endl;
+  std::ofstream sdfOut("sdf.raw",std::ios::binary);
+  sdfOut.write((const char *)sdf,numQueries*sizeof(float));
+#endif
+
+  // ------------------------------------------------------------------
+  // step 6: host-side queries, scalar vs SIMD
+  // ------------------------------------------------------------------
+  {
+    // the SIMD kernels want leaves of about simd::width triangles
+    bvh3f simdBVH;
+    box3f *boxes = allocManaged<box3f>(numTriangles);
+    generateBoxes<<<divRoundUp(numTriangles,1024),1024>>>
+      (boxes,indices,numTriangles,vertices);
+    cuBQL::BuildConfig buildConfig;
+    buildConfig.makeLeafThreshold = cuBQL::simd::width;
+    cuBQL::gpuBuilder(simdBVH,boxes,numTriangles,buildConfig);
+    CUBQL_CUDA_SYNC_CHECK();
+    cudaFree(boxes);
+    cuBQL::triangles::LeafSoA leafSoA;
+    cuBQL::triangles::host::buildLeafSoA(leafSoA,simdBVH,indices,vertices);
+
+    int hostGridDim = 128;
+    int numHostQueries = hostGridDim * hostGridDim * hostGridDim;
+    const box3f bbox = trianglesBVH.nodes[0].bounds;
+    std::vector<vec3f> queryPoints(numHostQueries);
+    for (int i=0;i<numHostQueries;i++) {
+      vec3f relQueryPoint = vec3f{float((i % hostGridDim+.5f)/hostGridDim),
+                                  float(((i / hostGridDim) % hostGridDim+.5f)/hostGridDim),
+                                  float((i / (hostGridDim*hostGridDim)+.5f)/hostGridDim)};
+      queryPoints[i] = bbox.lower + relQueryPoint * bbox.size();
+    }
+
+    std::vector<float> results(numHostQueries);
+    auto runScalar = [&](bvh3f bvh) {
+      double t0 = getCurrentTime();
+      cuBQL::host::parallel_for(numHostQueries,[&](size_t queryID) {
+        const vec3f queryPoint = queryPoints[queryID];
+        float sqrDist = INFINITY;
+        auto perPrim = [&](uint32_t primID)->float {
+          cuBQL::triangles::Triangle triangle
+            = cuBQL::triangles::getTriangle(indices,vertices,primID);
+          sqrDist = std::min(sqrDist,
+                             cuBQL::triangles::closestPoint(queryPoint,triangle).sqrDistance);
+          return sqrDist;
+        };
+        cuBQL::shrinkingRadiusQuery_forEachPrim(bvh,queryPoint,sqrDist,perPrim);
+        results[queryID] = sqrtf(sqrDist);
+      });
+      return getCurrentTime()-t0;
+    };
+    std::cout << "host-side queries on a " << hostGridDim << "^3 grid (simd width "
+              << (int)cuBQL::simd::width << "):" << std::endl;
+    double scalarTime = runScalar(trianglesBVH);
+    std::cout << " - scalar, default BVH: " << prettyDouble(scalarTime) << "s" << std::endl;
+    double scalarSimdBVHTime = runScalar(simdBVH);
+    std::cout << " - scalar, SIMD-width leaves: " << prettyDouble(scalarSimdBVHTime) << "s"
+              << std::endl;
+
+    std::vector<cuBQL::triangles::FCPResult> simdResults(numHostQueries);
+    t0 = getCurrentTime();
+    cuBQL::triangles::host::fcp(simdResults.data(),queryPoints.data(),numHostQueries,
+                                simdBVH,leafSoA);
+    t1 = getCurrentTime();
+    float maxDiff = 0.f;
+    for (int i=0;i<numHostQueries;i++)
+      maxDiff = std::max(maxDiff,fabsf(sqrtf(simdResults[i].sqrDistance)-results[i]));
+    std::cout << " - SIMD, SIMD-width leaves: " << prettyDouble(t1-t0) << "s (speedup "
+              << (scalarTime/(t1-t0)) << "x), max diff to scalar " << maxDiff << std::endl;
+    cuBQL::free(simdBVH);
+  }
   return 0;
 }
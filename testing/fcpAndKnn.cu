@@ -49,6 +49,11 @@ namespace cuBQL {
       std::string referenceFileName;
 
       bool dumpTestData = false;
+
+      /*! if > 0, also run the approximate (ie, (1+epsilon)) variants
+          of the queries, and report their recall and speedup
+          relative to the exact ones */
+      float epsilon = 0.f;
     };
   
     void usage(const std::string &error = "")
@@ -62,6 +67,7 @@ namespace cuBQL {
       std::cout << "-dg <data_generator_string> (see generator strings)\n";
       std::cout << "-qc <guery_count> (see generator strings)\n";
       std::cout << "-qg <query_generator_string> (see generator strings)\n";
+      std::cout << "-eps <epsilon> : compare (1+eps)-approximate queries against exact ones\n";
       
       exit(error.empty()?0:1);
     }
@@ -149,7 +155,8 @@ namespace cuBQL {
 #endif
                 const vec_t<float,D> *queries,
                 float         maxRadius,
-                int           numQueries
+                int           numQueries,
+                float         epsilon
 #if DO_STATS
                 ,Stats *d_stats
 #endif
@@ -160,13 +167,14 @@ namespace cuBQL {
 
       const vec_t<float,D> query = queries[tid];
       float sqrMaxQueryDist = maxRadius*maxRadius;
-      int res = fcp(bvh,prims,query,
-                    /* fcp kernel expects SQUARE of radius */
-                    sqrMaxQueryDist
+      int res = fcp_approx(bvh,prims,query,
+                           /* fcp kernel expects SQUARE of radius */
+                           sqrMaxQueryDist,
+                           epsilon
 #if DO_STATS
-                    ,d_stats
+                           ,d_stats
 #endif
-                    );
+                           );
       if (res == -1)
         results[tid] = INFINITY;
       else
@@ -186,7 +194,8 @@ namespace cuBQL {
 #endif
                 const vec_t<float,D> *queries,
                 float         maxRadius,
-                int           numQueries
+                int           numQueries,
+                float         epsilon
 #if DO_STATS
                 ,Stats *d_stats
 #endif
@@ -204,17 +213,108 @@ namespace cuBQL {
       KNNResults<K> kNearest;
       kNearest.clear(maxRadius*maxRadius);
       const vec_t<float,D> query = queries[tid];
-      knn(kNearest,bvh,prims,query
-          /* fcp kernel expects SQUARE of radius */
+      knn_approx(kNearest,bvh,prims,query,epsilon
 #if DO_STATS
-          ,d_stats
+                 ,d_stats
 #endif
-          );
+                 );
       results[tid] = sqrtf(kNearest.maxDist2);
     }
   
 
 
+    // ------------------------------------------------------------------
+    /*! launches either the fcp or the knn kernel (depending on
+        testConfig.knn_k), with the given epsilon for approximate
+        queries (0 means exact) */
+    template<int D, typename bvh_t>
+    void launchQueries(const TestConfig &testConfig,
+                       float         epsilon,
+                       float        *results,
+                       bvh_t         bvh,
+#if USE_BOXES
+                       const box_t<float,D>    *prims,
+#else
+                       const vec_t<float,D>    *prims,
+#endif
+                       const vec_t<float,D> *queries,
+                       int           numQueries
+#if DO_STATS
+                       ,Stats *d_stats = 0
+#endif
+                       )
+    {
+      switch(testConfig.knn_k) {
+      case 0:
+        // no knn, just fcp
+        runFCP<<<divRoundUp(numQueries,128),128>>>
+          (results,bvh,prims,queries,
+           testConfig.maxQueryRadius,numQueries,epsilon
+#if DO_STATS
+           ,d_stats
+#endif
+           );
+        break;
+      case 4:
+        runKNN<4><<<divRoundUp(numQueries,128),128>>>
+          (results,bvh,prims,queries,
+           testConfig.maxQueryRadius,numQueries,epsilon
+#if DO_STATS
+           ,d_stats
+#endif
+           );
+        break;
+      case 8:
+        runKNN<8><<<divRoundUp(numQueries,128),128>>>
+          (results,bvh,prims,queries,
+           testConfig.maxQueryRadius,numQueries,epsilon
+#if DO_STATS
+           ,d_stats
+#endif
+           );
+        break;
+      case 16:
+        runKNN<16><<<divRoundUp(numQueries,128),128>>>
+          (results,bvh,prims,queries,
+           testConfig.maxQueryRadius,numQueries,epsilon
+#if DO_STATS
+           ,d_stats
+#endif
+           );
+        break;
+      case 64:
+        runKNN<64><<<divRoundUp(numQueries,128),128>>>
+          (results,bvh,prims,queries,
+           testConfig.maxQueryRadius,numQueries,epsilon
+#if DO_STATS
+           ,d_stats
+#endif
+           );
+        break;
+      case 50:
+        runKNN<50><<<divRoundUp(numQueries,128),128>>>
+          (results,bvh,prims,queries,
+           testConfig.maxQueryRadius,numQueries,epsilon
+#if DO_STATS
+           ,d_stats
+#endif
+           );
+        break;
+      case 20:
+        runKNN<20><<<divRoundUp(numQueries,128),128>>>
+          (results,bvh,prims,queries,
+           testConfig.maxQueryRadius,numQueries,epsilon
+#if DO_STATS
+           ,d_stats
+#endif
+           );
+        break;
+      default:
+        throw std::runtime_error("un-supported k="+std::to_string(testConfig.knn_k)+" for knn queries...");
+      };
+    }
+
+
     // ------------------------------------------------------------------
   
     template<int D, typename bvh_t=cuBQL::BinaryBVH<float,D>>
@@ -290,74 +390,12 @@ namespace cuBQL {
                 << std::endl;
       // ------------------------------------------------------------------
       resetResults<<<divRoundUp(numQueries,128),128>>>(closest.data(),numQueries);
-      switch(testConfig.knn_k) {
-      case 0:
-        // no knn, just fcp
-        runFCP<<<divRoundUp(numQueries,128),128>>>
-          (closest.data(),bvh,data.get(),queryPoints.get(),
-           testConfig.maxQueryRadius,numQueries
-#if DO_STATS
-           ,stats.get()
-#endif
-           );
-        break;
-      case 4:
-        runKNN<4><<<divRoundUp(numQueries,128),128>>>
-          (closest.data(),bvh,data.get(),queryPoints.get(),
-           testConfig.maxQueryRadius,numQueries
-#if DO_STATS
-           ,stats.get()
-#endif
-           );
-        break;
-      case 8:
-        runKNN<8><<<divRoundUp(numQueries,128),128>>>
-          (closest.data(),bvh,data.get(),queryPoints.get(),
-           testConfig.maxQueryRadius,numQueries
-#if DO_STATS
-           ,stats.get()
-#endif
-           );
-        break;
-      case 16:
-        runKNN<16><<<divRoundUp(numQueries,128),128>>>
-          (closest.data(),bvh,data.get(),queryPoints.get(),
-           testConfig.maxQueryRadius,numQueries
-#if DO_STATS
-           ,stats.get()
-#endif
-           );
-        break;
-      case 64:
-        runKNN<64><<<divRoundUp(numQueries,128),128>>>
-          (closest.data(),bvh,data.get(),queryPoints.get(),
-           testConfig.maxQueryRadius,numQueries
-#if DO_STATS
-           ,stats.get()
-#endif
-           );
-        break;
-      case 50:
-        runKNN<50><<<divRoundUp(numQueries,128),128>>>
-          (closest.data(),bvh,data.get(),queryPoints.get(),
-           testConfig.maxQueryRadius,numQueries
-#if DO_STATS
-           ,stats.get()
-#endif
-           );
-        break;
-      case 20:
-        runKNN<20><<<divRoundUp(numQueries,128),128>>>
-          (closest.data(),bvh,data.get(),queryPoints.get(),
-           testConfig.maxQueryRadius,numQueries
+      launchQueries<D>(testConfig,/*epsilon*/0.f,closest.data(),bvh,data.get(),
+                       queryPoints.get(),numQueries
 #if DO_STATS
-           ,stats.get()
+                       ,stats.get()
 #endif
-           );
-        break;
-      default:
-        throw std::runtime_error("un-supported k="+std::to_string(testConfig.knn_k)+" for knn queries...");
-      };
+                       );
       CUBQL_CUDA_SYNC_CHECK();
 #if DO_STATS
       auto results = closest.download();
@@ -400,6 +438,53 @@ namespace cuBQL {
         std::cout << "all good, ours matches reference array ..." << std::endl;
       }
 
+      if (testConfig.epsilon > 0.f) {
+        // ------------------------------------------------------------------
+        // approximate queries: compare against the exact results we
+        // just computed, then time both variants
+        // ------------------------------------------------------------------
+        const float eps = testConfig.epsilon;
+        std::vector<float> exact = closest.download();
+        CUDAArray<float> approx(numQueries);
+        resetResults<<<divRoundUp(numQueries,128),128>>>(approx.data(),numQueries);
+        launchQueries<D>(testConfig,eps,approx.data(),bvh,data.get(),
+                         queryPoints.get(),numQueries);
+        CUBQL_CUDA_SYNC_CHECK();
+        std::vector<float> ours = approx.download();
+        int numExact = 0;
+        float maxRatio = 1.f;
+        for (int i=0;i<numQueries;i++) {
+          if (ours[i] == exact[i]) { numExact++; continue; }
+          if (exact[i] > 0.f && exact[i] != INFINITY)
+            maxRatio = std::max(maxRatio,ours[i]/exact[i]);
+        }
+        std::cout << "approximate (eps=" << eps << ") queries:" << std::endl;
+        std::cout << "  recall (same result as exact) : "
+                  << (100.*numExact/std::max(1,numQueries)) << "%" << std::endl;
+        std::cout << "  max observed distance ratio   : " << maxRatio
+                  << " (bound is " << (1.f+eps) << ")" << std::endl;
+
+        auto timeQueries = [&](float epsilon, int numReps) -> double {
+          CUBQL_CUDA_SYNC_CHECK();
+          double t0 = getCurrentTime();
+          for (int i=0;i<numReps;i++) {
+            resetResults<<<divRoundUp(numQueries,128),128>>>(approx.data(),numQueries);
+            launchQueries<D>(testConfig,epsilon,approx.data(),bvh,data.get(),
+                             queryPoints.get(),numQueries);
+          }
+          CUBQL_CUDA_SYNC_CHECK();
+          return getCurrentTime()-t0;
+        };
+        int numReps = 1;
+        while (timeQueries(0.f,numReps) < 1. && numReps < (1<<20))
+          numReps *= 2;
+        double t_exact  = timeQueries(0.f,numReps)/numReps;
+        double t_approx = timeQueries(eps,numReps)/numReps;
+        std::cout << "  exact  : " << prettyDouble(t_exact) << "s per query batch" << std::endl;
+        std::cout << "  approx : " << prettyDouble(t_approx) << "s per query batch" << std::endl;
+        std::cout << "  speedup: " << (t_exact/t_approx) << "x" << std::endl;
+      }
+
       // ------------------------------------------------------------------
       // actual timing runs
       // ------------------------------------------------------------------
@@ -416,7 +501,8 @@ namespace cuBQL {
              data.get(),
              queryPoints.get(),
              testConfig.maxQueryRadius,
-             numQueries
+             numQueries,
+             /*epsilon*/0.f
 #if DO_STATS
              ,stats.get()
 #endif
@@ -470,6 +556,8 @@ int main(int ac, char **av)
       testConfig.maxQueryRadius = std::stof(av[++i]);
     else if (arg == "-k" || arg == "--knn-k")
       testConfig.knn_k = std::stoi(av[++i]);
+    else if (arg == "-eps" || arg == "--epsilon")
+      testConfig.epsilon = std::stof(av[++i]);
     else if (arg == "--check-reference") {
       testConfig.referenceFileName = av[++i];
       testConfig.make_reference = false;
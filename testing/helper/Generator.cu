@@ -734,8 +734,10 @@ namespace cuBQL {
                                                   int numRequested, int seed)
     {
       std::vector<box3f> boxes;
-      for (auto tri : triangles)
-        boxes.push_back(make_box<float,3>(tri.a).grow(tri.b).grow(tri.c));
+      for (auto idx : indices)
+        boxes.push_back(make_box<float,3>(vertices[idx.x])
+                        .grow(vertices[idx.y])
+                        .grow(vertices[idx.z]));
       d_boxes.upload(boxes);
     }
     
@@ -753,8 +755,8 @@ namespace cuBQL {
 
       std::cout << "going to start reading triangles from '"
                 << fileName << "'" << std::endl;
-      triangles = loadData<Triangle>(fileName);
-      std::cout << "done loading " << prettyNumber(triangles.size())
+      loadTriangles(indices,vertices,format,fileName);
+      std::cout << "done loading " << prettyNumber(indices.size())
                 << " triangles..." << std::endl;
       currentParsePos = next;
     }
@@ -776,17 +778,7 @@ namespace cuBQL {
     TrianglesPointGenerator<float,3>::generate(CUDAArray<vec_t<float,3>> &d_points,
                                                int numRequested, int seed)
     {
-      float sumAreas = 0.f;
-      std::vector<float> areas;
-      std::vector<box3f> boxes;
-      for (auto tri : triangles) {
-        boxes.push_back(make_box<float,3>(tri.a).grow(tri.b).grow(tri.c));
-        float a = area(tri);
-        areas.push_back(a);
-        sumAreas += a;
-      }
-
-      std::vector<vec3f> points = sample(triangles,numRequested,seed);
+      std::vector<vec3f> points = sample(indices,vertices,numRequested,seed);
       assert(points.size() == numRequested);
       
       d_points.upload(points);
@@ -806,8 +798,8 @@ namespace cuBQL {
 
       std::cout << "going to start reading triangles from '"
                 << fileName << "'" << std::endl;
-      triangles = loadData<Triangle>(fileName);
-      std::cout << "done loading " << prettyNumber(triangles.size())
+      loadTriangles(indices,vertices,format,fileName);
+      std::cout << "done loading " << prettyNumber(indices.size())
                 << " triangles..." << std::endl;
       currentParsePos = next;
     }
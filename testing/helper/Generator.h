@@ -181,7 +181,8 @@ namespace cuBQL {
       *must* be created with a a generator string that specifies a
       file (and format) to read those triangles from; this is
       specified through two strings: one for the format ('obj' for
-      .obj files), and a second with a file name. E.g., to read
+      .obj files, 'ply' for .ply files, anything else for a raw
+      dump of triangles), and a second with a file name. E.g., to read
       triangles from bunny.obj, just the generator string "triangles
       obj bunny.obj"
     */
@@ -193,7 +194,8 @@ namespace cuBQL {
     
       void parse(const char *&currentParsePos) override;
     
-      std::vector<test_rig::Triangle> triangles;
+      std::vector<vec3i> indices;
+      std::vector<vec3f> vertices;
     };
 
     // ==================================================================
@@ -203,7 +205,8 @@ namespace cuBQL {
       *must* be created with a a generator string that specifies a
       file (and format) to read those triangles from; this is
       specified through two strings: one for the format ('obj' for
-      .obj files), and a second with a file name. E.g., to read
+      .obj files, 'ply' for .ply files, anything else for a raw
+      dump of triangles), and a second with a file name. E.g., to read
       triangles from bunny.obj, just the generator string "triangles
       obj bunny.obj"
     */
@@ -215,7 +218,8 @@ namespace cuBQL {
     
       void parse(const char *&currentParsePos) override;
     
-      std::vector<test_rig::Triangle> triangles;
+      std::vector<vec3i> indices;
+      std::vector<vec3f> vertices;
     };
 
     // ==================================================================
@@ -16,6 +16,7 @@
 
 #include "cuBQL/math/random.h"
 #include "testing/helper/triangles.h"
+#include "cuBQL/io/meshFile.h"
 
 #define TINYOBJLOADER_IMPLEMENTATION
 #include "tiny_obj_loader.h"
@@ -169,14 +170,43 @@ namespace cuBQL {
       return triangles;
     }
   
-    std::vector<vec3f> sample(const std::vector<Triangle> &triangles,
-                              size_t numSamples,
-                              int seed)
+    void loadTriangles(std::vector<vec3i> &indices,
+                       std::vector<vec3f> &vertices,
+                       const std::string &format,
+                       const std::string &fileName)
+    {
+      if (format == "obj") {
+        host::loadOBJ(indices,vertices,fileName);
+        return;
+      }
+      if (format == "ply") {
+        host::loadPLY(indices,vertices,fileName);
+        return;
+      }
+      std::vector<Triangle> triangles = loadData<Triangle>(fileName);
+      indices.resize(triangles.size());
+      vertices.resize(3*triangles.size());
+      for (int i=0;i<(int)triangles.size();i++) {
+        indices[i] = vec3i(3*i+0,3*i+1,3*i+2);
+        vertices[3*i+0] = triangles[i].a;
+        vertices[3*i+1] = triangles[i].b;
+        vertices[3*i+2] = triangles[i].c;
+      }
+    }
+
+    /*! samples numSamples points on the surface of the given
+        triangles, proportional to their area; getTriangle(i) returns
+        the i'th triangle */
+    template<typename GetTriangle>
+    std::vector<vec3f> sampleTriangles(size_t numTriangles,
+                                       const GetTriangle &getTriangle,
+                                       size_t numSamples,
+                                       int seed)
     {
       std::vector<float> cdf;
       float sum = 0.f;
-      for (auto tri : triangles) {
-        float a = area(tri);
+      for (size_t i=0;i<numTriangles;i++) {
+        float a = area(getTriangle(i));
         sum += a;
         cdf.push_back(sum);
       }
@@ -194,7 +224,7 @@ namespace cuBQL {
           = (int)min(std::lower_bound(cdf.begin(),cdf.end(),rnd(reng)) - cdf.begin(),
                      cdf.size()-1);
         
-        Triangle tri = triangles[idx];
+        Triangle tri = getTriangle(idx);
         float u = rnd(reng);
         float v = rnd(reng);
         if (u+v > 1.f) { u = 1.f-u; v = 1.f-v; };
@@ -203,6 +233,28 @@ namespace cuBQL {
       return points;
     }
   
+    std::vector<vec3f> sample(const std::vector<Triangle> &triangles,
+                              size_t numSamples,
+                              int seed)
+    {
+      return sampleTriangles(triangles.size(),
+                             [&](size_t i) { return triangles[i]; },
+                             numSamples,seed);
+    }
+  
+    std::vector<vec3f> sample(const std::vector<vec3i> &indices,
+                              const std::vector<vec3f> &vertices,
+                              size_t numSamples,
+                              int seed)
+    {
+      return sampleTriangles(indices.size(),
+                             [&](size_t i) {
+                               const vec3i idx = indices[i];
+                               return Triangle{ vertices[idx.x],vertices[idx.y],vertices[idx.z] };
+                             },
+                             numSamples,seed);
+    }
+  
   } // ::cuBQL::test_rig
 } // ::cuBQL
 
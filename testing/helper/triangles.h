@@ -35,9 +35,22 @@ namespace cuBQL {
                  const std::string &fileName);
     std::vector<Triangle> triangulate(const std::vector<box3f> &boxes);
 
+    /*! loads the given file as indexed triangles: 'obj' and 'ply'
+        files go through the (parallel) loaders in cuBQL/io/meshFile.h,
+        anything else is read as a dump of Triangles (see
+        loadData()) */
+    void loadTriangles(std::vector<vec3i> &indices,
+                       std::vector<vec3f> &vertices,
+                       const std::string &format,
+                       const std::string &fileName);
+
     std::vector<vec3f> sample(const std::vector<Triangle> &triangles,
                               size_t numSamples,
                               int seed=0x34234987);
+    std::vector<vec3f> sample(const std::vector<vec3i> &indices,
+                              const std::vector<vec3f> &vertices,
+                              size_t numSamples,
+                              int seed=0x34234987);
     void saveOBJ(const std::vector<Triangle> &triangles, const std::string &fileName);
 
   } // ::cuBQL::test_rig
@@ -24,6 +24,7 @@ void foo()
   using bvh_t = cuBQL::bvh_t<T,UNIT_TEST_N_FROM_CMAKE>;
   using bvh4_t = cuBQL::WideBVH<T,UNIT_TEST_N_FROM_CMAKE,4>;
   using bvh8_t = cuBQL::WideBVH<T,UNIT_TEST_N_FROM_CMAKE,8>;
+  using bvh64_t = cuBQL::BinaryBVH64<T,UNIT_TEST_N_FROM_CMAKE>;
 
   /* this obviously will not RUN, but it should at least trigger the
      template instantiation */
@@ -40,6 +41,10 @@ void foo()
   
   bvh8_t bvh8;
   gpuBuilder(bvh8,d_boxes,numBoxes,buildConfig);
+
+  bvh64_t bvh64;
+  gpuBuilder(bvh64,d_boxes,numBoxes,buildConfig);
+  refit(bvh64,d_boxes);
 }
 
 int main(int, char **)
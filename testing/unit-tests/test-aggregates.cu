@@ -0,0 +1,194 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+/*! checks the per-node aggregates in queries/aggregates.h - and the
+    shared bottom-up pass they and refit() are built on - against a
+    brute-force fold over each subtree, and aggregateQuery() against
+    a per-prim fold over all prims in range */
+
+#include "testRig.h"
+#include "cuBQL/queries/aggregates.h"
+
+using namespace cuBQL;
+using namespace cuBQL::test_rig;
+
+/*! all prims in the given node's subtree */
+void collectPrims(std::vector<uint32_t> &prims, const bvh3f &bvh, uint32_t nodeID)
+{
+  const bvh3f::Node::Admin admin = bvh.nodes[nodeID].admin;
+  if (admin.count != 0) {
+    for (int i=0;i<(int)admin.count;i++)
+      prims.push_back(bvh.primIDs[admin.offset+i]);
+    return;
+  }
+  collectPrims(prims,bvh,admin.offset+0);
+  collectPrims(prims,bvh,admin.offset+1);
+}
+
+/*! checks, for every node, the aggregates (and, if boxes is
+    non-null, the bounds) against a brute-force fold over all prims
+    in its subtree */
+void checkNodes(const bvh3f        &bvh,
+                const CountAndSum  *sums,
+                const MinMax       *minMaxes,
+                const CountAndSum  *primSums,
+                const MinMax       *primMinMaxes,
+                const box3f        *boxes)
+{
+  for (uint32_t nodeID=0;nodeID<bvh.numNodes;nodeID++) {
+    if (nodeID == 1) continue;
+    std::vector<uint32_t> prims;
+    collectPrims(prims,bvh,nodeID);
+    uint32_t count = 0;
+    double   sum   = 0.;
+    MinMax   minMax = MinMax::empty();
+    box3f    bounds;
+    for (auto primID : prims) {
+      count  += primSums[primID].count;
+      sum    += primSums[primID].sum;
+      minMax  = MinMax::combine(minMax,primMinMaxes[primID]);
+      if (boxes) bounds.grow(boxes[primID]);
+    }
+    CUBQL_TEST_CHECK(sums[nodeID].count == count);
+    CUBQL_TEST_CHECK(fabs(sums[nodeID].sum-sum) <= 1e-4*count);
+    CUBQL_TEST_CHECK(minMaxes[nodeID].lower == minMax.lower);
+    CUBQL_TEST_CHECK(minMaxes[nodeID].upper == minMax.upper);
+    if (boxes) {
+      CUBQL_TEST_CHECK(bvh.nodes[nodeID].bounds.lower == bounds.lower);
+      CUBQL_TEST_CHECK(bvh.nodes[nodeID].bounds.upper == bounds.upper);
+    }
+  }
+}
+
+/*! checks aggregateQuery() results against a fold over all prims in
+    range */
+template<typename query_t>
+void checkQueries(const CountAndSum          *results,
+                  const std::vector<query_t> &queries,
+                  const box3f                *boxes,
+                  const CountAndSum          *primSums,
+                  int                         numPrims)
+{
+  for (int i=0;i<(int)queries.size();i++) {
+    uint32_t count = 0;
+    double   sum   = 0.;
+    for (int j=0;j<numPrims;j++)
+      if (rangeQuery_impl::inRange(queries[i],boxes[j])) {
+        count += primSums[j].count;
+        sum   += primSums[j].sum;
+      }
+    CUBQL_TEST_CHECK(results[i].count == count);
+    CUBQL_TEST_CHECK(fabs(results[i].sum-sum) <= 1e-4*(count+1));
+  }
+}
+
+template<typename query_t>
+void testQueries(const std::vector<query_t> &h_queries,
+                 const bvh3f                &bvh,
+                 const CountAndSum          *nodeSums,
+                 const CountAndSum          *primSums,
+                 const box3f                *boxes,
+                 int                         numPrims)
+{
+  const int numQueries = (int)h_queries.size();
+  const query_t *queries = managedCopy(h_queries);
+  CountAndSum *results = managedAlloc<CountAndSum>(numQueries);
+
+  aggregateQuery(results,queries,numQueries,bvh,nodeSums,primSums,boxes);
+  CUBQL_CUDA_SYNC_CHECK();
+  checkQueries(results,h_queries,boxes,primSums,numPrims);
+
+  host::aggregateQuery(results,queries,numQueries,bvh,nodeSums,primSums,boxes);
+  checkQueries(results,h_queries,boxes,primSums,numPrims);
+
+  managedFree(results);
+  managedFree(queries);
+}
+
+int main(int, char **)
+{
+  const int numPrims = 20000;
+  std::vector<box3f> h_boxes = randomBoxes<float,3>(numPrims,0x1234,.02f);
+  std::mt19937 rng(0x4321);
+  std::uniform_real_distribution<float> uniform(0.f,1.f);
+  std::vector<CountAndSum> h_primSums(numPrims);
+  std::vector<MinMax>      h_primMinMaxes(numPrims);
+  for (int i=0;i<numPrims;i++) {
+    const float value = uniform(rng);
+    h_primSums[i]     = { 1u, value };
+    h_primMinMaxes[i] = { value, value };
+  }
+  box3f       *boxes        = managedCopy(h_boxes);
+  CountAndSum *primSums     = managedCopy(h_primSums);
+  MinMax      *primMinMaxes = managedCopy(h_primMinMaxes);
+
+  for (int leafThreshold : { 1, 8 }) {
+    BuildConfig buildConfig;
+    buildConfig.makeLeafThreshold = leafThreshold;
+    bvh3f bvh = buildBVH(h_boxes,buildConfig);
+    CountAndSum *nodeSums     = managedAlloc<CountAndSum>(bvh.numNodes);
+    MinMax      *nodeMinMaxes = managedAlloc<MinMax>(bvh.numNodes);
+
+    // device and host computation of the aggregates
+    computeAggregates(nodeSums,bvh,primSums,0,managedMem());
+    computeAggregates(nodeMinMaxes,bvh,primMinMaxes,0,managedMem());
+    CUBQL_CUDA_SYNC_CHECK();
+    checkNodes(bvh,nodeSums,nodeMinMaxes,h_primSums.data(),h_primMinMaxes.data(),0);
+    std::fill(nodeSums,nodeSums+bvh.numNodes,CountAndSum{ 12345u, -1.f });
+    host::computeAggregates(nodeSums,bvh,primSums);
+    host::computeAggregates(nodeMinMaxes,bvh,primMinMaxes);
+    checkNodes(bvh,nodeSums,nodeMinMaxes,h_primSums.data(),h_primMinMaxes.data(),0);
+
+    // aggregate queries vs per-prim folds
+    std::vector<vec3f> centers = randomPoints<float,3>(500,0x2345);
+    std::vector<box3f> queryBoxes;
+    std::vector<ball3f> queryBalls;
+    for (auto center : centers) {
+      queryBoxes.push_back(box3f(center-vec3f(.1f),center+vec3f(.1f)));
+      queryBalls.push_back({ center, .15f });
+    }
+    testQueries(queryBoxes,bvh,nodeSums,primSums,boxes,numPrims);
+    testQueries(queryBalls,bvh,nodeSums,primSums,boxes,numPrims);
+
+    // move the prims, then refit - both plain, and with aggregates
+    for (int i=0;i<numPrims;i++) {
+      const vec3f delta = .05f*vec3f(uniform(rng),uniform(rng),uniform(rng));
+      h_boxes[i] = box3f(h_boxes[i].lower+delta,h_boxes[i].upper+delta);
+      boxes[i]   = h_boxes[i];
+      h_primSums[i].sum = primSums[i].sum = uniform(rng);
+    }
+    refit(bvh,boxes,0,managedMem());
+    CUBQL_CUDA_SYNC_CHECK();
+    host::computeAggregates(nodeSums,bvh,primSums);
+    checkNodes(bvh,nodeSums,nodeMinMaxes,h_primSums.data(),h_primMinMaxes.data(),boxes);
+    for (int i=0;i<numPrims;i++) {
+      boxes[i].lower = boxes[i].lower-vec3f(.01f);
+      h_boxes[i] = boxes[i];
+    }
+    refit(bvh,boxes,nodeSums,primSums,0,managedMem());
+    CUBQL_CUDA_SYNC_CHECK();
+    checkNodes(bvh,nodeSums,nodeMinMaxes,h_primSums.data(),h_primMinMaxes.data(),boxes);
+
+    managedFree(nodeMinMaxes);
+    managedFree(nodeSums);
+    freeBVH(bvh);
+  }
+  managedFree(primMinMaxes);
+  managedFree(primSums);
+  managedFree(boxes);
+  printf("test-aggregates: all tests passed\n");
+  return 0;
+}
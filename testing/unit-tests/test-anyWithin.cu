@@ -0,0 +1,81 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+/*! checks the anyWithin() predicate queries against brute force,
+    in particular for prims that are exactly at the given (square)
+    query distance */
+
+#include "testRig.h"
+#include "cuBQL/queries/anyWithin.h"
+
+using namespace cuBQL;
+using namespace cuBQL::test_rig;
+
+template<typename prim_t>
+void testAnyWithin(const std::vector<prim_t> &h_prims,
+                   const std::vector<box3f>  &boxes)
+{
+  const int numQueries = 1000;
+  const prim_t *prims = managedCopy(h_prims);
+  bvh3f bvh = buildBVH(boxes);
+  std::vector<vec3f> queries = randomPoints<float,3>(numQueries,0x4321);
+  std::vector<float> sqrMaxDists(numQueries);
+
+  for (int i=0;i<numQueries;i++) {
+    // the closest prim, and the closest one with an odd ID
+    float closest = INFINITY, closestOdd = INFINITY;
+    for (int j=0;j<(int)h_prims.size();j++) {
+      const float dist = fSqrDistance(h_prims[j],queries[i]);
+      closest = std::min(closest,dist);
+      if (j & 1) closestOdd = std::min(closestOdd,dist);
+    }
+    // exactly at the closest distance is in range, anything less is
+    // not. For boxes the query point may be inside the closest box,
+    // at distance 0
+    CUBQL_TEST_CHECK(anyWithin(bvh,prims,queries[i],closest));
+    if (closest > 0.f)
+      CUBQL_TEST_CHECK(!anyWithin(bvh,prims,queries[i],nextafterf(closest,0.f)));
+
+    auto isOdd = [](uint32_t primID)->bool { return (primID & 1) != 0; };
+    CUBQL_TEST_CHECK(anyWithin(bvh,prims,queries[i],closestOdd,isOdd));
+    if (closestOdd > closest)
+      CUBQL_TEST_CHECK(!anyWithin(bvh,prims,queries[i],
+                                  nextafterf(closestOdd,0.f),isOdd));
+    sqrMaxDists[i] = closest;
+  }
+
+  // host-side batch, with one of the per-query distances as a shared
+  // radius
+  const float sqrMaxDist = sqrMaxDists[numQueries/2];
+  bool *results = new bool[numQueries];
+  host::anyWithin(results,queries.data(),numQueries,sqrMaxDist,bvh,prims);
+  for (int i=0;i<numQueries;i++)
+    CUBQL_TEST_CHECK(results[i] == (sqrMaxDists[i] <= sqrMaxDist));
+  delete[] results;
+
+  freeBVH(bvh);
+  managedFree(prims);
+}
+
+int main(int, char **)
+{
+  std::vector<vec3f> points = randomPoints<float,3>(10000,0x1234);
+  testAnyWithin(points,pointBoxes(points));
+  std::vector<box3f> boxes = randomBoxes<float,3>(5000,0x2345,.01f);
+  testAnyWithin(boxes,boxes);
+  printf("test-anyWithin: all tests passed\n");
+  return 0;
+}
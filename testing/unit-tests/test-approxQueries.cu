@@ -0,0 +1,145 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+
+/*! checks the approximate queries fcp_approx() and knn_approx()
+    (queries/fcp.h and queries/knn.h) against brute force: every
+    (square) distance they return has to be within a factor of
+    (1+eps)^2 of the exact one, and eps=0 has to give exactly the
+    results of the exact queries */
+
+#include "testRig.h"
+#include "cuBQL/queries/knn.h"
+#include <algorithm>
+
+using namespace cuBQL;
+using namespace cuBQL::test_rig;
+
+enum { K = 8 };
+
+__global__
+void approxQueries(int           *fcpResults,
+                   float         *fcpDists,
+                   int           *exactFcpResults,
+                   KNNResults<K> *knnResults,
+                   KNNResults<K> *exactKnnResults,
+                   const vec3f   *queries,
+                   int            numQueries,
+                   bvh3f          bvh,
+                   const vec3f   *points,
+                   float          eps)
+{
+  int tid = threadIdx.x+blockIdx.x*blockDim.x;
+  if (tid >= numQueries) return;
+  float sqrMaxDist = INFINITY;
+  fcpResults[tid] = fcp_approx(bvh,points,queries[tid],sqrMaxDist,eps);
+  fcpDists[tid] = sqrMaxDist;
+  sqrMaxDist = INFINITY;
+  exactFcpResults[tid] = fcp(bvh,points,queries[tid],sqrMaxDist);
+  knnResults[tid].clear(INFINITY);
+  knn_approx(knnResults[tid],bvh,points,queries[tid],eps);
+  exactKnnResults[tid].clear(INFINITY);
+  knn(exactKnnResults[tid],bvh,points,queries[tid]);
+}
+
+/*! the (square) distances of the K results, sorted */
+std::vector<float> sortedDists(const KNNResults<K> &results,
+                               const std::vector<vec3f> &points,
+                               vec3f query)
+{
+  std::vector<float> dists;
+  std::vector<uint32_t> items;
+  for (int k=0;k<K;k++) {
+    const uint32_t item = results.getItem(k);
+    CUBQL_TEST_CHECK(item < points.size());
+    CUBQL_TEST_CHECK(fSqrDistance(points[item],query) == results.getDist(k));
+    items.push_back(item);
+    dists.push_back(results.getDist(k));
+  }
+  std::sort(items.begin(),items.end());
+  CUBQL_TEST_CHECK(std::unique(items.begin(),items.end()) == items.end());
+  std::sort(dists.begin(),dists.end());
+  return dists;
+}
+
+int main(int, char **)
+{
+  // half of the points uniform, the other half in small clusters, so
+  // that the approximate queries actually have something to skip
+  const int numPoints = 20000;
+  const int numQueries = 1000;
+  std::vector<vec3f> h_points = randomPoints<float,3>(numPoints,0x1234);
+  std::vector<vec3f> centers = randomPoints<float,3>(20,0x2345);
+  for (int i=0;i<numPoints;i+=2)
+    h_points[i] = centers[i%20] + .02f*(h_points[i]-vec3f(.5f));
+  std::vector<vec3f> h_queries = randomPoints<float,3>(numQueries,0x4321);
+  vec3f *points  = managedCopy(h_points);
+  vec3f *queries = managedCopy(h_queries);
+  bvh3f bvh = buildBVH(pointBoxes(h_points));
+
+  int           *fcpResults      = managedAlloc<int>(numQueries);
+  float         *fcpDists        = managedAlloc<float>(numQueries);
+  int           *exactFcpResults = managedAlloc<int>(numQueries);
+  KNNResults<K> *knnResults      = managedAlloc<KNNResults<K>>(numQueries);
+  KNNResults<K> *exactKnnResults = managedAlloc<KNNResults<K>>(numQueries);
+  for (float eps : { 0.f, .1f, .5f, 2.f }) {
+    approxQueries<<<divRoundUp(numQueries,128),128>>>
+      (fcpResults,fcpDists,exactFcpResults,knnResults,exactKnnResults,
+       queries,numQueries,bvh,points,eps);
+    CUBQL_CUDA_SYNC_CHECK();
+    // allow for the rounding in (1+eps)^2 itself
+    const double bound = (1.+eps)*(1.+eps)*(1.+1e-6);
+    for (int i=0;i<numQueries;i++) {
+      const vec3f query = h_queries[i];
+      std::vector<float> dists;
+      for (auto point : h_points)
+        dists.push_back(fSqrDistance(point,query));
+      std::partial_sort(dists.begin(),dists.begin()+K,dists.end());
+
+      // fcp
+      CUBQL_TEST_CHECK(fcpResults[i] >= 0 && fcpResults[i] < numPoints);
+      CUBQL_TEST_CHECK(fSqrDistance(h_points[fcpResults[i]],query) == fcpDists[i]);
+      CUBQL_TEST_CHECK(double(fcpDists[i]) <= bound*double(dists[0]));
+      if (eps == 0.f) {
+        CUBQL_TEST_CHECK(fcpDists[i] == dists[0]);
+        CUBQL_TEST_CHECK(fcpResults[i] == exactFcpResults[i]);
+      }
+
+      // knn
+      const std::vector<float> found = sortedDists(knnResults[i],h_points,query);
+      for (int k=0;k<K;k++)
+        CUBQL_TEST_CHECK(double(found[k]) <= bound*double(dists[k]));
+      if (eps == 0.f) {
+        const std::vector<float> exact = sortedDists(exactKnnResults[i],h_points,query);
+        for (int k=0;k<K;k++) {
+          CUBQL_TEST_CHECK(found[k] == dists[k]);
+          CUBQL_TEST_CHECK(exact[k] == dists[k]);
+          CUBQL_TEST_CHECK(knnResults[i].getItem(k) == exactKnnResults[i].getItem(k));
+        }
+      }
+    }
+  }
+  managedFree(exactKnnResults);
+  managedFree(knnResults);
+  managedFree(exactFcpResults);
+  managedFree(fcpDists);
+  managedFree(fcpResults);
+  managedFree(queries);
+  managedFree(points);
+  freeBVH(bvh);
+  printf("test-approxQueries: all tests passed\n");
+  return 0;
+}
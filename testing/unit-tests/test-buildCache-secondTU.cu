@@ -0,0 +1,38 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+
+/*! a second translation unit of test-buildCache, to make sure that
+    io/buildCache.h (including its kernels) can be included - and
+    used - by more than one file of the same program. Unlike
+    test-buildCache.cu this does not include testRig.h, which pulls
+    in the builder implementation. */
+
+#include "cuBQL/io/buildCache.h"
+
+namespace cuBQL {
+  namespace test_rig {
+
+    /*! computeBuildCacheKey(), as instantiated in this file */
+    BuildCacheKey computeBuildCacheKey_secondTU(const box3f *boxes,
+                                                uint32_t     numBoxes,
+                                                BuildConfig  buildConfig)
+    {
+      return computeBuildCacheKey(boxes,numBoxes,buildConfig);
+    }
+    
+  }
+}
@@ -0,0 +1,115 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+
+/*! checks the build cache in io/buildCache.h: that device- and
+    host-side keys agree, that keys change with the input boxes and
+    with the build config, and that a second build over the same
+    input is served from the cache with the same BVH */
+
+#include "testRig.h"
+#include "cuBQL/io/buildCache.h"
+#include "cuBQL/queries/shrinkingRadiusQuery.h"
+
+using namespace cuBQL;
+using namespace cuBQL::test_rig;
+
+namespace cuBQL {
+  namespace test_rig {
+    /*! in test-buildCache-secondTU.cu */
+    BuildCacheKey computeBuildCacheKey_secondTU(const box3f *boxes,
+                                                uint32_t     numBoxes,
+                                                BuildConfig  buildConfig);
+  }
+}
+
+/*! checks that the BVH finds the closest of the given points */
+void checkQueries(const bvh3f &bvh, const std::vector<vec3f> &points)
+{
+  std::vector<vec3f> queries = randomPoints<float,3>(200,0x4321);
+  for (auto query : queries) {
+    float closest = INFINITY;
+    for (auto point : points)
+      closest = std::min(closest,fSqrDistance(point,query));
+    float found = INFINITY;
+    shrinkingRadiusQuery_forEachPrim(bvh,query,INFINITY,[&](uint32_t primID)->float {
+      found = std::min(found,fSqrDistance(points[primID],query));
+      return found;
+    });
+    CUBQL_TEST_CHECK(found == closest);
+  }
+}
+
+int main(int, char **)
+{
+  const int numPoints = 10000;
+  std::vector<vec3f> points = randomPoints<float,3>(numPoints,0x1234);
+  std::vector<box3f> h_boxes = pointBoxes(points);
+  box3f *boxes = managedCopy(h_boxes);
+  BuildConfig buildConfig;
+  buildConfig.makeLeafThreshold = 4;
+
+  const BuildCacheKey key = computeBuildCacheKey(boxes,numPoints,buildConfig);
+  CUBQL_TEST_CHECK(key == host::computeBuildCacheKey(boxes,numPoints,buildConfig));
+  CUBQL_TEST_CHECK(key == computeBuildCacheKey_secondTU(boxes,numPoints,buildConfig));
+
+  // anything that changes the BVH changes the key
+  BuildConfig otherConfig = buildConfig;
+  otherConfig.makeLeafThreshold = 8;
+  CUBQL_TEST_CHECK(key != host::computeBuildCacheKey(boxes,numPoints,otherConfig));
+  otherConfig = buildConfig;
+  otherConfig.enableSAH();
+  CUBQL_TEST_CHECK(key != host::computeBuildCacheKey(boxes,numPoints,otherConfig));
+  CUBQL_TEST_CHECK(key != host::computeBuildCacheKey(boxes,numPoints-1,buildConfig));
+  std::vector<box3f> changed = h_boxes;
+  changed[numPoints/2].upper.y = std::nextafter(changed[numPoints/2].upper.y,2.f);
+  CUBQL_TEST_CHECK(key != host::computeBuildCacheKey(changed.data(),numPoints,buildConfig));
+  std::swap(changed[0],changed[1]);
+  CUBQL_TEST_CHECK(key != host::computeBuildCacheKey(changed.data(),numPoints,buildConfig));
+
+  BuildCache cache("test-buildCache.dir");
+  const std::string fileName = cache.fileNameFor(key);
+  // from an earlier run, maybe
+  std::remove(fileName.c_str());
+  {
+    MappedBVH<bvh3f> built = cache.build(boxes,numPoints,buildConfig,0,managedMem());
+    CUBQL_TEST_CHECK(cache.numMisses == 1 && cache.numHits == 0);
+    checkQueries(built.bvh,points);
+    MappedBVH<bvh3f> cached = cache.build(boxes,numPoints,buildConfig,0,managedMem());
+    CUBQL_TEST_CHECK(cache.numMisses == 1 && cache.numHits == 1);
+    CUBQL_TEST_CHECK(cached.bvh.numNodes == built.bvh.numNodes);
+    CUBQL_TEST_CHECK(memcmp(cached.bvh.nodes,built.bvh.nodes,
+                            built.bvh.numNodes*sizeof(bvh3f::Node)) == 0);
+    CUBQL_TEST_CHECK(memcmp(cached.bvh.primIDs,built.bvh.primIDs,
+                            built.bvh.numPrims*sizeof(uint32_t)) == 0);
+    CUBQL_TEST_CHECK(cached.buildConfig.makeLeafThreshold == 4);
+  }
+
+  // a corrupt cache entry gets re-built
+  {
+    std::ofstream out(fileName,std::ios::binary);
+    out << "not a bvh";
+  }
+  {
+    MappedBVH<bvh3f> rebuilt = cache.build(boxes,numPoints,buildConfig,0,managedMem());
+    CUBQL_TEST_CHECK(cache.numMisses == 2 && cache.numHits == 1);
+    checkQueries(rebuilt.bvh,points);
+  }
+  std::remove(fileName.c_str());
+  managedFree(boxes);
+  printf("test-buildCache: all tests passed\n");
+  return 0;
+}
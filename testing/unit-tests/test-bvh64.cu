@@ -0,0 +1,287 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+
+/*! checks BinaryBVH64 end to end: the chunked gpuBuilder(), refit(),
+    fcp(), knn() (with KNNResults64), the fixed-box and
+    shrinking-radius queries, saving and loading, and
+    buildOutOfCore() with 64-bit primIDs - all against brute force,
+    and with chunks much smaller than the input so the top-level tree
+    over the chunks actually gets exercised */
+
+#include "testRig.h"
+#include "cuBQL/io/outOfCore.h"
+#include "cuBQL/queries/knn.h"
+#include "cuBQL/queries/fixedBoxQuery.h"
+#include "cuBQL/queries/shrinkingRadiusQuery.h"
+#include <fstream>
+#include <algorithm>
+
+using namespace cuBQL;
+using namespace cuBQL::test_rig;
+
+using bvh64_3f = BinaryBVH64<float,3>;
+
+enum { K = 8 };
+
+__global__
+void fcpQueries(int64_t     *results,
+                const vec3f *queries,
+                int          numQueries,
+                bvh64_3f     bvh,
+                const vec3f *points)
+{
+  int tid = threadIdx.x+blockIdx.x*blockDim.x;
+  if (tid >= numQueries) return;
+  float sqrMaxDist = INFINITY;
+  results[tid] = fcp(bvh,points,queries[tid],sqrMaxDist);
+}
+
+__global__
+void knnQueries(KNNResults64<K> *results,
+                const vec3f     *queries,
+                int              numQueries,
+                bvh64_3f         bvh,
+                const vec3f     *points)
+{
+  int tid = threadIdx.x+blockIdx.x*blockDim.x;
+  if (tid >= numQueries) return;
+  results[tid].clear(INFINITY);
+  knn(results[tid],bvh,points,queries[tid]);
+}
+
+__global__
+void boxQueries(int         *results,
+                const vec3f *queries,
+                int          numQueries,
+                bvh64_3f     bvh,
+                const vec3f *points)
+{
+  int tid = threadIdx.x+blockIdx.x*blockDim.x;
+  if (tid >= numQueries) return;
+  const box3f queryBox(queries[tid]-vec3f(.05f),queries[tid]+vec3f(.05f));
+  int count = 0;
+  fixedBoxQuery_forEachPrim(bvh,queryBox,[&](uint64_t primID)->int {
+    count += queryBox.overlaps(box3f().including(points[primID]));
+    return CUBQL_CONTINUE_TRAVERSAL;
+  });
+  results[tid] = count;
+}
+
+bool contains(const box3f &outer, const box3f &inner)
+{
+  for (int d=0;d<3;d++)
+    if (inner.lower[d] < outer.lower[d] || inner.upper[d] > outer.upper[d])
+      return false;
+  return true;
+}
+
+/*! checks the BVH's structure, and that it references exactly the
+    valid boxes, once each */
+void checkStructure(const bvh64_3f &bvh, const std::vector<box3f> &boxes)
+{
+  std::vector<int> numRefs(boxes.size(),0);
+  uint64_t numVisited = 0;
+  std::vector<uint64_t> stack = { 0 };
+  while (!stack.empty()) {
+    const bvh64_3f::Node node = bvh.nodes[stack.back()];
+    stack.pop_back();
+    numVisited++;
+    if (node.admin.count == 0) {
+      CUBQL_TEST_CHECK(node.admin.offset % 2 == 0);
+      CUBQL_TEST_CHECK(node.admin.offset+1 < bvh.numNodes);
+      for (int i=0;i<2;i++) {
+        CUBQL_TEST_CHECK(contains(node.bounds,bvh.nodes[node.admin.offset+i].bounds));
+        stack.push_back(node.admin.offset+i);
+      }
+      continue;
+    }
+    CUBQL_TEST_CHECK(node.admin.offset+node.admin.count <= bvh.numPrims);
+    for (int i=0;i<(int)node.admin.count;i++) {
+      const uint64_t primID = bvh.primIDs[node.admin.offset+i];
+      CUBQL_TEST_CHECK(primID < boxes.size());
+      numRefs[primID]++;
+      CUBQL_TEST_CHECK(contains(node.bounds,boxes[primID]));
+    }
+  }
+  // every node but the unused node 1
+  CUBQL_TEST_CHECK(numVisited == bvh.numNodes-1);
+  for (size_t i=0;i<boxes.size();i++)
+    CUBQL_TEST_CHECK(numRefs[i] == (boxes[i].empty() ? 0 : 1));
+}
+
+/*! runs all queries on the given BVH, and compares to brute force */
+void checkQueries(const bvh64_3f &bvh, const std::vector<vec3f> &h_points,
+                  const std::vector<box3f> &boxes)
+{
+  const int numQueries = 500;
+  std::vector<vec3f> h_queries = randomPoints<float,3>(numQueries,0x4321);
+  vec3f *queries = managedCopy(h_queries);
+  vec3f *points  = managedCopy(h_points);
+  int64_t         *fcpResults = managedAlloc<int64_t>(numQueries);
+  KNNResults64<K> *knnResults = managedAlloc<KNNResults64<K>>(numQueries);
+  int             *boxResults = managedAlloc<int>(numQueries);
+  fcpQueries<<<divRoundUp(numQueries,128),128>>>(fcpResults,queries,numQueries,bvh,points);
+  knnQueries<<<divRoundUp(numQueries,128),128>>>(knnResults,queries,numQueries,bvh,points);
+  boxQueries<<<divRoundUp(numQueries,128),128>>>(boxResults,queries,numQueries,bvh,points);
+  CUBQL_CUDA_SYNC_CHECK();
+
+  for (int i=0;i<numQueries;i++) {
+    const vec3f query = h_queries[i];
+    std::vector<float> dists;
+    int inBox = 0;
+    const box3f queryBox(query-vec3f(.05f),query+vec3f(.05f));
+    for (size_t j=0;j<boxes.size();j++) {
+      if (boxes[j].empty()) continue;
+      dists.push_back(fSqrDistance(h_points[j],query));
+      inBox += queryBox.overlaps(boxes[j]);
+    }
+    std::sort(dists.begin(),dists.end());
+
+    CUBQL_TEST_CHECK(fcpResults[i] >= 0 && fcpResults[i] < (int64_t)boxes.size());
+    CUBQL_TEST_CHECK(fSqrDistance(h_points[fcpResults[i]],query) == dists[0]);
+
+    std::vector<float> found;
+    for (int k=0;k<K;k++) {
+      CUBQL_TEST_CHECK(knnResults[i].getItem(k) < boxes.size());
+      CUBQL_TEST_CHECK(!boxes[knnResults[i].getItem(k)].empty());
+      CUBQL_TEST_CHECK(fSqrDistance(h_points[knnResults[i].getItem(k)],query)
+                       == knnResults[i].getDist(k));
+      found.push_back(knnResults[i].getDist(k));
+    }
+    std::sort(found.begin(),found.end());
+    for (int k=0;k<K;k++)
+      CUBQL_TEST_CHECK(found[k] == dists[k]);
+    
+    CUBQL_TEST_CHECK(boxResults[i] == inBox);
+
+    float closest = INFINITY;
+    shrinkingRadiusQuery_forEachPrim(bvh,query,INFINITY,[&](uint64_t primID)->float {
+      closest = std::min(closest,fSqrDistance(h_points[primID],query));
+      return closest;
+    });
+    CUBQL_TEST_CHECK(closest == dists[0]);
+  }
+  managedFree(boxResults);
+  managedFree(knnResults);
+  managedFree(fcpResults);
+  managedFree(points);
+  managedFree(queries);
+}
+
+/*! whether constructing a MappedBVH<bvh_t> from the given file throws */
+template<typename bvh_t>
+bool failsToLoad(const std::string &fileName)
+{
+  try {
+    MappedBVH<bvh_t> loaded(fileName);
+  } catch (const std::runtime_error &) {
+    return true;
+  }
+  return false;
+}
+
+void testFiles(const bvh64_3f &bvh, const std::vector<box3f> &boxes)
+{
+  const std::string fileName = "test-bvh64.bvh";
+  saveBVH(fileName,bvh);
+  {
+    MappedBVH<bvh64_3f> loaded(fileName);
+    CUBQL_TEST_CHECK(loaded.header.primIDSize == sizeof(uint64_t));
+    CUBQL_TEST_CHECK(loaded.bvh.numNodes == bvh.numNodes);
+    CUBQL_TEST_CHECK(loaded.bvh.numPrims == bvh.numPrims);
+    CUBQL_TEST_CHECK(memcmp(loaded.bvh.nodes,bvh.nodes,
+                            bvh.numNodes*sizeof(bvh64_3f::Node)) == 0);
+    CUBQL_TEST_CHECK(memcmp(loaded.bvh.primIDs,bvh.primIDs,
+                            bvh.numPrims*sizeof(uint64_t)) == 0);
+  }
+  CUBQL_TEST_CHECK(failsToLoad<bvh3f>(fileName));
+
+  // files written before primIDSize existed have 32-bit primIDs
+  bvh3f bvh32 = buildBVH(boxes);
+  saveBVH(fileName,bvh32);
+  {
+    std::fstream file(fileName,std::ios::in|std::ios::out|std::ios::binary);
+    BVHFileHeader header;
+    file.read((char *)&header,sizeof(header));
+    header.version    = 1;
+    header.primIDSize = 0;
+    file.seekp(0);
+    file.write((const char *)&header,sizeof(header));
+  }
+  CUBQL_TEST_CHECK(MappedBVH<bvh3f>(fileName).bvh.numPrims == bvh32.numPrims);
+  CUBQL_TEST_CHECK(failsToLoad<bvh64_3f>(fileName));
+  freeBVH(bvh32);
+  std::remove(fileName.c_str());
+
+  // out-of-core builds with 64-bit primIDs
+  const std::string boxesFileName = "test-bvh64.boxes";
+  {
+    std::ofstream out(boxesFileName,std::ios::binary);
+    out.write((const char *)boxes.data(),boxes.size()*sizeof(box3f));
+  }
+  buildOutOfCore<float,3,uint64_t>(fileName,boxesFileName,BuildConfig(),1000,0,managedMem());
+  {
+    MappedBVH<bvh64_3f> loaded(fileName);
+    CUBQL_TEST_CHECK(loaded.bvh.numPrims == bvh.numPrims);
+    checkStructure(loaded.bvh,boxes);
+  }
+  CUBQL_TEST_CHECK(failsToLoad<bvh3f>(fileName));
+  std::remove(boxesFileName.c_str());
+  std::remove(fileName.c_str());
+}
+
+int main(int, char **)
+{
+  const int numPoints = 20000;
+  std::vector<vec3f> points = randomPoints<float,3>(numPoints,0x1234);
+  std::vector<box3f> boxes = pointBoxes(points);
+  // some invalid ones
+  for (size_t i=0;i<boxes.size();i+=97)
+    boxes[i] = box3f();
+  uint64_t numValid = 0;
+  for (auto box : boxes)
+    numValid += !box.empty();
+  
+  box3f *d_boxes = managedCopy(boxes);
+  for (size_t maxPrimsPerChunk : { size_t(1000), size_t(1)<<24 }) {
+    BuildConfig buildConfig;
+    buildConfig.makeLeafThreshold = 4;
+    bvh64_3f bvh;
+    gpuBuilder(bvh,d_boxes,boxes.size(),buildConfig,0,managedMem(),maxPrimsPerChunk);
+    CUBQL_CUDA_SYNC_CHECK();
+    CUBQL_TEST_CHECK(bvh.numPrims == numValid);
+    checkStructure(bvh,boxes);
+    checkQueries(bvh,points,boxes);
+    if (maxPrimsPerChunk < boxes.size())
+      testFiles(bvh,boxes);
+
+    // move everything, and refit
+    for (size_t i=0;i<boxes.size();i++)
+      if (!boxes[i].empty()) {
+        points[i] = points[i]*.5f+vec3f(.25f);
+        boxes[i] = d_boxes[i] = box3f().including(points[i]);
+      }
+    refit(bvh,d_boxes,0,managedMem());
+    CUBQL_CUDA_SYNC_CHECK();
+    checkStructure(bvh,boxes);
+    checkQueries(bvh,points,boxes);
+    cuBQL::free(bvh,0,managedMem());
+  }
+  managedFree(d_boxes);
+  printf("test-bvh64: all tests passed\n");
+  return 0;
+}
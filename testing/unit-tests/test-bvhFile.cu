@@ -0,0 +1,125 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+
+/*! checks that BVHs written with saveBVH() load back (through
+    MappedBVH, ie, mmap) bit-identical, with page-aligned arrays that
+    queries can run on directly, and that loading a file as the
+    wrong BVH type, or a truncated file, fails */
+
+#include "testRig.h"
+#include "cuBQL/io/bvhFile.h"
+#include "cuBQL/queries/shrinkingRadiusQuery.h"
+#include <fstream>
+
+using namespace cuBQL;
+using namespace cuBQL::test_rig;
+
+/*! whether constructing a MappedBVH<bvh_t> from the given file throws */
+template<typename bvh_t>
+bool failsToLoad(const std::string &fileName)
+{
+  try {
+    MappedBVH<bvh_t> loaded(fileName);
+  } catch (const std::runtime_error &) {
+    return true;
+  }
+  return false;
+}
+
+template<typename bvh_t>
+void checkIdentical(const bvh_t &loaded, const bvh_t &original)
+{
+  CUBQL_TEST_CHECK(loaded.numNodes == original.numNodes);
+  CUBQL_TEST_CHECK(loaded.numPrims == original.numPrims);
+  CUBQL_TEST_CHECK(memcmp(loaded.nodes,original.nodes,
+                          original.numNodes*sizeof(*original.nodes)) == 0);
+  CUBQL_TEST_CHECK(memcmp(loaded.primIDs,original.primIDs,
+                          original.numPrims*sizeof(uint32_t)) == 0);
+  CUBQL_TEST_CHECK(size_t(loaded.nodes) % BVHFileHeader::alignment == 0);
+  CUBQL_TEST_CHECK(size_t(loaded.primIDs) % BVHFileHeader::alignment == 0);
+}
+
+int main(int, char **)
+{
+  const std::string fileName = "test-bvhFile.bvh";
+  const int numPoints = 20000;
+  std::vector<vec3f> points = randomPoints<float,3>(numPoints,0x1234);
+
+  BuildConfig buildConfig;
+  buildConfig.makeLeafThreshold = 5;
+  bvh3f bvh = buildBVH(pointBoxes(points),buildConfig);
+  saveBVH(fileName,bvh,buildConfig);
+  {
+    MappedBVH<bvh3f> loaded(fileName);
+    checkIdentical(loaded.bvh,bvh);
+    CUBQL_TEST_CHECK(loaded.buildConfig.makeLeafThreshold == 5);
+    CUBQL_TEST_CHECK(loaded.buildConfig.buildMethod == BuildConfig::SPATIAL_MEDIAN);
+
+    // queries run right on the mapped file
+    std::vector<vec3f> queries = randomPoints<float,3>(1000,0x4321);
+    for (auto query : queries) {
+      float closest = INFINITY;
+      for (auto point : points)
+        closest = std::min(closest,fSqrDistance(point,query));
+      float found = INFINITY;
+      shrinkingRadiusQuery_forEachPrim(loaded.bvh,query,INFINITY,
+                                       [&](uint32_t primID)->float {
+                                         found = std::min(found,fSqrDistance(points[primID],query));
+                                         return found;
+                                       });
+      CUBQL_TEST_CHECK(found == closest);
+    }
+  }
+
+  // wrong type, wrong dimensionality, wrong branching factor
+  CUBQL_TEST_CHECK((failsToLoad<BinaryBVH<double,3>>(fileName)));
+  CUBQL_TEST_CHECK((failsToLoad<BinaryBVH<float,2>>(fileName)));
+  CUBQL_TEST_CHECK((failsToLoad<BinaryBVH<int,3>>(fileName)));
+  CUBQL_TEST_CHECK((failsToLoad<WideBVH<float,3,4>>(fileName)));
+
+  // truncated, and non-existing files
+  {
+    std::ifstream in(fileName,std::ios::binary);
+    std::vector<char> head(BVHFileHeader::alignment+100);
+    in.read(head.data(),head.size());
+    std::ofstream out(fileName,std::ios::binary);
+    out.write(head.data(),head.size());
+  }
+  CUBQL_TEST_CHECK(failsToLoad<bvh3f>(fileName));
+  std::remove(fileName.c_str());
+  CUBQL_TEST_CHECK(failsToLoad<bvh3f>(fileName));
+  freeBVH(bvh);
+
+  // wide BVHs, built over boxes
+  box3f *boxes = managedCopy(randomBoxes<float,3>(numPoints,0x2345,.01f));
+  WideBVH<float,3,4> wideBVH;
+  gpuBuilder(wideBVH,boxes,numPoints,buildConfig,0,managedMem());
+  CUBQL_CUDA_SYNC_CHECK();
+  saveBVH(fileName,wideBVH,buildConfig);
+  {
+    MappedBVH<WideBVH<float,3,4>> loaded(fileName);
+    checkIdentical(loaded.bvh,wideBVH);
+    CUBQL_TEST_CHECK((failsToLoad<WideBVH<float,3,8>>(fileName)));
+    CUBQL_TEST_CHECK(failsToLoad<bvh3f>(fileName));
+  }
+  std::remove(fileName.c_str());
+  cuBQL::free(wideBVH,0,managedMem());
+  managedFree(boxes);
+
+  printf("test-bvhFile: all tests passed\n");
+  return 0;
+}
@@ -0,0 +1,261 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+
+/*! checks BVHMaintainer (bvhMaintainer.h) through frames of animated
+    boxes: that it only refits while the tree stays good, re-builds
+    just the subtrees over prims that got shuffled around locally, and
+    the whole tree when they are shuffled everywhere - and that the
+    BVH is valid, and gives the right box queries, after each of
+    those */
+
+#include "testRig.h"
+#include "cuBQL/bvhMaintainer.h"
+#include "cuBQL/queries/rangeQuery.h"
+
+using namespace cuBQL;
+using namespace cuBQL::test_rig;
+
+/*! checks that each prim is in exactly one leaf, and that all nodes'
+    bounds are exactly those of their prims */
+template<typename T, int D>
+void checkTree(const BinaryBVH<T,D> &bvh, const box_t<T,D> *boxes, uint32_t numBoxes)
+{
+  CUBQL_TEST_CHECK(bvh.numPrims == numBoxes);
+  CUBQL_TEST_CHECK(bvh.numNodes <= 2*numBoxes);
+  std::vector<int> seen(numBoxes,0);
+  std::vector<uint32_t> stack = { 0 };
+  while (!stack.empty()) {
+    const auto &node = bvh.nodes[stack.back()];
+    stack.pop_back();
+    box_t<T,D> bounds;
+    if (node.admin.count == 0) {
+      CUBQL_TEST_CHECK(node.admin.offset >= 2 && node.admin.offset+1 < bvh.numNodes);
+      for (int c=0;c<2;c++) {
+        bounds.grow(bvh.nodes[node.admin.offset+c].bounds);
+        stack.push_back(node.admin.offset+c);
+      }
+    } else {
+      CUBQL_TEST_CHECK(node.admin.offset+node.admin.count <= bvh.numPrims);
+      for (int i=0;i<node.admin.count;i++) {
+        const uint32_t primID = bvh.primIDs[node.admin.offset+i];
+        CUBQL_TEST_CHECK(primID < numBoxes);
+        seen[primID]++;
+        bounds.grow(boxes[primID]);
+      }
+    }
+    CUBQL_TEST_CHECK(node.bounds.lower == bounds.lower && node.bounds.upper == bounds.upper);
+  }
+  for (uint32_t primID=0;primID<numBoxes;primID++)
+    CUBQL_TEST_CHECK(seen[primID] == 1);
+}
+
+/*! SAH cost with the metric of computeSAH.h */
+template<typename T, int D>
+float sahCost(const BinaryBVH<T,D> &bvh)
+{
+  const double rootArea = bvhMaintainer_impl::area(bvh.nodes[0].bounds);
+  double cost = 0.;
+  for (uint32_t nodeID=0;nodeID<bvh.numNodes;nodeID++) {
+    if (nodeID == 1) continue;
+    const auto &node = bvh.nodes[nodeID];
+    cost += bvhMaintainer_impl::area(node.bounds)/rootArea
+      * std::max(1,(int)node.admin.count);
+  }
+  return float(cost);
+}
+
+__global__
+void countInBox(uint32_t *counts, const box3f *queries, int numQueries,
+                bvh3f bvh, const box3f *boxes)
+{
+  int tid = threadIdx.x+blockIdx.x*blockDim.x;
+  if (tid >= numQueries) return;
+  counts[tid] = rangeQuery_count(bvh,boxes,queries[tid]);
+}
+
+/*! checks box queries (host and device) against brute force */
+void checkQueries(const bvh3f &bvh, const box3f *boxes, uint32_t numBoxes)
+{
+  const int numQueries = 200;
+  std::vector<box3f> h_queries = randomBoxes<float,3>(numQueries,0x5678,.2f);
+  box3f *queries = managedCopy(h_queries);
+  uint32_t *counts = managedAlloc<uint32_t>(numQueries);
+  countInBox<<<divRoundUp(numQueries,128),128>>>(counts,queries,numQueries,bvh,boxes);
+  CUBQL_CUDA_SYNC_CHECK();
+  for (int i=0;i<numQueries;i++) {
+    uint32_t expected = 0;
+    for (uint32_t j=0;j<numBoxes;j++)
+      expected += h_queries[i].overlaps(boxes[j]);
+    CUBQL_TEST_CHECK(counts[i] == expected);
+    CUBQL_TEST_CHECK(rangeQuery_count(bvh,boxes,h_queries[i]) == expected);
+  }
+  managedFree(counts);
+  managedFree(queries);
+}
+
+/*! randomly permutes the boxes whose lower corner is in [0,maxCoord)^D,
+    so the tree's topology no longer matches them */
+template<typename T, int D>
+void shuffleBoxes(box_t<T,D> *boxes, uint32_t numBoxes, float maxCoord, int seed)
+{
+  std::vector<uint32_t> shuffled;
+  for (uint32_t i=0;i<numBoxes;i++) {
+    bool inside = true;
+    for (int d=0;d<D;d++)
+      inside = inside && boxes[i].lower[d] < maxCoord;
+    if (inside) shuffled.push_back(i);
+  }
+  std::vector<box_t<T,D>> values;
+  for (auto i : shuffled) values.push_back(boxes[i]);
+  std::shuffle(values.begin(),values.end(),std::mt19937(seed));
+  for (size_t i=0;i<shuffled.size();i++)
+    boxes[shuffled[i]] = values[i];
+}
+
+/*! a maintainer with a BVH over (a managed copy of) the given boxes */
+template<typename T, int D>
+BVHMaintainer<T,D> *makeMaintainer(box_t<T,D> *boxes, uint32_t numBoxes,
+                                   typename BVHMaintainer<T,D>::Config config)
+{
+  config.buildConfig.makeLeafThreshold = 4;
+  BVHMaintainer<T,D> *maintainer = new BVHMaintainer<T,D>(config,0,managedMem());
+  maintainer->build(boxes,numBoxes);
+  checkTree(maintainer->bvh,boxes,numBoxes);
+  return maintainer;
+}
+
+int main(int, char **)
+{
+  using Maintainer = BVHMaintainer<float,3>;
+  const uint32_t numBoxes = 20000;
+  const std::vector<box3f> initialBoxes = randomBoxes<float,3>(numBoxes,0x1234,.01f);
+  box3f *boxes = managedCopy(initialBoxes);
+
+  Maintainer::Config config;
+  config.minSubtreePrims = 500;
+  Maintainer *maintainer = makeMaintainer(boxes,numBoxes,config);
+  const float initialCost = sahCost(maintainer->bvh);
+
+  // nothing moves, or everything moves only a little: refit only
+  Maintainer::FrameReport report = maintainer->update(boxes);
+  CUBQL_TEST_CHECK(report.decision == Maintainer::REFIT);
+  CUBQL_TEST_CHECK(report.sahRatio == 1.f);
+  CUBQL_TEST_CHECK(report.numPrimsRebuilt == 0 && report.numSubtreesRebuilt == 0);
+  CUBQL_TEST_CHECK(fabsf(report.sah-initialCost) < 1e-3f*initialCost);
+  CUBQL_TEST_CHECK(report.refitTime >= 0. && report.costTime >= 0.);
+  std::mt19937 rng(0x2345);
+  for (uint32_t i=0;i<numBoxes;i++) {
+    const vec3f delta = 1e-3f*(randomPoints<float,3>(1,rng())[0]-vec3f(.5f));
+    boxes[i].lower = boxes[i].lower+delta;
+    boxes[i].upper = boxes[i].upper+delta;
+  }
+  report = maintainer->update(boxes);
+  CUBQL_TEST_CHECK(report.decision == Maintainer::REFIT);
+  CUBQL_TEST_CHECK(report.sahRatio < 1.1f);
+  checkTree(maintainer->bvh,boxes,numBoxes);
+  CUBQL_TEST_CHECK(fabsf(report.sah-sahCost(maintainer->bvh)) < 1e-3f*report.sah);
+
+  // prims shuffled around in one corner only: that corner's subtrees
+  // get re-built, which brings the cost back to where it was
+  shuffleBoxes(boxes,numBoxes,.5f,0x3456);
+  Maintainer::Config partialConfig = config;
+  partialConfig.rebuildThreshold = 1000.f;
+  delete maintainer;
+  maintainer = makeMaintainer(boxes,numBoxes,partialConfig);
+  shuffleBoxes(boxes,numBoxes,.5f,0x4567);
+  report = maintainer->update(boxes);
+  CUBQL_TEST_CHECK(report.decision == Maintainer::REBUILD_SUBTREES);
+  CUBQL_TEST_CHECK(report.sahRatio > partialConfig.subtreeRebuildThreshold);
+  CUBQL_TEST_CHECK(report.numSubtreesRebuilt > 0);
+  CUBQL_TEST_CHECK(report.numPrimsRebuilt >= report.numSubtreesRebuilt*config.minSubtreePrims);
+  CUBQL_TEST_CHECK(report.numPrimsRebuilt <= numBoxes/2);
+  checkTree(maintainer->bvh,boxes,numBoxes);
+  checkQueries(maintainer->bvh,boxes,numBoxes);
+  CUBQL_TEST_CHECK(fabsf(report.sah-sahCost(maintainer->bvh)) < 1e-3f*report.sah);
+  CUBQL_TEST_CHECK(report.sah < 1.1f*initialCost);
+  // ... after which the tree is as good as before, and refits again
+  report = maintainer->update(boxes);
+  CUBQL_TEST_CHECK(report.decision == Maintainer::REFIT);
+  CUBQL_TEST_CHECK(report.sahRatio < 1.1f);
+
+  // the same, with subtrees too small to be re-built on their own,
+  // or too many of them: refit only, or a full re-build
+  Maintainer::Config smallConfig = partialConfig;
+  smallConfig.minSubtreePrims = numBoxes+1;
+  delete maintainer;
+  maintainer = makeMaintainer(boxes,numBoxes,smallConfig);
+  shuffleBoxes(boxes,numBoxes,.5f,0x5678);
+  report = maintainer->update(boxes);
+  CUBQL_TEST_CHECK(report.decision == Maintainer::REFIT);
+  CUBQL_TEST_CHECK(report.sahRatio > partialConfig.subtreeRebuildThreshold);
+  checkTree(maintainer->bvh,boxes,numBoxes);
+  Maintainer::Config fractionConfig = partialConfig;
+  fractionConfig.maxSubtreeFraction = .01f;
+  delete maintainer;
+  maintainer = makeMaintainer(boxes,numBoxes,fractionConfig);
+  shuffleBoxes(boxes,numBoxes,.5f,0x6789);
+  report = maintainer->update(boxes);
+  CUBQL_TEST_CHECK(report.decision == Maintainer::REBUILD);
+  CUBQL_TEST_CHECK(report.numPrimsRebuilt == numBoxes);
+  checkTree(maintainer->bvh,boxes,numBoxes);
+
+  // prims shuffled around everywhere: full re-build, either because
+  // the root's subtree crossed its threshold, or the whole tree its
+  // own
+  Maintainer::Config rootConfig = partialConfig;
+  rootConfig.maxSubtreeFraction = 1.f;
+  delete maintainer;
+  maintainer = makeMaintainer(boxes,numBoxes,rootConfig);
+  shuffleBoxes(boxes,numBoxes,2.f,0x6789);
+  report = maintainer->update(boxes);
+  CUBQL_TEST_CHECK(report.decision == Maintainer::REBUILD);
+  CUBQL_TEST_CHECK(report.numPrimsRebuilt == numBoxes);
+  checkTree(maintainer->bvh,boxes,numBoxes);
+  delete maintainer;
+  maintainer = makeMaintainer(boxes,numBoxes,config);
+  shuffleBoxes(boxes,numBoxes,2.f,0x789a);
+  report = maintainer->update(boxes);
+  CUBQL_TEST_CHECK(report.decision == Maintainer::REBUILD);
+  CUBQL_TEST_CHECK(report.sahRatio > config.rebuildThreshold);
+  CUBQL_TEST_CHECK(report.numPrimsRebuilt == numBoxes);
+  checkTree(maintainer->bvh,boxes,numBoxes);
+  checkQueries(maintainer->bvh,boxes,numBoxes);
+  CUBQL_TEST_CHECK(report.sah < 1.1f*initialCost);
+  report = maintainer->update(boxes);
+  CUBQL_TEST_CHECK(report.decision == Maintainer::REFIT);
+  CUBQL_TEST_CHECK(report.sahRatio == 1.f);
+  delete maintainer;
+  managedFree(boxes);
+
+  // other dimensionalities
+  using Maintainer2 = BVHMaintainer<float,2>;
+  box2f *boxes2 = managedCopy(randomBoxes<float,2>(numBoxes,0x3456,.01f));
+  Maintainer2::Config config2;
+  config2.minSubtreePrims = 500;
+  config2.rebuildThreshold = 1000.f;
+  Maintainer2 *maintainer2 = makeMaintainer(boxes2,numBoxes,config2);
+  shuffleBoxes(boxes2,numBoxes,.5f,0x4567);
+  Maintainer2::FrameReport report2 = maintainer2->update(boxes2);
+  CUBQL_TEST_CHECK(report2.decision == Maintainer2::REBUILD_SUBTREES);
+  checkTree(maintainer2->bvh,boxes2,numBoxes);
+  CUBQL_TEST_CHECK(fabsf(report2.sah-sahCost(maintainer2->bvh)) < 1e-3f*report2.sah);
+  delete maintainer2;
+  managedFree(boxes2);
+
+  printf("test-bvhMaintainer: all tests passed\n");
+  return 0;
+}
@@ -0,0 +1,126 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+/*! checks the dual-tree closest-pair queries in
+    queries/closestPairs.h against brute force, on host and device,
+    for points and boxes, and with bounded and unbounded search
+    radii */
+
+#include "testRig.h"
+#include "cuBQL/queries/closestPairs.h"
+
+using namespace cuBQL;
+using namespace cuBQL::test_rig;
+
+/*! checks that each prim of A got (one of) its closest prim(s) in B,
+    or -1 if there is none within the search radius */
+template<typename primA_t, typename primB_t>
+void checkResults(const ClosestPairResult *results,
+                  float                    sqrMaxSearchDist,
+                  const std::vector<primA_t> &primsA,
+                  const std::vector<primB_t> &primsB)
+{
+  for (int i=0;i<(int)primsA.size();i++) {
+    float closest = sqrMaxSearchDist;
+    for (int j=0;j<(int)primsB.size();j++)
+      closest = std::min(closest,closestPairs_impl::primSqrDistance(primsA[i],primsB[j]));
+    CUBQL_TEST_CHECK(results[i].primA == i);
+    if (closest >= sqrMaxSearchDist) {
+      CUBQL_TEST_CHECK(results[i].primB == -1);
+      continue;
+    }
+    CUBQL_TEST_CHECK(results[i].primB >= 0 && results[i].primB < (int)primsB.size());
+    CUBQL_TEST_CHECK(results[i].sqrDistance == closest);
+    CUBQL_TEST_CHECK(closestPairs_impl::primSqrDistance(primsA[i],primsB[results[i].primB])
+                     == closest);
+  }
+}
+
+template<typename primA_t, typename primB_t>
+void testClosestPairs(const std::vector<primA_t> &h_primsA,
+                      const std::vector<box3f>   &boxesA,
+                      const std::vector<primB_t> &h_primsB,
+                      const std::vector<box3f>   &boxesB,
+                      int                         leafThreshold)
+{
+  const primA_t *primsA = managedCopy(h_primsA);
+  const primB_t *primsB = managedCopy(h_primsB);
+  BuildConfig buildConfig;
+  buildConfig.makeLeafThreshold = leafThreshold;
+  bvh3f bvhA = buildBVH(boxesA,buildConfig);
+  bvh3f bvhB = buildBVH(boxesB,buildConfig);
+  const int numA = (int)h_primsA.size();
+  ClosestPairResult *results = managedAlloc<ClosestPairResult>(numA);
+
+  // once unbounded, and once with a radius small enough that some
+  // prims of A don't find anything
+  for (float sqrMaxSearchDist : { INFINITY, .02f*.02f }) {
+    allClosestPairs(results,sqrMaxSearchDist,bvhA,primsA,bvhB,primsB,0,managedMem());
+    CUBQL_CUDA_SYNC_CHECK();
+    checkResults(results,sqrMaxSearchDist,h_primsA,h_primsB);
+
+    host::allClosestPairs(results,sqrMaxSearchDist,bvhA,primsA,bvhB,primsB);
+    checkResults(results,sqrMaxSearchDist,h_primsA,h_primsB);
+
+    // a single dual-tree descent over all of A
+    std::vector<float> sqrNodeCullDists(bvhA.numNodes,sqrMaxSearchDist);
+    for (int i=0;i<numA;i++) {
+      results[i].clear(sqrMaxSearchDist);
+      results[i].primA = i;
+    }
+    closestPairs_forSubtreeOfA(results,sqrNodeCullDists.data(),0,
+                               bvhA,primsA,bvhB,primsB);
+    checkResults(results,sqrMaxSearchDist,h_primsA,h_primsB);
+
+    // the single closest pair
+    float closest = sqrMaxSearchDist;
+    for (int i=0;i<numA;i++)
+      closest = std::min(closest,results[i].sqrDistance);
+    ClosestPairResult result;
+    result.clear(sqrMaxSearchDist);
+    closestPair(result,bvhA,primsA,bvhB,primsB);
+    if (closest >= sqrMaxSearchDist)
+      CUBQL_TEST_CHECK(result.primA == -1 && result.primB == -1);
+    else {
+      CUBQL_TEST_CHECK(result.sqrDistance == closest);
+      CUBQL_TEST_CHECK(closestPairs_impl::primSqrDistance(h_primsA[result.primA],
+                                                          h_primsB[result.primB])
+                       == closest);
+    }
+  }
+
+  managedFree(results);
+  freeBVH(bvhB);
+  freeBVH(bvhA);
+  managedFree(primsB);
+  managedFree(primsA);
+}
+
+int main(int, char **)
+{
+  std::vector<vec3f> pointsA = randomPoints<float,3>(5000,0x1234);
+  std::vector<vec3f> pointsB = randomPoints<float,3>(3000,0x4321);
+  std::vector<box3f> boxesA  = randomBoxes<float,3>(4000,0x2345,.02f);
+  std::vector<box3f> boxesB  = randomBoxes<float,3>(2000,0x5432,.02f);
+  for (int leafThreshold : { 1, 8 }) {
+    testClosestPairs(pointsA,pointBoxes(pointsA),pointsB,pointBoxes(pointsB),leafThreshold);
+    testClosestPairs(boxesA,boxesA,pointsB,pointBoxes(pointsB),leafThreshold);
+    testClosestPairs(pointsA,pointBoxes(pointsA),boxesB,boxesB,leafThreshold);
+    testClosestPairs(boxesA,boxesA,boxesB,boxesB,leafThreshold);
+  }
+  printf("test-closestPairs: all tests passed\n");
+  return 0;
+}
@@ -0,0 +1,219 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+/*! checks DynamicBVH (dynamicBVH.h) through sequences of inserts,
+    removes, and updates: the tree's structure, the re-use of primIDs,
+    its SAH cost compared to a full re-build, and box queries on the
+    exported BinaryBVH against brute force */
+
+#include "testRig.h"
+#include "cuBQL/dynamicBVH.h"
+#include "cuBQL/queries/rangeQuery.h"
+
+using namespace cuBQL;
+using namespace cuBQL::test_rig;
+
+/*! checks parent links, bounds, and the leaves' prims; 'boxes' has
+    the box of each valid primID, and empty boxes for the others */
+template<typename T, int D>
+void checkTree(const DynamicBVH<T,D> &bvh, const std::vector<box_t<T,D>> &boxes)
+{
+  using Node = typename DynamicBVH<T,D>::Node;
+  CUBQL_TEST_CHECK(bvh.primIDRange() == boxes.size());
+  uint32_t numValid = 0;
+  for (uint32_t primID=0;primID<boxes.size();primID++) {
+    CUBQL_TEST_CHECK(bvh.isValid(primID) == !boxes[primID].empty());
+    if (!bvh.isValid(primID)) continue;
+    numValid++;
+    CUBQL_TEST_CHECK(bvh.getBox(primID).lower == boxes[primID].lower);
+    CUBQL_TEST_CHECK(bvh.getBox(primID).upper == boxes[primID].upper);
+  }
+  CUBQL_TEST_CHECK(bvh.numPrims() == numValid);
+  if (numValid == 0) {
+    CUBQL_TEST_CHECK(bvh.root == -1);
+    return;
+  }
+
+  CUBQL_TEST_CHECK(bvh.nodes[bvh.root].parent == -1);
+  std::vector<int> seen(boxes.size(),0);
+  std::vector<int32_t> stack = { bvh.root };
+  uint32_t numNodes = 0;
+  while (!stack.empty()) {
+    const int32_t nodeID = stack.back();
+    stack.pop_back();
+    const Node &node = bvh.nodes[nodeID];
+    numNodes++;
+    if (node.isLeaf()) {
+      CUBQL_TEST_CHECK(node.primID >= 0 && node.primID < (int)boxes.size());
+      seen[node.primID]++;
+      continue;
+    }
+    box_t<T,D> bounds;
+    for (int c=0;c<2;c++) {
+      CUBQL_TEST_CHECK(bvh.nodes[node.child[c]].parent == nodeID);
+      bounds.grow(bvh.nodes[node.child[c]].bounds);
+      stack.push_back(node.child[c]);
+    }
+    CUBQL_TEST_CHECK(node.bounds.lower == bounds.lower && node.bounds.upper == bounds.upper);
+  }
+  CUBQL_TEST_CHECK(numNodes == 2*numValid-1);
+  for (uint32_t primID=0;primID<boxes.size();primID++)
+    CUBQL_TEST_CHECK(seen[primID] == (bvh.isValid(primID) ? 1 : 0));
+}
+
+/*! SAH cost of a regular BVH, with the same metric as
+    DynamicBVH::sahCost() */
+float sahCost(const bvh3f &bvh)
+{
+  const double rootArea = dynamicBVH_impl::area(bvh.nodes[0].bounds);
+  double cost = 0.;
+  for (uint32_t nodeID=0;nodeID<bvh.numNodes;nodeID++) {
+    if (nodeID == 1) continue;
+    const bvh3f::Node &node = bvh.nodes[nodeID];
+    cost += dynamicBVH_impl::area(box3f(node.bounds))/rootArea
+      * std::max(1,(int)node.admin.count);
+  }
+  return float(cost);
+}
+
+__global__
+void countInBox(uint32_t *counts, const box3f *queries, int numQueries,
+                bvh3f bvh, const box3f *boxes)
+{
+  int tid = threadIdx.x+blockIdx.x*blockDim.x;
+  if (tid >= numQueries) return;
+  counts[tid] = rangeQuery_count(bvh,boxes,queries[tid]);
+}
+
+/*! exports the tree, and checks box queries on it (host and device)
+    against brute force */
+void checkQueries(const DynamicBVH<float,3> &dynamic, const std::vector<box3f> &h_boxes)
+{
+  bvh3f bvh;
+  dynamic.exportBVH(bvh,0,managedMem());
+  CUBQL_TEST_CHECK(bvh.numPrims == dynamic.numPrims());
+  CUBQL_TEST_CHECK(bvh.nodes[0].bounds.lower == dynamic.getBounds().lower);
+
+  const int numQueries = 200;
+  std::vector<box3f> h_queries = randomBoxes<float,3>(numQueries,0x5678,.2f);
+  box3f *queries = managedCopy(h_queries);
+  box3f *boxes = managedCopy(h_boxes);
+  uint32_t *counts = managedAlloc<uint32_t>(numQueries);
+  countInBox<<<divRoundUp(numQueries,128),128>>>(counts,queries,numQueries,bvh,boxes);
+  CUBQL_CUDA_SYNC_CHECK();
+  for (int i=0;i<numQueries;i++) {
+    uint32_t expected = 0;
+    for (auto box : h_boxes)
+      expected += !box.empty() && h_queries[i].overlaps(box);
+    CUBQL_TEST_CHECK(counts[i] == expected);
+    CUBQL_TEST_CHECK(rangeQuery_count(bvh,boxes,h_queries[i]) == expected);
+  }
+  managedFree(counts);
+  managedFree(boxes);
+  managedFree(queries);
+  freeBVH(bvh);
+}
+
+int main(int, char **)
+{
+  std::mt19937 rng(0x1234);
+  const int numInitial = 4000;
+  std::vector<box3f> candidates = randomBoxes<float,3>(3*numInitial,0x2345,.02f);
+  size_t nextCandidate = 0;
+
+  DynamicBVH<float,3> dynamic;
+  std::vector<box3f> boxes;
+  for (int i=0;i<numInitial;i++) {
+    CUBQL_TEST_CHECK(dynamic.insert(candidates[nextCandidate]) == (uint32_t)boxes.size());
+    boxes.push_back(candidates[nextCandidate++]);
+  }
+  checkTree(dynamic,boxes);
+  checkQueries(dynamic,boxes);
+
+  // inserting in a (spatially) sorted order does not make the tree
+  // any worse than a random order; and neither is much worse than a
+  // full re-build
+  const float randomOrderCost = dynamic.sahCost();
+  std::vector<box3f> sorted = boxes;
+  std::sort(sorted.begin(),sorted.end(),[](const box3f &a, const box3f &b)
+            { return a.lower.x < b.lower.x; });
+  DynamicBVH<float,3> sortedDynamic;
+  for (auto box : sorted) sortedDynamic.insert(box);
+  BuildConfig buildConfig = BuildConfig().enableSAH();
+  buildConfig.makeLeafThreshold = 1;
+  bvh3f rebuilt = buildBVH(boxes,buildConfig);
+  const float rebuiltCost = sahCost(rebuilt);
+  freeBVH(rebuilt);
+  CUBQL_TEST_CHECK(sortedDynamic.sahCost() < 1.25f*randomOrderCost);
+  CUBQL_TEST_CHECK(randomOrderCost < 1.5f*rebuiltCost);
+
+  // a few frames of removing, updating, and inserting prims
+  for (int frame=0;frame<10;frame++) {
+    for (int i=0;i<200;i++) {
+      const uint32_t primID = rng() % boxes.size();
+      if (boxes[primID].empty()) continue;
+      if (rng() & 1) {
+        dynamic.remove(primID);
+        boxes[primID] = box3f();
+      } else {
+        boxes[primID] = candidates[nextCandidate++];
+        dynamic.update(primID,boxes[primID]);
+      }
+    }
+    const uint32_t oldRange = dynamic.primIDRange();
+    for (int i=0;i<100;i++) {
+      const uint32_t primID = dynamic.insert(candidates[nextCandidate]);
+      // freed primIDs get re-used first
+      CUBQL_TEST_CHECK(primID < oldRange || primID == (uint32_t)boxes.size());
+      if (primID == boxes.size()) boxes.push_back(box3f());
+      CUBQL_TEST_CHECK(boxes[primID].empty());
+      boxes[primID] = candidates[nextCandidate++];
+    }
+    checkTree(dynamic,boxes);
+  }
+  // node slots get re-used, too
+  CUBQL_TEST_CHECK(dynamic.nodes.size() < 2*size_t(dynamic.primIDRange()));
+  checkQueries(dynamic,boxes);
+
+  bool threw = false;
+  try { dynamic.remove(dynamic.primIDRange()); } catch (std::runtime_error &) { threw = true; }
+  CUBQL_TEST_CHECK(threw);
+
+  // remove everything, then start over
+  for (uint32_t primID=0;primID<boxes.size();primID++)
+    if (!boxes[primID].empty()) {
+      dynamic.remove(primID);
+      boxes[primID] = box3f();
+    }
+  checkTree(dynamic,boxes);
+  const uint32_t primID = dynamic.insert(candidates[0]);
+  boxes[primID] = candidates[0];
+  checkTree(dynamic,boxes);
+  checkQueries(dynamic,boxes);
+
+  // other dimensionalities
+  DynamicBVH<float,2> dynamic2;
+  std::vector<box2f> boxes2 = randomBoxes<float,2>(1000,0x3456,.05f);
+  for (auto box : boxes2) dynamic2.insert(box);
+  for (uint32_t i=0;i<boxes2.size();i+=3) {
+    dynamic2.remove(i);
+    boxes2[i] = box2f();
+  }
+  checkTree(dynamic2,boxes2);
+
+  printf("test-dynamicBVH: all tests passed\n");
+  return 0;
+}
@@ -0,0 +1,157 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+/*! checks the Barnes-Hut style far-field evaluation in
+    queries/farField.h against direct summation over all prims: with
+    theta=0 (which never approximates) the result has to match up to
+    float rounding, and small theta values have to stay close */
+
+#include "testRig.h"
+#include "cuBQL/queries/farField.h"
+
+using namespace cuBQL;
+using namespace cuBQL::test_rig;
+
+/*! direct sum of the kernel over all prims, accumulated in double */
+template<typename Kernel>
+double directGaussian(const Kernel &kernel, vec3f query,
+                      const std::vector<PointMass<3>> &masses)
+{
+  double sum = 0.;
+  for (auto mass : masses) {
+    if (mass.weight == 0.f) continue;
+    float contrib = 0.f;
+    kernel(contrib,query,mass);
+    sum += contrib;
+  }
+  return sum;
+}
+
+template<typename Kernel>
+vec_t<double,3> directGravity(const Kernel &kernel, vec3f query,
+                              const std::vector<PointMass<3>> &masses)
+{
+  vec_t<double,3> sum(0.);
+  for (auto mass : masses) {
+    if (mass.weight == 0.f) continue;
+    vec3f contrib(0.f);
+    kernel(contrib,query,mass);
+    for (int d=0;d<3;d++) sum[d] += contrib[d];
+  }
+  return sum;
+}
+
+double directIDW(const InverseDistanceKernel<3> &kernel, vec3f query,
+                 const std::vector<WeightedSample<3>> &samples)
+{
+  double weightedValueSum = 0., weightSum = 0.;
+  for (auto sample : samples) {
+    InverseDistanceResult contrib;
+    kernel(contrib,query,sample);
+    weightedValueSum += contrib.weightedValueSum;
+    weightSum        += contrib.weightSum;
+  }
+  return weightedValueSum / weightSum;
+}
+
+int main(int, char **)
+{
+  const int numPrims = 10000;
+  const int numQueries = 500;
+  std::vector<vec3f> positions = randomPoints<float,3>(numPrims,0x1234);
+  std::vector<vec3f> h_queries = randomPoints<float,3>(numQueries,0x4321);
+  std::mt19937 rng(0x2345);
+  std::uniform_real_distribution<float> uniform(.5f,1.5f);
+  std::vector<PointMass<3>>      h_masses(numPrims);
+  std::vector<WeightedSample<3>> h_samples(numPrims);
+  for (int i=0;i<numPrims;i++) {
+    // some massless prims, too, which have to get skipped
+    const float weight = (i % 10 == 0) ? 0.f : uniform(rng);
+    h_masses[i]  = PointMass<3>::make(positions[i],weight);
+    h_samples[i] = WeightedSample<3>::make(positions[i],positions[i].x,uniform(rng));
+  }
+
+  bvh3f bvh = buildBVH(pointBoxes(positions));
+  const vec3f             *queries  = managedCopy(h_queries);
+  const PointMass<3>      *masses   = managedCopy(h_masses);
+  const WeightedSample<3> *samples  = managedCopy(h_samples);
+  PointMass<3>      *nodeMasses  = managedAlloc<PointMass<3>>(bvh.numNodes);
+  WeightedSample<3> *nodeSamples = managedAlloc<WeightedSample<3>>(bvh.numNodes);
+  computeAggregates(nodeMasses,bvh,masses,0,managedMem());
+  computeAggregates(nodeSamples,bvh,samples,0,managedMem());
+  CUBQL_CUDA_SYNC_CHECK();
+
+  GaussianKernel<3> gaussian; gaussian.sigma = .1f;
+  GravityKernel<3>  gravity;  gravity.softening = .01f;
+  InverseDistanceKernel<3> idw;
+  float                 *densities = managedAlloc<float>(numQueries);
+  vec3f                 *forces    = managedAlloc<vec3f>(numQueries);
+  InverseDistanceResult *idws      = managedAlloc<InverseDistanceResult>(numQueries);
+
+  // theta=0 never approximates: same as direct summation, up to float
+  // rounding; as theta goes to 0, the approximation error has to go
+  // to 0 as well
+  const struct { float theta; double tolerance; } tests[]
+    = { { 0.f, 1e-4 }, { .1f, 5e-3 }, { .2f, 2e-2 } };
+  for (auto test : tests) {
+    const float  theta     = test.theta;
+    const double tolerance = test.tolerance;
+    for (bool onDevice : { true, false }) {
+      std::fill(densities,densities+numQueries,0.f);
+      std::fill(forces,forces+numQueries,vec3f(0.f));
+      std::fill(idws,idws+numQueries,InverseDistanceResult());
+      if (onDevice) {
+        farField(densities,queries,numQueries,bvh,nodeMasses,masses,theta,gaussian);
+        farField(forces,queries,numQueries,bvh,nodeMasses,masses,theta,gravity);
+        farField(idws,queries,numQueries,bvh,nodeSamples,samples,theta,idw);
+        CUBQL_CUDA_SYNC_CHECK();
+      } else {
+        host::farField(densities,queries,numQueries,bvh,nodeMasses,masses,theta,gaussian);
+        host::farField(forces,queries,numQueries,bvh,nodeMasses,masses,theta,gravity);
+        host::farField(idws,queries,numQueries,bvh,nodeSamples,samples,theta,idw);
+      }
+      for (int i=0;i<numQueries;i++) {
+        const vec3f query = h_queries[i];
+        const double density = directGaussian(gaussian,query,h_masses);
+        CUBQL_TEST_CHECK(fabs(densities[i]-density) <= tolerance*density);
+
+        const vec_t<double,3> force = directGravity(gravity,query,h_masses);
+        double forceLength = 0., forceError = 0.;
+        for (int d=0;d<3;d++) {
+          forceLength += force[d]*force[d];
+          forceError  += (forces[i][d]-force[d])*(forces[i][d]-force[d]);
+        }
+        forceLength = sqrt(forceLength);
+        CUBQL_TEST_CHECK(sqrt(forceError) <= tolerance*forceLength);
+
+        const double value = directIDW(idw,query,h_samples);
+        CUBQL_TEST_CHECK(fabs(idws[i].value()-value) <= tolerance*fabs(value));
+      }
+    }
+  }
+
+  managedFree(idws);
+  managedFree(forces);
+  managedFree(densities);
+  managedFree(nodeSamples);
+  managedFree(nodeMasses);
+  managedFree(samples);
+  managedFree(masses);
+  managedFree(queries);
+  freeBVH(bvh);
+  printf("test-farField: all tests passed\n");
+  return 0;
+}
@@ -0,0 +1,284 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+/*! checks the two-level (instanced) point, ray, and range queries in
+    queries/instancing.h against brute force over the flattened
+    scene, with rigid as well as scaling and shearing transforms */
+
+#include "testRig.h"
+#include "cuBQL/queries/instancing.h"
+#include "cuBQL/triangles/rays.h"
+
+using namespace cuBQL;
+using namespace cuBQL::test_rig;
+
+/*! random rotations plus translations; every third one also scales
+    (non-uniformly), and every third one also shears */
+std::vector<affine3f> randomTransforms(int N, int seed)
+{
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<float> uniform(0.f,1.f);
+  std::vector<affine3f> xfms;
+  for (int i=0;i<N;i++) {
+    const vec3f axis
+      = normalize(vec3f(uniform(rng)-.5f,uniform(rng)-.5f,uniform(rng)-.5f)+vec3f(1e-3f));
+    const vec3f offset = 4.f*vec3f(uniform(rng),uniform(rng),uniform(rng));
+    affine3f xfm = affine3f::translate(offset) * affine3f::rotate(axis,6.28f*uniform(rng));
+    if (i % 3 == 1)
+      xfm = xfm * affine3f::scale(vec3f(.2f+uniform(rng),.2f+uniform(rng),.2f+uniform(rng)));
+    if (i % 3 == 2) {
+      LinearSpace3f shear;
+      shear.vy.x = uniform(rng);
+      shear.vz.y = -uniform(rng);
+      xfm = xfm * affine3f(shear);
+    }
+    xfms.push_back(xfm);
+  }
+  return xfms;
+}
+
+/*! closest (world-space) point among all instances of pointsObject;
+    returns its square distance */
+inline __cubql_both
+float instancedFCP(int &closestInstance, int &closestPrim,
+                   const TwoLevelBVH &bvh,
+                   const bvh3f       *pointsObject,
+                   const vec3f       *points,
+                   vec3f              query,
+                   float              sqrMaxDist = INFINITY)
+{
+  closestInstance = closestPrim = -1;
+  auto perPrim = [&](int instanceID, uint32_t primID)->float {
+    const Instance &instance = bvh.instances[instanceID];
+    if (instance.object != pointsObject) return INFINITY;
+    const float sqrDist = fSqrDistance(xfmPoint(instance.xfm,points[primID]),query);
+    if (sqrDist < sqrMaxDist) {
+      sqrMaxDist = sqrDist;
+      closestInstance = instanceID;
+      closestPrim = (int)primID;
+    }
+    return sqrMaxDist;
+  };
+  shrinkingRadiusQuery_forEachPrim(bvh,query,sqrMaxDist,perPrim);
+  return sqrMaxDist;
+}
+
+__global__
+void instancedFCP(float       *results,
+                  const vec3f *queries,
+                  int          numQueries,
+                  TwoLevelBVH  bvh,
+                  const bvh3f *pointsObject,
+                  const vec3f *points)
+{
+  int tid = threadIdx.x+blockIdx.x*blockDim.x;
+  if (tid >= numQueries) return;
+  int instanceID, primID;
+  results[tid] = instancedFCP(instanceID,primID,bvh,pointsObject,points,queries[tid]);
+}
+
+/*! checks instanced fcp (host and device) against brute force over
+    all instances' world-space points */
+void checkFCP(const TwoLevelBVH        &bvh,
+              const bvh3f              *pointsObject,
+              const vec3f              *points,
+              int                       numPoints,
+              const std::vector<vec3f> &h_queries)
+{
+  const int numQueries = (int)h_queries.size();
+  vec3f *queries = managedCopy(h_queries);
+  float *results = managedAlloc<float>(numQueries);
+  instancedFCP<<<divRoundUp(numQueries,32),32>>>
+    (results,queries,numQueries,bvh,pointsObject,points);
+  CUBQL_CUDA_SYNC_CHECK();
+  for (int i=0;i<numQueries;i++) {
+    const vec3f query = queries[i];
+    float closest = INFINITY;
+    for (uint32_t instanceID=0;instanceID<bvh.numInstances;instanceID++) {
+      const Instance &instance = bvh.instances[instanceID];
+      if (instance.object != pointsObject) continue;
+      for (int j=0;j<numPoints;j++)
+        closest = std::min(closest,fSqrDistance(xfmPoint(instance.xfm,points[j]),query));
+    }
+    int instanceID, primID;
+    const float result = instancedFCP(instanceID,primID,bvh,pointsObject,points,query);
+    CUBQL_TEST_CHECK(result == closest);
+    CUBQL_TEST_CHECK(results[i] == closest);
+    CUBQL_TEST_CHECK(fSqrDistance(xfmPoint(bvh.instances[instanceID].xfm,points[primID]),query)
+                     == closest);
+    // nothing strictly closer than the closest point
+    CUBQL_TEST_CHECK(instancedFCP(instanceID,primID,bvh,pointsObject,points,query,closest)
+                     == closest);
+    CUBQL_TEST_CHECK(instanceID == -1);
+  }
+  managedFree(results);
+  managedFree(queries);
+}
+
+int main(int, char **)
+{
+  // object 0: points; object 1: small triangles; object 2: empty
+  const int numPoints = 2000;
+  const int numTriangles = 500;
+  std::vector<vec3f> h_points = randomPoints<float,3>(numPoints,0x1234);
+  std::vector<vec3f> corners = randomPoints<float,3>(numTriangles,0x2345);
+  std::vector<vec3f> offsets = randomPoints<float,3>(2*numTriangles,0x3456);
+  std::vector<vec3f> h_vertices;
+  std::vector<vec3i> h_indices;
+  std::vector<box3f> triangleBoxes;
+  for (int i=0;i<numTriangles;i++) {
+    const int base = (int)h_vertices.size();
+    h_vertices.push_back(corners[i]);
+    h_vertices.push_back(corners[i]+.1f*(offsets[2*i+0]-vec3f(.5f)));
+    h_vertices.push_back(corners[i]+.1f*(offsets[2*i+1]-vec3f(.5f)));
+    h_indices.push_back(vec3i(base,base+1,base+2));
+    triangleBoxes.push_back(box3f()
+                            .including(h_vertices[base])
+                            .including(h_vertices[base+1])
+                            .including(h_vertices[base+2]));
+  }
+  vec3f *points   = managedCopy(h_points);
+  vec3f *vertices = managedCopy(h_vertices);
+  vec3i *indices  = managedCopy(h_indices);
+  bvh3f *objects  = managedCopy(std::vector<bvh3f>{
+      buildBVH(pointBoxes(h_points)), buildBVH(triangleBoxes), bvh3f() });
+
+  const int numInstances = 600;
+  const std::vector<affine3f> xfms = randomTransforms(numInstances,0x4567);
+  Instance *instances = managedAlloc<Instance>(numInstances);
+  for (int i=0;i<numInstances;i++)
+    instances[i] = Instance::make(&objects[(i % 7 == 6) ? 2 : (i & 1)],xfms[i]);
+  TwoLevelBVH bvh;
+  gpuBuilder(bvh,instances,numInstances,BuildConfig(),0,managedMem());
+  CUBQL_CUDA_SYNC_CHECK();
+
+  // minScale: never more than what the transform actually scales
+  // by, and (up to its margin) exactly 1 for rigid transforms
+  std::vector<vec3f> directions = randomPoints<float,3>(1000,0x5678);
+  for (int i=0;i<numInstances;i++) {
+    for (auto dir : directions) {
+      dir = dir - vec3f(.5f);
+      CUBQL_TEST_CHECK(length(xfmVector(instances[i].xfm,dir))
+                       >= instances[i].minScale*length(dir));
+    }
+    if (i % 3 == 0)
+      CUBQL_TEST_CHECK(instances[i].minScale > .9999f && instances[i].minScale <= 1.f);
+  }
+
+  std::vector<vec3f> queries = randomPoints<float,3>(100,0x6789);
+  for (auto &query : queries)
+    query = 6.f*query - vec3f(1.f);
+  checkFCP(bvh,&objects[0],points,numPoints,queries);
+
+  // closest-hit and any-hit rays on the triangle instances; t values
+  // are the same in world and object space
+  std::vector<vec3f> origins    = randomPoints<float,3>(200,0x789a);
+  std::vector<vec3f> rayTargets = randomPoints<float,3>(200,0x89ab);
+  int numHits = 0;
+  for (size_t i=0;i<origins.size();i++) {
+    Ray ray;
+    ray.origin    = 6.f*origins[i] - vec3f(1.f);
+    ray.direction = 5.f*rayTargets[i] - vec3f(.5f) - ray.origin;
+
+    float closest = INFINITY;
+    for (int instanceID=0;instanceID<numInstances;instanceID++) {
+      const Instance &instance = instances[instanceID];
+      if (instance.object != &objects[1]) continue;
+      Ray objectRay = ray;
+      objectRay.origin    = xfmPoint(instance.invXfm,ray.origin);
+      objectRay.direction = xfmVector(instance.invXfm,ray.direction);
+      for (int j=0;j<numTriangles;j++) {
+        float t, u, v;
+        if (triangles::intersect(objectRay,triangles::getTriangle(indices,vertices,j),
+                                 ray.tMin,closest,t,u,v))
+          closest = t;
+      }
+    }
+    numHits += (closest < INFINITY);
+
+    float hitT = INFINITY;
+    int hitInstance = -1;
+    rayQuery_forEachPrim(bvh,ray,[&](int instanceID, const Ray &objectRay,
+                                     uint32_t primID)->float {
+      if (instances[instanceID].object != &objects[1]) return INFINITY;
+      float t, u, v;
+      if (triangles::intersect(objectRay,triangles::getTriangle(indices,vertices,primID),
+                               objectRay.tMin,objectRay.tMax,t,u,v)) {
+        hitT = t;
+        hitInstance = instanceID;
+      }
+      return hitT;
+    });
+    CUBQL_TEST_CHECK(hitT == closest);
+    CUBQL_TEST_CHECK((hitInstance >= 0) == (closest < INFINITY));
+
+    bool anyHit = false;
+    rayQuery_forEachPrim(bvh,ray,[&](int instanceID, const Ray &objectRay,
+                                     uint32_t primID)->float {
+      CUBQL_TEST_CHECK(!anyHit);
+      if (instances[instanceID].object != &objects[1]) return INFINITY;
+      float t, u, v;
+      if (!triangles::intersect(objectRay,triangles::getTriangle(indices,vertices,primID),
+                                objectRay.tMin,objectRay.tMax,t,u,v))
+        return INFINITY;
+      anyHit = true;
+      return -1.f;
+    });
+    CUBQL_TEST_CHECK(anyHit == (closest < INFINITY));
+  }
+  CUBQL_TEST_CHECK(numHits > 0);
+
+  // range queries: all world-space points inside a world-space box
+  for (auto center : queries) {
+    const box3f queryBox(center-vec3f(.3f),center+vec3f(.3f));
+    int expected = 0;
+    for (int instanceID=0;instanceID<numInstances;instanceID++) {
+      if (instances[instanceID].object != &objects[0]) continue;
+      for (int j=0;j<numPoints;j++)
+        expected += queryBox.overlaps(box3f(xfmPoint(instances[instanceID].xfm,points[j])));
+    }
+    int found = 0;
+    rangeQuery_forEachLeaf(bvh,queryBox,[&](int instanceID, const uint32_t *primIDs,
+                                            int numPrims)->int {
+      if (instances[instanceID].object != &objects[0]) return CUBQL_CONTINUE_TRAVERSAL;
+      for (int j=0;j<numPrims;j++)
+        found += queryBox.overlaps(box3f(xfmPoint(instances[instanceID].xfm,points[primIDs[j]])));
+      return CUBQL_CONTINUE_TRAVERSAL;
+    });
+    CUBQL_TEST_CHECK(found == expected);
+  }
+
+  // move all instances, then refit
+  for (int i=0;i<numInstances;i++)
+    instances[i] = Instance::make(instances[i].object,
+                                  affine3f::translate(vec3f(.5f,-1.f,2.f))
+                                  * affine3f::rotate(vec3f(0.f,0.f,1.f),.3f)
+                                  * instances[i].xfm);
+  refit(bvh,0,managedMem());
+  CUBQL_CUDA_SYNC_CHECK();
+  checkFCP(bvh,&objects[0],points,numPoints,queries);
+
+  free(bvh,0,managedMem());
+  freeBVH(objects[0]);
+  freeBVH(objects[1]);
+  managedFree(objects);
+  managedFree(instances);
+  managedFree(indices);
+  managedFree(vertices);
+  managedFree(points);
+  printf("test-instancing: all tests passed\n");
+  return 0;
+}
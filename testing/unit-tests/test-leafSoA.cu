@@ -0,0 +1,142 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+/*! checks the host-side SIMD closest-point queries in
+    points/leafSoA.h and triangles/leafSoA.h against brute force */
+
+#include "testRig.h"
+#include "cuBQL/points/leafSoA.h"
+#include "cuBQL/triangles/leafSoA.h"
+
+using namespace cuBQL;
+using namespace cuBQL::test_rig;
+
+void testPoints(int leafThreshold)
+{
+  const int numPoints = 10000;
+  const int numQueries = 1000;
+  std::vector<vec3f> points = randomPoints<float,3>(numPoints,0x1234);
+  std::vector<vec3f> queries = randomPoints<float,3>(numQueries,0x4321);
+
+  BuildConfig buildConfig;
+  buildConfig.makeLeafThreshold = leafThreshold;
+  bvh3f bvh = buildBVH(pointBoxes(points),buildConfig);
+  points::LeafSoA soa;
+  points::host::buildLeafSoA(soa,bvh,points.data());
+
+  std::vector<int> results(numQueries);
+  points::host::fcp(results.data(),queries.data(),numQueries,bvh,soa);
+  for (int i=0;i<numQueries;i++) {
+    float closest = INFINITY;
+    for (auto point : points)
+      closest = std::min(closest,fSqrDistance(point,queries[i]));
+    CUBQL_TEST_CHECK(results[i] >= 0);
+    CUBQL_TEST_CHECK(fSqrDistance(points[results[i]],queries[i]) == closest);
+
+    // with a max query distance that excludes the closest point, we
+    // must not get anything
+    CUBQL_TEST_CHECK(points::host::fcp(queries[i],bvh,soa,closest) == -1);
+  }
+
+  // each point's closest _other_ point
+  for (int i=0;i<numPoints;i+=10) {
+    float closest = INFINITY;
+    for (int j=0;j<numPoints;j++)
+      if (j != i)
+        closest = std::min(closest,fSqrDistance(points[j],points[i]));
+    int result = points::host::fcp_excluding(i,points[i],bvh,soa);
+    CUBQL_TEST_CHECK(result >= 0 && result != i);
+    CUBQL_TEST_CHECK(fSqrDistance(points[result],points[i]) == closest);
+  }
+  freeBVH(bvh);
+}
+
+void testTriangles(int leafThreshold)
+{
+  const int numTriangles = 4000;
+  const int numQueries = 1000;
+  std::vector<vec3f> corners = randomPoints<float,3>(numTriangles,0x2345);
+  std::vector<vec3f> offsets = randomPoints<float,3>(2*numTriangles,0x5432);
+  std::vector<vec3f> vertices;
+  std::vector<vec3i> indices;
+  std::vector<box3f> boxes;
+  for (int i=0;i<numTriangles;i++) {
+    int base = (int)vertices.size();
+    vertices.push_back(corners[i]);
+    vertices.push_back(corners[i]+.05f*(offsets[2*i+0]-vec3f(.5f)));
+    vertices.push_back(corners[i]+.05f*(offsets[2*i+1]-vec3f(.5f)));
+    // some degenerate ones, too
+    vec3i triangle(base,base+1,base+2);
+    if (i % 7 == 0) triangle.y = triangle.x;
+    if (i % 11 == 0) triangle.z = triangle.y;
+    if (i % 13 == 0)
+      vertices[base+2] = vertices[base+0] + 2.f*(vertices[base+1]-vertices[base+0]);
+    indices.push_back(triangle);
+    boxes.push_back(box3f()
+                    .including(vertices[triangle.x])
+                    .including(vertices[triangle.y])
+                    .including(vertices[triangle.z]));
+  }
+  std::vector<vec3f> queries = randomPoints<float,3>(numQueries,0x3456);
+
+  BuildConfig buildConfig;
+  buildConfig.makeLeafThreshold = leafThreshold;
+  bvh3f bvh = buildBVH(boxes,buildConfig);
+  triangles::LeafSoA soa;
+  triangles::host::buildLeafSoA(soa,bvh,indices.data(),vertices.data());
+
+  std::vector<triangles::FCPResult> results(numQueries);
+  triangles::host::fcp(results.data(),queries.data(),numQueries,bvh,soa);
+  for (int i=0;i<numQueries;i++) {
+    float closest = INFINITY;
+    for (int j=0;j<numTriangles;j++) {
+      triangles::Triangle triangle
+        = triangles::getTriangle(indices.data(),vertices.data(),j);
+      closest = std::min(closest,triangles::closestPoint(queries[i],triangle).sqrDistance);
+    }
+    const triangles::FCPResult &result = results[i];
+    CUBQL_TEST_CHECK(result.primID >= 0 && result.primID < numTriangles);
+    CUBQL_TEST_CHECK(fabsf(sqrtf(result.sqrDistance)-sqrtf(closest)) < 1e-5f);
+    float primDist
+      = triangles::closestPoint(queries[i],
+                                triangles::getTriangle(indices.data(),vertices.data(),
+                                                       result.primID)).sqrDistance;
+    CUBQL_TEST_CHECK(fabsf(sqrtf(primDist)-sqrtf(closest)) < 1e-5f);
+
+    // the surface point, barycentrics and feature of the winner
+    const triangles::Triangle triangle
+      = triangles::getTriangle(indices.data(),vertices.data(),result.primID);
+    const triangles::CPResult expected
+      = triangles::closestPoint(queries[i],triangles::PrecomputedTriangle::make(triangle));
+    CUBQL_TEST_CHECK(result.feature == expected.feature);
+    CUBQL_TEST_CHECK(result.point == expected.point);
+    CUBQL_TEST_CHECK(result.u == expected.u && result.v == expected.v);
+    CUBQL_TEST_CHECK(fabsf(result.sqrDistance-sqrDistance(queries[i],result.point)) < 1e-6f);
+  }
+  freeBVH(bvh);
+}
+
+int main(int, char **)
+{
+  // both with the leaf size the SIMD code is meant for, and with
+  // leaves that are much smaller or larger than a SIMD vector
+  for (int leafThreshold : { 1, (int)simd::width, 3*(int)simd::width }) {
+    testPoints(leafThreshold);
+    testTriangles(leafThreshold);
+  }
+  printf("test-leafSoA: all tests passed (simd width %i)\n",(int)simd::width);
+  return 0;
+}
@@ -0,0 +1,147 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+/*! checks the category-masked queries in queries/masked.h against
+    brute force, and that masked traversal never visits a leaf
+    without matching prims - not even with an unbounded search
+    radius */
+
+#include "testRig.h"
+#include "cuBQL/queries/masked.h"
+
+using namespace cuBQL;
+using namespace cuBQL::test_rig;
+
+__global__
+void maskedFCP(int                  *results,
+               const vec3f          *queries,
+               const uint64_t       *queryMasks,
+               int                   numQueries,
+               bvh3f                 bvh,
+               const vec3f          *points,
+               const CategoryMask64 *nodeMasks,
+               const CategoryMask64 *primMasks)
+{
+  int tid = threadIdx.x+blockIdx.x*blockDim.x;
+  if (tid >= numQueries) return;
+  float sqrMaxDist = INFINITY;
+  results[tid] = fcp_masked(bvh,points,nodeMasks,primMasks,queryMasks[tid],
+                            queries[tid],sqrMaxDist);
+}
+
+int main(int, char **)
+{
+  const int numPoints = 20000;
+  const int numQueries = 1000;
+  std::vector<vec3f> h_points = randomPoints<float,3>(numPoints,0x1234);
+  std::vector<vec3f> h_queries = randomPoints<float,3>(numQueries,0x4321);
+  std::mt19937 rng(0x2345);
+  // categories are spatially coherent (so that node masks actually
+  // cull something), but not entirely so
+  std::vector<CategoryMask64> h_primMasks(numPoints);
+  for (int i=0;i<numPoints;i++)
+    h_primMasks[i] = CategoryMask64::make(std::min(63,int(h_points[i].x*8)*8+int(rng()%8)));
+  std::vector<uint64_t> h_queryMasks(numQueries);
+  for (int i=0;i<numQueries;i++)
+    h_queryMasks[i]
+      = (i % 3 == 0)
+      ? (uint64_t(1) << (rng() % 64))
+      : (uint64_t(rng()) & (uint64_t(rng()) << 32));
+
+  vec3f *points = managedCopy(h_points);
+  vec3f *queries = managedCopy(h_queries);
+  uint64_t *queryMasks = managedCopy(h_queryMasks);
+  CategoryMask64 *primMasks = managedCopy(h_primMasks);
+  bvh3f bvh = buildBVH(pointBoxes(h_points));
+  CategoryMask64 *nodeMasks = managedAlloc<CategoryMask64>(bvh.numNodes);
+  computeAggregates(nodeMasks,bvh,primMasks,0,managedMem());
+  CUBQL_CUDA_SYNC_CHECK();
+
+  int *results = managedAlloc<int>(numQueries);
+  maskedFCP<<<divRoundUp(numQueries,128),128>>>
+    (results,queries,queryMasks,numQueries,bvh,points,nodeMasks,primMasks);
+  CUBQL_CUDA_SYNC_CHECK();
+
+  for (int i=0;i<numQueries;i++) {
+    const vec3f query = h_queries[i];
+    const uint64_t queryMask = h_queryMasks[i];
+    float closest = INFINITY;
+    for (int j=0;j<numPoints;j++)
+      if (h_primMasks[j].matches(queryMask))
+        closest = std::min(closest,fSqrDistance(h_points[j],query));
+
+    // device-side fcp
+    if (closest == INFINITY)
+      CUBQL_TEST_CHECK(results[i] == -1);
+    else
+      CUBQL_TEST_CHECK(results[i] >= 0
+                       && h_primMasks[results[i]].matches(queryMask)
+                       && fSqrDistance(h_points[results[i]],query) == closest);
+
+    // host-side fcp, with an unbounded and with a bounded radius
+    float sqrMaxDist = INFINITY;
+    int result = fcp_masked(bvh,points,nodeMasks,primMasks,queryMask,query,sqrMaxDist);
+    CUBQL_TEST_CHECK(sqrMaxDist == closest);
+    CUBQL_TEST_CHECK(closest == INFINITY || h_primMasks[result].matches(queryMask));
+    sqrMaxDist = closest;
+    CUBQL_TEST_CHECK(fcp_masked(bvh,points,nodeMasks,primMasks,queryMask,
+                                query,sqrMaxDist) == -1);
+
+    // with an unbounded radius, and a leaf callback that doesn't
+    // shrink it, every leaf with matching prims gets visited - but
+    // none without
+    int numMatchingVisited = 0;
+    maskedQuery_forEachLeaf(bvh,nodeMasks,queryMask,query,INFINITY,
+                            [&](const uint32_t *primIDs, int numPrims)->float {
+                              bool anyMatch = false;
+                              for (int j=0;j<numPrims;j++)
+                                if (h_primMasks[primIDs[j]].matches(queryMask)) {
+                                  anyMatch = true;
+                                  numMatchingVisited++;
+                                }
+                              CUBQL_TEST_CHECK(anyMatch);
+                              return INFINITY;
+                            });
+    int numMatching = 0;
+    for (int j=0;j<numPoints;j++)
+      numMatching += h_primMasks[j].matches(queryMask);
+    CUBQL_TEST_CHECK(numMatchingVisited == numMatching);
+
+    // range queries
+    const box3f queryBox(query-vec3f(.1f),query+vec3f(.1f));
+    const ball3f queryBall{ query, .15f };
+    int expectedInBox = 0, expectedInBall = 0;
+    for (int j=0;j<numPoints;j++) {
+      if (!h_primMasks[j].matches(queryMask)) continue;
+      expectedInBox  += queryBox.overlaps(box3f().including(h_points[j]));
+      expectedInBall += fSqrDistance(h_points[j],query) <= .15f*.15f;
+    }
+    CUBQL_TEST_CHECK(rangeQuery_masked_count(bvh,points,nodeMasks,primMasks,
+                                             queryMask,queryBox) == expectedInBox);
+    CUBQL_TEST_CHECK(rangeQuery_masked_count(bvh,points,nodeMasks,primMasks,
+                                             queryMask,queryBall) == expectedInBall);
+  }
+
+  managedFree(results);
+  managedFree(nodeMasks);
+  managedFree(primMasks);
+  managedFree(queryMasks);
+  managedFree(queries);
+  managedFree(points);
+  freeBVH(bvh);
+  printf("test-masked: all tests passed\n");
+  return 0;
+}
@@ -0,0 +1,313 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+
+/*! checks the OBJ and PLY loaders in io/meshFile.h: a small
+    hand-written OBJ (parsed with every possible chunk size), a large
+    random OBJ, ascii and binary PLYs of either endianness, and that
+    malformed files get rejected */
+
+#include "testRig.h"
+#include "cuBQL/io/meshFile.h"
+#include <fstream>
+#include <cstring>
+
+using namespace cuBQL;
+using namespace cuBQL::test_rig;
+
+void writeFile(const std::string &fileName, const std::string &contents)
+{
+  std::ofstream out(fileName,std::ios::binary);
+  out.write(contents.data(),contents.size());
+}
+
+template<typename Lambda>
+bool throws(const Lambda &lambda)
+{
+  try {
+    lambda();
+  } catch (const std::runtime_error &) {
+    return true;
+  }
+  return false;
+}
+
+bool sameMesh(const std::vector<vec3i> &indices,
+              const std::vector<vec3f> &vertices,
+              const std::vector<vec3i> &expectedIndices,
+              const std::vector<vec3f> &expectedVertices)
+{
+  return indices == expectedIndices && vertices == expectedVertices;
+}
+
+void testSmallOBJ()
+{
+  // comments, other line types, texture and normal indices, quads
+  // and pentagons, relative indices, CRLF line ends, blanks all
+  // over the place, and no newline at the end
+  const std::string obj
+    = "# a comment\n"
+    "mtllib foo.mtl\n"
+    "v 0 0 0\n"
+    "v 1.5 0 0 1\n"
+    "vt 0.5 0.5\n"
+    "vn 0 0 1\n"
+    "  v\t0 -2.5e1 .25\r\n"
+    "v 1 1 1e-3\n"
+    "\n"
+    "g group\n"
+    "f 1 2 3\n"
+    "f 1/1 2/1/1 3//1 4 # a quad\n"
+    "s off\n"
+    "v -1 -1 -1\n"
+    "f -1 -2 -3\r\n"
+    "f 5 4 3 2 1\n"
+    "l 1 2\n"
+    "f 1 2";
+  const std::vector<vec3f> expectedVertices = {
+    vec3f(0.f,0.f,0.f), vec3f(1.5f,0.f,0.f), vec3f(0.f,-25.f,.25f),
+    vec3f(1.f,1.f,1e-3f), vec3f(-1.f,-1.f,-1.f)
+  };
+  const std::vector<vec3i> expectedIndices = {
+    vec3i(0,1,2),
+    vec3i(0,1,2), vec3i(0,2,3),
+    vec3i(4,3,2),
+    vec3i(4,3,2), vec3i(4,2,1), vec3i(4,1,0)
+  };
+  // every chunk size, from one chunk per byte to a single chunk
+  for (size_t chunkSize=1;chunkSize<=obj.size();chunkSize++) {
+    std::vector<vec3i> indices;
+    std::vector<vec3f> vertices;
+    meshFile_impl::parseOBJ(indices,vertices,obj.data(),obj.data()+obj.size(),
+                            chunkSize,"test");
+    CUBQL_TEST_CHECK(sameMesh(indices,vertices,expectedIndices,expectedVertices));
+  }
+  std::vector<vec3i> indices;
+  std::vector<vec3f> vertices;
+  writeFile("test-meshFile.obj",obj);
+  host::loadTriangleMesh(indices,vertices,"test-meshFile.obj");
+  CUBQL_TEST_CHECK(sameMesh(indices,vertices,expectedIndices,expectedVertices));
+
+  // malformed ones
+  auto malformed = [](const std::string &obj) {
+    return throws([&]() {
+      std::vector<vec3i> indices;
+      std::vector<vec3f> vertices;
+      meshFile_impl::parseOBJ(indices,vertices,obj.data(),obj.data()+obj.size(),
+                              4,"test");
+    });
+  };
+  CUBQL_TEST_CHECK(!malformed("v 0 0 0\nv 1 0 0\nv 0 1 0\nf 1 2 3\n"));
+  CUBQL_TEST_CHECK(malformed("v 0 0 0\nv 1 0 0\nv 0 1 0\nf 1 2 4\n"));
+  CUBQL_TEST_CHECK(malformed("v 0 0 0\nv 1 0 0\nv 0 1 0\nf 0 1 2\n"));
+  CUBQL_TEST_CHECK(malformed("v 0 0 0\nv 1 0 0\nf -1 -2 -3\nv 0 1 0\n"));
+  CUBQL_TEST_CHECK(malformed("v 0 0 0\nv 1 0\nv 0 1 0\n"));
+  CUBQL_TEST_CHECK(malformed("v 0 0 0\nv 1 0 0\nv 0 1 0\nf 1 2 x\n"));
+  try {
+    const std::string obj = "v 0 0 0\n\nv 1 0 0\nf 1 2 3\n";
+    meshFile_impl::parseOBJ(indices,vertices,obj.data(),obj.data()+obj.size(),
+                            1<<20,"test");
+    CUBQL_TEST_CHECK(false);
+  } catch (const std::runtime_error &e) {
+    CUBQL_TEST_CHECK(strstr(e.what(),"line 4") != 0);
+  }
+}
+
+/*! a random mesh of triangles and quads, with relative and absolute
+    indices, large enough to get split into many chunks */
+void testLargeOBJ()
+{
+  const int numVertices = 300000;
+  std::vector<vec3f> expectedVertices
+    = randomPoints<float,3>(numVertices,0x1234);
+  for (auto &v : expectedVertices)
+    v = 2000.f*v - vec3f(1000.f);
+  std::vector<vec3i> expectedIndices;
+  std::mt19937 rng(0x4321);
+  std::string obj;
+  char line[200];
+  for (int i=0;i<numVertices;i++) {
+    const vec3f v = expectedVertices[i];
+    snprintf(line,sizeof(line),"v %.9g %.9g %.9g\n",v.x,v.y,v.z);
+    obj += line;
+    if (i < 4 || i % 3 != 0) continue;
+    int corners[4];
+    for (int j=0;j<4;j++) corners[j] = int(rng() % (i+1));
+    const bool relative = (rng() % 2 == 0);
+    const int numCorners = (rng() % 2 == 0) ? 3 : 4;
+    obj += "f";
+    for (int j=0;j<numCorners;j++) {
+      snprintf(line,sizeof(line)," %i/%i",
+               relative ? corners[j]-(i+1) : corners[j]+1,j+1);
+      obj += line;
+    }
+    obj += "\n";
+    expectedIndices.push_back(vec3i(corners[0],corners[1],corners[2]));
+    if (numCorners == 4)
+      expectedIndices.push_back(vec3i(corners[0],corners[2],corners[3]));
+  }
+  CUBQL_TEST_CHECK(obj.size() > (size_t(8) << 20));
+  writeFile("test-meshFile.obj",obj);
+  std::vector<vec3i> indices;
+  std::vector<vec3f> vertices;
+  host::loadOBJ(indices,vertices,"test-meshFile.obj");
+  CUBQL_TEST_CHECK(sameMesh(indices,vertices,expectedIndices,expectedVertices));
+  std::remove("test-meshFile.obj");
+}
+
+/*! appends the given value to a binary PLY body */
+template<typename T>
+void put(std::string &body, T value, bool bigEndian)
+{
+  char bytes[sizeof(T)];
+  memcpy(bytes,&value,sizeof(T));
+  for (int i=0;i<(int)sizeof(T);i++)
+    body += bytes[bigEndian ? sizeof(T)-1-i : i];
+}
+
+/*! writes the given polygons (and some other elements and
+    properties the loader has to skip) as a PLY file of the given
+    format. With 'vertexList', the vertex records have a list
+    property, so they are not of fixed size */
+std::string makePLY(const std::vector<vec3f> &vertices,
+                    const std::vector<std::vector<int>> &polygons,
+                    const std::string &format,
+                    bool vertexList)
+{
+  std::string ply
+    = "ply\r\n"
+    "format "+format+" 1.0\r\n"
+    "comment made by test-meshFile\r\n"
+    "element material 2\r\n"
+    "property uchar red\r\n"
+    "property list uchar double values\r\n"
+    "element vertex "+std::to_string(vertices.size())+"\r\n"
+    "property double z\r\n"
+    "property short flags\r\n"
+    "property float y\r\n"
+    "property float x\r\n"
+    + (vertexList ? "property list ushort int neighbors\r\n" : "")
+    + "element face "+std::to_string(polygons.size())+"\r\n"
+    "property uchar quality\r\n"
+    "property list uchar uint vertex_indices\r\n"
+    "property list int float uvs\r\n"
+    "element edge 1\r\n"
+    "property int vertex1\r\n"
+    "property int vertex2\r\n"
+    "end_header\r\n";
+  if (format == "ascii") {
+    char line[200];
+    ply += "255 3 1 2 3\n0 0\n";
+    for (auto v : vertices) {
+      snprintf(line,sizeof(line),"%.17g -3 %.9g %.9g",double(v.z),v.y,v.x);
+      ply += line;
+      ply += vertexList ? " 2 7 8\n" : "\n";
+    }
+    for (auto &polygon : polygons) {
+      ply += "9 "+std::to_string(polygon.size());
+      for (int idx : polygon) ply += " "+std::to_string(idx);
+      ply += " 2 .5 .25\n";
+    }
+    ply += "0 1\n";
+    return ply;
+  }
+  const bool bigEndian = (format == "binary_big_endian");
+  put<uint8_t>(ply,255,bigEndian);
+  put<uint8_t>(ply,3,bigEndian);
+  for (double d : { 1., 2., 3. }) put(ply,d,bigEndian);
+  put<uint8_t>(ply,0,bigEndian);
+  put<uint8_t>(ply,0,bigEndian);
+  for (auto v : vertices) {
+    put<double>(ply,v.z,bigEndian);
+    put<int16_t>(ply,-3,bigEndian);
+    put<float>(ply,v.y,bigEndian);
+    put<float>(ply,v.x,bigEndian);
+    if (vertexList) {
+      put<uint16_t>(ply,2,bigEndian);
+      put<int32_t>(ply,7,bigEndian);
+      put<int32_t>(ply,8,bigEndian);
+    }
+  }
+  for (auto &polygon : polygons) {
+    put<uint8_t>(ply,9,bigEndian);
+    put<uint8_t>(ply,(uint8_t)polygon.size(),bigEndian);
+    for (int idx : polygon) put<uint32_t>(ply,idx,bigEndian);
+    put<int32_t>(ply,2,bigEndian);
+    put<float>(ply,.5f,bigEndian);
+    put<float>(ply,.25f,bigEndian);
+  }
+  put<int32_t>(ply,0,bigEndian);
+  put<int32_t>(ply,1,bigEndian);
+  return ply;
+}
+
+void testPLY()
+{
+  const int numVertices = 5000;
+  std::vector<vec3f> expectedVertices
+    = randomPoints<float,3>(numVertices,0x2345);
+  std::vector<std::vector<int>> polygons;
+  std::vector<vec3i> expectedIndices;
+  std::mt19937 rng(0x5432);
+  for (int i=0;i<2*numVertices;i++) {
+    std::vector<int> polygon(rng() % 6);
+    for (auto &idx : polygon) idx = int(rng() % numVertices);
+    for (int j=2;j<(int)polygon.size();j++)
+      expectedIndices.push_back(vec3i(polygon[0],polygon[j-1],polygon[j]));
+    polygons.push_back(polygon);
+  }
+
+  for (std::string format : { "ascii", "binary_little_endian", "binary_big_endian" })
+    for (bool vertexList : { false, true }) {
+      const std::string ply = makePLY(expectedVertices,polygons,format,vertexList);
+      writeFile("test-meshFile.ply",ply);
+      std::vector<vec3i> indices;
+      std::vector<vec3f> vertices;
+      host::loadTriangleMesh(indices,vertices,"test-meshFile.ply");
+      CUBQL_TEST_CHECK(sameMesh(indices,vertices,expectedIndices,expectedVertices));
+
+      // truncated, and with an out-of-range vertex index
+      writeFile("test-meshFile.ply",ply.substr(0,ply.size()-10));
+      CUBQL_TEST_CHECK(throws([&]() {
+        host::loadPLY(indices,vertices,"test-meshFile.ply");
+      }));
+      std::vector<std::vector<int>> invalid = polygons;
+      invalid[7] = { 0, 1, numVertices };
+      writeFile("test-meshFile.ply",makePLY(expectedVertices,invalid,format,vertexList));
+      CUBQL_TEST_CHECK(throws([&]() {
+        host::loadPLY(indices,vertices,"test-meshFile.ply");
+      }));
+    }
+  writeFile("test-meshFile.ply","ply\nformat binary_middle_endian 1.0\nend_header\n");
+  std::vector<vec3i> indices;
+  std::vector<vec3f> vertices;
+  CUBQL_TEST_CHECK(throws([&]() {
+    host::loadPLY(indices,vertices,"test-meshFile.ply");
+  }));
+  std::remove("test-meshFile.ply");
+  CUBQL_TEST_CHECK(throws([&]() {
+    host::loadTriangleMesh(indices,vertices,"test-meshFile.stl");
+  }));
+}
+
+int main(int, char **)
+{
+  testSmallOBJ();
+  testLargeOBJ();
+  testPLY();
+  printf("test-meshFile: all tests passed\n");
+  return 0;
+}
@@ -0,0 +1,138 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+/*! checks that NearestIterator (queries/nearestIterator.h) returns
+    prims in non-decreasing distance order, and exactly the
+    brute-force sequence of distances - on host and device, for
+    points and boxes, and with and without heap truncation */
+
+#include "testRig.h"
+#include "cuBQL/queries/nearestIterator.h"
+#include <algorithm>
+
+using namespace cuBQL;
+using namespace cuBQL::test_rig;
+
+/*! number of results each query asks for */
+const int maxResults = 200;
+
+template<typename prim_t, int HeapSize>
+inline __cubql_both
+int iterate(float *dists, uint32_t *primIDs, bool &truncated,
+            bvh3f bvh, const prim_t *prims, vec3f query, float sqrMaxDist)
+{
+  NearestIterator<prim_t,HeapSize> it(bvh,prims,query,sqrMaxDist);
+  int numFound = 0;
+  while (numFound < maxResults && it.next(primIDs[numFound],dists[numFound]))
+    numFound++;
+  truncated = it.wasTruncated();
+  return numFound;
+}
+
+template<typename prim_t, int HeapSize>
+__global__
+void iterateKernel(int *numFound, float *dists, uint32_t *primIDs, bool *truncated,
+                   const vec3f *queries, int numQueries,
+                   bvh3f bvh, const prim_t *prims, float sqrMaxDist)
+{
+  int tid = threadIdx.x+blockIdx.x*blockDim.x;
+  if (tid >= numQueries) return;
+  numFound[tid] = iterate<prim_t,HeapSize>(dists+tid*maxResults,primIDs+tid*maxResults,
+                                           truncated[tid],bvh,prims,queries[tid],sqrMaxDist);
+}
+
+template<typename prim_t>
+void checkQuery(const float *dists, const uint32_t *primIDs, int numFound, bool truncated,
+                const std::vector<prim_t> &prims, vec3f query, float sqrMaxDist)
+{
+  std::vector<float> expected;
+  for (auto prim : prims) {
+    float dist = nearestIterator_impl::primSqrDistance(prim,query);
+    if (dist <= sqrMaxDist) expected.push_back(dist);
+  }
+  std::sort(expected.begin(),expected.end());
+  CUBQL_TEST_CHECK(numFound <= (int)expected.size());
+  if (!truncated)
+    CUBQL_TEST_CHECK(numFound == std::min(maxResults,(int)expected.size()));
+  for (int i=0;i<numFound;i++) {
+    CUBQL_TEST_CHECK(i == 0 || dists[i] >= dists[i-1]);
+    CUBQL_TEST_CHECK(dists[i] == expected[i]);
+    CUBQL_TEST_CHECK(primIDs[i] < prims.size());
+    CUBQL_TEST_CHECK(nearestIterator_impl::primSqrDistance(prims[primIDs[i]],query)
+                     == dists[i]);
+  }
+}
+
+template<typename prim_t, int HeapSize>
+void testIterator(const std::vector<prim_t> &h_prims,
+                  const std::vector<box3f>  &boxes,
+                  float                      sqrMaxDist)
+{
+  const int numQueries = 500;
+  const prim_t *prims = managedCopy(h_prims);
+  bvh3f bvh = buildBVH(boxes);
+  std::vector<vec3f> h_queries = randomPoints<float,3>(numQueries,0x4321);
+  const vec3f *queries = managedCopy(h_queries);
+
+  int      *numFound  = managedAlloc<int>(numQueries);
+  bool     *truncated = managedAlloc<bool>(numQueries);
+  float    *dists     = managedAlloc<float>(numQueries*maxResults);
+  uint32_t *primIDs   = managedAlloc<uint32_t>(numQueries*maxResults);
+  iterateKernel<prim_t,HeapSize><<<divRoundUp(numQueries,128),128>>>
+    (numFound,dists,primIDs,truncated,queries,numQueries,bvh,prims,sqrMaxDist);
+  CUBQL_CUDA_SYNC_CHECK();
+  int numTruncated = 0;
+  for (int i=0;i<numQueries;i++) {
+    checkQuery(dists+i*maxResults,primIDs+i*maxResults,numFound[i],truncated[i],
+               h_prims,h_queries[i],sqrMaxDist);
+    numTruncated += truncated[i];
+
+    // same on the host
+    bool hostTruncated;
+    int hostFound = iterate<prim_t,HeapSize>(dists,primIDs,hostTruncated,
+                                             bvh,prims,h_queries[i],sqrMaxDist);
+    CUBQL_TEST_CHECK(hostFound == numFound[i] && hostTruncated == truncated[i]);
+    checkQuery(dists,primIDs,hostFound,hostTruncated,h_prims,h_queries[i],sqrMaxDist);
+  }
+  // with a tiny heap and no radius limit we want to see truncation
+  // being handled, with a large heap and small radius we don't
+  if (HeapSize < 16 && sqrMaxDist == INFINITY)
+    CUBQL_TEST_CHECK(numTruncated > 0);
+  if (HeapSize >= 64 && sqrMaxDist < 1.f)
+    CUBQL_TEST_CHECK(numTruncated == 0);
+
+  managedFree(primIDs);
+  managedFree(dists);
+  managedFree(truncated);
+  managedFree(numFound);
+  managedFree(queries);
+  freeBVH(bvh);
+  managedFree(prims);
+}
+
+int main(int, char **)
+{
+  std::vector<vec3f> points = randomPoints<float,3>(10000,0x1234);
+  std::vector<box3f> boxes  = randomBoxes<float,3>(5000,0x2345,.02f);
+  testIterator<vec3f,64>(points,pointBoxes(points),.05f*.05f);
+  testIterator<vec3f,64>(points,pointBoxes(points),INFINITY);
+  testIterator<vec3f,8>(points,pointBoxes(points),INFINITY);
+  testIterator<box3f,64>(boxes,boxes,.05f*.05f);
+  testIterator<box3f,64>(boxes,boxes,INFINITY);
+  testIterator<box3f,8>(boxes,boxes,INFINITY);
+  printf("test-nearestIterator: all tests passed\n");
+  return 0;
+}
@@ -0,0 +1,177 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+
+/*! checks buildOutOfCore() from io/outOfCore.h: that the BVH file
+    it writes loads through MappedBVH, references every valid box
+    exactly once (and no invalid one), has consistent bounds, and
+    answers queries the same as brute force - with chunks that are
+    much smaller than the input (including a cell that has to get
+    split across several chunks), and with a single chunk */
+
+#include "testRig.h"
+#include "cuBQL/io/outOfCore.h"
+#include "cuBQL/queries/shrinkingRadiusQuery.h"
+#include <fstream>
+
+using namespace cuBQL;
+using namespace cuBQL::test_rig;
+
+bool contains(const box3f &outer, const box3f &inner)
+{
+  for (int d=0;d<3;d++)
+    if (inner.lower[d] < outer.lower[d] || inner.upper[d] > outer.upper[d])
+      return false;
+  return true;
+}
+
+/*! checks the BVH's structure, and that it references exactly the
+    valid boxes, once each */
+void checkStructure(const bvh3f &bvh, const std::vector<box3f> &boxes)
+{
+  std::vector<int> numRefs(boxes.size(),0);
+  int numVisited = 0;
+  std::vector<uint32_t> stack = { 0 };
+  while (!stack.empty()) {
+    const bvh3f::Node node = bvh.nodes[stack.back()];
+    stack.pop_back();
+    numVisited++;
+    if (node.admin.count == 0) {
+      CUBQL_TEST_CHECK(node.admin.offset % 2 == 0);
+      CUBQL_TEST_CHECK(node.admin.offset+1 < bvh.numNodes);
+      for (int i=0;i<2;i++) {
+        const box3f child = bvh.nodes[node.admin.offset+i].bounds;
+        CUBQL_TEST_CHECK(contains(node.bounds,child));
+        stack.push_back(uint32_t(node.admin.offset+i));
+      }
+      continue;
+    }
+    CUBQL_TEST_CHECK(node.admin.offset+node.admin.count <= bvh.numPrims);
+    for (int i=0;i<(int)node.admin.count;i++) {
+      const uint32_t primID = bvh.primIDs[node.admin.offset+i];
+      CUBQL_TEST_CHECK(primID < boxes.size());
+      numRefs[primID]++;
+      CUBQL_TEST_CHECK(contains(node.bounds,boxes[primID]));
+    }
+  }
+  // every node but the unused node 1
+  CUBQL_TEST_CHECK(numVisited == (int)bvh.numNodes-1);
+  for (size_t i=0;i<boxes.size();i++)
+    CUBQL_TEST_CHECK(numRefs[i] == (boxes[i].empty() ? 0 : 1));
+}
+
+/*! checks that chunks are no larger than allowed, and only split
+    cells that are */
+void testMakeChunks()
+{
+  const uint64_t counts[] = { 0, 500, 2500, 300, 300, 0, 900, 1000, 1, 0 };
+  std::vector<uint64_t> cellBegin = { 0 };
+  for (auto count : counts)
+    cellBegin.push_back(cellBegin.back()+count);
+  const std::vector<uint64_t> chunkBegin = chunkedBuilder_impl::makeChunks(cellBegin,1000);
+  CUBQL_TEST_CHECK(chunkBegin.front() == 0 && chunkBegin.back() == cellBegin.back());
+  for (size_t i=0;i+1<chunkBegin.size();i++) {
+    CUBQL_TEST_CHECK(chunkBegin[i] < chunkBegin[i+1]);
+    CUBQL_TEST_CHECK(chunkBegin[i+1]-chunkBegin[i] <= 1000);
+    const bool atCellBoundary
+      = std::find(cellBegin.begin(),cellBegin.end(),chunkBegin[i]) != cellBegin.end();
+    // only the cell with 2500 prims may get split
+    CUBQL_TEST_CHECK(atCellBoundary || (chunkBegin[i] > 500 && chunkBegin[i] < 3000));
+  }
+  // 500 | 2500 (in three) | 300+300 | 900 | 1000 | 1
+  CUBQL_TEST_CHECK(chunkBegin.size() == 9);
+}
+
+int main(int, char **)
+{
+  testMakeChunks();
+
+  const std::string boxesFileName = "test-outOfCore.boxes";
+  const std::string bvhFileName = "test-outOfCore.bvh";
+  std::vector<box3f> boxes = randomBoxes<float,3>(100000,0x1234,.01f);
+  // some invalid ones, and a cluster of identical ones that is larger
+  // than a chunk
+  for (size_t i=0;i<boxes.size();i+=97)
+    boxes[i] = box3f();
+  for (int i=0;i<3000;i++)
+    boxes.push_back(box3f(vec3f(.5f),vec3f(.5f)));
+  int numValid = 0;
+  for (auto box : boxes)
+    numValid += !box.empty();
+  {
+    std::ofstream out(boxesFileName,std::ios::binary);
+    out.write((const char *)boxes.data(),boxes.size()*sizeof(box3f));
+  }
+  std::vector<vec3f> queries = randomPoints<float,3>(500,0x4321);
+
+  for (size_t maxPrimsPerChunk : { size_t(1000), size_t(1)<<24 }) {
+    BuildConfig buildConfig;
+    buildConfig.makeLeafThreshold = 4;
+    buildOutOfCore<float,3>(bvhFileName,boxesFileName,buildConfig,
+                            maxPrimsPerChunk,0,managedMem());
+    MappedBVH<bvh3f> loaded(bvhFileName);
+    const bvh3f &bvh = loaded.bvh;
+    CUBQL_TEST_CHECK(loaded.buildConfig.makeLeafThreshold == 4);
+    CUBQL_TEST_CHECK((int)bvh.numPrims == numValid);
+    checkStructure(bvh,boxes);
+    if (maxPrimsPerChunk < boxes.size())
+      // at least one top-level node per chunk
+      CUBQL_TEST_CHECK(bvh.numNodes > 2*numValid/maxPrimsPerChunk);
+
+    for (auto query : queries) {
+      float closest = INFINITY;
+      for (auto box : boxes)
+        if (!box.empty())
+          closest = std::min(closest,fSqrDistance(box,query));
+      float found = INFINITY;
+      shrinkingRadiusQuery_forEachPrim(bvh,query,INFINITY,
+                                       [&](uint32_t primID)->float {
+                                         found = std::min(found,fSqrDistance(boxes[primID],query));
+                                         return found;
+                                       });
+      CUBQL_TEST_CHECK(found == closest);
+    }
+  }
+  // no temporary files left behind
+  CUBQL_TEST_CHECK(!std::ifstream(bvhFileName+".partition.tmp"));
+  CUBQL_TEST_CHECK(!std::ifstream(bvhFileName+".tmp"));
+
+  // a file that is not a box array, and one without valid boxes
+  {
+    std::ofstream out(boxesFileName,std::ios::binary);
+    out.write((const char *)boxes.data(),sizeof(box3f)+1);
+  }
+  bool threw = false;
+  try {
+    buildOutOfCore<float,3>(bvhFileName,boxesFileName);
+  } catch (const std::runtime_error &) { threw = true; }
+  CUBQL_TEST_CHECK(threw);
+  {
+    const box3f invalid[2];
+    std::ofstream out(boxesFileName,std::ios::binary);
+    out.write((const char *)invalid,sizeof(invalid));
+  }
+  threw = false;
+  try {
+    buildOutOfCore<float,3>(bvhFileName,boxesFileName);
+  } catch (const std::runtime_error &) { threw = true; }
+  CUBQL_TEST_CHECK(threw);
+  
+  std::remove(boxesFileName.c_str());
+  std::remove(bvhFileName.c_str());
+  printf("test-outOfCore: all tests passed\n");
+  return 0;
+}
@@ -0,0 +1,176 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+
+/*! checks PagedBVH from io/pagedBVH.h: that queries over a paged
+    BVH - with a page cache much smaller than the file, and with one
+    large enough to hold all of it - give the same results as brute
+    force, that the cache stays within its limit, that the pages it
+    copied do not stay resident through the file mapping either, and
+    that savePagedBVH() writes a valid BVH with the resident levels
+    up front */
+
+#include "testRig.h"
+#include "cuBQL/io/pagedBVH.h"
+#include <fstream>
+
+using namespace cuBQL;
+using namespace cuBQL::test_rig;
+
+/*! number of nodes in the top numLevels levels of the given BVH */
+int countTopNodes(const bvh3f &bvh, int numLevels)
+{
+  int count = 0;
+  std::vector<uint32_t> level = { 0 };
+  for (int depth=0;depth<numLevels && !level.empty();depth++) {
+    std::vector<uint32_t> nextLevel;
+    for (auto nodeID : level) {
+      count++;
+      const bvh3f::Node node = bvh.nodes[nodeID];
+      if (node.admin.count == 0) {
+        nextLevel.push_back(uint32_t(node.admin.offset+0));
+        nextLevel.push_back(uint32_t(node.admin.offset+1));
+      }
+    }
+    level.swap(nextLevel);
+  }
+  return count;
+}
+
+/*! the (sorted) primIDs of all leaves, as reached from the root */
+std::vector<uint32_t> collectPrims(const bvh3f &bvh)
+{
+  std::vector<uint32_t> prims, stack = { 0 };
+  while (!stack.empty()) {
+    const bvh3f::Node node = bvh.nodes[stack.back()];
+    stack.pop_back();
+    if (node.admin.count == 0) {
+      CUBQL_TEST_CHECK(node.admin.offset % 2 == 0);
+      stack.push_back(uint32_t(node.admin.offset+0));
+      stack.push_back(uint32_t(node.admin.offset+1));
+    } else
+      for (int i=0;i<(int)node.admin.count;i++)
+        prims.push_back(bvh.primIDs[node.admin.offset+i]);
+  }
+  std::sort(prims.begin(),prims.end());
+  return prims;
+}
+
+/*! number of bytes of file-backed memory (ie, mapped files) that are
+    currently resident in this process; always 0 where we cannot tell */
+size_t residentFileBytes()
+{
+#ifdef __linux__
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status,line))
+    if (line.compare(0,8,"RssFile:") == 0)
+      return size_t(std::stoull(line.substr(8)))*1024;
+#endif
+  return 0;
+}
+
+/*! runs queries over the given file, and returns the number of page
+    misses they caused */
+size_t testQueries(const std::string &fileName,
+                 int numResidentLevels,
+                 size_t maxCachedPages,
+                 const std::vector<vec3f> &points)
+{
+  const size_t residentBefore = residentFileBytes();
+  PagedBVH<float,3> paged(fileName,numResidentLevels,maxCachedPages);
+  CUBQL_TEST_CHECK(paged.numPrims == points.size());
+
+  std::vector<vec3f> queries = randomPoints<float,3>(300,0x4321);
+  for (auto query : queries) {
+    float closest = INFINITY;
+    for (auto point : points)
+      closest = std::min(closest,fSqrDistance(point,query));
+    float found = INFINITY;
+    shrinkingRadiusQuery_forEachPrim(paged,query,INFINITY,[&](uint32_t primID) {
+      found = std::min(found,fSqrDistance(points[primID],query));
+      return found;
+    });
+    CUBQL_TEST_CHECK(found == closest);
+
+    const box3f queryBox(query-vec3f(.02f),query+vec3f(.02f));
+    int expected = 0;
+    for (auto point : points)
+      expected += queryBox.overlaps(box3f(point,point));
+    int numFound = 0;
+    fixedBoxQuery_forEachPrim(paged,queryBox,[&](uint32_t primID) {
+      numFound += queryBox.overlaps(box3f(points[primID],points[primID]));
+    });
+    CUBQL_TEST_CHECK(numFound == expected);
+    CUBQL_TEST_CHECK(paged.numCachedPages() <= maxCachedPages);
+  }
+  CUBQL_TEST_CHECK(paged.stats.pageMisses > 0);
+  CUBQL_TEST_CHECK(paged.stats.pageHits > 0);
+  CUBQL_TEST_CHECK(numResidentLevels <= 1 || paged.stats.residentHits > 0);
+  // without eviction, each page gets fetched exactly once
+  CUBQL_TEST_CHECK(paged.stats.evictions > 0
+                   || paged.stats.pageMisses == paged.numCachedPages());
+  // every page gets released from the file mapping once it is copied
+  // into the cache, so (other than code pages the queries may have
+  // faulted in) the resident memory of the mapping must not have grown
+  CUBQL_TEST_CHECK(residentFileBytes() <= residentBefore + 64*BVHFileHeader::alignment);
+  return paged.stats.pageMisses;
+}
+
+int main(int, char **)
+{
+  const int numPoints = 200000;
+  const int numResidentLevels = 6;
+  const std::string fileName = "test-pagedBVH.bvh";
+  std::vector<vec3f> points = randomPoints<float,3>(numPoints,0x1234);
+  BuildConfig buildConfig;
+  buildConfig.makeLeafThreshold = 4;
+  bvh3f bvh = buildBVH(pointBoxes(points),buildConfig);
+  std::vector<uint32_t> prims = collectPrims(bvh);
+  size_t numMisses[2];
+
+  for (bool pagedLayout : { true, false }) {
+    if (pagedLayout) 
+      savePagedBVH(fileName,bvh,buildConfig,numResidentLevels);
+    else
+      saveBVH(fileName,bvh,buildConfig);
+    size_t fileSize = 0;
+    {
+      MappedBVH<bvh3f> loaded(fileName);
+      CUBQL_TEST_CHECK(collectPrims(loaded.bvh) == prims);
+      fileSize = loaded.bvh.numNodes*sizeof(bvh3f::Node);
+      if (pagedLayout) {
+        PagedBVH<float,3> paged(fileName,numResidentLevels,1);
+        // the resident levels, plus the unused node 1
+        CUBQL_TEST_CHECK((int)paged.numResidentNodes
+                         == countTopNodes(loaded.bvh,numResidentLevels)+1);
+      }
+    }
+    // a cache that is a small fraction of the file, one that holds all
+    // of it, and no resident levels at all
+    const size_t smallCache = 8;
+    CUBQL_TEST_CHECK(fileSize > 20*smallCache*BVHFileHeader::alignment);
+    numMisses[pagedLayout] = testQueries(fileName,numResidentLevels,smallCache,points);
+    testQueries(fileName,numResidentLevels,size_t(1)<<20,points);
+    testQueries(fileName,0,1,points);
+  }
+  // treelets have to pay off
+  CUBQL_TEST_CHECK(numMisses[true] < numMisses[false]);
+  std::remove(fileName.c_str());
+  freeBVH(bvh);
+  printf("test-pagedBVH: all tests passed\n");
+  return 0;
+}
@@ -0,0 +1,219 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+/*! checks fcp() on precomputed triangles (triangles/precomputed.h),
+    in both PRIM_ORDER and LEAF_ORDER layouts and as both AoS and
+    SoA, against the reference fcp() on indices and vertices,
+    including the closest point, barycentrics and feature they
+    report */
+
+#include "testRig.h"
+#include "cuBQL/triangles/precomputed.h"
+
+using namespace cuBQL;
+using namespace cuBQL::test_rig;
+using namespace cuBQL::triangles;
+
+__global__
+void referenceQueries(FCPResult   *results,
+                      const vec3f *queries,
+                      int          numQueries,
+                      bvh3f        bvh,
+                      const vec3i *indices,
+                      const vec3f *vertices)
+{
+  int tid = threadIdx.x+blockIdx.x*blockDim.x;
+  if (tid >= numQueries) return;
+  results[tid].clear(INFINITY);
+  triangles::fcp(results[tid],queries[tid],bvh,indices,vertices);
+}
+
+template<typename PrecomputedArray>
+__global__
+void precomputedQueries(FCPResult             *results,
+                        const vec3f           *queries,
+                        int                    numQueries,
+                        bvh3f                  bvh,
+                        const PrecomputedArray triangles,
+                        PrecomputedLayout      layout)
+{
+  int tid = threadIdx.x+blockIdx.x*blockDim.x;
+  if (tid >= numQueries) return;
+  results[tid].clear(INFINITY);
+  triangles::fcp(results[tid],queries[tid],bvh,triangles,layout);
+}
+
+/*! checks that the closest point, barycentrics and feature in
+    'result' are the ones of its own triangle */
+void checkSurfacePoint(const FCPResult &result,
+                       const vec3f      query,
+                       const vec3i     *indices,
+                       const vec3f     *vertices)
+{
+  const Triangle triangle = getTriangle(indices,vertices,result.primID);
+  const CPResult expected
+    = closestPoint(query,PrecomputedTriangle::make(triangle));
+  CUBQL_TEST_CHECK(result.feature == expected.feature);
+  CUBQL_TEST_CHECK(sqrDistance(result.point,expected.point) < 1e-10f);
+  const vec3f fromUV
+    = triangle.a
+    + result.u*(triangle.b-triangle.a)
+    + result.v*(triangle.c-triangle.a);
+  CUBQL_TEST_CHECK(sqrDistance(fromUV,result.point) < 1e-10f);
+  CUBQL_TEST_CHECK(fabsf(result.sqrDistance-sqrDistance(query,result.point)) < 1e-6f);
+}
+
+/*! checks the given results against the reference results; the
+    primIDs may differ where two triangles are equally close */
+void checkResults(const FCPResult *results,
+                  const FCPResult *reference,
+                  int              numQueries,
+                  const vec3f     *queries,
+                  const vec3i     *indices,
+                  const vec3f     *vertices)
+{
+  for (int i=0;i<numQueries;i++) {
+    CUBQL_TEST_CHECK(results[i].primID >= 0);
+    CUBQL_TEST_CHECK(fabsf(sqrtf(results[i].sqrDistance)
+                           -sqrtf(reference[i].sqrDistance)) < 1e-5f);
+    const float primDist
+      = closestPoint(queries[i],getTriangle(indices,vertices,results[i].primID)).sqrDistance;
+    CUBQL_TEST_CHECK(fabsf(sqrtf(primDist)-sqrtf(reference[i].sqrDistance)) < 1e-5f);
+    checkSurfacePoint(results[i],queries[i],indices,vertices);
+  }
+}
+
+template<typename PrecomputedArray>
+void testLayout(PrecomputedArray triangles,
+                PrecomputedLayout layout,
+                bool              onDevice,
+                const FCPResult  *reference,
+                const vec3f      *queries,
+                int               numQueries,
+                bvh3f             bvh,
+                const vec3i      *indices,
+                const vec3f      *vertices)
+{
+  if (onDevice) {
+    precomputeTriangles(triangles,layout,bvh,indices,vertices);
+    CUBQL_CUDA_SYNC_CHECK();
+  } else
+    triangles::host::precomputeTriangles(triangles,layout,bvh,indices,vertices);
+
+  // device-side queries
+  FCPResult *results = managedAlloc<FCPResult>(numQueries);
+  precomputedQueries<<<divRoundUp(numQueries,128),128>>>
+    (results,queries,numQueries,bvh,triangles,layout);
+  CUBQL_CUDA_SYNC_CHECK();
+  checkResults(results,reference,numQueries,queries,indices,vertices);
+
+  // host-side queries
+  for (int i=0;i<numQueries;i++) {
+    results[i].clear(INFINITY);
+    triangles::fcp(results[i],queries[i],bvh,triangles,layout);
+  }
+  checkResults(results,reference,numQueries,queries,indices,vertices);
+  managedFree(results);
+}
+
+int main(int, char **)
+{
+  // random small triangles, some of them degenerate
+  const int numTriangles = 20000;
+  const int numQueries = 2000;
+  std::vector<vec3f> corners = randomPoints<float,3>(numTriangles,0x1234);
+  std::vector<vec3f> offsets = randomPoints<float,3>(2*numTriangles,0x4321);
+  std::vector<vec3f> h_vertices;
+  std::vector<vec3i> h_indices;
+  std::vector<box3f> boxes;
+  for (int i=0;i<numTriangles;i++) {
+    int base = (int)h_vertices.size();
+    h_vertices.push_back(corners[i]);
+    h_vertices.push_back(corners[i]+.05f*(offsets[2*i+0]-vec3f(.5f)));
+    h_vertices.push_back(corners[i]+.05f*(offsets[2*i+1]-vec3f(.5f)));
+    vec3i triangle(base,base+1,base+2);
+    if (i % 17 == 0) triangle.y = triangle.x;
+    if (i % 19 == 0) triangle.z = triangle.y;
+    h_indices.push_back(triangle);
+    boxes.push_back(box3f()
+                    .including(h_vertices[triangle.x])
+                    .including(h_vertices[triangle.y])
+                    .including(h_vertices[triangle.z]));
+  }
+  vec3f *vertices = managedCopy(h_vertices);
+  vec3i *indices  = managedCopy(h_indices);
+  vec3f *queries  = managedCopy(randomPoints<float,3>(numQueries,0x2345));
+
+  // the precomputed closest-point test itself, including degenerate
+  // triangles
+  for (int i=0;i<numTriangles;i++)
+    for (int j=0;j<numQueries;j+=97) {
+      const Triangle triangle = getTriangle(indices,vertices,i);
+      const CPResult expected = closestPoint(queries[j],triangle);
+      const CPResult result
+        = closestPoint(queries[j],PrecomputedTriangle::make(triangle));
+      CUBQL_TEST_CHECK(!isnan(result.sqrDistance));
+      CUBQL_TEST_CHECK(fabsf(sqrtf(result.sqrDistance)-sqrtf(expected.sqrDistance)) < 1e-5f);
+    }
+
+  for (int leafThreshold : { 1, 8 }) {
+    BuildConfig buildConfig;
+    buildConfig.makeLeafThreshold = leafThreshold;
+    bvh3f bvh = buildBVH(boxes,buildConfig);
+
+    FCPResult *reference = managedAlloc<FCPResult>(numQueries);
+    referenceQueries<<<divRoundUp(numQueries,128),128>>>
+      (reference,queries,numQueries,bvh,indices,vertices);
+    CUBQL_CUDA_SYNC_CHECK();
+    // make sure the reference itself is right
+    for (int i=0;i<numQueries;i++) {
+      float closest = INFINITY;
+      for (int j=0;j<numTriangles;j++)
+        closest = std::min(closest,closestPoint(queries[i],
+                                                getTriangle(indices,vertices,j)).sqrDistance);
+      CUBQL_TEST_CHECK(reference[i].sqrDistance == closest);
+      const CPResult expected
+        = closestPoint(queries[i],getTriangle(indices,vertices,reference[i].primID));
+      CUBQL_TEST_CHECK(reference[i].feature == expected.feature);
+      CUBQL_TEST_CHECK(reference[i].point == expected.point);
+      CUBQL_TEST_CHECK(reference[i].u == expected.u && reference[i].v == expected.v);
+    }
+
+    PrecomputedTriangle *aos = managedAlloc<PrecomputedTriangle>(numTriangles);
+    PrecomputedTrianglesSoA soa;
+    soa.a    = managedAlloc<vec3f>(numTriangles);
+    soa.ab   = managedAlloc<vec3f>(numTriangles);
+    soa.ac   = managedAlloc<vec3f>(numTriangles);
+    soa.dots = managedAlloc<vec3f>(numTriangles);
+    for (PrecomputedLayout layout : { PRIM_ORDER, LEAF_ORDER })
+      for (bool onDevice : { false, true }) {
+        testLayout(aos,layout,onDevice,reference,queries,numQueries,bvh,indices,vertices);
+        testLayout(soa,layout,onDevice,reference,queries,numQueries,bvh,indices,vertices);
+      }
+    managedFree(aos);
+    managedFree(soa.a);
+    managedFree(soa.ab);
+    managedFree(soa.ac);
+    managedFree(soa.dots);
+    managedFree(reference);
+    freeBVH(bvh);
+  }
+  managedFree(queries);
+  managedFree(indices);
+  managedFree(vertices);
+  printf("test-precomputedTriangles: all tests passed\n");
+  return 0;
+}
@@ -0,0 +1,127 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+/*! checks the batched range queries in queries/rangeQuery.h, on
+    host and device, against brute force: for ball, square-radius
+    ball, and box query ranges, over both points and boxes */
+
+#include "testRig.h"
+#include "cuBQL/queries/rangeQuery.h"
+#include <algorithm>
+
+using namespace cuBQL;
+using namespace cuBQL::test_rig;
+
+/*! checks that the CSR results are, for each query, exactly the
+    brute-force set of prims in range (in any order) */
+template<typename query_t, typename prim_t, typename offset_t>
+void checkResults(const offset_t              *offsets,
+                  const uint32_t              *primIDs,
+                  const std::vector<query_t>  &queries,
+                  const std::vector<prim_t>   &prims)
+{
+  CUBQL_TEST_CHECK(offsets[0] == 0);
+  for (int i=0;i<(int)queries.size();i++) {
+    std::vector<uint32_t> expected;
+    for (int j=0;j<(int)prims.size();j++)
+      if (rangeQuery_impl::inRange(queries[i],prims[j]))
+        expected.push_back(j);
+    CUBQL_TEST_CHECK(offsets[i+1] >= offsets[i]);
+    std::vector<uint32_t> found(primIDs+offsets[i],primIDs+offsets[i+1]);
+    std::sort(found.begin(),found.end());
+    CUBQL_TEST_CHECK(found == expected);
+  }
+}
+
+template<typename query_t, typename prim_t>
+void testRangeQuery(const std::vector<query_t> &h_queries,
+                    const std::vector<prim_t>  &h_prims,
+                    const std::vector<box3f>   &boxes)
+{
+  const int numQueries = (int)h_queries.size();
+  const query_t *queries = managedCopy(h_queries);
+  const prim_t  *prims   = managedCopy(h_prims);
+  bvh3f bvh = buildBVH(boxes);
+
+  // device: per-query counts only
+  uint32_t *counts = managedAlloc<uint32_t>(numQueries);
+  rangeQuery_count(counts,queries,numQueries,bvh,prims);
+  CUBQL_CUDA_SYNC_CHECK();
+  uint64_t total = 0;
+  for (int i=0;i<numQueries;i++) {
+    CUBQL_TEST_CHECK(counts[i] == rangeQuery_count(bvh,prims,h_queries[i]));
+    total += counts[i];
+  }
+  CUBQL_TEST_CHECK(total > 0);
+
+  // device: full results; first with a small batch, then re-using
+  // (and growing) the same result for the full one
+  RangeQueryResult result;
+  rangeQuery(result,queries,numQueries/10,bvh,prims,0,managedMem());
+  CUBQL_CUDA_SYNC_CHECK();
+  CUBQL_TEST_CHECK(result.numQueries == uint32_t(numQueries/10));
+  checkResults(result.offsets,result.primIDs,
+               std::vector<query_t>(h_queries.begin(),h_queries.begin()+numQueries/10),
+               h_prims);
+  rangeQuery(result,queries,numQueries,bvh,prims,0,managedMem());
+  CUBQL_CUDA_SYNC_CHECK();
+  CUBQL_TEST_CHECK(result.numResults == total);
+  CUBQL_TEST_CHECK(result.offsets[numQueries] == total);
+  checkResults(result.offsets,result.primIDs,h_queries,h_prims);
+  free(result,0,managedMem());
+
+  // host
+  std::vector<uint64_t> offsets;
+  std::vector<uint32_t> primIDs;
+  host::rangeQuery(offsets,primIDs,queries,numQueries,bvh,prims);
+  CUBQL_TEST_CHECK(offsets.size() == size_t(numQueries+1));
+  CUBQL_TEST_CHECK(primIDs.size() == total);
+  checkResults(offsets.data(),primIDs.data(),h_queries,h_prims);
+  host::rangeQuery_count(counts,queries,numQueries,bvh,prims);
+  for (int i=0;i<numQueries;i++)
+    CUBQL_TEST_CHECK(counts[i] == offsets[i+1]-offsets[i]);
+
+  managedFree(counts);
+  freeBVH(bvh);
+  managedFree(prims);
+  managedFree(queries);
+}
+
+template<typename prim_t>
+void testAllRanges(const std::vector<prim_t> &prims, const std::vector<box3f> &boxes)
+{
+  const int numQueries = 500;
+  std::vector<vec3f> centers = randomPoints<float,3>(numQueries,0x4321);
+  std::vector<ball3f> balls;
+  std::vector<sqrBall_t<float,3>> sqrBalls;
+  for (auto center : centers) {
+    balls.push_back({ center, .05f });
+    sqrBalls.push_back({ center, .05f*.05f });
+  }
+  testRangeQuery(balls,prims,boxes);
+  testRangeQuery(sqrBalls,prims,boxes);
+  testRangeQuery(randomBoxes<float,3>(numQueries,0x5432,.1f),prims,boxes);
+}
+
+int main(int, char **)
+{
+  std::vector<vec3f> points = randomPoints<float,3>(20000,0x1234);
+  testAllRanges(points,pointBoxes(points));
+  std::vector<box3f> boxes = randomBoxes<float,3>(10000,0x2345,.02f);
+  testAllRanges(boxes,boxes);
+  printf("test-rangeQuery: all tests passed\n");
+  return 0;
+}
@@ -0,0 +1,282 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+
+/*! checks the segment-to-box distance bound in
+    queries/segmentQuery.h, and the segment-to-segment and
+    segment-to-triangle fcp queries built on it, against brute force
+    and against densely sampled reference distances */
+
+#include "testRig.h"
+#include "cuBQL/triangles/segmentFCP.h"
+
+using namespace cuBQL;
+using namespace cuBQL::test_rig;
+
+/*! reference distance from q to segment [a,b], in double */
+double refSqrDistanceToSegment(vec3f q, vec3f a, vec3f b)
+{
+  double ab[3], aq[3], ab_ab = 0., ab_aq = 0.;
+  for (int d=0;d<3;d++) {
+    ab[d] = double(b[d])-double(a[d]);
+    aq[d] = double(q[d])-double(a[d]);
+    ab_ab += ab[d]*ab[d];
+    ab_aq += ab[d]*aq[d];
+  }
+  double t = (ab_ab > 0.) ? std::max(0.,std::min(1.,ab_aq/ab_ab)) : 0.;
+  double result = 0.;
+  for (int d=0;d<3;d++) {
+    double diff = aq[d]-t*ab[d];
+    result += diff*diff;
+  }
+  return result;
+}
+
+/*! random query segments of up to 'maxLength' along each dimension,
+    some of them of zero length, some axis-aligned */
+std::vector<lineSegs::Segment> randomSegments(int N, int seed, float maxLength)
+{
+  std::vector<vec3f> begins = randomPoints<float,3>(N,seed);
+  std::vector<vec3f> offsets = randomPoints<float,3>(N,seed+1);
+  std::vector<lineSegs::Segment> segments;
+  for (int i=0;i<N;i++) {
+    vec3f offset = maxLength*(offsets[i]-vec3f(.5f));
+    if (i % 11 == 0) offset = vec3f(0.f);
+    if (i % 13 == 0) offset.y = offset.z = 0.f;
+    segments.push_back({ begins[i], begins[i]+offset });
+  }
+  return segments;
+}
+
+/*! min over numSamples points along the segment of the given point
+    distance; this is an upper bound of the segment's distance, and
+    close to it for enough samples */
+template<typename PointDistance>
+double sampledSqrDistance(const lineSegs::Segment &segment,
+                          int numSamples,
+                          const PointDistance &pointDistance)
+{
+  double result = INFINITY;
+  for (int i=0;i<numSamples;i++) {
+    const float t = i/float(numSamples-1);
+    result = std::min(result,(double)pointDistance(segment.begin+t*(segment.end-segment.begin)));
+  }
+  return result;
+}
+
+void testSegmentBoxDistance()
+{
+  std::vector<lineSegs::Segment> segments = randomSegments(20000,0x1234,1.f);
+  std::vector<box3f> boxes = randomBoxes<float,3>(segments.size(),0x4321,.3f);
+  int numOverlapping = 0;
+  for (size_t i=0;i<segments.size();i++) {
+    const box3f box = boxes[i];
+    const lineSegs::Segment segment = segments[i];
+    const float dist = sqrDistance(segment.begin,segment.end,box);
+    const double sampled
+      = sampledSqrDistance(segment,2001,[box](vec3f p){ return sqrDistance(p,box); });
+    numOverlapping += (dist == 0.f);
+    // it's the distance of an actual point on the segment, so can't
+    // be less than the true distance; and it must not be more than
+    // any of the sampled ones
+    CUBQL_TEST_CHECK(sqrt(dist) <= sqrt(sampled)+1e-6);
+    CUBQL_TEST_CHECK(sqrt(dist) >= sqrt(sampled)-1e-3);
+  }
+  CUBQL_TEST_CHECK(numOverlapping > 0);
+}
+
+__global__
+void segmentQueries(lineSegs::SegmentFCPResult   *results,
+                    const lineSegs::Segment      *queries,
+                    int                           numQueries,
+                    bvh3f                         bvh,
+                    const lineSegs::IndexedSegment *segments,
+                    const vec3f                  *vertices)
+{
+  int tid = threadIdx.x+blockIdx.x*blockDim.x;
+  if (tid >= numQueries) return;
+  results[tid].clear(INFINITY);
+  lineSegs::fcp(results[tid],queries[tid],bvh,segments,vertices);
+}
+
+void testSegments()
+{
+  const int numSegments = 10000;
+  const int numQueries = 1000;
+  std::vector<lineSegs::Segment> h_segments = randomSegments(numSegments,0x2345,.05f);
+  std::vector<vec3f> h_vertices;
+  std::vector<lineSegs::IndexedSegment> h_indices;
+  std::vector<box3f> boxes;
+  for (auto segment : h_segments) {
+    h_indices.push_back({ (int)h_vertices.size(), (int)h_vertices.size()+1 });
+    h_vertices.push_back(segment.begin);
+    h_vertices.push_back(segment.end);
+    boxes.push_back(box3f().including(segment.begin).including(segment.end));
+  }
+  std::vector<lineSegs::Segment> h_queries = randomSegments(numQueries,0x3456,.2f);
+  vec3f *vertices = managedCopy(h_vertices);
+  lineSegs::IndexedSegment *indices = managedCopy(h_indices);
+  lineSegs::Segment *queries = managedCopy(h_queries);
+  bvh3f bvh = buildBVH(boxes);
+
+  lineSegs::SegmentFCPResult *results = managedAlloc<lineSegs::SegmentFCPResult>(numQueries);
+  segmentQueries<<<divRoundUp(numQueries,128),128>>>
+    (results,queries,numQueries,bvh,indices,vertices);
+  CUBQL_CUDA_SYNC_CHECK();
+
+  for (int i=0;i<numQueries;i++) {
+    const lineSegs::Segment query = h_queries[i];
+    float closest = INFINITY;
+    for (auto segment : h_segments)
+      closest = std::min(closest,lineSegs::closestPoints(query,segment).sqrDistance);
+
+    lineSegs::SegmentFCPResult hostResult;
+    hostResult.clear(INFINITY);
+    lineSegs::fcp(hostResult,query,bvh,indices,vertices);
+    for (auto result : { results[i], hostResult }) {
+      CUBQL_TEST_CHECK(result.primID >= 0 && result.primID < numSegments);
+      CUBQL_TEST_CHECK(fabsf(sqrtf(result.sqrDistance)-sqrtf(closest)) < 1e-5f);
+      const lineSegs::Segment segment = h_segments[result.primID];
+      CUBQL_TEST_CHECK(result.t >= 0.f && result.t <= 1.f);
+      CUBQL_TEST_CHECK(result.u >= 0.f && result.u <= 1.f);
+      const vec3f onQuery = query.begin + result.t*(query.end-query.begin);
+      const vec3f onSegment = segment.begin + result.u*(segment.end-segment.begin);
+      CUBQL_TEST_CHECK(fabsf(sqrDistance(onQuery,onSegment)-result.sqrDistance) < 1e-6f);
+    }
+
+    // the closest points themselves, against a sampled reference
+    const lineSegs::Segment segment = h_segments[results[i].primID];
+    const double sampled
+      = sampledSqrDistance(query,1001,[segment](vec3f p)
+                           { return refSqrDistanceToSegment(p,segment.begin,segment.end); });
+    CUBQL_TEST_CHECK(sqrt(results[i].sqrDistance) <= sqrt(sampled)+1e-6);
+
+    // nothing within a radius that excludes the closest one
+    lineSegs::SegmentFCPResult bounded;
+    bounded.clear(closest);
+    lineSegs::fcp(bounded,query,bvh,indices,vertices);
+    CUBQL_TEST_CHECK(bounded.primID == -1);
+  }
+  managedFree(results);
+  managedFree(queries);
+  managedFree(indices);
+  managedFree(vertices);
+  freeBVH(bvh);
+}
+
+__global__
+void triangleQueries(triangles::SegmentFCPResult *results,
+                     const lineSegs::Segment     *queries,
+                     int                          numQueries,
+                     bvh3f                        bvh,
+                     const vec3i                 *indices,
+                     const vec3f                 *vertices)
+{
+  int tid = threadIdx.x+blockIdx.x*blockDim.x;
+  if (tid >= numQueries) return;
+  results[tid].clear(INFINITY);
+  triangles::fcp(results[tid],queries[tid],bvh,indices,vertices);
+}
+
+void testTriangles()
+{
+  const int numTriangles = 10000;
+  const int numQueries = 1000;
+  std::vector<vec3f> corners = randomPoints<float,3>(numTriangles,0x4567);
+  std::vector<vec3f> offsets = randomPoints<float,3>(2*numTriangles,0x7654);
+  std::vector<vec3f> h_vertices;
+  std::vector<vec3i> h_indices;
+  std::vector<box3f> boxes;
+  for (int i=0;i<numTriangles;i++) {
+    int base = (int)h_vertices.size();
+    h_vertices.push_back(corners[i]);
+    h_vertices.push_back(corners[i]+.05f*(offsets[2*i+0]-vec3f(.5f)));
+    h_vertices.push_back(corners[i]+.05f*(offsets[2*i+1]-vec3f(.5f)));
+    vec3i triangle(base,base+1,base+2);
+    if (i % 17 == 0) triangle.y = triangle.x;
+    if (i % 19 == 0) triangle.z = triangle.y;
+    h_indices.push_back(triangle);
+    boxes.push_back(box3f()
+                    .including(h_vertices[triangle.x])
+                    .including(h_vertices[triangle.y])
+                    .including(h_vertices[triangle.z]));
+  }
+  std::vector<lineSegs::Segment> h_queries = randomSegments(numQueries,0x5678,.2f);
+  vec3f *vertices = managedCopy(h_vertices);
+  vec3i *indices  = managedCopy(h_indices);
+  lineSegs::Segment *queries = managedCopy(h_queries);
+  bvh3f bvh = buildBVH(boxes);
+
+  triangles::SegmentFCPResult *results = managedAlloc<triangles::SegmentFCPResult>(numQueries);
+  triangleQueries<<<divRoundUp(numQueries,128),128>>>
+    (results,queries,numQueries,bvh,indices,vertices);
+  CUBQL_CUDA_SYNC_CHECK();
+
+  int numCrossing = 0;
+  for (int i=0;i<numQueries;i++) {
+    const lineSegs::Segment query = h_queries[i];
+    float closest = INFINITY;
+    for (int j=0;j<numTriangles;j++)
+      closest = std::min(closest,
+                         triangles::closestPoint(query,triangles::getTriangle(indices,vertices,j))
+                         .sqrDistance);
+    numCrossing += (closest == 0.f);
+
+    triangles::SegmentFCPResult hostResult;
+    hostResult.clear(INFINITY);
+    triangles::fcp(hostResult,query,bvh,indices,vertices);
+    for (auto result : { results[i], hostResult }) {
+      CUBQL_TEST_CHECK(result.primID >= 0 && result.primID < numTriangles);
+      CUBQL_TEST_CHECK(fabsf(sqrtf(result.sqrDistance)-sqrtf(closest)) < 1e-5f);
+      const triangles::Triangle triangle
+        = triangles::getTriangle(indices,vertices,result.primID);
+      const vec3f fromUV
+        = triangle.a
+        + result.u*(triangle.b-triangle.a)
+        + result.v*(triangle.c-triangle.a);
+      CUBQL_TEST_CHECK(sqrDistance(fromUV,result.point) < 1e-10f);
+      const vec3f onQuery = query.begin + result.t*(query.end-query.begin);
+      CUBQL_TEST_CHECK(sqrDistance(onQuery,result.queryPoint) < 1e-10f);
+      CUBQL_TEST_CHECK(fabsf(sqrDistance(result.queryPoint,result.point)
+                             -result.sqrDistance) < 1e-6f);
+      if (result.feature == triangles::FEATURE_VERTEX_A)
+        CUBQL_TEST_CHECK(result.point == triangle.a);
+    }
+
+    // the closest points themselves, against a sampled reference
+    const triangles::Triangle triangle
+      = triangles::getTriangle(indices,vertices,results[i].primID);
+    const double sampled
+      = sampledSqrDistance(query,1001,[triangle](vec3f p)
+                           { return triangles::closestPoint(p,triangle).sqrDistance; });
+    CUBQL_TEST_CHECK(sqrt(results[i].sqrDistance) <= sqrt(sampled)+1e-6);
+  }
+  CUBQL_TEST_CHECK(numCrossing > 0);
+  managedFree(results);
+  managedFree(queries);
+  managedFree(indices);
+  managedFree(vertices);
+  freeBVH(bvh);
+}
+
+int main(int, char **)
+{
+  testSegmentBoxDistance();
+  testSegments();
+  testTriangles();
+  printf("test-segmentQueries: all tests passed\n");
+  return 0;
+}
@@ -0,0 +1,102 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+/*! checks the self-overlap query in queries/selfOverlap.h, on host
+    and device, against an O(N^2) brute-force test of all pairs of
+    boxes: every overlapping pair has to be reported exactly once,
+    and nothing else */
+
+#include "testRig.h"
+#include "cuBQL/queries/selfOverlap.h"
+#include <algorithm>
+
+using namespace cuBQL;
+using namespace cuBQL::test_rig;
+
+namespace cuBQL {
+  bool operator<(const PrimPair &a, const PrimPair &b)
+  { return (a.primA < b.primA) || (a.primA == b.primA && a.primB < b.primB); }
+  bool operator==(const PrimPair &a, const PrimPair &b)
+  { return a.primA == b.primA && a.primB == b.primB; }
+}
+
+void checkPairs(std::vector<PrimPair> pairs, const std::vector<PrimPair> &expected)
+{
+  for (auto pair : pairs)
+    CUBQL_TEST_CHECK(pair.primA < pair.primB);
+  // sorting also makes duplicates end up next to each other, so
+  // comparing against the (duplicate-free) brute force result also
+  // checks that each pair got reported only once
+  std::sort(pairs.begin(),pairs.end());
+  CUBQL_TEST_CHECK(pairs == expected);
+}
+
+void testSelfOverlap(const std::vector<box3f> &h_boxes, int leafThreshold)
+{
+  const int numBoxes = (int)h_boxes.size();
+  std::vector<PrimPair> expected;
+  for (int i=0;i<numBoxes;i++)
+    for (int j=i+1;j<numBoxes;j++)
+      if (h_boxes[i].overlaps(h_boxes[j]))
+        expected.push_back(PrimPair{ uint32_t(i), uint32_t(j) });
+  CUBQL_TEST_CHECK(!expected.empty());
+
+  const box3f *boxes = managedCopy(h_boxes);
+  BuildConfig buildConfig;
+  buildConfig.makeLeafThreshold = leafThreshold;
+  bvh3f bvh = buildBVH(h_boxes,buildConfig);
+
+  // device; twice, to also check re-using the same buffer
+  PrimPairBuffer buffer;
+  for (int rep=0;rep<2;rep++) {
+    selfOverlap(buffer,bvh,boxes,0,managedMem());
+    CUBQL_CUDA_SYNC_CHECK();
+    CUBQL_TEST_CHECK(buffer.numPairs <= buffer.capacity);
+    checkPairs(std::vector<PrimPair>(buffer.pairs,buffer.pairs+buffer.numPairs),expected);
+  }
+  free(buffer,0,managedMem());
+
+  // host
+  std::vector<PrimPair> pairs;
+  host::selfOverlap(pairs,bvh,boxes);
+  checkPairs(pairs,expected);
+
+  freeBVH(bvh);
+  managedFree(boxes);
+}
+
+int main(int, char **)
+{
+  // random boxes of different sizes, plus some exact duplicates,
+  // boxes that only touch, and degenerate (point) boxes, which all
+  // count as overlapping
+  std::vector<box3f> boxes = randomBoxes<float,3>(3000,0x1234,.03f);
+  std::vector<box3f> large = randomBoxes<float,3>(50,0x4321,.2f);
+  boxes.insert(boxes.end(),large.begin(),large.end());
+  for (int i=0;i<100;i++) {
+    boxes.push_back(boxes[i]);
+    box3f touching = boxes[i+100];
+    const float width = touching.upper.x-touching.lower.x;
+    touching.lower.x += width;
+    touching.upper.x += width;
+    boxes.push_back(touching);
+    boxes.push_back(box3f().including(boxes[i+200].lower));
+  }
+  for (int leafThreshold : { 1, 8 })
+    testSelfOverlap(boxes,leafThreshold);
+  printf("test-selfOverlap: all tests passed\n");
+  return 0;
+}
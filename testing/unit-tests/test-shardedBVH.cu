@@ -0,0 +1,174 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+/*! checks the Morton-range partitioning and the sharded fcp() and
+    knn() queries in io/shardedBVH.h against brute force, with
+    in-process, mapped, and remote shards, and after re-building a
+    single shard */
+
+#include "testRig.h"
+#include "cuBQL/io/shardedBVH.h"
+#include <cstdio>
+
+using namespace cuBQL;
+using namespace cuBQL::test_rig;
+
+/*! the k closest points by brute force, sorted like ShardedBVH::knn() */
+std::vector<ShardHit> bruteForceKNN(const std::vector<vec3f> &points,
+                                    vec3f query, int k, float sqrMaxDist)
+{
+  std::vector<ShardHit> hits;
+  for (size_t i=0;i<points.size();i++) {
+    const float sqrDist = fSqrDistance(points[i],query);
+    if (sqrDist < sqrMaxDist) hits.push_back({ i,sqrDist });
+  }
+  std::sort(hits.begin(),hits.end(),shardedBVH_impl::closer);
+  if ((int)hits.size() > k) hits.resize(k);
+  return hits;
+}
+
+void checkQueries(ShardedBVH &sharded,
+                  const std::vector<vec3f> &points,
+                  const std::vector<vec3f> &queries)
+{
+  for (auto query : queries) {
+    for (int k : { 1, 10 })
+      for (float sqrMaxDist : { INFINITY, 1e-3f }) {
+        const std::vector<ShardHit> expected = bruteForceKNN(points,query,k,sqrMaxDist);
+        const std::vector<ShardHit> result = sharded.knn(query,k,sqrMaxDist);
+        CUBQL_TEST_CHECK(result.size() == expected.size());
+        for (size_t i=0;i<result.size();i++) {
+          // ties may come out as different points
+          CUBQL_TEST_CHECK(result[i].sqrDistance == expected[i].sqrDistance);
+          CUBQL_TEST_CHECK(fSqrDistance(points[result[i].primID],query)
+                           == result[i].sqrDistance);
+          if (i > 0) CUBQL_TEST_CHECK(result[i].primID != result[i-1].primID);
+        }
+      }
+
+    float closest = INFINITY;
+    for (auto point : points)
+      closest = std::min(closest,fSqrDistance(point,query));
+    float sqrMaxDist = INFINITY;
+    const int64_t result = sharded.fcp(query,sqrMaxDist);
+    CUBQL_TEST_CHECK(result >= 0 && result < (int64_t)points.size());
+    CUBQL_TEST_CHECK(sqrMaxDist == closest);
+    CUBQL_TEST_CHECK(fSqrDistance(points[result],query) == closest);
+    // nothing strictly closer than the closest point
+    sqrMaxDist = closest;
+    CUBQL_TEST_CHECK(sharded.fcp(query,sqrMaxDist) == -1);
+    CUBQL_TEST_CHECK(sqrMaxDist == closest);
+  }
+}
+
+std::vector<std::shared_ptr<PointShard>>
+buildShards(const std::vector<vec3f> &points,
+            const std::vector<std::vector<uint64_t>> &partition)
+{
+  std::vector<std::shared_ptr<PointShard>> shards;
+  for (auto &primIDs : partition)
+    shards.push_back(std::make_shared<InProcessShard>(points.data(),primIDs));
+  return shards;
+}
+
+void testPartition(const std::vector<vec3f> &points, int numShards)
+{
+  const auto partition = partitionByMortonRange(points.data(),points.size(),numShards);
+  CUBQL_TEST_CHECK((int)partition.size() == numShards);
+  std::vector<int> seen(points.size(),0);
+  for (auto &primIDs : partition) {
+    CUBQL_TEST_CHECK(primIDs.size() >= points.size()/numShards);
+    CUBQL_TEST_CHECK(primIDs.size() <= points.size()/numShards+1);
+    for (auto primID : primIDs) seen[primID]++;
+  }
+  for (auto count : seen)
+    CUBQL_TEST_CHECK(count == 1);
+}
+
+int main(int, char **)
+{
+  const int numPoints = 20000;
+  const int numQueries = 200;
+  std::vector<vec3f> points = randomPoints<float,3>(numPoints,0x1234);
+  const std::vector<vec3f> queries = randomPoints<float,3>(numQueries,0x4321);
+
+  for (int numShards : { 1, 7, 32 }) {
+    testPartition(points,numShards);
+    const auto partition = partitionByMortonRange(points.data(),points.size(),numShards);
+    ShardedBVH sharded(buildShards(points,partition));
+    checkQueries(sharded,points,queries);
+
+    // shards get visited in order of distance, so exactly those
+    // closer than the k-th closest point get queried at all
+    std::vector<box3f> shardBounds;
+    for (auto &shard : sharded.shards)
+      shardBounds.push_back(shard->getBounds());
+    for (auto query : queries) {
+      sharded.numShardQueries = 0;
+      const std::vector<ShardHit> hits = sharded.knn(query,10);
+      uint64_t expected = 0;
+      for (auto bounds : shardBounds)
+        expected += fSqrDistance(bounds,query) < hits.back().sqrDistance;
+      CUBQL_TEST_CHECK(sharded.numShardQueries == expected);
+    }
+  }
+
+  // mixed backends: one shard mapped from disk, one behind a
+  // (local stand-in for a) remote service
+  const int numShards = 7;
+  const auto partition = partitionByMortonRange(points.data(),points.size(),numShards);
+  ShardedBVH sharded(buildShards(points,partition));
+  const std::string fileName = "test-shardedBVH.bvh";
+  ((InProcessShard &)*sharded.shards[0]).save(fileName);
+  sharded.setShard(0,std::make_shared<MappedShard>(fileName));
+  auto service = std::make_shared<LocalShardService>(sharded.shards[1]);
+  sharded.setShard(1,std::make_shared<RemoteShard>(service));
+  checkQueries(sharded,points,queries);
+
+  // malformed messages get rejected
+  bool threw = false;
+  try { service->call(std::vector<char>(3,0)); } catch (std::runtime_error &) { threw = true; }
+  CUBQL_TEST_CHECK(threw);
+  threw = false;
+  try { MappedShard("test-shardedBVH.missing.bvh"); } catch (std::runtime_error &) { threw = true; }
+  CUBQL_TEST_CHECK(threw);
+
+  // move one shard's points, and re-build only that shard
+  for (auto primID : partition[3])
+    points[primID] = points[primID]*.5f + vec3f(.75f);
+  sharded.setShard(3,std::make_shared<InProcessShard>(points.data(),partition[3]));
+  checkQueries(sharded,points,queries);
+
+  // an empty shard gets skipped
+  sharded.setShard(5,std::make_shared<InProcessShard>(points.data(),std::vector<uint64_t>()));
+  std::vector<vec3f> remaining;
+  for (int shardID=0;shardID<numShards;shardID++)
+    if (shardID != 5)
+      for (auto primID : partition[shardID]) remaining.push_back(points[primID]);
+  for (auto query : queries) {
+    float sqrMaxDist = INFINITY;
+    const int64_t result = sharded.fcp(query,sqrMaxDist);
+    float closest = INFINITY;
+    for (auto point : remaining)
+      closest = std::min(closest,fSqrDistance(point,query));
+    CUBQL_TEST_CHECK(result >= 0 && sqrMaxDist == closest);
+  }
+
+  std::remove(fileName.c_str());
+  std::remove((fileName+".points").c_str());
+  printf("test-shardedBVH: all tests passed\n");
+  return 0;
+}
@@ -0,0 +1,187 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+
+/*! checks triangles::closestHit() and triangles::anyHit() (in
+    triangles/rays.h), host- and device-side, against brute-force
+    intersection with all triangles: the hit's t, primID, and u/v,
+    misses, and that only hits within [ray.tMin,ray.tMax] count */
+
+#include "testRig.h"
+#include "cuBQL/triangles/rays.h"
+
+using namespace cuBQL;
+using namespace cuBQL::test_rig;
+using namespace cuBQL::triangles;
+
+__global__
+void closestHits(RayHit      *hits,
+                 int         *anyHits,
+                 const Ray   *rays,
+                 int          numRays,
+                 bvh3f        bvh,
+                 const vec3i *indices,
+                 const vec3f *vertices)
+{
+  int tid = threadIdx.x+blockIdx.x*blockDim.x;
+  if (tid >= numRays) return;
+  closestHit(hits[tid],rays[tid],bvh,indices,vertices);
+  anyHits[tid] = anyHit(rays[tid],bvh,indices,vertices);
+}
+
+/*! closest hit within [ray.tMin,ray.tMax], by intersecting the ray
+    with each triangle */
+RayHit bruteForce(const Ray &ray, const vec3i *indices, const vec3f *vertices,
+                  int numTriangles)
+{
+  RayHit hit;
+  hit.clear();
+  for (int i=0;i<numTriangles;i++) {
+    float t, u, v;
+    if (!intersect(ray,getTriangle(indices,vertices,i),ray.tMin,ray.tMax,t,u,v))
+      continue;
+    if (t >= hit.t) continue;
+    hit.primID = i;
+    hit.t = t;
+    hit.u = u;
+    hit.v = v;
+  }
+  return hit;
+}
+
+/*! checks a closest-hit result against the brute-force one */
+void checkHit(const RayHit &hit, const RayHit &expected, const Ray &ray,
+              const vec3i *indices, const vec3f *vertices)
+{
+  CUBQL_TEST_CHECK(hit.hadHit() == expected.hadHit());
+  if (!expected.hadHit()) {
+    CUBQL_TEST_CHECK(hit.t == INFINITY);
+    return;
+  }
+  // the primIDs may differ only where two triangles are hit at the
+  // same distance
+  CUBQL_TEST_CHECK(hit.t == expected.t);
+  CUBQL_TEST_CHECK(hit.t >= ray.tMin && hit.t <= ray.tMax);
+  float t, u, v;
+  const Triangle triangle = getTriangle(indices,vertices,hit.primID);
+  CUBQL_TEST_CHECK(intersect(ray,triangle,ray.tMin,ray.tMax,t,u,v));
+  CUBQL_TEST_CHECK(t == hit.t && u == hit.u && v == hit.v);
+  // and the hit point is where u/v say it is
+  CUBQL_TEST_CHECK(u >= 0.f && v >= 0.f && u+v <= 1.f);
+  for (int d=0;d<3;d++) {
+    const double onRay = double(ray.origin[d]) + double(t)*double(ray.direction[d]);
+    const double onTriangle
+      = double(triangle.a[d])
+      + double(u)*(double(triangle.b[d])-double(triangle.a[d]))
+      + double(v)*(double(triangle.c[d])-double(triangle.a[d]));
+    CUBQL_TEST_CHECK(fabs(onRay-onTriangle) < 1e-4);
+  }
+}
+
+int main(int, char **)
+{
+  // random small triangles, some of them degenerate
+  const int numTriangles = 5000;
+  std::vector<vec3f> corners = randomPoints<float,3>(numTriangles,0x1234);
+  std::vector<vec3f> offsets = randomPoints<float,3>(2*numTriangles,0x4321);
+  std::vector<vec3f> h_vertices;
+  std::vector<vec3i> h_indices;
+  std::vector<box3f> boxes;
+  for (int i=0;i<numTriangles;i++) {
+    int base = (int)h_vertices.size();
+    h_vertices.push_back(corners[i]);
+    h_vertices.push_back(corners[i]+.1f*(offsets[2*i+0]-vec3f(.5f)));
+    h_vertices.push_back(corners[i]+.1f*(offsets[2*i+1]-vec3f(.5f)));
+    vec3i triangle(base,base+1,base+2);
+    if (i % 17 == 0) triangle.y = triangle.x;
+    h_indices.push_back(triangle);
+    boxes.push_back(box3f()
+                    .including(h_vertices[triangle.x])
+                    .including(h_vertices[triangle.y])
+                    .including(h_vertices[triangle.z]));
+  }
+  vec3f *vertices = managedCopy(h_vertices);
+  vec3i *indices  = managedCopy(h_indices);
+
+  // rays from all around the triangles towards points among them
+  // (with un-normalized directions, and some of them axis-parallel),
+  // and rays pointing away from them; each with an unbounded
+  // [tMin,tMax] and with ones that cut off (or just include) the
+  // closest hit
+  const int numBaseRays = 1000;
+  std::vector<vec3f> origins = randomPoints<float,3>(numBaseRays,0x2345);
+  std::vector<vec3f> targets = randomPoints<float,3>(numBaseRays,0x5432);
+  std::vector<Ray> h_rays;
+  for (int i=0;i<numBaseRays;i++) {
+    Ray ray;
+    ray.origin = 2.f*origins[i]-vec3f(.5f);
+    ray.direction = targets[i]-ray.origin;
+    if (i % 10 == 0) ray.direction = vec3f(0.f,0.f,ray.direction.z);
+    if (i % 10 == 1) ray.direction = -ray.direction;
+    h_rays.push_back(ray);
+    const float t0 = bruteForce(ray,indices,vertices,numTriangles).t;
+    if (t0 == INFINITY) continue;
+    Ray bounded = ray;
+    bounded.tMax = .5f*t0;
+    h_rays.push_back(bounded);
+    bounded.tMax = INFINITY;
+    bounded.tMin = 1.0001f*t0;
+    h_rays.push_back(bounded);
+    bounded.tMin = bounded.tMax = t0;
+    h_rays.push_back(bounded);
+  }
+  const int numRays = (int)h_rays.size();
+  Ray *rays = managedCopy(h_rays);
+
+  for (int leafThreshold : { 1, 8 }) {
+    BuildConfig buildConfig;
+    buildConfig.makeLeafThreshold = leafThreshold;
+    bvh3f bvh = buildBVH(boxes,buildConfig);
+
+    RayHit *hits = managedAlloc<RayHit>(numRays);
+    int *anyHits = managedAlloc<int>(numRays);
+    closestHits<<<divRoundUp(numRays,128),128>>>
+      (hits,anyHits,rays,numRays,bvh,indices,vertices);
+    CUBQL_CUDA_SYNC_CHECK();
+
+    int numHits = 0, numMisses = 0;
+    for (int i=0;i<numRays;i++) {
+      const Ray ray = h_rays[i];
+      const RayHit expected = bruteForce(ray,indices,vertices,numTriangles);
+      numHits   += expected.hadHit();
+      numMisses += !expected.hadHit();
+      // device-side
+      checkHit(hits[i],expected,ray,indices,vertices);
+      CUBQL_TEST_CHECK(anyHits[i] == (int)expected.hadHit());
+      // host-side
+      RayHit hit;
+      closestHit(hit,ray,bvh,indices,vertices);
+      checkHit(hit,expected,ray,indices,vertices);
+      CUBQL_TEST_CHECK(anyHit(ray,bvh,indices,vertices) == expected.hadHit());
+    }
+    // make sure the test actually covers both
+    CUBQL_TEST_CHECK(numHits > numBaseRays/4 && numMisses > numBaseRays/4);
+
+    managedFree(anyHits);
+    managedFree(hits);
+    freeBVH(bvh);
+  }
+  managedFree(rays);
+  managedFree(indices);
+  managedFree(vertices);
+  printf("test-triangleRays: all tests passed\n");
+  return 0;
+}
@@ -0,0 +1,213 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+/*! checks triangles::closestPoint() (including on degenerate
+    triangles) against a reference, and the signed distance fields
+    from triangles/sdf.h against the analytic distance to a cube */
+
+#include "testRig.h"
+#include "cuBQL/triangles/sdf.h"
+
+using namespace cuBQL;
+using namespace cuBQL::test_rig;
+
+/*! reference distance from q to segment [a,b], in double */
+double refSqrDistanceToSegment(vec3f q, vec3f a, vec3f b)
+{
+  double ab[3], aq[3], ab_ab = 0., ab_aq = 0.;
+  for (int d=0;d<3;d++) {
+    ab[d] = double(b[d])-double(a[d]);
+    aq[d] = double(q[d])-double(a[d]);
+    ab_ab += ab[d]*ab[d];
+    ab_aq += ab[d]*aq[d];
+  }
+  double t = (ab_ab > 0.) ? std::max(0.,std::min(1.,ab_aq/ab_ab)) : 0.;
+  double result = 0.;
+  for (int d=0;d<3;d++) {
+    double diff = aq[d]-t*ab[d];
+    result += diff*diff;
+  }
+  return result;
+}
+
+/*! reference distance from q to a triangle: the distance to the
+    plane if q projects into the triangle, else the distance to the
+    closest edge */
+double refSqrDistance(vec3f q, triangles::Triangle triangle)
+{
+  double result = std::min(refSqrDistanceToSegment(q,triangle.a,triangle.b),
+                           std::min(refSqrDistanceToSegment(q,triangle.b,triangle.c),
+                                    refSqrDistanceToSegment(q,triangle.c,triangle.a)));
+  const vec3f N = cross(triangle.b-triangle.a,triangle.c-triangle.a);
+  if (dot(N,N) < 1e-12f) return result;
+  const float dist = dot(q-triangle.a,N) / sqrtf(dot(N,N));
+  const vec3f p = q - dist * N * (1.f/sqrtf(dot(N,N)));
+  if (dot(cross(triangle.b-triangle.a,p-triangle.a),N) >= 0.f &&
+      dot(cross(triangle.c-triangle.b,p-triangle.b),N) >= 0.f &&
+      dot(cross(triangle.a-triangle.c,p-triangle.c),N) >= 0.f)
+    result = std::min(result,double(dist)*double(dist));
+  return result;
+}
+
+void testClosestPoint()
+{
+  std::vector<vec3f> points = randomPoints<float,3>(4*100000,0x1234);
+  int numDegenerate = 0;
+  for (size_t i=0;i<points.size();i+=4) {
+    triangles::Triangle triangle = { points[i+0], points[i+1], points[i+2] };
+    // make two thirds of them degenerate, in different ways
+    switch (i/4 % 9) {
+    case 0: triangle.b = triangle.a; break;
+    case 1: triangle.c = triangle.b; break;
+    case 2: triangle.a = triangle.c; break;
+    case 3: triangle.b = triangle.c = triangle.a; break;
+    case 4: // collinear
+      triangle.b = triangle.a + vec3f(.25f,0.f,0.f);
+      triangle.c = triangle.a + vec3f(.5f,0.f,0.f);
+      break;
+    case 5: // collinear, up to rounding
+      triangle.c = triangle.a + 2.f*(triangle.b-triangle.a);
+      break;
+    default: break;
+    }
+    numDegenerate += (i/4 % 9) < 6;
+    const vec3f q = points[i+3];
+    triangles::CPResult result = triangles::closestPoint(q,triangle);
+    CUBQL_TEST_CHECK(!isnan(result.sqrDistance));
+    CUBQL_TEST_CHECK(!isnan(result.u) && !isnan(result.v));
+    CUBQL_TEST_CHECK(fabsf(result.sqrDistance-sqrDistance(q,result.point)) < 1e-6f);
+    const vec3f fromUV
+      = triangle.a
+      + result.u*(triangle.b-triangle.a)
+      + result.v*(triangle.c-triangle.a);
+    CUBQL_TEST_CHECK(sqrDistance(fromUV,result.point) < 1e-10f);
+    CUBQL_TEST_CHECK(fabs(sqrt(result.sqrDistance)
+                          -sqrt(refSqrDistance(q,triangle))) < 1e-5);
+  }
+  CUBQL_TEST_CHECK(numDegenerate > 0);
+}
+
+/*! the unit cube [0,1]^3, as 12 outward-facing triangles */
+void makeUnitCube(std::vector<vec3i> &indices, std::vector<vec3f> &vertices)
+{
+  for (int i=0;i<8;i++)
+    vertices.push_back(vec3f(float(i&1),float((i>>1)&1),float((i>>2)&1)));
+  const vec3i faces[6][2] = {
+    { { 0,2,3 }, { 0,3,1 } }, // z=0
+    { { 4,5,7 }, { 4,7,6 } }, // z=1
+    { { 0,1,5 }, { 0,5,4 } }, // y=0
+    { { 2,6,7 }, { 2,7,3 } }, // y=1
+    { { 0,4,6 }, { 0,6,2 } }, // x=0
+    { { 1,3,7 }, { 1,7,5 } }, // x=1
+  };
+  for (auto &face : faces)
+    for (auto &triangle : face)
+      indices.push_back(triangle);
+}
+
+/*! analytic signed distance to the unit cube */
+float cubeDistance(vec3f p)
+{
+  vec3f q;
+  float outside = 0.f;
+  for (int d=0;d<3;d++) {
+    q[d] = fabsf(p[d]-.5f)-.5f;
+    outside += std::max(q[d],0.f)*std::max(q[d],0.f);
+  }
+  return sqrtf(outside) + std::min(std::max(q.x,std::max(q.y,q.z)),0.f);
+}
+
+void testSDF()
+{
+  std::vector<vec3i> h_indices;
+  std::vector<vec3f> h_vertices;
+  makeUnitCube(h_indices,h_vertices);
+  vec3i *indices  = managedCopy(h_indices);
+  vec3f *vertices = managedCopy(h_vertices);
+  std::vector<box3f> boxes;
+  for (auto idx : h_indices)
+    boxes.push_back(box3f()
+                    .including(h_vertices[idx.x])
+                    .including(h_vertices[idx.y])
+                    .including(h_vertices[idx.z]));
+  bvh3f bvh = buildBVH(boxes);
+
+  std::vector<vec3f> faceNormals, edgeNormals, vertexNormals;
+  triangles::computePseudoNormals(faceNormals,edgeNormals,vertexNormals,
+                                  h_indices.data(),(int)h_indices.size(),
+                                  h_vertices.data(),(int)h_vertices.size());
+
+  // a grid that is not a multiple of the brick size, and whose
+  // cells straddle the cube's faces
+  const vec3i dims(13,16,19);
+  const box3f bounds(vec3f(-.5f),vec3f(1.5f));
+  const size_t numCells = size_t(dims.x)*dims.y*dims.z;
+  std::vector<float> hostSDF(numCells);
+  triangles::host::computeSDF(hostSDF.data(),dims,bounds,bvh,indices,vertices);
+
+  triangles::PseudoNormals normals;
+  normals.faceNormals   = managedCopy(faceNormals);
+  normals.edgeNormals   = managedCopy(edgeNormals);
+  normals.vertexNormals = managedCopy(vertexNormals);
+  float *deviceSDF = managedAlloc<float>(numCells);
+  triangles::computeSDF(deviceSDF,dims,bounds,bvh,indices,vertices,normals);
+  CUBQL_CUDA_SYNC_CHECK();
+
+  int numInside = 0;
+  for (int iz=0;iz<dims.z;iz++)
+    for (int iy=0;iy<dims.y;iy++)
+      for (int ix=0;ix<dims.x;ix++) {
+        const size_t cellID = ix+size_t(dims.x)*(iy+size_t(dims.y)*iz);
+        const vec3f center
+          = triangles::sdf_impl::cellCenter(dims,bounds,ix,iy,iz);
+        const float expected = cubeDistance(center);
+        numInside += (expected < 0.f);
+        CUBQL_TEST_CHECK(fabsf(hostSDF[cellID]-expected) < 1e-5f);
+        CUBQL_TEST_CHECK(fabsf(deviceSDF[cellID]-expected) < 1e-5f);
+      }
+  CUBQL_TEST_CHECK(numInside > 0);
+
+  // a few individual points right next to the cube's edges and
+  // vertices, where the sign comes from the edge and vertex
+  // pseudo-normals
+  const vec3f testPoints[] = {
+    vec3f(-.01f,-.01f,.5f), vec3f(.01f,.01f,.5f),
+    vec3f(1.01f,.5f,1.01f), vec3f(.99f,.5f,.99f),
+    vec3f(-.01f,-.01f,-.01f), vec3f(1.01f,1.01f,1.01f),
+  };
+  const triangles::PseudoNormals hostNormals
+    = { faceNormals.data(), edgeNormals.data(), vertexNormals.data() };
+  for (auto point : testPoints) {
+    float dist = triangles::signedDistance(point,bvh,indices,vertices,hostNormals);
+    CUBQL_TEST_CHECK(fabsf(dist-cubeDistance(point)) < 1e-5f);
+  }
+
+  managedFree(deviceSDF);
+  managedFree(normals.faceNormals);
+  managedFree(normals.edgeNormals);
+  managedFree(normals.vertexNormals);
+  managedFree(indices);
+  managedFree(vertices);
+  freeBVH(bvh);
+}
+
+int main(int, char **)
+{
+  testClosestPoint();
+  testSDF();
+  printf("test-triangleSDF: all tests passed\n");
+  return 0;
+}
@@ -0,0 +1,145 @@
+// ======================================================================== //
+// Copyright 2023-2023 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+/*! small helpers shared by the unit tests that actually run queries
+    (the test-*.cu ones, as opposed to the instantiate-*.cu ones that
+    only check that things compile): building BVHs in managed memory
+    (so both host- and device-side queries can use them), generating
+    random inputs, and checking results. Each test is its own
+    executable, so this header also pulls in the builder
+    implementation; include it before any other cuBQL header. */
+#pragma once
+
+#define CUBQL_GPU_BUILDER_IMPLEMENTATION 1
+#include "cuBQL/bvh.h"
+#include <vector>
+#include <random>
+#include <cstdio>
+#include <cstdlib>
+
+/*! fails the test (with exit code 1) if the given condition is not met */
+#define CUBQL_TEST_CHECK(cond)                                          \
+  do {                                                                  \
+    if (!(cond)) {                                                      \
+      fprintf(stderr,"%s:%i: check failed: %s\n",__FILE__,__LINE__,#cond); \
+      exit(1);                                                          \
+    }                                                                   \
+  } while (0)
+
+namespace cuBQL {
+  namespace test_rig {
+
+    inline GpuMemoryResource &managedMem()
+    {
+      static ManagedMemMemoryResource memResource;
+      return memResource;
+    }
+
+    /*! allocates managed memory for N elements of type T */
+    template<typename T>
+    T *managedAlloc(size_t N)
+    {
+      T *ptr = 0;
+      CUBQL_CUDA_CALL(MallocManaged((void **)&ptr,std::max(N,size_t(1))*sizeof(T)));
+      return ptr;
+    }
+
+    /*! allocates managed memory for, and copies, the given vector */
+    template<typename T>
+    T *managedCopy(const std::vector<T> &values)
+    {
+      T *ptr = managedAlloc<T>(values.size());
+      std::copy(values.begin(),values.end(),ptr);
+      return ptr;
+    }
+
+    template<typename T>
+    void managedFree(const T *ptr)
+    {
+      CUBQL_CUDA_CALL(Free((void *)ptr));
+    }
+
+    /*! builds a BVH over the given boxes, in managed memory */
+    template<typename T, int D>
+    BinaryBVH<T,D> buildBVH(const std::vector<box_t<T,D>> &boxes,
+                            BuildConfig buildConfig = BuildConfig())
+    {
+      box_t<T,D> *d_boxes = managedCopy(boxes);
+      BinaryBVH<T,D> bvh;
+      gpuBuilder(bvh,d_boxes,(uint32_t)boxes.size(),buildConfig,0,managedMem());
+      CUBQL_CUDA_SYNC_CHECK();
+      managedFree(d_boxes);
+      return bvh;
+    }
+
+    template<typename T, int D>
+    void freeBVH(BinaryBVH<T,D> &bvh)
+    {
+      cuBQL::free(bvh,0,managedMem());
+    }
+
+    /*! N uniformly distributed random points in [0,1]^D */
+    template<typename T, int D>
+    std::vector<vec_t<T,D>> randomPoints(size_t N, int seed)
+    {
+      std::mt19937 rng(seed);
+      std::uniform_real_distribution<double> uniform(0.,1.);
+      std::vector<vec_t<T,D>> points(N);
+      for (auto &point : points)
+        for (int d=0;d<D;d++)
+          point[d] = T(uniform(rng));
+      return points;
+    }
+
+    /*! N random boxes with lower corner in [0,1]^D, and a size of up
+        to maxSize along each dimension */
+    template<typename T, int D>
+    std::vector<box_t<T,D>> randomBoxes(size_t N, int seed, T maxSize)
+    {
+      std::mt19937 rng(seed);
+      std::uniform_real_distribution<double> uniform(0.,1.);
+      std::vector<box_t<T,D>> boxes(N);
+      for (auto &box : boxes)
+        for (int d=0;d<D;d++) {
+          box.lower[d] = T(uniform(rng));
+          box.upper[d] = box.lower[d] + T(maxSize*uniform(rng));
+        }
+      return boxes;
+    }
+
+    /*! the (degenerate) bounding boxes of the given points */
+    template<typename T, int D>
+    std::vector<box_t<T,D>> pointBoxes(const std::vector<vec_t<T,D>> &points)
+    {
+      std::vector<box_t<T,D>> boxes;
+      for (auto point : points)
+        boxes.push_back(box_t<T,D>().including(point));
+      return boxes;
+    }
+
+    /*! squared euclidean distance, in double precision */
+    template<typename T, int D>
+    double doubleSqrDistance(const vec_t<T,D> &a, const vec_t<T,D> &b)
+    {
+      double result = 0.;
+      for (int d=0;d<D;d++) {
+        double diff = double(a[d]) - double(b[d]);
+        result += diff*diff;
+      }
+      return result;
+    }
+  }
+}